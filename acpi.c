@@ -0,0 +1,522 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* acpi table discovery, and decoding of the tables describing the platform
+ *
+ * the root system description pointer is searched for in the first kilobyte of
+ * the extended bios data area, and in the bios read-only memory area; the page
+ * at address 0 is not mapped, so the extended bios data area segment can not be
+ * read from the bios data area, and the usual extended bios data area location,
+ * at the top of the conventional memory, is used
+ *
+ * the root system description pointer points to the root system description
+ * table (with 32 bit table addresses), or, for acpi 2.0 and later, also to the
+ * extended system description table (with 64 bit table addresses), which is
+ * preferred; tables located above the memory mapped by the initial page tables
+ * are mapped with the memory mapped device region mapper */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "acpi.h"
+#include "constants.h"
+#include "pgtable.h"
+#include "apic.h"
+#include "utils.h"
+
+enum
+{
+	EBDA_START			=	0x9fc00,
+	EBDA_SEARCH_SIZE		=	1024,
+	BIOS_ROM_START			=	0xe0000,
+	BIOS_ROM_END			=	0x100000,
+	RSDP_ALIGNMENT			=	16,
+	RSDP_V1_SIZE			=	20,
+
+	/* multiple apic description table layout */
+	MADT_LAPIC_ADDRESS		=	36,
+	MADT_FLAGS			=	40,
+	MADT_ENTRIES			=	44,
+	MADT_ENTRY_LAPIC		=	0,
+	MADT_ENTRY_IOAPIC		=	1,
+	MADT_ENTRY_IRQ_OVERRIDE		=	2,
+	MADT_ENTRY_LAPIC_ADDRESS_OVERRIDE	=	5,
+	MADT_LAPIC_ENABLED		=	1 << 0,
+	/* pci express memory mapped configuration space table layout */
+	MCFG_ENTRIES			=	44,
+	MCFG_ENTRY_SIZE			=	16,
+	/* high precision event timer table layout */
+	HPET_EVENT_TIMER_BLOCK_ID	=	36,
+	HPET_BASE_ADDRESS		=	40,
+	HPET_NUMBER			=	52,
+	HPET_MIN_TICK			=	53,
+	/* fixed acpi description table layout */
+	FADT_FACS			=	36,
+	FADT_DSDT			=	40,
+	FADT_PREFERRED_PM_PROFILE	=	45,
+	FADT_SCI_IRQ			=	46,
+	FADT_SMI_COMMAND		=	48,
+	FADT_ACPI_ENABLE		=	52,
+	FADT_ACPI_DISABLE		=	53,
+	FADT_PM1A_EVENT_BLOCK		=	56,
+	FADT_PM1A_CONTROL_BLOCK		=	64,
+	FADT_PM_TIMER_BLOCK		=	76,
+	FADT_PM_TIMER_LENGTH		=	91,
+	FADT_CENTURY			=	108,
+	FADT_IAPC_BOOT_ARCH		=	109,
+	FADT_FLAGS			=	112,
+	FADT_RESET_REGISTER		=	116,
+	FADT_RESET_VALUE		=	128,
+	/* generic address structure layout */
+	GAS_ADDRESS_SPACE		=	0,
+	GAS_ADDRESS			=	4,
+};
+
+struct acpi_rsdp
+{
+	char		signature[8];
+	uint8_t		checksum;
+	char		oem_id[6];
+	uint8_t		revision;
+	uint32_t	rsdt_address;
+	/* acpi 2.0 and later */
+	uint32_t	length;
+	uint64_t	xsdt_address;
+	uint8_t		extended_checksum;
+	uint8_t		reserved[3];
+}
+__attribute__((packed));
+
+static struct
+{
+	/* either one of these is used */
+	const struct acpi_table_header	* rsdt;
+	const struct acpi_table_header	* xsdt;
+	/* the decoded tables, and flags telling which ones are present */
+	bool				madt_present, mcfg_present, hpet_present, fadt_present;
+	struct acpi_madt		madt;
+	struct acpi_mcfg		mcfg;
+	struct acpi_hpet		hpet;
+	struct acpi_fadt		fadt;
+}
+acpi __attribute__((section(".common-data")));
+
+static uint16_t get16(const uint8_t * p) { return * (const uint16_t *) p; }
+static uint32_t get32(const uint8_t * p) { return * (const uint32_t *) p; }
+static uint64_t get64(const uint8_t * p) { return * (const uint64_t *) p; }
+
+static bool checksum_valid(const void * p, uint32_t length)
+{
+const uint8_t * x = p;
+uint8_t sum = 0;
+
+	while (length --)
+		sum += * x ++;
+	return !sum;
+}
+
+static bool signature_equal(const char * a, const char * b, int length)
+{
+	while (length --)
+		if (* a ++ != * b ++)
+			return false;
+	return true;
+}
+
+/* returns the address to use for accessing a physical memory region; the memory
+ * below 1 MByte, and the extended memory, are identity mapped; the region in between
+ * holds the kernel process images, and is mapped differently in each process */
+static const void * map_physical(uint64_t physical_address, uint32_t size)
+{
+	if (physical_address >> 32 || physical_address + size > 0x100000000ULL)
+		return 0;
+	if (physical_address + size <= 0x100000)
+		return (const void *) (uint32_t) physical_address;
+	if (physical_address >= EXTENDED_MEMORY_BASE && physical_address + size <= EXTENDED_MEMORY_TOP)
+		return (const void *) (uint32_t) physical_address;
+	if (physical_address < EXTENDED_MEMORY_TOP)
+		return 0;
+	return mem_map_mmio_region(physical_address, size, false);
+}
+
+static const struct acpi_table_header * map_table(uint64_t physical_address)
+{
+const struct acpi_table_header * header = map_physical(physical_address, sizeof * header);
+
+	if (!header || header->length < sizeof * header)
+		return 0;
+	header = map_physical(physical_address, header->length);
+	return (header && checksum_valid(header, header->length)) ? header : 0;
+}
+
+static const struct acpi_rsdp * find_rsdp_in(uint32_t start, uint32_t end)
+{
+const struct acpi_rsdp * rsdp;
+
+	for (; start < end; start += RSDP_ALIGNMENT)
+	{
+		rsdp = (const struct acpi_rsdp *) start;
+		if (signature_equal(rsdp->signature, "RSD PTR ", 8) && checksum_valid(rsdp, RSDP_V1_SIZE))
+			return rsdp;
+	}
+	return 0;
+}
+
+/* returns the physical address of the 'index'-th table in the root table, or 0 past the last table */
+static uint64_t table_address(int index)
+{
+const uint8_t * entries;
+int nr_entries;
+
+	if (acpi.xsdt)
+	{
+		entries = (const uint8_t *) (acpi.xsdt + 1);
+		nr_entries = (acpi.xsdt->length - sizeof * acpi.xsdt) / 8;
+		/* the 64 bit entries are not naturally aligned */
+		return index < nr_entries ? * (const uint64_t *) (entries + 8 * index) : 0;
+	}
+	if (acpi.rsdt)
+	{
+		entries = (const uint8_t *) (acpi.rsdt + 1);
+		nr_entries = (acpi.rsdt->length - sizeof * acpi.rsdt) / 4;
+		return index < nr_entries ? * (const uint32_t *) (entries + 4 * index) : 0;
+	}
+	return 0;
+}
+
+const struct acpi_table_header * acpi_find_table(const char * signature, int index)
+{
+const struct acpi_table_header * table;
+uint64_t address;
+int i;
+
+	for (i = 0; (address = table_address(i)); i ++)
+	{
+		if (!(table = map_table(address)) || !signature_equal(table->signature, signature, 4))
+			continue;
+		if (!index --)
+			return table;
+	}
+	return 0;
+}
+
+static void decode_madt(const uint8_t * table, uint32_t length)
+{
+struct acpi_madt * madt = & acpi.madt;
+const uint8_t * entry;
+
+	madt->lapic_address = get32(table + MADT_LAPIC_ADDRESS);
+	madt->flags = get32(table + MADT_FLAGS);
+	for (entry = table + MADT_ENTRIES; entry + 2 <= table + length && entry[1] >= 2 && entry + entry[1] <= table + length; entry += entry[1])
+		switch (entry[0])
+		{
+			case MADT_ENTRY_LAPIC:
+				if ((get32(entry + 4) & MADT_LAPIC_ENABLED) && madt->nr_cpus < ACPI_MAX_CPUS)
+					madt->cpu_apic_ids[madt->nr_cpus ++] = entry[3];
+				break;
+			case MADT_ENTRY_IOAPIC:
+				if (madt->nr_ioapics == ACPI_MAX_IOAPICS)
+					break;
+				madt->ioapics[madt->nr_ioapics].id = entry[2];
+				madt->ioapics[madt->nr_ioapics].address = get32(entry + 4);
+				madt->ioapics[madt->nr_ioapics ++].gsi_base = get32(entry + 8);
+				break;
+			case MADT_ENTRY_IRQ_OVERRIDE:
+				/* only isa bus overrides are defined */
+				if (entry[2] || madt->nr_irq_overrides == ACPI_MAX_IRQ_OVERRIDES)
+					break;
+				madt->irq_overrides[madt->nr_irq_overrides].irq = entry[3];
+				madt->irq_overrides[madt->nr_irq_overrides].gsi = get32(entry + 4);
+				madt->irq_overrides[madt->nr_irq_overrides ++].flags = get16(entry + 8);
+				break;
+			case MADT_ENTRY_LAPIC_ADDRESS_OVERRIDE:
+				if (!(get64(entry + 4) >> 32))
+					madt->lapic_address = get64(entry + 4);
+				break;
+		}
+}
+
+static void decode_mcfg(const uint8_t * table, uint32_t length)
+{
+struct acpi_mcfg * mcfg = & acpi.mcfg;
+const uint8_t * entry;
+
+	for (entry = table + MCFG_ENTRIES; entry + MCFG_ENTRY_SIZE <= table + length && mcfg->nr_entries < ACPI_MAX_MCFG_ENTRIES; entry += MCFG_ENTRY_SIZE)
+	{
+		mcfg->entries[mcfg->nr_entries].base = get64(entry);
+		mcfg->entries[mcfg->nr_entries].segment = get16(entry + 8);
+		mcfg->entries[mcfg->nr_entries].start_bus = entry[10];
+		mcfg->entries[mcfg->nr_entries ++].end_bus = entry[11];
+	}
+}
+
+static void decode_hpet(const uint8_t * table, uint32_t length)
+{
+	if (length < HPET_MIN_TICK + 2)
+		return;
+	acpi.hpet = (struct acpi_hpet)
+	{
+		.event_timer_block_id	= get32(table + HPET_EVENT_TIMER_BLOCK_ID),
+		.address_space		= table[HPET_BASE_ADDRESS + GAS_ADDRESS_SPACE],
+		.address		= get64(table + HPET_BASE_ADDRESS + GAS_ADDRESS),
+		.hpet_number		= table[HPET_NUMBER],
+		.min_tick		= get16(table + HPET_MIN_TICK),
+	};
+	acpi.hpet_present = true;
+}
+
+static void decode_fadt(const uint8_t * table, uint32_t length)
+{
+struct acpi_fadt * fadt = & acpi.fadt;
+
+	if (length < FADT_PM_TIMER_LENGTH + 1)
+		return;
+	* fadt = (struct acpi_fadt)
+	{
+		.facs_address		= get32(table + FADT_FACS),
+		.dsdt_address		= get32(table + FADT_DSDT),
+		.preferred_pm_profile	= table[FADT_PREFERRED_PM_PROFILE],
+		.sci_irq		= get16(table + FADT_SCI_IRQ),
+		.smi_command_port	= get32(table + FADT_SMI_COMMAND),
+		.acpi_enable		= table[FADT_ACPI_ENABLE],
+		.acpi_disable		= table[FADT_ACPI_DISABLE],
+		.pm1a_event_block	= get32(table + FADT_PM1A_EVENT_BLOCK),
+		.pm1a_control_block	= get32(table + FADT_PM1A_CONTROL_BLOCK),
+		.pm_timer_block		= get32(table + FADT_PM_TIMER_BLOCK),
+		.pm_timer_length	= table[FADT_PM_TIMER_LENGTH],
+		.reset_register_space	= 0xff,
+	};
+	/* the fields below were added in acpi 2.0 */
+	if (length >= FADT_FLAGS + 4)
+	{
+		fadt->century = table[FADT_CENTURY];
+		fadt->iapc_boot_arch = get16(table + FADT_IAPC_BOOT_ARCH);
+		fadt->flags = get32(table + FADT_FLAGS);
+	}
+	if (length >= FADT_RESET_VALUE + 1)
+	{
+		fadt->reset_register_space = table[FADT_RESET_REGISTER + GAS_ADDRESS_SPACE];
+		fadt->reset_register_address = get64(table + FADT_RESET_REGISTER + GAS_ADDRESS);
+		fadt->reset_value = table[FADT_RESET_VALUE];
+	}
+	acpi.fadt_present = true;
+}
+
+void init_acpi(void)
+{
+const struct acpi_rsdp * rsdp;
+const struct acpi_table_header * table;
+int i;
+
+	xmemset(& acpi, 0, sizeof acpi);
+	if (!(rsdp = find_rsdp_in(EBDA_START, EBDA_START + EBDA_SEARCH_SIZE))
+			&& !(rsdp = find_rsdp_in(BIOS_ROM_START, BIOS_ROM_END)))
+		return;
+	if (rsdp->revision >= 2 && checksum_valid(rsdp, rsdp->length) && rsdp->xsdt_address)
+		acpi.xsdt = map_table(rsdp->xsdt_address);
+	if (!acpi.xsdt)
+		acpi.rsdt = map_table(rsdp->rsdt_address);
+	if (!acpi.xsdt && !acpi.rsdt)
+	{
+		print_str(__func__);
+		print_str("(): bad root system description table\n");
+		return;
+	}
+
+	if ((table = acpi_find_table("APIC", 0)))
+	{
+		decode_madt((const uint8_t *) table, table->length);
+		acpi.madt_present = true;
+		/*! \todo	only the first i/o apic is used */
+		if (acpi.madt.nr_ioapics)
+			apic_set_ioapic_address(acpi.madt.ioapics[0].address, acpi.madt.ioapics[0].gsi_base);
+		for (i = 0; i < acpi.madt.nr_irq_overrides; i ++)
+			apic_set_irq_override(acpi.madt.irq_overrides[i].irq, acpi.madt.irq_overrides[i].gsi,
+					(acpi.madt.irq_overrides[i].flags & ACPI_MPS_POLARITY_MASK) == ACPI_MPS_POLARITY_ACTIVE_LOW,
+					(acpi.madt.irq_overrides[i].flags & ACPI_MPS_TRIGGER_MASK) == ACPI_MPS_TRIGGER_LEVEL);
+	}
+	if ((table = acpi_find_table("MCFG", 0)))
+	{
+		decode_mcfg((const uint8_t *) table, table->length);
+		acpi.mcfg_present = true;
+	}
+	if ((table = acpi_find_table("HPET", 0)))
+		decode_hpet((const uint8_t *) table, table->length);
+	if ((table = acpi_find_table("FACP", 0)))
+		decode_fadt((const uint8_t *) table, table->length);
+}
+
+const struct acpi_madt * acpi_get_madt(void) { return acpi.madt_present ? & acpi.madt : 0; }
+const struct acpi_mcfg * acpi_get_mcfg(void) { return acpi.mcfg_present ? & acpi.mcfg : 0; }
+const struct acpi_hpet * acpi_get_hpet(void) { return acpi.hpet_present ? & acpi.hpet : 0; }
+const struct acpi_fadt * acpi_get_fadt(void) { return acpi.fadt_present ? & acpi.fadt : 0; }
+
+static void do_acpi_tables(void)
+{
+const struct acpi_table_header * table;
+char signature[5] = { 0 };
+uint64_t address;
+int i;
+
+	if (!acpi.rsdt && !acpi.xsdt)
+	{
+		print_str("no acpi tables found\n");
+		return;
+	}
+	print_str(acpi.xsdt ? "xsdt:" : "rsdt:");
+	for (i = 0; (address = table_address(i)); i ++)
+	{
+		if (!(table = map_table(address)))
+		{
+			print_str(" (bad)");
+			continue;
+		}
+		xmemcpy(signature, table->signature, 4);
+		print_str(" ");
+		print_str(signature);
+	}
+	print_str("\n");
+}
+
+static void print_field(const char * label, uint32_t x, bool hex)
+{
+	print_str(label);
+	print_number(x, 0, hex);
+	print_str(" ");
+}
+
+static void do_madt(void)
+{
+const struct acpi_madt * madt = acpi_get_madt();
+int i;
+
+	if (!madt)
+	{
+		print_str("no madt\n");
+		return;
+	}
+	print_field("local apic address: $", madt->lapic_address, true);
+	print_str("\nprocessor local apic ids:");
+	for (i = 0; i < madt->nr_cpus; i ++)
+		print_field(" ", madt->cpu_apic_ids[i], false);
+	for (i = 0; i < madt->nr_ioapics; i ++)
+	{
+		print_field("\ni/o apic id ", madt->ioapics[i].id, false);
+		print_field("at $", madt->ioapics[i].address, true);
+		print_field("gsi base ", madt->ioapics[i].gsi_base, false);
+	}
+	for (i = 0; i < madt->nr_irq_overrides; i ++)
+	{
+		print_field("\nirq ", madt->irq_overrides[i].irq, false);
+		print_field("-> gsi ", madt->irq_overrides[i].gsi, false);
+		print_field("flags $", madt->irq_overrides[i].flags, true);
+	}
+	print_str("\n");
+}
+
+static void do_mcfg(void)
+{
+const struct acpi_mcfg * mcfg = acpi_get_mcfg();
+int i;
+
+	if (!mcfg)
+	{
+		print_str("no mcfg\n");
+		return;
+	}
+	for (i = 0; i < mcfg->nr_entries; i ++)
+	{
+		print_field("segment ", mcfg->entries[i].segment, false);
+		print_field("buses ", mcfg->entries[i].start_bus, false);
+		print_field("- ", mcfg->entries[i].end_bus, false);
+		print_field("base $", mcfg->entries[i].base, true);
+		print_str("\n");
+	}
+}
+
+static void do_hpet(void)
+{
+const struct acpi_hpet * hpet = acpi_get_hpet();
+
+	if (!hpet)
+	{
+		print_str("no hpet\n");
+		return;
+	}
+	print_field("hpet ", hpet->hpet_number, false);
+	print_field("at $", hpet->address, true);
+	print_field(hpet->address_space == ACPI_ADDRESS_SPACE_MEMORY ? "(memory) event timer block id $" : "(i/o) event timer block id $",
+			hpet->event_timer_block_id, true);
+	print_field("minimum tick ", hpet->min_tick, false);
+	print_str("\n");
+}
+
+static void do_fadt(void)
+{
+const struct acpi_fadt * fadt = acpi_get_fadt();
+
+	if (!fadt)
+	{
+		print_str("no fadt\n");
+		return;
+	}
+	print_field("dsdt at $", fadt->dsdt_address, true);
+	print_field("\nsci irq ", fadt->sci_irq, false);
+	print_field("\nsmi command port $", fadt->smi_command_port, true);
+	print_field("\npm1a event block $", fadt->pm1a_event_block, true);
+	print_field("\npm1a control block $", fadt->pm1a_control_block, true);
+	print_field("\npm timer block $", fadt->pm_timer_block, true);
+	print_field(fadt->flags & (1 << 8) ? "(32 bit) " : "(24 bit) ", fadt->pm_timer_length, false);
+	print_field("\nia-pc boot architecture flags $", fadt->iapc_boot_arch, true);
+	print_field("\nflags $", fadt->flags, true);
+	if (fadt->reset_register_space != 0xff)
+	{
+		print_field("\nreset register $", fadt->reset_register_address, true);
+		print_field("value $", fadt->reset_value, true);
+	}
+	print_str("\n");
+}
+
+static void do_acpi_hpet_address(void) { /* ( -- physical-address|0) */ sf_push(acpi.hpet_present && acpi.hpet.address_space == ACPI_ADDRESS_SPACE_MEMORY ? acpi.hpet.address : 0); }
+static void do_acpi_cpu_count(void) { /* ( -- n) */ sf_push(acpi.madt_present ? acpi.madt.nr_cpus : 1); }
+static void do_acpi_pm_timer_port(void) { /* ( -- port|0) */ sf_push(acpi.fadt_present ? acpi.fadt.pm_timer_block : 0); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	".acpi-tables",		do_acpi_tables),
+	MKWORD(custom_dict,	__COUNTER__,	".madt",			do_madt),
+	MKWORD(custom_dict,	__COUNTER__,	".mcfg",			do_mcfg),
+	MKWORD(custom_dict,	__COUNTER__,	".hpet",			do_hpet),
+	MKWORD(custom_dict,	__COUNTER__,	".fadt",			do_fadt),
+	MKWORD(custom_dict,	__COUNTER__,	"acpi-hpet-address",		do_acpi_hpet_address),
+	MKWORD(custom_dict,	__COUNTER__,	"acpi-cpu-count",		do_acpi_cpu_count),
+	MKWORD(custom_dict,	__COUNTER__,	"acpi-pm-timer-port",		do_acpi_pm_timer_port),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
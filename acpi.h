@@ -0,0 +1,152 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __ACPI_H__
+#define __ACPI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* the header common to all acpi system description tables */
+struct acpi_table_header
+{
+	char		signature[4];
+	uint32_t	length;
+	uint8_t		revision;
+	uint8_t		checksum;
+	char		oem_id[6];
+	char		oem_table_id[8];
+	uint32_t	oem_revision;
+	uint32_t	creator_id;
+	uint32_t	creator_revision;
+}
+__attribute__((packed));
+
+enum
+{
+	ACPI_MAX_CPUS		=	32,
+	ACPI_MAX_IOAPICS	=	8,
+	ACPI_MAX_IRQ_OVERRIDES	=	16,
+	ACPI_MAX_MCFG_ENTRIES	=	4,
+
+	/* multiple apic description table interrupt source override flags */
+	ACPI_MPS_POLARITY_MASK		=	3 << 0,
+	ACPI_MPS_POLARITY_ACTIVE_LOW	=	3 << 0,
+	ACPI_MPS_TRIGGER_MASK		=	3 << 2,
+	ACPI_MPS_TRIGGER_LEVEL		=	3 << 2,
+	/* generic address structure address space identifiers */
+	ACPI_ADDRESS_SPACE_MEMORY	=	0,
+	ACPI_ADDRESS_SPACE_IO		=	1,
+};
+
+/* the decoded multiple apic description table ("APIC") */
+struct acpi_madt
+{
+	uint32_t	lapic_address;
+	uint32_t	flags;
+	/* the local apic ids of the enabled processors */
+	int		nr_cpus;
+	uint8_t		cpu_apic_ids[ACPI_MAX_CPUS];
+	int		nr_ioapics;
+	struct
+	{
+		uint8_t		id;
+		uint32_t	address;
+		uint32_t	gsi_base;
+	}
+	ioapics[ACPI_MAX_IOAPICS];
+	/* legacy (isa) interrupt request line routing overrides */
+	int		nr_irq_overrides;
+	struct
+	{
+		uint8_t		irq;
+		uint32_t	gsi;
+		uint16_t	flags;
+	}
+	irq_overrides[ACPI_MAX_IRQ_OVERRIDES];
+};
+
+/* the decoded pci express memory mapped configuration space table */
+struct acpi_mcfg
+{
+	int		nr_entries;
+	struct
+	{
+		/* the address of the configuration space of bus 0 of the segment */
+		uint64_t	base;
+		uint16_t	segment;
+		uint8_t		start_bus;
+		uint8_t		end_bus;
+	}
+	entries[ACPI_MAX_MCFG_ENTRIES];
+};
+
+/* the decoded high precision event timer table */
+struct acpi_hpet
+{
+	uint32_t	event_timer_block_id;
+	uint8_t		address_space;
+	uint64_t	address;
+	uint8_t		hpet_number;
+	/* the minimum periodic mode tick, in main counter ticks */
+	uint16_t	min_tick;
+};
+
+/* the decoded fixed acpi description table ("FACP"); only the 32 bit fields */
+struct acpi_fadt
+{
+	uint32_t	facs_address;
+	uint32_t	dsdt_address;
+	uint8_t		preferred_pm_profile;
+	uint16_t	sci_irq;
+	uint32_t	smi_command_port;
+	uint8_t		acpi_enable;
+	uint8_t		acpi_disable;
+	uint32_t	pm1a_event_block;
+	uint32_t	pm1a_control_block;
+	uint32_t	pm_timer_block;
+	uint8_t		pm_timer_length;
+	uint8_t		century;
+	uint16_t	iapc_boot_arch;
+	uint32_t	flags;
+	/* the reset register; 'reset_register_space' is 0xff if there is no reset register */
+	uint8_t		reset_register_space;
+	uint64_t	reset_register_address;
+	uint8_t		reset_value;
+};
+
+/* locates the root system description pointer, and the root (or extended)
+ * system description table, and decodes the madt, mcfg, hpet, and fadt tables;
+ * only the acpi tables are used, there is no acpi machine language support;
+ * the i/o apic address and the interrupt routing overrides found in the madt are
+ * passed to the apic code, so this must be called before 'init_apic()' */
+void init_acpi(void);
+/* returns the 'index'-th (counting from 0) table with the given signature, with
+ * a valid checksum, mapped in memory; returns null if there is no such table */
+const struct acpi_table_header * acpi_find_table(const char * signature, int index);
+/* the decoded tables; these return null if the table is not present */
+const struct acpi_madt * acpi_get_madt(void);
+const struct acpi_mcfg * acpi_get_mcfg(void);
+const struct acpi_hpet * acpi_get_hpet(void);
+const struct acpi_fadt * acpi_get_fadt(void);
+
+#endif /* __ACPI_H__ */
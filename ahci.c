@@ -0,0 +1,642 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* ahci serial ata driver; commands are issued by dma, through the per-port
+ * command lists. When both the host bus adapter and the drive support native
+ * command queuing, up to 32 read/write commands are kept outstanding per port,
+ * so that requests are split in several commands running concurrently, and the
+ * requests of a batch submitted with 'blockdev_submit()' are all in flight at
+ * the same time. Command completion is signalled by the hba interrupt (a message
+ * signalled interrupt, if available); completions are polled when interrupts are
+ * disabled. On errors, all commands outstanding on the port are failed, and the
+ * port is restarted.
+ *
+ * All driver data - the drive descriptors, command lists, received fis areas and
+ * command tables, reside in common data, or in (identity mapped) extended memory,
+ * so that they can be accessed from interrupt context, and from all kernel processes */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "ahci.h"
+#include "irq.h"
+#include "pci.h"
+#include "clock.h"
+#include "pgtable.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+enum
+{
+	/* hba capabilities register bits */
+	AHCI_CAP_NR_PORTS_MASK		=	0x1f,
+	AHCI_CAP_NR_SLOTS_SHIFT		=	8,
+	AHCI_CAP_NR_SLOTS_MASK		=	0x1f,
+	AHCI_CAP_SSS			=	1 << 27,
+	AHCI_CAP_SNCQ			=	1 << 30,
+	AHCI_CAP2_BOH			=	1 << 0,
+	/* global hba control register bits */
+	AHCI_GHC_IE			=	1 << 1,
+	AHCI_GHC_AE			=	1 << 31,
+	/* bios/os handoff control register bits */
+	AHCI_BOHC_BOS			=	1 << 0,
+	AHCI_BOHC_OOS			=	1 << 1,
+
+	/* port command register bits */
+	AHCI_PORT_CMD_ST		=	1 << 0,
+	AHCI_PORT_CMD_SUD		=	1 << 1,
+	AHCI_PORT_CMD_POD		=	1 << 2,
+	AHCI_PORT_CMD_FRE		=	1 << 4,
+	AHCI_PORT_CMD_FR		=	1 << 14,
+	AHCI_PORT_CMD_CR		=	1 << 15,
+	/* port interrupt status/enable register bits */
+	AHCI_PORT_IS_DHRS		=	1 << 0,
+	AHCI_PORT_IS_PSS		=	1 << 1,
+	AHCI_PORT_IS_DSS		=	1 << 2,
+	AHCI_PORT_IS_SDBS		=	1 << 3,
+	AHCI_PORT_IS_IFS		=	1 << 27,
+	AHCI_PORT_IS_HBDS		=	1 << 28,
+	AHCI_PORT_IS_HBFS		=	1 << 29,
+	AHCI_PORT_IS_TFES		=	1 << 30,
+	AHCI_PORT_IS_ERRORS		=	AHCI_PORT_IS_IFS | AHCI_PORT_IS_HBDS | AHCI_PORT_IS_HBFS | AHCI_PORT_IS_TFES,
+	AHCI_PORT_INTERRUPTS		=	AHCI_PORT_IS_DHRS | AHCI_PORT_IS_PSS | AHCI_PORT_IS_DSS | AHCI_PORT_IS_SDBS | AHCI_PORT_IS_ERRORS,
+	/* serial ata status register device detection field */
+	AHCI_SSTS_DET_MASK		=	0xf,
+	AHCI_SSTS_DET_PRESENT		=	3,
+	/* serial ata control register device detection initialization field */
+	AHCI_SCTL_DET_MASK		=	0xf,
+	AHCI_SCTL_DET_COMRESET		=	1,
+	/* the signature of ata (non-packet) devices */
+	AHCI_SIG_ATA			=	0x00000101,
+
+	/* task file data status bits */
+	AHCI_TFD_BSY			=	1 << 7,
+	AHCI_TFD_DRQ			=	1 << 3,
+
+	/* command header flags */
+	AHCI_COMMAND_FIS_LENGTH		=	5,
+	AHCI_COMMAND_WRITE		=	1 << 6,
+	AHCI_PRD_MAX_BYTES		=	4 << 20,
+
+	/* register host to device fis */
+	FIS_TYPE_REG_H2D		=	0x27,
+	FIS_H2D_COMMAND			=	0x80,
+	ATA_DEVICE_LBA			=	1 << 6,
+
+	ATA_COMMAND_READ_DMA_EXT	=	0x25,
+	ATA_COMMAND_WRITE_DMA_EXT	=	0x35,
+	ATA_COMMAND_READ_FPDMA_QUEUED	=	0x60,
+	ATA_COMMAND_WRITE_FPDMA_QUEUED	=	0x61,
+	ATA_COMMAND_READ_DMA		=	0xc8,
+	ATA_COMMAND_WRITE_DMA		=	0xca,
+	ATA_COMMAND_FLUSH_CACHE		=	0xe7,
+	ATA_COMMAND_FLUSH_CACHE_EXT	=	0xea,
+	ATA_COMMAND_IDENTIFY		=	0xec,
+
+	/* identify device data word offsets */
+	ATA_ID_MODEL			=	27,
+	ATA_ID_LBA28_SECTORS		=	60,
+	ATA_ID_QUEUE_DEPTH		=	75,
+	ATA_ID_SATA_CAPABILITIES	=	76,
+	ATA_ID_NCQ_SUPPORTED		=	1 << 8,
+	ATA_ID_COMMAND_SETS		=	83,
+	ATA_ID_LBA48_SUPPORTED		=	1 << 10,
+	ATA_ID_LBA48_SECTORS		=	100,
+
+	/* timeouts, in milliseconds */
+	AHCI_PORT_STOP_TIMEOUT_MS	=	500,
+	AHCI_HANDOFF_TIMEOUT_MS		=	25,
+	AHCI_LINK_TIMEOUT_MS		=	10,
+	AHCI_COMRESET_MS		=	1,
+	/* a command table for each command slot of a port */
+	AHCI_COMMAND_TABLE_FRAMES	=	AHCI_MAX_COMMAND_SLOTS * sizeof(struct ahci_command_table) / FRAME_SIZE,
+};
+
+static struct ahci_hba hbas[MAX_AHCI_HBAS] __attribute__((section(".common-data")));
+static int nr_hbas __attribute__((section(".common-data")));
+static struct ahci_drive drives[MAX_AHCI_DRIVES] __attribute__((section(".common-data")));
+static int nr_drives __attribute__((section(".common-data")));
+
+static const char * const drive_names[MAX_AHCI_DRIVES] = { "ahci0", "ahci1", "ahci2", "ahci3", "ahci4", "ahci5", "ahci6", "ahci7", };
+
+/* waits for the given bits of a register to become clear; returns false on timeout */
+static bool ahci_wait_clear(volatile uint32_t * reg, uint32_t bits, uint32_t timeout_ms)
+{
+uint64_t deadline = clock_deadline_ms(timeout_ms);
+
+	while (* reg & bits)
+		if (clock_deadline_expired(deadline))
+			return false;
+	return true;
+}
+
+/*
+ * command completion
+ */
+
+/* called with interrupts disabled */
+static void ahci_port_service(struct ahci_drive * d)
+{
+uint32_t is = d->regs->is, done;
+
+	d->regs->is = is;
+	if (is & AHCI_PORT_IS_ERRORS)
+	{
+		/* the port stops processing commands on errors, fail all commands
+		 * outstanding, the port is restarted by 'ahci_recover_port()' */
+		d->failed |= d->issued;
+		d->completed |= d->issued;
+		d->issued = 0;
+		d->error = true;
+		return;
+	}
+	/* commands are completed when cleared in both the command issue register, and - for
+	 * queued commands, in the serial ata active register */
+	done = d->issued & ~ (d->regs->sact | d->regs->ci);
+	d->issued &= ~ done;
+	d->completed |= done;
+}
+
+static void ahci_irq_handler(void * argument)
+{
+struct ahci_hba * hba = argument;
+uint32_t is = hba->regs->is;
+int i;
+
+	for (i = 0; i < nr_drives; i ++)
+		if (drives[i].hba == hba && (is & (1 << drives[i].port_number)))
+			ahci_port_service(drives + i);
+	/* the port interrupt status must be cleared before the hba interrupt status */
+	hba->regs->is = is;
+}
+
+/* waits for any outstanding command to complete; returns false on timeout */
+static bool ahci_wait_completion(struct ahci_drive * d, uint64_t deadline)
+{
+unsigned irqflag;
+
+	while (!d->completed)
+	{
+		if (clock_deadline_expired(deadline))
+			return false;
+		if (d->hba->polled || !interrupts_enabled())
+		{
+			irqflag = get_irq_flag_and_disable_irqs();
+			ahci_port_service(d);
+			restore_irq_flag(irqflag);
+			continue;
+		}
+		asm("cli");
+		if (!d->completed)
+			/* the timer tick bounds the wait, should the interrupt be lost */
+			asm("sti\n" "hlt\n");
+		else
+			asm("sti");
+	}
+	return true;
+}
+
+/* processes completed commands, and frees their slots */
+static void ahci_reap_completions(struct ahci_drive * d)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+uint32_t completed = d->completed, failed = d->failed;
+int slot;
+
+	d->completed = d->failed = 0;
+	restore_irq_flag(irqflag);
+	for (slot = 0; completed; slot ++, completed >>= 1, failed >>= 1)
+	{
+		if (!(completed & 1))
+			continue;
+		if ((failed & 1) && d->slot_requests[slot])
+			d->slot_requests[slot]->status = -1;
+		d->slot_requests[slot] = 0;
+	}
+}
+
+/*
+ * port control
+ */
+
+static bool ahci_stop_port(struct ahci_drive * d)
+{
+	d->regs->cmd &= ~ AHCI_PORT_CMD_ST;
+	if (!ahci_wait_clear(& d->regs->cmd, AHCI_PORT_CMD_CR, AHCI_PORT_STOP_TIMEOUT_MS))
+		return false;
+	d->regs->cmd &= ~ AHCI_PORT_CMD_FRE;
+	return ahci_wait_clear(& d->regs->cmd, AHCI_PORT_CMD_FR, AHCI_PORT_STOP_TIMEOUT_MS);
+}
+
+static bool ahci_start_port(struct ahci_drive * d)
+{
+	if (!ahci_stop_port(d))
+		return false;
+	d->regs->clb = (uint32_t) d->command_list;
+	d->regs->clbu = 0;
+	d->regs->fb = (uint32_t) d->received_fis;
+	d->regs->fbu = 0;
+	d->regs->serr = 0xffffffff;
+	d->regs->is = 0xffffffff;
+	d->regs->cmd |= AHCI_PORT_CMD_FRE;
+	/* the drive must be idle before the port is started */
+	if (!ahci_wait_clear(& d->regs->tfd, AHCI_TFD_BSY | AHCI_TFD_DRQ, AHCI_TIMEOUT_MS))
+		return false;
+	d->regs->ie = AHCI_PORT_INTERRUPTS;
+	d->regs->cmd |= AHCI_PORT_CMD_ST;
+	return true;
+}
+
+static bool ahci_link_up(struct ahci_drive * d)
+{
+uint64_t deadline = clock_deadline_ms(AHCI_LINK_TIMEOUT_MS);
+
+	while ((d->regs->ssts & AHCI_SSTS_DET_MASK) != AHCI_SSTS_DET_PRESENT)
+		if (clock_deadline_expired(deadline))
+			return false;
+	return true;
+}
+
+/* restarts a port after errors, or timeouts; all outstanding commands are failed */
+static void ahci_recover_port(struct ahci_drive * d)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	d->failed |= d->issued;
+	d->completed |= d->issued;
+	d->issued = 0;
+	d->error = false;
+	restore_irq_flag(irqflag);
+
+	if (ahci_start_port(d))
+		return;
+	/* the drive is stuck, reset the link */
+	ahci_stop_port(d);
+	d->regs->sctl = (d->regs->sctl & ~ AHCI_SCTL_DET_MASK) | AHCI_SCTL_DET_COMRESET;
+	clock_delay_us(AHCI_COMRESET_MS * 1000);
+	d->regs->sctl &= ~ AHCI_SCTL_DET_MASK;
+	if (!ahci_link_up(d) || !ahci_start_port(d))
+	{
+		print_str(d->blockdev.name);
+		print_str(": port recovery failed\n");
+	}
+}
+
+/*
+ * command construction
+ */
+
+/* fills in the physical region descriptor table of a command; returns the number
+ * of descriptors used, or -1 if the buffer can not be used for dma */
+static int ahci_build_prdt(struct ahci_command_table * table, uint8_t * buffer, uint32_t size)
+{
+struct ahci_prd * prd = 0;
+uint32_t physical_address, n, length = 0;
+
+	if ((uint32_t) buffer & 1)
+		return -1;
+	for (; size; size -= n, buffer += n)
+	{
+		/* the buffer is physically contiguous only within a page */
+		n = 0x1000 - ((uint32_t) buffer & 0xfff);
+		if (n > size)
+			n = size;
+		if (!(physical_address = mem_virtual_to_physical(buffer)))
+			return -1;
+		if (prd && prd->data_base + length == physical_address && length + n <= AHCI_PRD_MAX_BYTES)
+		{
+			/* merge with the previous region */
+			length += n;
+			prd->byte_count = length - 1;
+			continue;
+		}
+		prd = prd ? prd + 1 : table->prdt;
+		if (prd == table->prdt + AHCI_NR_PRD_ENTRIES)
+			return -1;
+		* prd = (struct ahci_prd) { .data_base = physical_address, .byte_count = n - 1, };
+		length = n;
+	}
+	return prd ? prd - table->prdt + 1 : 0;
+}
+
+/* prepares a command in a slot; for queued commands, the sector count is passed in the
+ * features register, and the slot number (the queuing tag) in the sector count register */
+static int ahci_build_command(struct ahci_drive * d, int slot, int command, uint64_t lba,
+		uint32_t count, bool queued, void * buffer, uint32_t size, bool write)
+{
+struct ahci_command_table * table = d->command_tables + slot;
+uint8_t * fis = table->command_fis;
+int nr_prds;
+
+	if ((nr_prds = ahci_build_prdt(table, buffer, size)) == -1)
+		return -1;
+	xmemset(fis, 0, sizeof table->command_fis);
+	fis[0] = FIS_TYPE_REG_H2D;
+	fis[1] = FIS_H2D_COMMAND;
+	fis[2] = command;
+	fis[4] = lba, fis[5] = lba >> 8, fis[6] = lba >> 16;
+	fis[8] = lba >> 24, fis[9] = lba >> 32, fis[10] = lba >> 40;
+	if (command != ATA_COMMAND_IDENTIFY)
+		fis[7] = ATA_DEVICE_LBA | (d->lba48 ? 0 : (lba >> 24) & 0xf);
+	if (queued)
+	{
+		fis[3] = count, fis[11] = count >> 8;
+		fis[12] = slot << 3;
+	}
+	else
+		fis[12] = count, fis[13] = count >> 8;
+
+	d->command_list[slot] = (struct ahci_command_header)
+	{
+		.flags		= AHCI_COMMAND_FIS_LENGTH | (write ? AHCI_COMMAND_WRITE : 0),
+		.prdt_length	= nr_prds,
+		.command_table	= (uint32_t) table,
+	};
+	d->slot_requests[slot] = 0;
+	return 0;
+}
+
+static void ahci_issue(struct ahci_drive * d, int slot, bool queued)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	d->issued |= 1 << slot;
+	if (queued)
+		d->regs->sact = 1 << slot;
+	d->regs->ci = 1 << slot;
+	restore_irq_flag(irqflag);
+}
+
+/* executes a non-queued command, with no other commands outstanding; returns 0 on success */
+static int ahci_exec(struct ahci_drive * d, int command, void * buffer, uint32_t size)
+{
+uint64_t deadline = clock_deadline_ms(AHCI_TIMEOUT_MS);
+int status;
+
+	if (ahci_build_command(d, 0, command, 0, 0, false, buffer, size, false))
+		return -1;
+	ahci_issue(d, 0, false);
+	if (!ahci_wait_completion(d, deadline) || d->error)
+	{
+		ahci_recover_port(d);
+		ahci_reap_completions(d);
+		return -1;
+	}
+	status = (d->failed & 1) ? -1 : 0;
+	ahci_reap_completions(d);
+	return status;
+}
+
+/*
+ * block device operations
+ */
+
+static int ahci_submit(struct block_device * dev, struct blockdev_request * requests, int nr_requests)
+{
+struct ahci_drive * d = dev->driver_data;
+uint64_t deadline = clock_deadline_ms(AHCI_TIMEOUT_MS), lba;
+uint32_t slot_mask = (d->queue_depth == 32) ? 0xffffffff : (1 << d->queue_depth) - 1, count, n;
+uint8_t * buffer;
+int i, slot, command, result = 0;
+
+	for (i = 0; i < nr_requests; i ++)
+		requests[i].status = 0;
+	for (i = 0; i < nr_requests; i ++)
+	{
+		if (d->ncq)
+			command = requests[i].write ? ATA_COMMAND_WRITE_FPDMA_QUEUED : ATA_COMMAND_READ_FPDMA_QUEUED;
+		else if (d->lba48)
+			command = requests[i].write ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_READ_DMA_EXT;
+		else
+			command = requests[i].write ? ATA_COMMAND_WRITE_DMA : ATA_COMMAND_READ_DMA;
+		for (lba = requests[i].lba, count = requests[i].count, buffer = requests[i].buffer;
+				count && !requests[i].status; count -= n, lba += n, buffer += n * AHCI_SECTOR_SIZE)
+		{
+			n = count < AHCI_MAX_SECTORS ? count : AHCI_MAX_SECTORS;
+			/* find a free slot, waiting for outstanding commands to complete if necessary */
+			while (!(~ (d->issued | d->completed) & slot_mask) && ahci_wait_completion(d, deadline) && !d->error)
+				ahci_reap_completions(d);
+			if (d->error || !(~ (d->issued | d->completed) & slot_mask))
+			{
+				/* a timeout, or an error - fail the requests not yet issued */
+				for (; i < nr_requests; i ++)
+					requests[i].status = -1;
+				goto out;
+			}
+			slot = find_first_clear(d->issued | d->completed);
+			if (ahci_build_command(d, slot, command, lba, n, d->ncq, buffer, n * AHCI_SECTOR_SIZE, requests[i].write))
+			{
+				requests[i].status = -1;
+				break;
+			}
+			d->slot_requests[slot] = requests + i;
+			ahci_issue(d, slot, d->ncq);
+			/* restart the timeout for each command issued */
+			deadline = clock_deadline_ms(AHCI_TIMEOUT_MS);
+		}
+	}
+out:
+	while (d->issued && ahci_wait_completion(d, deadline) && !d->error)
+		ahci_reap_completions(d);
+	if (d->issued || d->error)
+		/* a timeout, or an error */
+		ahci_recover_port(d);
+	ahci_reap_completions(d);
+
+	for (i = 0; i < nr_requests; i ++)
+		result |= requests[i].status;
+	return result;
+}
+
+static int ahci_read(struct block_device * dev, uint64_t lba, uint32_t count, void * buffer)
+{
+struct blockdev_request request = { .lba = lba, .count = count, .buffer = buffer, .write = false, };
+
+	return ahci_submit(dev, & request, 1);
+}
+
+static int ahci_write(struct block_device * dev, uint64_t lba, uint32_t count, const void * buffer)
+{
+struct blockdev_request request = { .lba = lba, .count = count, .buffer = (void *) buffer, .write = true, };
+
+	return ahci_submit(dev, & request, 1);
+}
+
+static int ahci_flush(struct block_device * dev)
+{
+struct ahci_drive * d = dev->driver_data;
+
+	return ahci_exec(d, d->lba48 ? ATA_COMMAND_FLUSH_CACHE_EXT : ATA_COMMAND_FLUSH_CACHE, 0, 0);
+}
+
+/*
+ * initialization
+ */
+
+static bool ahci_identify(struct ahci_drive * d)
+{
+uint16_t * id = d->identify_data;
+int i;
+
+	if (ahci_exec(d, ATA_COMMAND_IDENTIFY, id, AHCI_SECTOR_SIZE))
+		return false;
+	d->lba48 = id[ATA_ID_COMMAND_SETS] & ATA_ID_LBA48_SUPPORTED;
+	if (d->lba48)
+		d->nr_sectors = id[ATA_ID_LBA48_SECTORS] | ((uint64_t) id[ATA_ID_LBA48_SECTORS + 1] << 16)
+			| ((uint64_t) id[ATA_ID_LBA48_SECTORS + 2] << 32) | ((uint64_t) id[ATA_ID_LBA48_SECTORS + 3] << 48);
+	else
+		d->nr_sectors = id[ATA_ID_LBA28_SECTORS] | ((uint32_t) id[ATA_ID_LBA28_SECTORS + 1] << 16);
+	/* the model string is stored with the bytes in each word swapped */
+	for (i = 0; i < 20; i ++)
+		d->model[2 * i] = id[ATA_ID_MODEL + i] >> 8, d->model[2 * i + 1] = id[ATA_ID_MODEL + i];
+	for (i = 40; i && d->model[i - 1] == ' '; d->model[-- i] = 0)
+		;
+	/* queued commands use 48 bit addressing */
+	d->ncq = d->hba->ncq && d->lba48 && (id[ATA_ID_SATA_CAPABILITIES] & ATA_ID_NCQ_SUPPORTED);
+	d->queue_depth = 1;
+	if (d->ncq)
+	{
+		d->queue_depth = (id[ATA_ID_QUEUE_DEPTH] & 0x1f) + 1;
+		if (d->queue_depth > d->hba->nr_slots)
+			d->queue_depth = d->hba->nr_slots;
+	}
+	return d->nr_sectors != 0;
+}
+
+static void ahci_init_port(struct ahci_hba * hba, int port_number)
+{
+struct ahci_drive * d = drives + nr_drives;
+uint8_t * frame;
+
+	* d = (struct ahci_drive) { .hba = hba, .port_number = port_number, .regs = hba->regs->ports + port_number, };
+	/* power on, and spin up the device */
+	d->regs->cmd |= AHCI_PORT_CMD_POD | AHCI_PORT_CMD_SUD;
+	if (!ahci_link_up(d))
+		return;
+
+	if (!(frame = frame_alloc(1)))
+		return;
+	if (!(d->command_tables = frame_alloc(AHCI_COMMAND_TABLE_FRAMES)))
+	{
+		frame_free(frame, 1);
+		return;
+	}
+	d->command_list = (struct ahci_command_header *) frame;
+	d->received_fis = frame + 0x400;
+	d->identify_data = (uint16_t *) (frame + 0x800);
+
+	if (!ahci_start_port(d) || d->regs->sig != AHCI_SIG_ATA || !ahci_identify(d))
+	{
+		/* no drive, or a packet interface device */
+		ahci_stop_port(d);
+		frame_free(d->command_tables, AHCI_COMMAND_TABLE_FRAMES);
+		frame_free(frame, 1);
+		return;
+	}
+	d->blockdev = (struct block_device)
+	{
+		.name		= drive_names[nr_drives],
+		.sector_size	= AHCI_SECTOR_SIZE,
+		.nr_sectors	= d->nr_sectors,
+		.read		= ahci_read,
+		.write		= ahci_write,
+		.flush		= ahci_flush,
+		.submit		= ahci_submit,
+		.driver_data	= d,
+	};
+	nr_drives ++;
+	hba->drive_mask |= 1 << port_number;
+	blockdev_register(& d->blockdev);
+	print_str(d->blockdev.name);
+	print_str(": ");
+	print_str(d->model);
+	if (d->ncq)
+	{
+		print_str(", ncq, queue depth ");
+		print_number(d->queue_depth, 0, false);
+	}
+	print_str("\n");
+}
+
+static bool ahci_probe(const struct pci_function * f)
+{
+struct ahci_hba * hba = hbas + nr_hbas;
+uint32_t ports;
+uint64_t deadline;
+int i, vector;
+bool polled;
+
+	/* the pci core has mapped the hba registers (the abar, base address register 5) */
+	if (nr_hbas == MAX_AHCI_HBAS || f->resources[5].io || !(hba->regs = f->resources[5].mmio))
+		return false;
+
+	/* take ownership of the hba from the firmware */
+	if (hba->regs->cap2 & AHCI_CAP2_BOH)
+	{
+		hba->regs->bohc |= AHCI_BOHC_OOS;
+		deadline = clock_deadline_ms(AHCI_HANDOFF_TIMEOUT_MS);
+		while ((hba->regs->bohc & AHCI_BOHC_BOS) && !clock_deadline_expired(deadline))
+			;
+	}
+	hba->regs->ghc |= AHCI_GHC_AE;
+	hba->nr_slots = ((hba->regs->cap >> AHCI_CAP_NR_SLOTS_SHIFT) & AHCI_CAP_NR_SLOTS_MASK) + 1;
+	hba->ncq = hba->regs->cap & AHCI_CAP_SNCQ;
+
+	/* prefer message signalled interrupts, which are never shared */
+	polled = true;
+	if ((vector = irq_alloc_vector(ahci_irq_handler, hba)) != -1)
+	{
+		if (pci_enable_msi(f->bus, f->device, f->function, vector))
+			polled = false;
+		else
+			irq_detach_vector(vector);
+	}
+	if (polled && f->irq_line < NR_LEGACY_IRQS && !irq_attach(f->irq_line, ahci_irq_handler, hba))
+		polled = false;
+	/* hba interrupts are only enabled after the ports have been set up */
+	hba->polled = true;
+	nr_hbas ++;
+
+	ports = hba->regs->pi;
+	for (i = 0; i < AHCI_MAX_PORTS && nr_drives < MAX_AHCI_DRIVES; i ++)
+		if (ports & (1 << i))
+			ahci_init_port(hba, i);
+	hba->regs->is = 0xffffffff;
+	hba->regs->ghc |= AHCI_GHC_IE;
+	hba->polled = polled;
+	return true;
+}
+
+static const struct pci_match ahci_match[] =
+{
+	{ PCI_ANY_ID, PCI_ANY_ID, PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_SATA, PCI_PROG_IF_AHCI, },
+	{ 0, },
+};
+
+static const struct pci_driver ahci_driver = { .name = "ahci", .match = ahci_match, .probe = ahci_probe, };
+
+void init_ahci(void)
+{
+	pci_register_driver(& ahci_driver);
+}
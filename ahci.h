@@ -0,0 +1,177 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __AHCI_H__
+#define __AHCI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+enum
+{
+	AHCI_MAX_PORTS			=	32,
+	AHCI_MAX_COMMAND_SLOTS		=	32,
+	/* maximum number of host bus adapters, and drives, supported */
+	MAX_AHCI_HBAS			=	2,
+	MAX_AHCI_DRIVES			=	8,
+	/* number of physical region descriptors in a command table; this makes
+	 * a command table exactly 1 KByte in size */
+	AHCI_NR_PRD_ENTRIES		=	56,
+	/* maximum number of sectors transferred by a single command; bounded by
+	 * the number of physical region descriptors, with one descriptor per page */
+	AHCI_MAX_SECTORS		=	256,
+	AHCI_SECTOR_SIZE		=	512,
+	AHCI_TIMEOUT_MS			=	5000,
+};
+
+/* port registers, located at offset 0x100 + port number * 0x80 in the hba memory space */
+struct ahci_port_registers
+{
+	/* command list base address, 1 KByte aligned */
+	uint32_t	clb;
+	uint32_t	clbu;
+	/* received fis base address, 256 byte aligned */
+	uint32_t	fb;
+	uint32_t	fbu;
+	uint32_t	is;
+	uint32_t	ie;
+	uint32_t	cmd;
+	uint32_t	reserved0;
+	/* task file data - the ata status register is in bits 0-7 */
+	uint32_t	tfd;
+	uint32_t	sig;
+	/* serial ata status, control, and error registers */
+	uint32_t	ssts;
+	uint32_t	sctl;
+	uint32_t	serr;
+	/* serial ata active - a bit per native command queuing tag */
+	uint32_t	sact;
+	/* command issue - a bit per command slot */
+	uint32_t	ci;
+	uint32_t	sntf;
+	uint32_t	fbs;
+	uint32_t	reserved1[11];
+	uint32_t	vendor[4];
+};
+
+/* host bus adapter memory registers, located at the address in the pci BAR5 register */
+struct ahci_hba_registers
+{
+	uint32_t	cap;
+	uint32_t	ghc;
+	uint32_t	is;
+	/* ports implemented */
+	uint32_t	pi;
+	uint32_t	vs;
+	uint32_t	ccc_ctl;
+	uint32_t	ccc_ports;
+	uint32_t	em_loc;
+	uint32_t	em_ctl;
+	uint32_t	cap2;
+	/* bios/os handoff control and status */
+	uint32_t	bohc;
+	uint8_t		reserved[0xa0 - 0x2c];
+	uint8_t		vendor[0x100 - 0xa0];
+	struct ahci_port_registers	ports[AHCI_MAX_PORTS];
+};
+
+/* an entry in a port's command list */
+struct ahci_command_header
+{
+	/* bits 0-4: command fis length in double words, bit 6: write,
+	 * bit 7: prefetchable, bit 10: clear busy upon r_ok */
+	uint16_t	flags;
+	/* number of entries in the physical region descriptor table */
+	uint16_t	prdt_length;
+	/* number of bytes transferred, updated by the hba */
+	uint32_t	prd_byte_count;
+	/* command table base address, 128 byte aligned */
+	uint32_t	command_table;
+	uint32_t	command_table_upper;
+	uint32_t	reserved[4];
+};
+
+/* physical region descriptor; a region must be word aligned, and its size even */
+struct ahci_prd
+{
+	uint32_t	data_base;
+	uint32_t	data_base_upper;
+	uint32_t	reserved;
+	/* bits 0-21: byte count - 1, bit 31: interrupt on completion */
+	uint32_t	byte_count;
+};
+
+struct ahci_command_table
+{
+	uint8_t		command_fis[64];
+	uint8_t		atapi_command[16];
+	uint8_t		reserved[48];
+	struct ahci_prd	prdt[AHCI_NR_PRD_ENTRIES];
+};
+
+struct ahci_hba
+{
+	volatile struct ahci_hba_registers	* regs;
+	/* number of command slots supported */
+	int		nr_slots;
+	bool		ncq;
+	/* true if no interrupt could be attached, and completions must be polled */
+	bool		polled;
+	/* the drives attached to the hba */
+	uint32_t	drive_mask;
+};
+
+struct ahci_drive
+{
+	struct ahci_hba	* hba;
+	int		port_number;
+	volatile struct ahci_port_registers	* regs;
+	/* the command list, and received fis area of the port share a page frame,
+	 * the command tables of the slots are in a separate run of page frames */
+	struct ahci_command_header	* command_list;
+	void		* received_fis;
+	uint16_t	* identify_data;
+	struct ahci_command_table	* command_tables;
+	/* number of commands to keep outstanding, 1 if native command queuing is not used */
+	int		queue_depth;
+	bool		ncq;
+	bool		lba48;
+	uint64_t	nr_sectors;
+	char		model[41];
+	/* slot bitmasks - commands issued and not yet completed, commands completed
+	 * and not yet processed, and completed commands that failed; these are
+	 * updated by the interrupt handler */
+	volatile uint32_t	issued;
+	volatile uint32_t	completed;
+	volatile uint32_t	failed;
+	/* set by the interrupt handler on errors, the port must be restarted */
+	volatile bool	error;
+	/* the request each of the slots in use is part of */
+	struct blockdev_request	* slot_requests[AHCI_MAX_COMMAND_SLOTS];
+	struct block_device	blockdev;
+};
+
+/* locates the ahci host bus adapters, and registers the drives attached to them as block devices */
+void init_ahci(void);
+
+#endif /* __AHCI_H__ */
@@ -0,0 +1,276 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* local and i/o apic support; when a local apic is present, the 8259a
+ * interrupt controllers are masked, and the legacy interrupt request lines
+ * are routed through the i/o apic redirection table to the same vectors
+ * that are used with the 8259a controllers, so that drivers do not need to
+ * care which controller is in use. Interrupts are acknowledged by a single
+ * memory write to the local apic, instead of port writes to the 8259a
+ * controllers. Only the processor running the kernel is used, so all
+ * interrupts are delivered to its local apic */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "apic.h"
+#include "irq.h"
+#include "pgtable.h"
+
+enum
+{
+	IA32_APIC_BASE_MSR		=	0x1b,
+	IA32_APIC_BASE_ENABLE		=	1 << 11,
+	CPUID_FEATURE_APIC		=	1 << 9,
+
+	/* local apic register offsets, in 32 bit words */
+	LAPIC_ID			=	0x20 / 4,
+	LAPIC_VERSION			=	0x30 / 4,
+	LAPIC_TPR			=	0x80 / 4,
+	LAPIC_EOI			=	0xb0 / 4,
+	LAPIC_SVR			=	0xf0 / 4,
+	LAPIC_LVT_TIMER			=	0x320 / 4,
+	LAPIC_LVT_LINT0			=	0x350 / 4,
+	LAPIC_LVT_ERROR			=	0x370 / 4,
+	LAPIC_SVR_ENABLE		=	1 << 8,
+	LAPIC_LVT_MASKED		=	1 << 16,
+
+	/* i/o apic register select and window, in 32 bit words */
+	IOAPIC_REGSEL			=	0x00 / 4,
+	IOAPIC_WINDOW			=	0x10 / 4,
+	/* i/o apic registers */
+	IOAPIC_VERSION			=	0x01,
+	IOAPIC_REDIRECTION_TABLE	=	0x10,
+	IOREDTBL_ACTIVE_LOW		=	1 << 13,
+	IOREDTBL_LEVEL_TRIGGERED	=	1 << 15,
+	IOREDTBL_MASKED			=	1 << 16,
+
+	/* interrupt mode configuration register, present on some older chipsets */
+	IMCR_ADDRESS_PORT		=	0x22,
+	IMCR_DATA_PORT			=	0x23,
+	IMCR_SELECT			=	0x70,
+	IMCR_APIC_MODE			=	0x01,
+};
+
+static struct
+{
+	bool		enabled;
+	volatile uint32_t	* lapic;
+	volatile uint32_t	* ioapic;
+	uint32_t	ioapic_physical_address;
+	int		ioapic_gsi_base;
+	int		ioapic_nr_pins;
+	int		lapic_id;
+	/* legacy interrupt request line routing */
+	struct
+	{
+		/* -1 if the line is not routed */
+		int	gsi;
+		bool	active_low;
+		bool	level_triggered;
+	}
+	irq_routing[NR_LEGACY_IRQS];
+	bool		irq_routing_initialized;
+}
+apic __attribute__((section(".common-data")));
+
+static void rdmsr(uint32_t msr, uint32_t * low, uint32_t * high) { asm volatile ("rdmsr" : "=a" (* low), "=d" (* high) : "c" (msr)); }
+static void wrmsr(uint32_t msr, uint32_t low, uint32_t high) { asm volatile ("wrmsr" : : "c" (msr), "a" (low), "d" (high)); }
+
+static uint32_t cpuid_features(void)
+{
+uint32_t eax = 1, ebx, ecx, edx;
+
+	asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+	return edx;
+}
+
+static uint32_t ioapic_read(int reg)
+{
+	apic.ioapic[IOAPIC_REGSEL] = reg;
+	return apic.ioapic[IOAPIC_WINDOW];
+}
+
+static void ioapic_write(int reg, uint32_t value)
+{
+	apic.ioapic[IOAPIC_REGSEL] = reg;
+	apic.ioapic[IOAPIC_WINDOW] = value;
+}
+
+static void init_irq_routing(void)
+{
+int i;
+
+	if (apic.irq_routing_initialized)
+		return;
+	apic.irq_routing_initialized = true;
+	apic.ioapic_physical_address = IOAPIC_DEFAULT_PHYSICAL_ADDRESS;
+	for (i = 0; i < NR_LEGACY_IRQS; i ++)
+		apic.irq_routing[i].gsi = i;
+	/* the timer is connected to input 2 of the i/o apic on virtually all pc systems,
+	 * and the cascade line is not used */
+	apic.irq_routing[IRQ_TIMER].gsi = 2;
+	apic.irq_routing[IRQ_CASCADE].gsi = -1;
+}
+
+void apic_set_irq_override(int irq, int gsi, bool active_low, bool level_triggered)
+{
+int i;
+
+	if (irq < 0 || irq >= NR_LEGACY_IRQS)
+		return;
+	init_irq_routing();
+	/* a line taking over an input displaces the line identity mapped to it */
+	for (i = 0; i < NR_LEGACY_IRQS; i ++)
+		if (apic.irq_routing[i].gsi == gsi)
+			apic.irq_routing[i].gsi = -1;
+	apic.irq_routing[irq].gsi = gsi;
+	apic.irq_routing[irq].active_low = active_low;
+	apic.irq_routing[irq].level_triggered = level_triggered;
+}
+
+void apic_set_ioapic_address(uint32_t physical_address, int gsi_base)
+{
+	init_irq_routing();
+	apic.ioapic_physical_address = physical_address;
+	apic.ioapic_gsi_base = gsi_base;
+}
+
+static int irq_to_ioapic_pin(int irq)
+{
+int pin;
+
+	if (irq < 0 || irq >= NR_LEGACY_IRQS || apic.irq_routing[irq].gsi == -1)
+		return -1;
+	pin = apic.irq_routing[irq].gsi - apic.ioapic_gsi_base;
+	return (pin >= 0 && pin < apic.ioapic_nr_pins) ? pin : -1;
+}
+
+static void apic_mask(int irq, bool mask)
+{
+int pin = irq_to_ioapic_pin(irq);
+uint32_t x;
+
+	if (pin == -1)
+		return;
+	x = ioapic_read(IOAPIC_REDIRECTION_TABLE + 2 * pin);
+	ioapic_write(IOAPIC_REDIRECTION_TABLE + 2 * pin, mask ? x | IOREDTBL_MASKED : x & ~ IOREDTBL_MASKED);
+}
+
+static void apic_eoi(int vector, int irq)
+{
+	apic.lapic[LAPIC_EOI] = 0;
+}
+
+static bool apic_is_spurious(int vector, int irq)
+{
+	/* spurious interrupts must not be acknowledged */
+	return vector == SPURIOUS_VECTOR;
+}
+
+static const struct irq_controller apic_controller =
+{
+	.name		= "apic",
+	.mask		= apic_mask,
+	.eoi		= apic_eoi,
+	.is_spurious	= apic_is_spurious,
+};
+
+bool init_apic(void)
+{
+uint32_t low, high;
+int i, pin;
+
+	if (!(cpuid_features() & CPUID_FEATURE_APIC))
+		return false;
+	init_irq_routing();
+
+	rdmsr(IA32_APIC_BASE_MSR, & low, & high);
+	if (!(low & IA32_APIC_BASE_ENABLE))
+		wrmsr(IA32_APIC_BASE_MSR, low |= IA32_APIC_BASE_ENABLE, high);
+	if (!(apic.lapic = mem_map_mmio_region(low & ~ 0xfff, 0x1000, true)))
+		return false;
+	if (!(apic.ioapic = mem_map_mmio_region(apic.ioapic_physical_address, 0x1000, true)))
+		return false;
+	apic.lapic_id = apic.lapic[LAPIC_ID] >> 24;
+	apic.ioapic_nr_pins = ((ioapic_read(IOAPIC_VERSION) >> 16) & 0xff) + 1;
+
+	/* mask all i/o apic inputs, then route the legacy interrupt request lines */
+	for (pin = 0; pin < apic.ioapic_nr_pins; pin ++)
+		ioapic_write(IOAPIC_REDIRECTION_TABLE + 2 * pin, IOREDTBL_MASKED);
+	for (i = 0; i < NR_LEGACY_IRQS; i ++)
+	{
+		if ((pin = irq_to_ioapic_pin(i)) == -1)
+			continue;
+		ioapic_write(IOAPIC_REDIRECTION_TABLE + 2 * pin + 1, apic.lapic_id << 24);
+		ioapic_write(IOAPIC_REDIRECTION_TABLE + 2 * pin, IOREDTBL_MASKED | irq_to_vector(i)
+				| (apic.irq_routing[i].active_low ? IOREDTBL_ACTIVE_LOW : 0)
+				| (apic.irq_routing[i].level_triggered ? IOREDTBL_LEVEL_TRIGGERED : 0));
+	}
+
+	/* accept all interrupt priorities, and disable the local interrupt sources that are not used */
+	apic.lapic[LAPIC_TPR] = 0;
+	apic.lapic[LAPIC_LVT_TIMER] = LAPIC_LVT_MASKED;
+	apic.lapic[LAPIC_LVT_LINT0] = LAPIC_LVT_MASKED;
+	apic.lapic[LAPIC_LVT_ERROR] = LAPIC_LVT_MASKED;
+	apic.lapic[LAPIC_SVR] = LAPIC_SVR_ENABLE | SPURIOUS_VECTOR;
+
+	/* disconnect the 8259a controllers from the processor interrupt pin, on systems that support this */
+	write_io_port_byte(IMCR_ADDRESS_PORT, IMCR_SELECT);
+	write_io_port_byte(IMCR_DATA_PORT, IMCR_APIC_MODE);
+
+	irq_set_controller(& apic_controller);
+	apic.enabled = true;
+	return true;
+}
+
+bool apic_enabled(void)
+{
+	return apic.enabled;
+}
+
+uint32_t apic_msi_address(void)
+{
+	return MSI_ADDRESS_BASE | (apic.lapic_id << 12);
+}
+
+uint32_t apic_msi_data(int vector)
+{
+	/* fixed delivery mode, edge triggered */
+	return vector & 0xff;
+}
+
+static void do_apic_enabled(void) { /* ( -- t=apics in use|f=8259a in use) */ sf_push(apic.enabled ? -1 : 0); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"apic?",		do_apic_enabled),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -0,0 +1,52 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __APIC_H__
+#define __APIC_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	LAPIC_DEFAULT_PHYSICAL_ADDRESS		=	0xfee00000,
+	IOAPIC_DEFAULT_PHYSICAL_ADDRESS		=	0xfec00000,
+	/* message signalled interrupts are delivered by writes to this region */
+	MSI_ADDRESS_BASE			=	0xfee00000,
+};
+
+/* overrides the default identity mapping of a legacy interrupt request line to an
+ * i/o apic input (a global system interrupt number); must be called before 'init_apic()' */
+void apic_set_irq_override(int irq, int gsi, bool active_low, bool level_triggered);
+/* overrides the default i/o apic address; must be called before 'init_apic()' */
+void apic_set_ioapic_address(uint32_t physical_address, int gsi_base);
+/* initializes the local and i/o apics, and switches interrupt handling over
+ * to them; returns false, and leaves the 8259a controllers in use, if there
+ * is no local apic */
+bool init_apic(void);
+bool apic_enabled(void);
+/* message signalled interrupt address and data values, for delivering the given
+ * vector to this processor */
+uint32_t apic_msi_address(void);
+uint32_t apic_msi_data(int vector);
+
+#endif /* __APIC_H__ */
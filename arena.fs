@@ -68,10 +68,13 @@ here 512 allot constant buf
 
 : id ( -- t=success|f=failure) buf ata-identify-drive dup if
 	." drive identified successfully" else ." COULD NOT IDENTIFY DRIVE" then cr ;
-: rs ( sector-number -- t=success|f=failure) buf swap ata-28lba-read-sector dup if
+: rs ( sector-number -- t=success|f=failure) buf swap 1 0 bcache-read dup if
 	." sector read successfully" else ." COULD NOT READ SECTOR" then cr ;
-: ws ( sector-number -- t=success|f=failure) buf swap ata-28lba-write-sector dup if
+\ sectors written are cached, use 'ss' to commit them to the drive
+: ws ( sector-number -- t=success|f=failure) buf swap 1 0 bcache-write dup if
 	." sector written successfully" else ." COULD NOT WRITE SECTOR" then cr ;
+: ss ( -- t=success|f=failure) 0 bcache-sync dup if
+	." sectors synced successfully" else ." COULD NOT SYNC SECTORS" then cr ;
 
 : ds buf 512 dump ;
 
@@ -328,12 +331,8 @@ vkjnfdkjvnfdkjvnfdk
 
 [then]
 
-.( enable usb ohci bus mastering)cr cr
-0 6 0 make-pci-config-address 4 + dup
-IO-PCICFG outpl IO-PCIDATA inpw 6 ( memory space, and bus master) or swap
-IO-PCICFG outpl IO-PCIDATA outpw
-
-phys-mem-window-base constant ohci
+\ the ohci pci driver enables bus mastering, and maps the operational registers
+: ohci ( -- ohci-registers-address) ohci-registers ;
 
 : ?port1 ( --)
 	ohci HcRhPortStatus[1] + @
@@ -0,0 +1,837 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* ata driver; when the ide controller is capable of bus master dma, data is
+ * transferred by dma, with scatter-gather physical region descriptor tables
+ * built from the physically contiguous pieces of the data buffer. Otherwise,
+ * and for buffers that can not be used for dma, data is transferred in pio
+ * mode, in blocks of several sectors per data request with the read/write
+ * multiple commands, when the drive supports them. Up to 256 sectors are
+ * transferred per command with 28 bit lba addressing, and up to 65536 sectors
+ * (ATA_DMA_MAX_SECTORS for dma) with 48 bit lba addressing. Command completion,
+ * and the readiness of each pio data block, is signalled by the channel
+ * interrupt; when interrupts are disabled, the status register is polled
+ * instead. All waits are bounded by ATA_TIMEOUT_MS.
+ * Drive caches are only flushed on request - see 'ata_flush()' */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "ata.h"
+#include "irq.h"
+#include "clock.h"
+#include "pci.h"
+#include "pgtable.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+enum
+{
+	/* command block register offsets */
+	ATA_REG_DATA		=	0,
+	ATA_REG_ERROR		=	1,
+	ATA_REG_FEATURES	=	1,
+	ATA_REG_SECTOR_COUNT	=	2,
+	ATA_REG_LBA_LOW		=	3,
+	ATA_REG_LBA_MID		=	4,
+	ATA_REG_LBA_HIGH	=	5,
+	ATA_REG_DRIVE_HEAD	=	6,
+	ATA_REG_STATUS		=	7,
+	ATA_REG_COMMAND		=	7,
+	/* control block register offsets */
+	ATA_REG_ALTERNATE_STATUS	=	0,
+	ATA_REG_DEVICE_CONTROL	=	0,
+
+	/* status register bits */
+	ATA_STATUS_ERR		=	1 << 0,
+	ATA_STATUS_DRQ		=	1 << 3,
+	ATA_STATUS_DF		=	1 << 5,
+	ATA_STATUS_DRDY		=	1 << 6,
+	ATA_STATUS_BSY		=	1 << 7,
+	/* device control register bits */
+	ATA_CONTROL_NIEN	=	1 << 1,
+	ATA_CONTROL_SRST	=	1 << 2,
+	/* drive/head register bits */
+	ATA_DRIVE_HEAD_LBA	=	0xe0,
+	ATA_DRIVE_HEAD_SLAVE	=	1 << 4,
+
+	ATA_COMMAND_READ_SECTORS	=	0x20,
+	ATA_COMMAND_READ_SECTORS_EXT	=	0x24,
+	ATA_COMMAND_READ_MULTIPLE_EXT	=	0x29,
+	ATA_COMMAND_WRITE_SECTORS	=	0x30,
+	ATA_COMMAND_WRITE_SECTORS_EXT	=	0x34,
+	ATA_COMMAND_WRITE_MULTIPLE_EXT	=	0x39,
+	ATA_COMMAND_READ_DMA_EXT	=	0x25,
+	ATA_COMMAND_WRITE_DMA_EXT	=	0x35,
+	ATA_COMMAND_READ_MULTIPLE	=	0xc4,
+	ATA_COMMAND_WRITE_MULTIPLE	=	0xc5,
+	ATA_COMMAND_SET_MULTIPLE	=	0xc6,
+	ATA_COMMAND_READ_DMA		=	0xc8,
+	ATA_COMMAND_WRITE_DMA		=	0xca,
+	ATA_COMMAND_FLUSH_CACHE		=	0xe7,
+	ATA_COMMAND_FLUSH_CACHE_EXT	=	0xea,
+	ATA_COMMAND_IDENTIFY		=	0xec,
+
+	/* identify device data word offsets */
+	ATA_ID_MODEL			=	27,
+	ATA_ID_MAX_MULTIPLE		=	47,
+	ATA_ID_CAPABILITIES		=	49,
+	ATA_ID_DMA_SUPPORTED		=	1 << 8,
+	ATA_ID_LBA28_SECTORS		=	60,
+	ATA_ID_COMMAND_SETS		=	83,
+	ATA_ID_LBA48_SECTORS		=	100,
+	ATA_ID_LBA48_SUPPORTED		=	1 << 10,
+
+	ATA_WORDS_PER_SECTOR		=	ATA_SECTOR_SIZE / 2,
+
+	/* bus master ide register offsets, relative to the channel's bus master base */
+	BM_REG_COMMAND			=	0,
+	BM_REG_STATUS			=	2,
+	BM_REG_PRD_TABLE		=	4,
+	/* the secondary channel registers follow the primary channel ones */
+	BM_CHANNEL_REGISTERS_SIZE	=	8,
+
+	BM_COMMAND_START		=	1 << 0,
+	/* set for transfers from the drive to memory */
+	BM_COMMAND_READ			=	1 << 3,
+	BM_STATUS_ACTIVE		=	1 << 0,
+	/* the error and interrupt bits are cleared by writing ones to them */
+	BM_STATUS_ERROR			=	1 << 1,
+	BM_STATUS_INTERRUPT		=	1 << 2,
+
+	ATA_PRD_END_OF_TABLE		=	1 << 15,
+	/* programming interface bits of the ide controller pci class code */
+	IDE_PROG_IF_PRIMARY_NATIVE	=	1 << 0,
+	IDE_PROG_IF_SECONDARY_NATIVE	=	1 << 2,
+	IDE_PROG_IF_BUS_MASTER		=	1 << 7,
+};
+
+static struct ata_channel channels[NR_ATA_CHANNELS] __attribute__((section(".common-data"))) =
+{
+	{ .io_base = 0x1f0, .control_base = 0x3f6, .irq = IRQ_PRIMARY_ATA, .selected_drive = -1, },
+	{ .io_base = 0x170, .control_base = 0x376, .irq = IRQ_SECONDARY_ATA, .selected_drive = -1, },
+};
+
+static struct ata_drive drives[NR_ATA_DRIVES] __attribute__((section(".common-data")));
+static bool ide_controller_bound __attribute__((section(".common-data")));
+
+static const char * const drive_names[NR_ATA_DRIVES] = { "ata0", "ata1", "ata2", "ata3", };
+
+static uint8_t ata_read_reg(struct ata_channel * ch, int reg) { return read_io_port_byte(ch->io_base + reg); }
+static void ata_write_reg(struct ata_channel * ch, int reg, uint8_t value) { write_io_port_byte(ch->io_base + reg, value); }
+static uint8_t ata_alternate_status(struct ata_channel * ch) { return read_io_port_byte(ch->control_base + ATA_REG_ALTERNATE_STATUS); }
+
+/* reading the alternate status register four times gives the drive the 400 ns it
+ * needs to update its status after a command, or after a drive selection */
+static void ata_delay_400ns(struct ata_channel * ch)
+{
+int i;
+
+	for (i = 0; i < 4; i ++)
+		ata_alternate_status(ch);
+}
+
+/* returns the status register value, or -1 on timeout */
+static int ata_wait_not_busy(struct ata_channel * ch, uint64_t deadline)
+{
+uint8_t status;
+
+	while ((status = ata_alternate_status(ch)) & ATA_STATUS_BSY)
+		if (clock_deadline_expired(deadline))
+			return -1;
+	return status;
+}
+
+/* polls the status register after a command, or after a data block, until the drive is
+ * not busy, and - if 'drq' is true - requests a data block, or reports an error; returns
+ * the status register value, or -1 on timeout; the status only reflects the command 400 ns
+ * after it has been written, a stale status, showing the drive not busy, may be read before */
+static int ata_poll_status(struct ata_channel * ch, bool drq, uint64_t deadline)
+{
+uint8_t status;
+
+	ata_delay_400ns(ch);
+	while (((status = ata_alternate_status(ch)) & ATA_STATUS_BSY)
+			|| (drq && !(status & (ATA_STATUS_DRQ | ATA_STATUS_ERR))))
+		if (clock_deadline_expired(deadline))
+			return -1;
+	/* acknowledge the interrupt at the drive */
+	ch->irq_pending = false;
+	return ata_read_reg(ch, ATA_REG_STATUS);
+}
+
+/* waits for the channel interrupt, and returns the status register value
+ * read by the interrupt handler, or -1 on timeout; the status register is
+ * polled instead, if interrupts are disabled */
+static int ata_wait_irq(struct ata_channel * ch, uint64_t deadline)
+{
+	if (!interrupts_enabled())
+		return ata_poll_status(ch, false, deadline);
+	while (1)
+	{
+		asm("cli");
+		if (ch->irq_pending)
+		{
+			ch->irq_pending = false;
+			asm("sti");
+			return ch->irq_status;
+		}
+		if (clock_deadline_expired(deadline))
+		{
+			asm("sti");
+			return -1;
+		}
+		/* the timer tick bounds the wait, should the interrupt be lost */
+		asm("sti\n" "hlt\n");
+	}
+}
+
+/* as 'ata_wait_irq()', for the interrupt of a pio data block request */
+static int ata_wait_data(struct ata_channel * ch, uint64_t deadline)
+{
+	return interrupts_enabled() ? ata_wait_irq(ch, deadline) : ata_poll_status(ch, true, deadline);
+}
+
+/* tells if the bus master is done with a dma transfer - it has seen the drive interrupt,
+ * and is no longer transferring data - or has failed */
+static bool ata_dma_done(struct ata_channel * ch)
+{
+uint8_t status = read_io_port_byte(ch->bus_master_base + BM_REG_STATUS);
+
+	return (status & BM_STATUS_ERROR) || ((status & BM_STATUS_INTERRUPT) && !(status & BM_STATUS_ACTIVE));
+}
+
+/* as 'ata_wait_irq()', for the completion of a dma transfer; when polling, the drive status
+ * alone does not tell that the transfer is over - the drive may not be busy yet, or may be done
+ * before the last data has reached the memory - so the bus master status is polled first */
+static int ata_wait_dma(struct ata_channel * ch, uint64_t deadline)
+{
+	if (interrupts_enabled())
+		return ata_wait_irq(ch, deadline);
+	while (!ata_dma_done(ch))
+		if (clock_deadline_expired(deadline))
+			return -1;
+	return ata_poll_status(ch, false, deadline);
+}
+
+static void ata_irq_handler(void * argument)
+{
+struct ata_channel * ch = argument;
+
+	/* reading the status register acknowledges the interrupt at the drive */
+	ch->irq_status = ata_read_reg(ch, ATA_REG_STATUS);
+	if (ch->bus_master_base)
+	{
+		/* acknowledge the interrupt at the bus master, the error bit is left for
+		 * the dma transfer code to examine */
+		ch->bus_master_status = read_io_port_byte(ch->bus_master_base + BM_REG_STATUS);
+		write_io_port_byte(ch->bus_master_base + BM_REG_STATUS, ch->bus_master_status & ~ BM_STATUS_ERROR);
+	}
+	ch->irq_pending = true;
+}
+
+/* pci native mode channels share the interrupt line of the controller; when
+ * the bus master status register is available, it tells which channel interrupted */
+static void ata_native_irq_handler(void * argument)
+{
+struct ata_channel * ch;
+
+	for (ch = channels; ch < channels + NR_ATA_CHANNELS; ch ++)
+		if (ch->native && ch->irq == (cell) argument && (!ch->bus_master_base
+				|| (read_io_port_byte(ch->bus_master_base + BM_REG_STATUS) & BM_STATUS_INTERRUPT)))
+			ata_irq_handler(ch);
+}
+
+static int ata_select_drive(struct ata_drive * d, uint8_t lba_top_bits, uint64_t deadline)
+{
+struct ata_channel * ch = d->channel;
+
+	if (ata_wait_not_busy(ch, deadline) == -1)
+		return -1;
+	ata_write_reg(ch, ATA_REG_DRIVE_HEAD, ATA_DRIVE_HEAD_LBA | (d->slave ? ATA_DRIVE_HEAD_SLAVE : 0) | lba_top_bits);
+	if (ch->selected_drive != d - drives)
+	{
+		ata_delay_400ns(ch);
+		ch->selected_drive = d - drives;
+	}
+	return ata_wait_not_busy(ch, deadline) == -1 ? -1 : 0;
+}
+
+/* 'count' is the number of sectors to transfer, up to the maximum for the addressing
+ * mode; the sector count registers are eight bits wide, so the maximum - 256, or
+ * 65536 for lba48 commands - is written to them as zero */
+static int ata_issue_command(struct ata_drive * d, int command, uint64_t lba, uint32_t count, uint64_t deadline)
+{
+struct ata_channel * ch = d->channel;
+
+	if (ata_select_drive(d, d->lba48 ? 0 : (lba >> 24) & 0xf, deadline))
+		return -1;
+	if (d->lba48)
+	{
+		/* the high order bytes are written first */
+		ata_write_reg(ch, ATA_REG_SECTOR_COUNT, count >> 8);
+		ata_write_reg(ch, ATA_REG_LBA_LOW, lba >> 24);
+		ata_write_reg(ch, ATA_REG_LBA_MID, lba >> 32);
+		ata_write_reg(ch, ATA_REG_LBA_HIGH, lba >> 40);
+	}
+	ata_write_reg(ch, ATA_REG_SECTOR_COUNT, count);
+	ata_write_reg(ch, ATA_REG_LBA_LOW, lba);
+	ata_write_reg(ch, ATA_REG_LBA_MID, lba >> 8);
+	ata_write_reg(ch, ATA_REG_LBA_HIGH, lba >> 16);
+	ch->irq_pending = false;
+	ata_write_reg(ch, ATA_REG_COMMAND, command);
+	return 0;
+}
+
+static bool ata_status_error(int status)
+{
+	return status == -1 || (status & (ATA_STATUS_ERR | ATA_STATUS_DF));
+}
+
+/* transfers up to the maximum number of sectors for a single command */
+static int ata_pio_transfer(struct ata_drive * d, uint64_t lba, uint32_t count, uint8_t * buffer, bool write)
+{
+struct ata_channel * ch = d->channel;
+uint64_t deadline = clock_deadline_ms(ATA_TIMEOUT_MS);
+int command, block_sectors, n, status;
+
+	block_sectors = d->multiple_sectors ? d->multiple_sectors : 1;
+	if (d->lba48)
+		command = write ? (d->multiple_sectors ? ATA_COMMAND_WRITE_MULTIPLE_EXT : ATA_COMMAND_WRITE_SECTORS_EXT)
+			: (d->multiple_sectors ? ATA_COMMAND_READ_MULTIPLE_EXT : ATA_COMMAND_READ_SECTORS_EXT);
+	else
+		command = write ? (d->multiple_sectors ? ATA_COMMAND_WRITE_MULTIPLE : ATA_COMMAND_WRITE_SECTORS)
+			: (d->multiple_sectors ? ATA_COMMAND_READ_MULTIPLE : ATA_COMMAND_READ_SECTORS);
+	if (ata_issue_command(d, command, lba, count, deadline))
+		return -1;
+
+	if (write)
+	{
+		/* the drive does not interrupt before accepting the first data block */
+		status = ata_poll_status(ch, true, deadline);
+	}
+	while (count)
+	{
+		if (!write)
+			status = ata_wait_data(ch, deadline);
+		if (ata_status_error(status) || !(status & ATA_STATUS_DRQ))
+			return -1;
+		n = count < block_sectors ? count : block_sectors;
+		if (write)
+			write_io_port_word_string(ch->io_base + ATA_REG_DATA, buffer, n * ATA_WORDS_PER_SECTOR);
+		else
+			read_io_port_word_string(ch->io_base + ATA_REG_DATA, buffer, n * ATA_WORDS_PER_SECTOR);
+		buffer += n * ATA_SECTOR_SIZE;
+		count -= n;
+		if (write)
+		{
+			/* the drive interrupts after each data block it accepts, the last
+			 * interrupt signals the completion of the command */
+			status = count ? ata_wait_data(ch, deadline) : ata_wait_irq(ch, deadline);
+			if (!count)
+				return ata_status_error(status) ? -1 : 0;
+		}
+	}
+	/* for reads, there is no interrupt after the last data block */
+	return ata_status_error(ata_read_reg(ch, ATA_REG_STATUS)) ? -1 : 0;
+}
+
+/* builds the physical region descriptor table of a channel for a buffer, returns
+ * false if the buffer can not be used for dma - a buffer must be word aligned,
+ * and must be mapped in memory below EXTENDED_MEMORY_TOP */
+static bool ata_build_prd_table(struct ata_channel * ch, uint8_t * buffer, uint32_t size)
+{
+struct ata_prd * prd = 0;
+uint32_t physical_address, n, length = 0;
+
+	if ((uint32_t) buffer & 1)
+		return false;
+	for (; size; size -= n, buffer += n)
+	{
+		/* the buffer is physically contiguous only within a page */
+		n = 0x1000 - ((uint32_t) buffer & 0xfff);
+		if (n > size)
+			n = size;
+		if (!(physical_address = mem_virtual_to_physical(buffer)))
+			return false;
+		if (prd && prd->physical_address + length == physical_address
+				&& (prd->physical_address >> 16) == ((physical_address + n - 1) >> 16))
+		{
+			/* merge with the previous region */
+			length += n;
+			prd->byte_count = length;
+			continue;
+		}
+		prd = prd ? prd + 1 : ch->prd_table;
+		if (prd == ch->prd_table + NR_ATA_PRD_ENTRIES)
+			return false;
+		* prd = (struct ata_prd) { .physical_address = physical_address, .byte_count = n, };
+		length = n;
+	}
+	prd->flags = ATA_PRD_END_OF_TABLE;
+	return true;
+}
+
+/* starts a dma transfer of up to ATA_DMA_MAX_SECTORS sectors, the physical region
+ * descriptor table of the channel must have already been built for the transfer */
+static int ata_dma_start(struct ata_drive * d, uint64_t lba, uint32_t count, bool write, uint64_t deadline)
+{
+struct ata_channel * ch = d->channel;
+int command, direction = write ? 0 : BM_COMMAND_READ;
+
+	if (d->lba48)
+		command = write ? ATA_COMMAND_WRITE_DMA_EXT : ATA_COMMAND_READ_DMA_EXT;
+	else
+		command = write ? ATA_COMMAND_WRITE_DMA : ATA_COMMAND_READ_DMA;
+
+	write_io_port_long(ch->bus_master_base + BM_REG_PRD_TABLE, (uint32_t) ch->prd_table);
+	write_io_port_byte(ch->bus_master_base + BM_REG_COMMAND, direction);
+	write_io_port_byte(ch->bus_master_base + BM_REG_STATUS,
+			read_io_port_byte(ch->bus_master_base + BM_REG_STATUS) | BM_STATUS_ERROR | BM_STATUS_INTERRUPT);
+	ch->bus_master_status = 0;
+	if (ata_issue_command(d, command, lba, count, deadline))
+		return -1;
+	write_io_port_byte(ch->bus_master_base + BM_REG_COMMAND, direction | BM_COMMAND_START);
+	return 0;
+}
+
+/* completes a dma transfer, given the status register value read after the
+ * command completion interrupt, or -1 on timeout */
+static int ata_dma_finish(struct ata_drive * d, int status)
+{
+struct ata_channel * ch = d->channel;
+uint8_t bus_master_status;
+
+	/* stop the bus master, also on errors and timeouts */
+	write_io_port_byte(ch->bus_master_base + BM_REG_COMMAND,
+			read_io_port_byte(ch->bus_master_base + BM_REG_COMMAND) & ~ BM_COMMAND_START);
+	bus_master_status = read_io_port_byte(ch->bus_master_base + BM_REG_STATUS) | ch->bus_master_status;
+	write_io_port_byte(ch->bus_master_base + BM_REG_STATUS,
+			read_io_port_byte(ch->bus_master_base + BM_REG_STATUS) | BM_STATUS_ERROR | BM_STATUS_INTERRUPT);
+	if (ata_status_error(status) || (bus_master_status & BM_STATUS_ERROR))
+		return -1;
+	return 0;
+}
+
+static int ata_dma_transfer(struct ata_drive * d, uint64_t lba, uint32_t count, bool write)
+{
+uint64_t deadline = clock_deadline_ms(ATA_TIMEOUT_MS);
+
+	if (ata_dma_start(d, lba, count, write, deadline))
+		return -1;
+	return ata_dma_finish(d, ata_wait_dma(d->channel, deadline));
+}
+
+static uint32_t ata_max_sectors(struct ata_drive * d)
+{
+uint32_t max_sectors = d->lba48 ? ATA_MAX_SECTORS_LBA48 : ATA_MAX_SECTORS_LBA28;
+
+	if (d->dma && max_sectors > ATA_DMA_MAX_SECTORS)
+		max_sectors = ATA_DMA_MAX_SECTORS;
+	return max_sectors;
+}
+
+static struct ata_drive * get_drive(int drive)
+{
+	if (drive < 0 || drive >= NR_ATA_DRIVES || !drives[drive].present)
+		return 0;
+	return drives + drive;
+}
+
+/* completes the dma command of a started batch in progress on a channel, if the drive
+ * is done with it, and frees the channel; the batch of the drive is advanced no further,
+ * that is left to the poll of the drive; returns false if the command is still in progress */
+static bool ata_batch_reap(struct ata_channel * ch)
+{
+struct ata_drive * d = ch->active_drive;
+int status;
+
+	if (!d)
+		return true;
+	if (interrupts_enabled())
+	{
+		if (!ch->irq_pending && !clock_deadline_expired(ch->deadline))
+			return false;
+		status = ch->irq_pending ? ch->irq_status : -1;
+	}
+	else
+	{
+		/* as in 'ata_wait_dma()', the bus master status tells when the transfer is over */
+		if (!ata_dma_done(ch) && !clock_deadline_expired(ch->deadline))
+			return false;
+		status = ata_wait_dma(ch, ch->deadline);
+	}
+	ch->irq_pending = false;
+	ch->active_drive = 0;
+	if (ata_dma_finish(d, status))
+	{
+		d->requests[d->current].status = -1;
+		d->current ++;
+		d->progress = 0;
+	}
+	else
+		d->progress += d->chunk;
+	return true;
+}
+
+/* waits for the channel to be free of the dma command of a started batch, before a
+ * synchronous command is issued on it */
+static void ata_channel_wait_idle(struct ata_channel * ch)
+{
+	while (!ata_batch_reap(ch))
+		;
+}
+
+static int ata_transfer(int drive, uint64_t lba, uint32_t count, uint8_t * buffer, bool write)
+{
+struct ata_drive * d = get_drive(drive);
+uint32_t max_sectors, n;
+int result;
+
+	if (!d || lba + count > d->nr_sectors)
+		return -1;
+	ata_channel_wait_idle(d->channel);
+	max_sectors = ata_max_sectors(d);
+	for (; count; count -= n, lba += n, buffer += n * ATA_SECTOR_SIZE)
+	{
+		n = count < max_sectors ? count : max_sectors;
+		if (d->dma && ata_build_prd_table(d->channel, buffer, n * ATA_SECTOR_SIZE))
+			result = ata_dma_transfer(d, lba, n, write);
+		else
+			result = ata_pio_transfer(d, lba, n, buffer, write);
+		if (result)
+			return -1;
+	}
+	return 0;
+}
+
+int ata_read(int drive, uint64_t lba, uint32_t count, void * buffer)
+{
+	return ata_transfer(drive, lba, count, buffer, false);
+}
+
+int ata_write(int drive, uint64_t lba, uint32_t count, const void * buffer)
+{
+	return ata_transfer(drive, lba, count, (uint8_t *) buffer, true);
+}
+
+int ata_flush(int drive)
+{
+struct ata_drive * d = get_drive(drive);
+uint64_t deadline = clock_deadline_ms(ATA_TIMEOUT_MS);
+
+	if (!d)
+		return -1;
+	ata_channel_wait_idle(d->channel);
+	if (ata_issue_command(d, d->lba48 ? ATA_COMMAND_FLUSH_CACHE_EXT : ATA_COMMAND_FLUSH_CACHE, 0, 0, deadline))
+		return -1;
+	return ata_status_error(ata_wait_irq(d->channel, deadline)) ? -1 : 0;
+}
+
+static int blockdev_ata_read(struct block_device * dev, uint64_t lba, uint32_t count, void * buffer)
+{
+	return ata_read((struct ata_drive *) dev->driver_data - drives, lba, count, buffer);
+}
+
+static int blockdev_ata_write(struct block_device * dev, uint64_t lba, uint32_t count, const void * buffer)
+{
+	return ata_write((struct ata_drive *) dev->driver_data - drives, lba, count, buffer);
+}
+
+static int blockdev_ata_flush(struct block_device * dev)
+{
+	return ata_flush((struct ata_drive *) dev->driver_data - drives);
+}
+
+/* advances the started batch of a drive, until a dma command is in progress, or until
+ * the batch is done; pio transfers are done right away, as they keep the processor busy
+ * anyway; returns true when the batch is done */
+static bool ata_batch_advance(struct ata_drive * d)
+{
+struct ata_channel * ch = d->channel;
+struct blockdev_request * r;
+uint8_t * buffer;
+
+	while (d->current < d->nr_requests)
+	{
+		r = d->requests + d->current;
+		if (d->progress == r->count)
+		{
+			r->status = 0;
+			d->current ++;
+			d->progress = 0;
+			continue;
+		}
+		d->chunk = r->count - d->progress;
+		if (d->chunk > ata_max_sectors(d))
+			d->chunk = ata_max_sectors(d);
+		buffer = (uint8_t *) r->buffer + d->progress * ATA_SECTOR_SIZE;
+		if (d->dma && ata_build_prd_table(ch, buffer, d->chunk * ATA_SECTOR_SIZE))
+		{
+			ch->deadline = clock_deadline_ms(ATA_TIMEOUT_MS);
+			if (!ata_dma_start(d, r->lba + d->progress, d->chunk, r->write, ch->deadline))
+			{
+				ch->active_drive = d;
+				return false;
+			}
+		}
+		else if (!ata_pio_transfer(d, r->lba + d->progress, d->chunk, buffer, r->write))
+		{
+			d->progress += d->chunk;
+			continue;
+		}
+		/* the request failed, go on with the next one */
+		r->status = -1;
+		d->current ++;
+		d->progress = 0;
+	}
+	return true;
+}
+
+static int blockdev_ata_start(struct block_device * dev, struct blockdev_request * requests, int nr_requests)
+{
+struct ata_drive * d = dev->driver_data;
+int i;
+
+	for (i = 0; i < nr_requests; i ++)
+		requests[i].status = -1;
+	d->requests = requests;
+	d->nr_requests = nr_requests;
+	d->current = 0;
+	d->progress = 0;
+	/* the batch is advanced by 'blockdev_ata_poll()', when the channel is free */
+	return 0;
+}
+
+/* the dma command in progress on the channel is reaped here also when it is one of the
+ * other drive on the channel, rather than waiting for the poll of that drive; that poll
+ * may not come until this batch is done, e.g. when a completion callback of a batch of
+ * the other drive does blocking i/o on this drive - the batch of the other drive is then
+ * paused, and goes on with its next poll */
+static bool blockdev_ata_poll(struct block_device * dev)
+{
+struct ata_drive * d = dev->driver_data;
+
+	if (!ata_batch_reap(d->channel))
+		return false;
+	return ata_batch_advance(d);
+}
+
+/*
+ * drive detection
+ */
+
+static bool ata_identify(struct ata_drive * d)
+{
+struct ata_channel * ch = d->channel;
+uint64_t deadline = clock_deadline_ms(ATA_TIMEOUT_MS);
+uint16_t id[ATA_WORDS_PER_SECTOR];
+int status, i;
+
+	/* a floating bus reads as all ones */
+	if (ata_alternate_status(ch) == 0xff)
+		return false;
+	if (ata_issue_command(d, ATA_COMMAND_IDENTIFY, 0, 0, deadline))
+		return false;
+	ata_delay_400ns(ch);
+	if (!ata_alternate_status(ch))
+		/* no drive */
+		return false;
+	if ((status = ata_wait_not_busy(ch, deadline)) == -1)
+		return false;
+	/* packet interface (atapi), and serial ata devices, abort the identify
+	 * command, and leave a signature in the lba registers */
+	if (ata_read_reg(ch, ATA_REG_LBA_MID) || ata_read_reg(ch, ATA_REG_LBA_HIGH))
+		return false;
+	while (!((status = ata_alternate_status(ch)) & (ATA_STATUS_DRQ | ATA_STATUS_ERR)))
+		if (clock_deadline_expired(deadline))
+			return false;
+	ata_read_reg(ch, ATA_REG_STATUS);
+	ch->irq_pending = false;
+	if (status & ATA_STATUS_ERR)
+		return false;
+	read_io_port_word_string(ch->io_base + ATA_REG_DATA, id, ATA_WORDS_PER_SECTOR);
+
+	d->lba48 = id[ATA_ID_COMMAND_SETS] & ATA_ID_LBA48_SUPPORTED;
+	if (d->lba48)
+		d->nr_sectors = id[ATA_ID_LBA48_SECTORS] | ((uint64_t) id[ATA_ID_LBA48_SECTORS + 1] << 16)
+			| ((uint64_t) id[ATA_ID_LBA48_SECTORS + 2] << 32) | ((uint64_t) id[ATA_ID_LBA48_SECTORS + 3] << 48);
+	else
+		d->nr_sectors = id[ATA_ID_LBA28_SECTORS] | ((uint32_t) id[ATA_ID_LBA28_SECTORS + 1] << 16);
+	/* the model string is stored with the bytes in each word swapped */
+	for (i = 0; i < 20; i ++)
+		d->model[2 * i] = id[ATA_ID_MODEL + i] >> 8, d->model[2 * i + 1] = id[ATA_ID_MODEL + i];
+	for (i = 40; i && d->model[i - 1] == ' '; d->model[-- i] = 0)
+		;
+
+	d->dma = d->channel->bus_master_base && (id[ATA_ID_CAPABILITIES] & ATA_ID_DMA_SUPPORTED);
+
+	/* enable the read/write multiple commands, with the largest block size supported */
+	if ((d->multiple_sectors = id[ATA_ID_MAX_MULTIPLE] & 0xff))
+	{
+		if (ata_issue_command(d, ATA_COMMAND_SET_MULTIPLE, 0, d->multiple_sectors, deadline)
+				|| ata_status_error(ata_wait_irq(ch, deadline)))
+			d->multiple_sectors = 0;
+	}
+	return d->nr_sectors != 0;
+}
+
+/* binds the pci ide controller; channels in pci native mode use the i/o ports
+ * and the interrupt assigned in the pci configuration space, channels in
+ * compatibility mode keep the legacy ones; both use bus master dma, when the
+ * controller supports it */
+static bool ide_probe(const struct pci_function * f)
+{
+const struct pci_resource * bus_master = f->resources + 4, * command_block, * control_block;
+struct ata_channel * ch;
+int i;
+
+	/* there is only room for the channels of a single controller */
+	if (ide_controller_bound)
+		return false;
+	ide_controller_bound = true;
+	for (i = 0; i < NR_ATA_CHANNELS; i ++)
+	{
+		ch = channels + i;
+		if (f->prog_if & (i ? IDE_PROG_IF_SECONDARY_NATIVE : IDE_PROG_IF_PRIMARY_NATIVE))
+		{
+			/* the command block registers are in the region of base address
+			 * register '2 * i', the device control register is at offset 2 of
+			 * the region of base address register '2 * i + 1' */
+			command_block = f->resources + 2 * i;
+			control_block = f->resources + 2 * i + 1;
+			if (!command_block->io || !command_block->size || !control_block->io || !control_block->size)
+			{
+				/* the channel does not decode the legacy ports either */
+				ch->io_base = 0;
+				continue;
+			}
+			ch->io_base = command_block->base;
+			ch->control_base = control_block->base + 2;
+			ch->irq = f->irq_line;
+			ch->native = true;
+		}
+		/* a page frame is naturally aligned, and so does not cross a 64 KByte boundary */
+		if ((f->prog_if & IDE_PROG_IF_BUS_MASTER) && bus_master->io && bus_master->size && (ch->prd_table = frame_alloc(1)))
+			ch->bus_master_base = bus_master->base + i * BM_CHANNEL_REGISTERS_SIZE;
+	}
+	return true;
+}
+
+static const struct pci_match ide_match[] =
+{
+	{ PCI_ANY_ID, PCI_ANY_ID, PCI_CLASS_MASS_STORAGE, PCI_SUBCLASS_IDE, PCI_ANY_ID, },
+	{ 0, },
+};
+
+static const struct pci_driver ide_driver = { .name = "ide", .match = ide_match, .probe = ide_probe, };
+
+void init_ata(void)
+{
+int i;
+struct ata_drive * d;
+struct ata_channel * ch;
+
+	for (i = 0; i < NR_ATA_CHANNELS; i ++)
+		drives[2 * i].channel = drives[2 * i + 1].channel = channels + i;
+	drives[1].slave = drives[3].slave = true;
+
+	/* without a pci ide controller, the channels are assumed to be at the legacy i/o ports */
+	pci_register_driver(& ide_driver);
+	for (ch = channels; ch < channels + NR_ATA_CHANNELS; ch ++)
+	{
+		/* a floating bus reads as all ones */
+		if (!ch->io_base || read_io_port_byte(ch->io_base + ATA_REG_STATUS) == 0xff)
+			continue;
+		/* enable the channel interrupt; native mode channels share the interrupt
+		 * line of the controller, attaching it a second time fails harmlessly */
+		write_io_port_byte(ch->control_base + ATA_REG_DEVICE_CONTROL, 0);
+		if (ch->native)
+			irq_attach(ch->irq, ata_native_irq_handler, (void *) (cell) ch->irq);
+		else
+			irq_attach(ch->irq, ata_irq_handler, ch);
+
+		for (d = drives + (ch - channels) * NR_ATA_DRIVES_PER_CHANNEL; d < drives + (ch - channels + 1) * NR_ATA_DRIVES_PER_CHANNEL; d ++)
+		{
+			if (!(d->present = ata_identify(d)))
+				continue;
+			d->blockdev = (struct block_device)
+			{
+				.name		= drive_names[d - drives],
+				.sector_size	= ATA_SECTOR_SIZE,
+				.nr_sectors	= d->nr_sectors,
+				.read		= blockdev_ata_read,
+				.write		= blockdev_ata_write,
+				.flush		= blockdev_ata_flush,
+				.start		= blockdev_ata_start,
+				.poll		= blockdev_ata_poll,
+				.driver_data	= d,
+			};
+			blockdev_register(& d->blockdev);
+			print_str(d->blockdev.name);
+			print_str(": ");
+			print_str(d->model);
+			print_str(d->lba48 ? ", lba48" : ", lba28");
+			print_str(d->dma ? ", dma\n" : ", pio\n");
+		}
+	}
+}
+
+/*
+ * forth words
+ */
+
+static void do_ata_read(void)
+{
+/* ( buffer lba count drive -- t=success|f=failure) */
+int drive = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(ata_read(drive, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_ata_write(void)
+{
+/* ( buffer lba count drive -- t=success|f=failure) */
+int drive = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(ata_write(drive, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_ata_flush(void) { /* ( drive -- t=success|f=failure) */ sf_push(ata_flush(sf_pop()) ? 0 : -1); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"ata-read",		do_ata_read),
+	MKWORD(custom_dict,	__COUNTER__,	"ata-write",			do_ata_write),
+	MKWORD(custom_dict,	__COUNTER__,	"ata-flush",			do_ata_flush),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -33,10 +33,16 @@ here
 512 constant ATA-SECTOR-BYTESIZE
 2 constant ATA-WORD-BYTESIZE
 
+\ the drive accessed by the words below; drive numbers are the same as
+\ in the c driver - 'channel number * 2 + (slave ? 1 : 0)'; use 'ata-drive!'
+\ to change the drive, it sets the port addresses of the drive channel
+0 value ATA-DRIVE
 $1f0 value ATA-PORT-BASE
 $3f6 value DEVICE-CONTROL-REGISTER
 : ALTERNATE-STATUS-REGISTER DEVICE-CONTROL-REGISTER ;
 
+create ATA-CHANNEL-PORTS $1f0 , $3f6 , $170 , $376 ,
+
 \ slave/master selection bit; must be used
 \ when writing to the DRIVE-HEAD-PORT i/o port
 4 bit constant SLAVE-SELECTION-FLAG
@@ -75,48 +81,58 @@ $e7 constant ATA-COMMAND-CACHE-FLUSH
 7 bit constant BSY \ indicates the drive is preparing to send/receice data
 		\ (wait for it to clear); in case of a 'hang' (it never
 		\ clears), do a software reset
+: ata-drive! ( drive-number --)
+	dup to ATA-DRIVE
+	1 rshift 2 cells * ATA-CHANNEL-PORTS +
+	dup @ to ATA-PORT-BASE
+	cell+ @ to DEVICE-CONTROL-REGISTER
+	;
+
+: ata-drive-head ( lba-mode-flags -- drive-head-register-value)
+	ATA-DRIVE 1 and if SLAVE-SELECTION-FLAG or then
+	;
+
 : ata-select-lba ( lba-index --)
 	dup LBA-LO-PORT outpb
 	dup 8 rshift LBA-MID-PORT outpb
 	16 rshift LBA-HI-PORT outpb
 	;
 
-: ata-wait-device-ready ( -- t=success|f=error)
-\ (waiting for the drive to be ready to transfer data):
+\ maximum time to wait for the drive, in milliseconds; drives
+\ spinning up may take several seconds to become ready
+5000 value ATA-TIMEOUT-MS
+
+: ata-device-ready? ( -- t=ready, or error|f=busy)
 \ Read the Regular Status port until bit 7 (BSY, value = 0x80) clears,
 \ and bit 3 (DRQ, value = 8) sets -- or until bit 0 (ERR, value = 1)
 \ or bit 5 (DF, value = 0x20) sets.
+	STATUS-PORT inpb
+	>r
+	r@ BSY and 0= r@ DRQ and 0<> and
+	r> ERR xDF or and 0<>
+	or
+	;
+
+: ata-wait-device-ready ( -- t=success|f=error)
+\ (waiting for the drive to be ready to transfer data):
 \ If neither error bit is set, the device is ready right then. 
-	begin
-		STATUS-PORT inpb
-		>r
-		r@ BSY and 0= r@ DRQ and 0<> and
-		r> ERR xDF or and 0<>
-		or
-	until
+	[ ' ata-device-ready? literal ] ATA-TIMEOUT-MS with-timeout
+	0= if ." device timeout" cr false exit then
 	\ set return code
 	STATUS-PORT inpb ERR xDF or and 0=
 	;
 
 : ata-read-data-words ( data-buffer word-count -- )
-	0 do
-		DATA-PORT inpw
-		2dup swap c!
-		8 rshift over 1+ c!
-		2 +
-	loop drop
+	DATA-PORT inpw-n
 	;
 
 : ata-write-data-words ( data-buffer word-count -- )
-	0 do
-		count swap count 8 lshift rot or
-		DATA-PORT outpw
-	loop drop
+	DATA-PORT outpw-n
 	;
 
 : ata-identify-drive ( data-buffer -- t=success|f=error)
 	\ todo: make sure what the $a0 below really does...
-	$a0 DRIVE-HEAD-PORT outpb
+	$a0 ata-drive-head DRIVE-HEAD-PORT outpb
 	0 SECTOR-COUNT-PORT outpb
 	0 ata-select-lba
 	ATA-COMMAND-IDENTIFY COMMAND-PORT outpb
@@ -126,33 +142,19 @@ $e7 constant ATA-COMMAND-CACHE-FLUSH
 	;
 
 : ata-28lba-read-sector ( data-buffer lba-sector-nr -- t=success|f=error)
-	\ todo: make sure what the $e0 below really does...
-	$e0 over 24 rshift $f and or DRIVE-HEAD-PORT outpb
-	1 SECTOR-COUNT-PORT outpb
-	ata-select-lba
-	ATA-COMMAND-READ-SECTORS COMMAND-PORT outpb
-	ata-wait-device-ready false = if ." device error" cr drop false exit then
-	ATA-SECTOR-BYTESIZE ATA-WORD-BYTESIZE / ata-read-data-words
-	true
+	\ transfers are done by the c driver, in interrupt mode
+	1 ATA-DRIVE ata-read
 	;
 
 : ata-28lba-write-sector ( data-buffer lba-sector-nr -- t=success|f=error)
-	\ todo: make sure what the $e0 below really does...
-	$e0 over 24 rshift $f and or DRIVE-HEAD-PORT outpb
-	1 SECTOR-COUNT-PORT outpb
-	ata-select-lba
-	ATA-COMMAND-WRITE-SECTORS COMMAND-PORT outpb
-	ata-wait-device-ready false = if ." device error" cr drop false exit then
-	." writing data..." cr
-	ATA-SECTOR-BYTESIZE ATA-WORD-BYTESIZE / ata-write-data-words
-	\ send an ata 'cache flush' command
-	\ todo: check if this is correct (i don't have documentation and network access now)
-	ATA-COMMAND-CACHE-FLUSH COMMAND-PORT outpb
-	true
+	\ the drive cache is no longer flushed after each sector written,
+	\ use 'ata-flush' when the data must be committed to the media
+	1 ATA-DRIVE ata-write
 	;
 
 .( selecting first master ata drive) cr
-$e0 DRIVE-HEAD-PORT outpb
+0 ata-drive!
+$e0 ata-drive-head DRIVE-HEAD-PORT outpb
 .( drive status: $) base @ hex STATUS-PORT inpb . base ! cr
 
 here swap -
@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __ATA_H__
+#define __ATA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+enum
+{
+	ATA_SECTOR_SIZE			=	512,
+	NR_ATA_CHANNELS			=	2,
+	NR_ATA_DRIVES_PER_CHANNEL	=	2,
+	NR_ATA_DRIVES			=	NR_ATA_CHANNELS * NR_ATA_DRIVES_PER_CHANNEL,
+	/* maximum number of sectors transferred by a single command */
+	ATA_MAX_SECTORS_LBA28		=	256,
+	ATA_MAX_SECTORS_LBA48		=	65536,
+	/* maximum number of sectors transferred by a single dma command; this
+	 * is bounded by the size of the physical region descriptor tables */
+	ATA_DMA_MAX_SECTORS		=	2048,
+	/* number of entries in a physical region descriptor table, the table
+	 * occupies a single page frame */
+	NR_ATA_PRD_ENTRIES		=	512,
+	/* drives needing to spin up may take several seconds to become ready */
+	ATA_TIMEOUT_MS			=	5000,
+};
+
+/* bus master ide physical region descriptor; describes a physically contiguous
+ * memory region of a dma transfer; a region must not cross a 64 KByte boundary */
+struct ata_prd
+{
+	uint32_t	physical_address;
+	/* a byte count of zero stands for 64 KBytes */
+	uint16_t	byte_count;
+	/* only bit 15 is defined - it marks the last descriptor in a table */
+	uint16_t	flags;
+};
+
+struct ata_drive;
+
+/* the two channels operate independently, each with its own interrupt; transfers
+ * of batches of requests started with the block device 'start' operation proceed
+ * on both channels concurrently */
+struct ata_channel
+{
+	uint16_t	io_base;
+	uint16_t	control_base;
+	int		irq;
+	/* true for channels in pci native mode, which share the interrupt of the controller */
+	bool		native;
+	/* set by the interrupt handler */
+	volatile bool	irq_pending;
+	/* the status register value read by the interrupt handler */
+	volatile uint8_t	irq_status;
+	/* the drive currently selected, -1 if unknown */
+	int		selected_drive;
+	/* base i/o port address of the bus master ide registers of the
+	 * channel, 0 if the channel is not capable of dma transfers */
+	uint16_t	bus_master_base;
+	/* the bus master ide status register value read by the interrupt handler */
+	volatile uint8_t	bus_master_status;
+	/* the physical region descriptor table of the channel, allocated from
+	 * the (identity mapped) extended memory */
+	struct ata_prd	* prd_table;
+	/* the drive with a dma command of a started batch in progress on the channel, 0 if none;
+	 * the command is completed by whichever of the drives on the channel is accessed next */
+	struct ata_drive	* active_drive;
+	uint64_t	deadline;
+};
+
+struct ata_drive
+{
+	struct ata_channel	* channel;
+	bool		present;
+	/* true for the slave drive on a channel */
+	bool		slave;
+	bool		lba48;
+	/* true if the drive is transferring data by bus master dma */
+	bool		dma;
+	/* number of sectors transferred per data request block by the
+	 * read/write multiple commands; 0 if these are not supported */
+	int		multiple_sectors;
+	uint64_t	nr_sectors;
+	char		model[41];
+	struct block_device	blockdev;
+	/* the batch of requests started with the block device 'start' operation; 'current'
+	 * is the index of the request in progress, 'progress' is the number of sectors of
+	 * that request already transferred, 'chunk' is the number of sectors transferred
+	 * by the command in progress */
+	struct blockdev_request	* requests;
+	int		nr_requests;
+	int		current;
+	uint32_t	progress;
+	uint32_t	chunk;
+};
+
+/* probes for ata drives on both channels, and registers the drives found as block devices */
+void init_ata(void);
+/* drive numbers are 'channel number * 2 + (slave ? 1 : 0)'; return 0 on success, -1 on failure */
+int ata_read(int drive, uint64_t lba, uint32_t count, void * buffer);
+int ata_write(int drive, uint64_t lba, uint32_t count, const void * buffer);
+int ata_flush(int drive);
+
+#endif /* __ATA_H__ */
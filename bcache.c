@@ -0,0 +1,490 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* block buffer cache; sectors are cached in blocks of BCACHE_BLOCK_SECTORS
+ * consecutive sectors, looked up by a hash on the (device number, block number)
+ * pair, and evicted in least recently used order. Writes only dirty the cached
+ * blocks; dirty blocks are written back when evicted, when they have aged (from
+ * the console idle loop - see 'bcache_background_writeback()'), or on request by
+ * 'bcache_sync()', which also issues a device cache flush, acting as a write
+ * barrier. Batches of blocks are transferred with a request per run of blocks
+ * consecutive on the device, through a staging buffer, so that small writes to
+ * neighbouring sectors are combined in large ones. A miss reads the rest of the
+ * requested sectors at once, and a miss while reading sequentially also reads
+ * ahead BCACHE_READAHEAD_BLOCKS blocks.
+ *
+ * The cache state is common to all kernel processes; block descriptors and data
+ * reside in extended memory */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "bcache.h"
+#include "blockdev.h"
+#include "clock.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+enum
+{
+	BCACHE_DESCRIPTOR_FRAMES	=	(BCACHE_NR_BLOCKS * sizeof(struct bcache_block) + FRAME_SIZE - 1) / FRAME_SIZE,
+	BCACHE_DATA_FRAMES		=	BCACHE_NR_BLOCKS * BCACHE_BLOCK_SIZE / FRAME_SIZE,
+	BCACHE_STAGING_FRAMES		=	BCACHE_MAX_BATCH_BLOCKS * BCACHE_BLOCK_SIZE / FRAME_SIZE,
+	BCACHE_WRITEBACK_AGE_TICKS	=	BCACHE_WRITEBACK_AGE_MS * CLOCK_TICK_HZ / 1000,
+	BCACHE_WRITEBACK_PERIOD_TICKS	=	BCACHE_WRITEBACK_PERIOD_MS * CLOCK_TICK_HZ / 1000,
+};
+
+static struct
+{
+	struct bcache_block	* blocks;
+	/* batches of blocks are transferred through this buffer */
+	uint8_t			* staging_buffer;
+	struct bcache_block	* hash[BCACHE_HASH_SIZE];
+	/* head of the least recently used list; 'lru.lru_next' is the most
+	 * recently used block, 'lru.lru_prev' the least recently used one */
+	struct bcache_block	lru;
+	int			nr_dirty;
+	/* set by the writeback timer */
+	volatile bool		writeback_due;
+	struct timer		writeback_timer;
+	/* for detecting sequential reads - the block following the last block read, per device */
+	uint64_t		next_sequential_block[MAX_BLOCK_DEVICES];
+	/* statistics */
+	uint32_t		hits, misses, readahead_blocks, blocks_written;
+}
+bcache __attribute__((section(".common-data")));
+
+static unsigned bcache_hash(int device_number, uint64_t block_number)
+{
+	return (((uint32_t) block_number ^ (uint32_t) (block_number >> 32)) * 2654435761u ^ device_number) % BCACHE_HASH_SIZE;
+}
+
+static void lru_unlink(struct bcache_block * b)
+{
+	b->lru_prev->lru_next = b->lru_next;
+	b->lru_next->lru_prev = b->lru_prev;
+}
+
+static void lru_insert_after(struct bcache_block * position, struct bcache_block * b)
+{
+	b->lru_prev = position;
+	b->lru_next = position->lru_next;
+	position->lru_next->lru_prev = b;
+	position->lru_next = b;
+}
+
+static void hash_remove(struct bcache_block * b)
+{
+struct bcache_block ** p = bcache.hash + bcache_hash(b->device, b->block_number);
+
+	while (* p != b)
+		p = & (* p)->hash_next;
+	* p = b->hash_next;
+}
+
+static struct bcache_block * bcache_lookup(int device_number, uint64_t block_number)
+{
+struct bcache_block * b;
+
+	for (b = bcache.hash[bcache_hash(device_number, block_number)]; b; b = b->hash_next)
+		if (b->device == device_number && b->block_number == block_number)
+			return b;
+	return 0;
+}
+
+/* transfers a batch of blocks, sorted by block number, from or to a device; returns -1
+ * if any of the requests failed; the blocks transferred successfully are marked as
+ * valid on reads, and as clean on writes */
+static int bcache_transfer(int device_number, struct bcache_block ** batch, int nr_blocks, bool write)
+{
+struct blockdev_request requests[BCACHE_MAX_BATCH_BLOCKS];
+int run_start[BCACHE_MAX_BATCH_BLOCKS + 1];
+int i, run, nr_runs = 0, result;
+uint8_t * p;
+
+	for (i = 0, p = bcache.staging_buffer; i < nr_blocks; i ++, p += BCACHE_BLOCK_SIZE)
+	{
+		/* only the last block of a device may be partial, so the blocks of a run are contiguous in the staging buffer */
+		if (!i || batch[i]->block_number != batch[i - 1]->block_number + 1)
+		{
+			run_start[nr_runs] = i;
+			requests[nr_runs ++] = (struct blockdev_request)
+				{ .lba = batch[i]->block_number * BCACHE_BLOCK_SECTORS, .buffer = p, .write = write, .status = -1, };
+		}
+		requests[nr_runs - 1].count += batch[i]->nr_sectors;
+		if (write)
+			xmemcpy(p, batch[i]->data, batch[i]->nr_sectors * BCACHE_SECTOR_SIZE);
+	}
+	run_start[nr_runs] = nr_blocks;
+
+	result = blockdev_submit(device_number, requests, nr_runs);
+
+	for (run = 0; run < nr_runs; run ++)
+	{
+		if (requests[run].status)
+			continue;
+		for (i = run_start[run]; i < run_start[run + 1]; i ++)
+			if (write)
+			{
+				batch[i]->dirty = false;
+				bcache.nr_dirty --;
+				bcache.blocks_written ++;
+			}
+			else
+			{
+				xmemcpy(batch[i]->data, bcache.staging_buffer + i * BCACHE_BLOCK_SIZE, batch[i]->nr_sectors * BCACHE_SECTOR_SIZE);
+				batch[i]->valid = true;
+			}
+	}
+	return result;
+}
+
+/* writes back the dirty blocks of a device, in batches of the lowest numbered dirty blocks;
+ * if 'aged_only' is true, only the blocks dirty for longer than BCACHE_WRITEBACK_AGE_MS */
+static int bcache_writeback(int device_number, bool aged_only)
+{
+struct bcache_block * batch[BCACHE_MAX_BATCH_BLOCKS], * b;
+int i, j, n;
+
+	while (1)
+	{
+		/* collect a batch of dirty blocks, sorted by block number */
+		for (i = n = 0; i < BCACHE_NR_BLOCKS; i ++)
+		{
+			b = bcache.blocks + i;
+			if (!b->dirty || b->device != device_number)
+				continue;
+			if (aged_only && clock_ticks() - b->dirty_since < BCACHE_WRITEBACK_AGE_TICKS)
+				continue;
+			if (n == BCACHE_MAX_BATCH_BLOCKS && b->block_number > batch[n - 1]->block_number)
+				continue;
+			if (n < BCACHE_MAX_BATCH_BLOCKS)
+				n ++;
+			for (j = n - 1; j && batch[j - 1]->block_number > b->block_number; j --)
+				batch[j] = batch[j - 1];
+			batch[j] = b;
+		}
+		if (!n)
+			return 0;
+		if (bcache_transfer(device_number, batch, n, true))
+			return -1;
+	}
+}
+
+/* returns the cached block for a device block, evicting the least recently used block if
+ * the block is not cached; the block returned is not valid, unless it was already cached;
+ * returns null if the block evicted was dirty, and could not be written back */
+static struct bcache_block * bcache_get_block(int device_number, uint64_t block_number)
+{
+struct bcache_block * b = bcache_lookup(device_number, block_number);
+struct block_device * dev;
+uint64_t nr_sectors;
+
+	if (!b)
+	{
+		b = bcache.lru.lru_prev;
+		if (b->dirty && (bcache_writeback(b->device, false) || b->dirty))
+			return 0;
+		if (b->device != -1)
+			hash_remove(b);
+		dev = blockdev_get(device_number);
+		nr_sectors = dev->nr_sectors - block_number * BCACHE_BLOCK_SECTORS;
+		b->device = device_number;
+		b->block_number = block_number;
+		b->nr_sectors = nr_sectors < BCACHE_BLOCK_SECTORS ? nr_sectors : BCACHE_BLOCK_SECTORS;
+		b->valid = false;
+		b->hash_next = bcache.hash[bcache_hash(device_number, block_number)];
+		bcache.hash[bcache_hash(device_number, block_number)] = b;
+	}
+	lru_unlink(b);
+	lru_insert_after(& bcache.lru, b);
+	return b;
+}
+
+/* reads the blocks, among 'nr_blocks' consecutive blocks, that are not valid */
+static void bcache_fill(int device_number, uint64_t block_number, int nr_blocks)
+{
+struct bcache_block * batch[BCACHE_MAX_BATCH_BLOCKS], * b;
+int i, n;
+
+	for (i = n = 0; i < nr_blocks; i ++)
+	{
+		if (!(b = bcache_get_block(device_number, block_number + i)))
+			break;
+		if (!b->valid)
+			batch[n ++] = b;
+	}
+	if (n)
+		bcache_transfer(device_number, batch, n, false);
+}
+
+static struct block_device * bcache_check_request(int device_number, uint64_t lba, uint32_t count, bool * cached)
+{
+struct block_device * dev = blockdev_get(device_number);
+
+	* cached = dev && dev->sector_size == BCACHE_SECTOR_SIZE && bcache.blocks;
+	if (!dev || lba >= dev->nr_sectors || count > dev->nr_sectors - lba)
+		return 0;
+	return dev;
+}
+
+int bcache_read(int device_number, uint64_t lba, uint32_t count, void * buffer)
+{
+struct block_device * dev;
+struct bcache_block * b;
+uint64_t block_number, nr_device_blocks;
+uint32_t offset, n, nr_blocks;
+uint8_t * p = buffer;
+bool cached;
+
+	if (!(dev = bcache_check_request(device_number, lba, count, & cached)))
+		return -1;
+	if (!cached)
+		return blockdev_read(device_number, lba, count, buffer);
+	nr_device_blocks = (dev->nr_sectors + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+	for (; count; count -= n, lba += n, p += n * BCACHE_SECTOR_SIZE)
+	{
+		block_number = lba / BCACHE_BLOCK_SECTORS;
+		offset = lba % BCACHE_BLOCK_SECTORS;
+		n = BCACHE_BLOCK_SECTORS - offset;
+		if (n > count)
+			n = count;
+		if ((b = bcache_lookup(device_number, block_number)) && b->valid)
+		{
+			bcache.hits ++;
+			lru_unlink(b);
+			lru_insert_after(& bcache.lru, b);
+		}
+		else
+		{
+			bcache.misses ++;
+			/* read the rest of the request at once, and read ahead if reading sequentially */
+			nr_blocks = (offset + count + BCACHE_BLOCK_SECTORS - 1) / BCACHE_BLOCK_SECTORS;
+			if (block_number == bcache.next_sequential_block[device_number] && nr_blocks < BCACHE_READAHEAD_BLOCKS)
+			{
+				bcache.readahead_blocks += BCACHE_READAHEAD_BLOCKS - nr_blocks;
+				nr_blocks = BCACHE_READAHEAD_BLOCKS;
+			}
+			if (nr_blocks > BCACHE_MAX_BATCH_BLOCKS)
+				nr_blocks = BCACHE_MAX_BATCH_BLOCKS;
+			if (nr_blocks > nr_device_blocks - block_number)
+				nr_blocks = nr_device_blocks - block_number;
+			bcache_fill(device_number, block_number, nr_blocks);
+			if (!(b = bcache_lookup(device_number, block_number)) || !b->valid)
+				return -1;
+		}
+		xmemcpy(p, b->data + offset * BCACHE_SECTOR_SIZE, n * BCACHE_SECTOR_SIZE);
+		bcache.next_sequential_block[device_number] = block_number + 1;
+	}
+	return 0;
+}
+
+int bcache_write(int device_number, uint64_t lba, uint32_t count, const void * buffer)
+{
+struct bcache_block * b;
+uint64_t block_number;
+uint32_t offset, n;
+const uint8_t * p = buffer;
+bool cached;
+
+	if (!bcache_check_request(device_number, lba, count, & cached))
+		return -1;
+	if (!cached)
+		return blockdev_write(device_number, lba, count, buffer);
+	for (; count; count -= n, lba += n, p += n * BCACHE_SECTOR_SIZE)
+	{
+		block_number = lba / BCACHE_BLOCK_SECTORS;
+		offset = lba % BCACHE_BLOCK_SECTORS;
+		n = BCACHE_BLOCK_SECTORS - offset;
+		if (n > count)
+			n = count;
+		if (!(b = bcache_get_block(device_number, block_number)))
+			return -1;
+		if (!b->valid && (offset || n < b->nr_sectors))
+		{
+			/* a partial block write, read in the rest of the block first */
+			bcache_fill(device_number, block_number, 1);
+			if (!b->valid)
+				return -1;
+		}
+		xmemcpy(b->data + offset * BCACHE_SECTOR_SIZE, p, n * BCACHE_SECTOR_SIZE);
+		b->valid = true;
+		if (!b->dirty)
+		{
+			b->dirty = true;
+			b->dirty_since = clock_ticks();
+			bcache.nr_dirty ++;
+		}
+	}
+	return 0;
+}
+
+int bcache_sync(int device_number)
+{
+int i, result = 0;
+
+	if (device_number == -1)
+	{
+		for (i = 0; i < blockdev_count(); i ++)
+			result |= bcache_sync(i);
+		return result;
+	}
+	if (!blockdev_get(device_number))
+		return -1;
+	result = bcache_writeback(device_number, false);
+	return blockdev_flush(device_number) | result;
+}
+
+int bcache_invalidate(int device_number)
+{
+struct bcache_block * b;
+int i, result = bcache_sync(device_number);
+
+	for (i = 0; i < BCACHE_NR_BLOCKS && bcache.blocks; i ++)
+	{
+		b = bcache.blocks + i;
+		if (b->device == -1 || b->dirty || (device_number != -1 && b->device != device_number))
+			continue;
+		hash_remove(b);
+		b->device = -1;
+		b->valid = false;
+		/* reuse the block first */
+		lru_unlink(b);
+		lru_insert_after(bcache.lru.lru_prev, b);
+	}
+	for (i = 0; i < MAX_BLOCK_DEVICES; i ++)
+		if (device_number == -1 || device_number == i)
+			bcache.next_sequential_block[i] = 0;
+	return result;
+}
+
+static void bcache_writeback_timer_callback(void * argument)
+{
+	if (bcache.nr_dirty)
+		bcache.writeback_due = true;
+}
+
+bool bcache_writeback_pending(void)
+{
+	return bcache.writeback_due;
+}
+
+void bcache_background_writeback(void)
+{
+int i;
+
+	if (!bcache.writeback_due)
+		return;
+	bcache.writeback_due = false;
+	for (i = 0; i < blockdev_count() && bcache.nr_dirty; i ++)
+		bcache_writeback(i, true);
+}
+
+void init_bcache(void)
+{
+uint8_t * data;
+int i;
+
+	bcache.lru.lru_next = bcache.lru.lru_prev = & bcache.lru;
+	if (!(bcache.blocks = frame_alloc(BCACHE_DESCRIPTOR_FRAMES)))
+		goto out_of_memory;
+	if (!(data = frame_alloc(BCACHE_DATA_FRAMES)))
+	{
+		frame_free(bcache.blocks, BCACHE_DESCRIPTOR_FRAMES);
+		goto out_of_memory;
+	}
+	if (!(bcache.staging_buffer = frame_alloc(BCACHE_STAGING_FRAMES)))
+	{
+		frame_free(data, BCACHE_DATA_FRAMES);
+		frame_free(bcache.blocks, BCACHE_DESCRIPTOR_FRAMES);
+		goto out_of_memory;
+	}
+	for (i = 0; i < BCACHE_NR_BLOCKS; i ++)
+	{
+		bcache.blocks[i] = (struct bcache_block) { .device = -1, .data = data + i * BCACHE_BLOCK_SIZE, };
+		lru_insert_after(& bcache.lru, bcache.blocks + i);
+	}
+	timer_start(& bcache.writeback_timer, BCACHE_WRITEBACK_PERIOD_TICKS, BCACHE_WRITEBACK_PERIOD_TICKS,
+			bcache_writeback_timer_callback, 0);
+	return;
+out_of_memory:
+	bcache.blocks = 0;
+	print_str(__func__);
+	print_str("(): out of memory, block devices are not cached\n");
+}
+
+/*
+ * forth words
+ */
+
+static void do_bcache_read(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+int device_number = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(bcache_read(device_number, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_bcache_write(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+int device_number = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(bcache_write(device_number, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_bcache_sync(void) { /* ( device|-1 -- t=success|f=failure) */ sf_push(bcache_sync(sf_pop()) ? 0 : -1); }
+static void do_bcache_invalidate(void) { /* ( device|-1 -- t=success|f=failure) */ sf_push(bcache_invalidate(sf_pop()) ? 0 : -1); }
+
+static void do_bcache_stats(void)
+{
+	sf_push(bcache.hits);
+	sf_eval("base @ >r decimal .( buffer cache hits: ) u.");
+	sf_push(bcache.misses);
+	sf_eval(".( , misses: ) u.");
+	sf_push(bcache.readahead_blocks);
+	sf_eval(".( , blocks read ahead: ) u.");
+	sf_push(bcache.blocks_written);
+	sf_eval(".( , blocks written: ) u.");
+	sf_push(bcache.nr_dirty);
+	sf_eval(".( , dirty: ) u. cr r> base !");
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"bcache-read",		do_bcache_read),
+	MKWORD(custom_dict,	__COUNTER__,	"bcache-write",			do_bcache_write),
+	MKWORD(custom_dict,	__COUNTER__,	"bcache-sync",			do_bcache_sync),
+	MKWORD(custom_dict,	__COUNTER__,	"bcache-invalidate",		do_bcache_invalidate),
+	MKWORD(custom_dict,	__COUNTER__,	".bcache",			do_bcache_stats),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
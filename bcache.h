@@ -0,0 +1,82 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	/* the cache works in blocks of several consecutive sectors */
+	BCACHE_SECTOR_SIZE		=	512,
+	BCACHE_BLOCK_SECTORS		=	8,
+	BCACHE_BLOCK_SIZE		=	BCACHE_SECTOR_SIZE * BCACHE_BLOCK_SECTORS,
+	BCACHE_NR_BLOCKS		=	512,
+	BCACHE_HASH_SIZE		=	256,
+	/* number of blocks read ahead when sequential reading is detected */
+	BCACHE_READAHEAD_BLOCKS		=	16,
+	/* maximum number of blocks read, or written, in a single batch of requests */
+	BCACHE_MAX_BATCH_BLOCKS		=	32,
+	/* dirty blocks are written back in the background once they have been
+	 * dirty for this long; checked every BCACHE_WRITEBACK_PERIOD_MS */
+	BCACHE_WRITEBACK_AGE_MS		=	5000,
+	BCACHE_WRITEBACK_PERIOD_MS	=	1000,
+};
+
+/* a cached block; block descriptors and data reside in extended memory */
+struct bcache_block
+{
+	int		device;
+	uint64_t	block_number;
+	uint8_t		* data;
+	/* less than BCACHE_BLOCK_SECTORS for a partial block at the end of a device */
+	int		nr_sectors;
+	bool		valid;
+	bool		dirty;
+	/* clock ticks at the time the block became dirty */
+	uint32_t	dirty_since;
+	struct bcache_block	* hash_next;
+	/* least recently used list links */
+	struct bcache_block	* lru_prev, * lru_next;
+};
+
+/* allocates the cache memory, and starts the background writeback timer */
+void init_bcache(void);
+/* cached sector reads and writes; devices with sector sizes different from
+ * BCACHE_SECTOR_SIZE are accessed directly; return 0 on success, -1 on failure */
+int bcache_read(int device_number, uint64_t lba, uint32_t count, void * buffer);
+int bcache_write(int device_number, uint64_t lba, uint32_t count, const void * buffer);
+/* writes back the dirty blocks of a device, and then flushes the device's
+ * write cache, so that all data written before are on the medium before any
+ * data written after; a device number of -1 syncs all devices */
+int bcache_sync(int device_number);
+/* syncs a device, and drops its blocks from the cache; needed before accessing
+ * a device directly, bypassing the cache */
+int bcache_invalidate(int device_number);
+/* writes back dirty blocks that have aged, if the writeback timer has expired;
+ * called from the console idle loop, outside interrupt context */
+void bcache_background_writeback(void);
+bool bcache_writeback_pending(void);
+
+#endif /* __BCACHE_H__ */
@@ -0,0 +1,162 @@
+\ Copyright (c) 2018 stoyan shopov
+\ 
+\ Permission is hereby granted, free of charge, to any person obtaining a copy
+\ of this software and associated documentation files (the "Software"), to deal
+\ in the Software without restriction, including without limitation the rights
+\ to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+\ copies of the Software, and to permit persons to whom the Software is
+\ furnished to do so, subject to the following conditions:
+\ 
+\ The above copyright notice and this permission notice shall be included in
+\ all copies or substantial portions of the Software.
+\ 
+\ THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+\ IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+\ FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+\ AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+\ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+\ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+\ THE SOFTWARE.
+
+( ans forth block and block extension wordsets)
+
+\ 1 KByte forth blocks are mapped on consecutive pairs of sectors of
+\ a block device, starting at sector BLOCK-FIRST-SECTOR; block
+\ buffers are kept in the forth memory of each kernel process, and
+\ are read and written through the kernel buffer cache - updated
+\ buffers are written back when their buffer is reassigned, or by
+\ 'save-buffers'/'flush', which also sync the buffer cache
+\ NOTE: block buffers are not shared between kernel processes, a block
+\ updated in one process is only seen by the others after it has been
+\ saved, and after they have emptied their buffers ('empty-buffers')
+
+base @ decimal
+
+here
+
+\ the block device (see '.blockdevs') holding forth blocks
+0 value BLOCK-DEVICE
+\ the device sector at which block 0 starts
+0 value BLOCK-FIRST-SECTOR
+1024 constant BLOCK-BYTESIZE
+512 constant BLOCK-SECTOR-BYTESIZE
+BLOCK-BYTESIZE BLOCK-SECTOR-BYTESIZE / constant SECTORS/BLOCK
+8 constant #BLOCK-BUFFERS
+\ block source lines are interpreted one at a time, so that comments
+\ started with '\' end at the end of a line
+64 constant C/L
+BLOCK-BYTESIZE C/L / constant L/BLOCK
+
+variable blk
+variable scr
+0 blk !
+
+\ block buffer data, and descriptors - the block number assigned to a
+\ buffer (-1 for unassigned buffers), the update flag, and the time
+\ stamp of the last access of a buffer, for least recently used reuse
+create block-buffers #BLOCK-BUFFERS BLOCK-BYTESIZE * allot
+create block-numbers #BLOCK-BUFFERS cells allot
+create block-update-flags #BLOCK-BUFFERS cells allot
+create block-stamps #BLOCK-BUFFERS cells allot
+variable block-clock
+\ the buffer accessed last, 'update' marks this buffer as updated
+variable current-block-buffer
+
+: block-buffer ( index -- a-addr) BLOCK-BYTESIZE * block-buffers + ;
+: block-number ( index -- a-addr) cells block-numbers + ;
+: block-update-flag ( index -- a-addr) cells block-update-flags + ;
+: block-stamp ( index -- a-addr) cells block-stamps + ;
+: block>sector ( u -- sector-nr) SECTORS/BLOCK * BLOCK-FIRST-SECTOR + ;
+
+: block-io-error ( --) ." block i/o error" cr abort ;
+
+: write-block-buffer ( index --)
+	dup block-buffer over block-number @ block>sector SECTORS/BLOCK BLOCK-DEVICE bcache-write
+	0= if drop block-io-error then
+	false swap block-update-flag !
+	;
+
+: save-block-buffer ( index --)
+	dup block-update-flag @ if write-block-buffer else drop then
+	;
+
+: find-block-buffer ( u -- index|-1)
+	-1 swap #BLOCK-BUFFERS 0 do
+		dup i block-number @ = if nip i swap leave then
+	loop drop
+	;
+
+\ unassigned buffers have a zero time stamp, and are reused first
+: lru-block-buffer ( -- index)
+	0 #BLOCK-BUFFERS 1 do
+		i block-stamp @ over block-stamp @ < if drop i then
+	loop
+	;
+
+\ assigns the least recently used buffer to a block, saving the buffer first if updated
+: assign-block-buffer ( u -- index)
+	lru-block-buffer dup save-block-buffer
+	swap over block-number !
+	false over block-update-flag !
+	;
+
+: use-block-buffer ( index -- a-addr)
+	block-clock @ 1+ dup block-clock ! over block-stamp !
+	dup current-block-buffer !
+	block-buffer
+	;
+
+: buffer ( u -- a-addr)
+	dup find-block-buffer dup -1 <> if nip else drop assign-block-buffer then
+	use-block-buffer
+	;
+
+: block ( u -- a-addr)
+	dup find-block-buffer dup -1 <> if nip use-block-buffer exit then
+	drop dup assign-block-buffer ( u index)
+	dup block-buffer rot block>sector SECTORS/BLOCK BLOCK-DEVICE bcache-read
+	0= if -1 swap block-number ! block-io-error then
+	use-block-buffer
+	;
+
+: update ( --) true current-block-buffer @ block-update-flag ! ;
+
+: save-buffers ( --)
+	#BLOCK-BUFFERS 0 do i save-block-buffer loop
+	\ commit the data to the medium
+	BLOCK-DEVICE bcache-sync 0= if block-io-error then
+	;
+
+: empty-buffers ( --)
+	#BLOCK-BUFFERS 0 do
+		-1 i block-number ! false i block-update-flag ! 0 i block-stamp !
+	loop
+	;
+
+: flush ( --) save-buffers empty-buffers ;
+
+: load ( i*x u -- j*x)
+	blk @ >r blk !
+	L/BLOCK 0 do
+		\ the block is looked up for each line, as loading may reuse its
+		\ buffer; the block number is not kept on the data stack, which
+		\ the interpreted lines may change
+		blk @ block i C/L * + C/L evaluate
+	loop
+	r> blk !
+	;
+
+: thru ( i*x u1 u2 -- j*x) 1+ swap ?do i load loop ;
+
+: list ( u --)
+	dup scr ! ." screen " dup . cr
+	block L/BLOCK 0 do
+		i 2 .r space dup i C/L * + C/L type cr
+	loop drop
+	;
+
+empty-buffers
+
+here swap -
+.( block wordset compiled: ) . .( bytes used) cr
+base !
@@ -0,0 +1,467 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* block device registry; block device drivers register their devices here,
+ * and all block device accesses - from c, and from forth - go through here
+ *
+ * all accesses are passed through a request queue, which is common to all
+ * devices and kernel processes; the queue is sorted in elevator (c-look) order,
+ * starting from the sector following the last request dispatched to a device,
+ * except that a request past its deadline restarts the sweep from that request,
+ * so that requests are not starved by streams of requests for nearby sectors;
+ * requests for consecutive sectors with consecutive buffers are merged, and the
+ * requests are passed to a device in batches, which devices capable of command
+ * queuing process concurrently; the batches for several devices are in progress
+ * at the same time, for devices supplying the 'start' and 'poll' operations
+ *
+ * the queue entries hold copies of the request parameters, because the requests
+ * themselves may reside in the private memory of another kernel process */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "blockdev.h"
+#include "clock.h"
+#include "common-data.h"
+
+static struct
+{
+	struct block_device	* devices[MAX_BLOCK_DEVICES];
+	int			nr_devices;
+}
+blockdevs __attribute__((section(".common-data")));
+
+static struct
+{
+	struct queue_entry
+	{
+		bool				in_use;
+		int				device_number;
+		int				process;
+		uint64_t			lba;
+		uint32_t			count;
+		bool				write;
+		uint64_t			deadline;
+		struct blockdev_request		* request;
+	}
+	entries[BLOCKDEV_QUEUE_DEPTH];
+	/* the sector following the last request dispatched to each device */
+	uint64_t	head_position[MAX_BLOCK_DEVICES];
+	/* statistics */
+	uint32_t	nr_queued;
+	uint32_t	nr_merged;
+	uint32_t	nr_dispatches;
+}
+queue __attribute__((section(".common-data")));
+
+/* the batches being dispatched; batches are only dispatched by the process that
+ * queued the requests, so this is private to each process */
+static struct dispatch
+{
+	bool			active;
+	/* true if the device is polled for the completion of the batch */
+	bool			polled;
+	/* the queue entries in the batch, in dispatch order */
+	struct queue_entry	* entries[BLOCKDEV_QUEUE_DEPTH];
+	int			nr_entries;
+	/* the merged requests passed to the device; 'run_start' holds the index
+	 * in 'entries' of the first queue entry of each run */
+	struct blockdev_request	runs[BLOCKDEV_MAX_DISPATCH];
+	int			run_start[BLOCKDEV_MAX_DISPATCH + 1];
+	int			nr_runs;
+}
+dispatches[MAX_BLOCK_DEVICES];
+
+int blockdev_register(struct block_device * dev)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+int i = -1;
+
+	if (blockdevs.nr_devices != MAX_BLOCK_DEVICES)
+		blockdevs.devices[i = blockdevs.nr_devices ++] = dev;
+	restore_irq_flag(irqflag);
+	return i;
+}
+
+struct block_device * blockdev_get(int device_number)
+{
+	if (device_number < 0 || device_number >= blockdevs.nr_devices)
+		return 0;
+	return blockdevs.devices[device_number];
+}
+
+int blockdev_count(void)
+{
+	return blockdevs.nr_devices;
+}
+
+static struct block_device * check_request(int device_number, uint64_t lba, uint32_t count)
+{
+struct block_device * dev = blockdev_get(device_number);
+
+	if (!dev || lba >= dev->nr_sectors || count > dev->nr_sectors - lba)
+		return 0;
+	return dev;
+}
+
+static int do_request(struct block_device * dev, struct blockdev_request * request)
+{
+	if (!request->count)
+		return 0;
+	return request->write ? dev->write(dev, request->lba, request->count, request->buffer)
+		: dev->read(dev, request->lba, request->count, request->buffer);
+}
+
+static bool entries_conflict(const struct queue_entry * e, int device_number, const struct blockdev_request * request)
+{
+	return e->in_use && e->device_number == device_number && (e->write || request->write)
+		&& e->lba < request->lba + request->count && request->lba < e->lba + e->count;
+}
+
+/* starts dispatching a batch of the requests queued for a device by the current
+ * process; returns the number of requests in the batch */
+static int dispatch_start(int device_number)
+{
+struct block_device * dev = blockdevs.devices[device_number];
+struct dispatch * d = dispatches + device_number;
+struct queue_entry * e, * sorted[BLOCKDEV_QUEUE_DEPTH], * previous;
+int i, j, n, first, oldest;
+uint64_t start;
+bool failed = false;
+
+	/* collect the requests of the device, sorted by sector number */
+	for (i = n = 0, oldest = -1; i < BLOCKDEV_QUEUE_DEPTH; i ++)
+	{
+		e = queue.entries + i;
+		if (!e->in_use || e->device_number != device_number || e->process != active_process)
+			continue;
+		for (j = n ++; j && sorted[j - 1]->lba > e->lba; j --)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = e;
+	}
+	if (!n)
+		return 0;
+	for (i = 0; i < n; i ++)
+		if (oldest == -1 || sorted[i]->deadline < sorted[oldest]->deadline)
+			oldest = i;
+
+	/* start the sweep at the head position, or at the oldest request, if it is past its deadline */
+	start = clock_deadline_expired(sorted[oldest]->deadline) ? sorted[oldest]->lba : queue.head_position[device_number];
+	for (first = 0; first < n && sorted[first]->lba < start; first ++)
+		;
+	if (first == n)
+		first = 0;
+
+	/* merge adjacent requests, in sweep order, wrapping around to the lowest sector once */
+	for (i = d->nr_runs = 0; i < n; i ++)
+	{
+		e = d->entries[i] = sorted[(first + i) % n];
+		if (d->nr_runs)
+		{
+			previous = d->entries[i - 1];
+			if (e->write == d->runs[d->nr_runs - 1].write && e->lba == d->runs[d->nr_runs - 1].lba + d->runs[d->nr_runs - 1].count
+					&& (uint8_t *) e->request->buffer == (uint8_t *) previous->request->buffer + previous->count * dev->sector_size
+					&& d->runs[d->nr_runs - 1].count + e->count <= BLOCKDEV_MAX_MERGE_SECTORS)
+			{
+				d->runs[d->nr_runs - 1].count += e->count;
+				queue.nr_merged ++;
+				continue;
+			}
+			if (d->nr_runs == BLOCKDEV_MAX_DISPATCH)
+				break;
+		}
+		d->run_start[d->nr_runs] = i;
+		d->runs[d->nr_runs ++] = (struct blockdev_request)
+			{ .lba = e->lba, .count = e->count, .buffer = e->request->buffer, .write = e->write, .status = -1, };
+	}
+	d->run_start[d->nr_runs] = d->nr_entries = i;
+	d->active = true;
+
+	queue.nr_dispatches ++;
+	queue.head_position[device_number] = d->runs[d->nr_runs - 1].lba + d->runs[d->nr_runs - 1].count;
+	if (dev->start)
+		failed = dev->start(dev, d->runs, d->nr_runs) != 0;
+	else if (dev->submit)
+		failed = dev->submit(dev, d->runs, d->nr_runs) != 0;
+	else
+		for (i = 0; i < d->nr_runs; i ++)
+			d->runs[i].status = do_request(dev, d->runs + i);
+	d->polled = dev->start && !failed;
+	/* a failure reported by the driver, rather than by the status of a run, fails the runs not already failed */
+	if (failed)
+		for (i = 0; i < d->nr_runs; i ++)
+			if (!d->runs[i].status)
+				d->runs[i].status = -1;
+	return d->nr_entries;
+}
+
+/* returns true when the batch being dispatched to a device has completed */
+static bool dispatch_poll(int device_number)
+{
+struct block_device * dev = blockdevs.devices[device_number];
+
+	return !dispatches[device_number].polled || dev->poll(dev);
+}
+
+/* completes the requests of the batch dispatched to a device */
+static void dispatch_complete(int device_number)
+{
+struct dispatch * d = dispatches + device_number;
+struct blockdev_request * completed[BLOCKDEV_QUEUE_DEPTH];
+struct queue_entry * e;
+int i, j, n = d->nr_entries;
+
+	/* release the queue entries before running the completion callbacks, which may queue more requests */
+	for (i = 0; i < d->nr_runs; i ++)
+		for (j = d->run_start[i]; j < d->run_start[i + 1]; j ++)
+		{
+			e = d->entries[j];
+			e->request->status = d->runs[i].status;
+			e->request->completed = true;
+			completed[j] = e->request;
+			e->in_use = false;
+		}
+	d->active = false;
+	for (j = 0; j < n; j ++)
+		if (completed[j]->done)
+			completed[j]->done(completed[j]);
+}
+
+/* dispatches a batch of the requests queued for a device by the current process, or
+ * completes the batch already being dispatched; returns the number of requests completed */
+static int dispatch(int device_number)
+{
+int n = dispatches[device_number].active ? dispatches[device_number].nr_entries : dispatch_start(device_number);
+
+	if (n)
+	{
+		while (!dispatch_poll(device_number))
+			;
+		dispatch_complete(device_number);
+	}
+	return n;
+}
+
+int blockdev_queue(int device_number, struct blockdev_request * request)
+{
+struct block_device * dev = check_request(device_number, request->lba, request->count);
+struct queue_entry * e;
+int i;
+
+	if (!dev)
+		return -1;
+	request->completed = false;
+	if (request->count)
+	{
+		/* overlapping requests, when either of them is a write, must be performed in order */
+		for (i = 0; i < BLOCKDEV_QUEUE_DEPTH; i ++)
+			if (entries_conflict(queue.entries + i, device_number, request) && queue.entries[i].process == active_process)
+				while (queue.entries[i].in_use && dispatch(device_number))
+					;
+		for (i = 0; i < BLOCKDEV_QUEUE_DEPTH && queue.entries[i].in_use; i ++)
+			;
+		if (i == BLOCKDEV_QUEUE_DEPTH)
+		{
+			/* the queue is full, make room by dispatching; if the queue is still full,
+			 * it is full of requests of other processes - perform the request now */
+			dispatch(device_number);
+			for (i = 0; i < BLOCKDEV_QUEUE_DEPTH && queue.entries[i].in_use; i ++)
+				;
+		}
+		if (i != BLOCKDEV_QUEUE_DEPTH)
+		{
+			e = queue.entries + i;
+			* e = (struct queue_entry)
+			{
+				.in_use = true, .device_number = device_number, .process = active_process,
+				.lba = request->lba, .count = request->count, .write = request->write,
+				.deadline = clock_deadline_ms(request->write ? BLOCKDEV_WRITE_DEADLINE_MS : BLOCKDEV_READ_DEADLINE_MS),
+				.request = request,
+			};
+			queue.nr_queued ++;
+			return 0;
+		}
+	}
+	request->status = do_request(dev, request);
+	request->completed = true;
+	if (request->done)
+		request->done(request);
+	return 0;
+}
+
+int blockdev_wait(int device_number, struct blockdev_request * request)
+{
+	while (!request->completed)
+		if (!dispatch(device_number))
+		{
+			print_str(__func__);
+			print_str("(): request not queued\n");
+			return -1;
+		}
+	return request->status;
+}
+
+void blockdev_run_queues(void)
+{
+int i, nr_active;
+
+	/* keep batches in progress on all devices at the same time */
+	do
+		for (i = nr_active = 0; i < blockdevs.nr_devices; i ++)
+		{
+			if (!dispatches[i].active && !dispatch_start(i))
+				continue;
+			nr_active ++;
+			if (dispatch_poll(i))
+				dispatch_complete(i);
+		}
+	while (nr_active);
+}
+
+bool blockdev_queues_pending(void)
+{
+int i;
+
+	for (i = 0; i < BLOCKDEV_QUEUE_DEPTH; i ++)
+		if (queue.entries[i].in_use && queue.entries[i].process == active_process)
+			return true;
+	return false;
+}
+
+static int queue_and_wait(int device_number, uint64_t lba, uint32_t count, void * buffer, bool write)
+{
+struct blockdev_request request = { .lba = lba, .count = count, .buffer = buffer, .write = write, };
+
+	if (blockdev_queue(device_number, & request))
+		return -1;
+	return blockdev_wait(device_number, & request);
+}
+
+int blockdev_read(int device_number, uint64_t lba, uint32_t count, void * buffer)
+{
+	return queue_and_wait(device_number, lba, count, buffer, false);
+}
+
+int blockdev_write(int device_number, uint64_t lba, uint32_t count, const void * buffer)
+{
+	return queue_and_wait(device_number, lba, count, (void *) buffer, true);
+}
+
+int blockdev_flush(int device_number)
+{
+struct block_device * dev = blockdev_get(device_number);
+
+	if (!dev)
+		return -1;
+	/* requests queued before the flush must reach the device first */
+	while (dispatch(device_number))
+		;
+	return dev->flush ? dev->flush(dev) : 0;
+}
+
+int blockdev_submit(int device_number, struct blockdev_request * requests, int nr_requests)
+{
+int i, result = 0;
+
+	if (!blockdev_get(device_number))
+		return -1;
+	for (i = 0; i < nr_requests; i ++)
+		if (!check_request(device_number, requests[i].lba, requests[i].count))
+			return -1;
+	for (i = 0; i < nr_requests; i ++)
+		blockdev_queue(device_number, requests + i);
+	for (i = 0; i < nr_requests; i ++)
+		result |= blockdev_wait(device_number, requests + i);
+	return result;
+}
+
+static void do_blockdev_read(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+int device_number = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(blockdev_read(device_number, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_blockdev_write(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+int device_number = sf_pop();
+uint32_t count = sf_pop(), lba = sf_pop();
+
+	sf_push(blockdev_write(device_number, lba, count, (void *) sf_pop()) ? 0 : -1);
+}
+
+static void do_blockdev_flush(void) { /* ( device -- t=success|f=failure) */ sf_push(blockdev_flush(sf_pop()) ? 0 : -1); }
+
+static void do_blockdev_sectors(void)
+{
+/* ( device -- sector-count) */
+struct block_device * dev = blockdev_get(sf_pop());
+
+	/* saturate at the largest single cell value for devices larger than 2 TB */
+	sf_push(dev ? (dev->nr_sectors > 0xffffffff ? 0xffffffff : dev->nr_sectors) : 0);
+}
+
+static void do_blockdevs(void)
+{
+int i;
+
+	for (i = 0; i < blockdevs.nr_devices; i ++)
+	{
+		sf_push(i);
+		sf_eval(". .( : )");
+		print_str(blockdevs.devices[i]->name);
+		sf_push((blockdevs.devices[i]->nr_sectors * blockdevs.devices[i]->sector_size) >> 20);
+		sf_eval(".(  ) . .( MB) cr");
+	}
+}
+
+static void do_blockdev_queue_stats(void)
+{
+	sf_push(queue.nr_queued);
+	sf_eval(".( requests queued: ) . cr");
+	sf_push(queue.nr_merged);
+	sf_eval(".( requests merged: ) . cr");
+	sf_push(queue.nr_dispatches);
+	sf_eval(".( batches dispatched: ) . cr");
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"blockdev-read",	do_blockdev_read),
+	MKWORD(custom_dict,	__COUNTER__,	"blockdev-write",		do_blockdev_write),
+	MKWORD(custom_dict,	__COUNTER__,	"blockdev-flush",		do_blockdev_flush),
+	MKWORD(custom_dict,	__COUNTER__,	"blockdev-sectors",		do_blockdev_sectors),
+	MKWORD(custom_dict,	__COUNTER__,	".blockdevs",			do_blockdevs),
+	MKWORD(custom_dict,	__COUNTER__,	".blockdev-queue",		do_blockdev_queue_stats),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -0,0 +1,112 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __BLOCKDEV_H__
+#define __BLOCKDEV_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	MAX_BLOCK_DEVICES	=	16,
+	/* the number of requests that may be queued, for all devices */
+	BLOCKDEV_QUEUE_DEPTH	=	64,
+	/* the maximum number of requests passed to a device at once */
+	BLOCKDEV_MAX_DISPATCH	=	32,
+	/* requests for consecutive sectors, with consecutive buffers, are merged up to this size */
+	BLOCKDEV_MAX_MERGE_SECTORS	=	256,
+	/* queued requests older than this are dispatched first, regardless of the elevator position */
+	BLOCKDEV_READ_DEADLINE_MS	=	100,
+	BLOCKDEV_WRITE_DEADLINE_MS	=	1000,
+};
+
+/* a single request in a batch submitted by 'blockdev_submit()', or queued by 'blockdev_queue()' */
+struct blockdev_request
+{
+	uint64_t	lba;
+	uint32_t	count;
+	void		* buffer;
+	bool		write;
+	/* set on completion; 0 on success, -1 on failure */
+	int		status;
+	/* only used for queued requests; 'done' is optional, and is called on completion, after
+	 * 'status' and 'completed' are set, in the context of the process that queued the request */
+	void		(* done)(struct blockdev_request * request);
+	void		* argument;
+	bool		completed;
+};
+
+/* a block device; drivers fill this in, and register it with 'blockdev_register()';
+ * block devices are accessed from all kernel processes, so they must reside in
+ * common data, or in extended memory; the operations return 0 on success, -1 on failure */
+struct block_device
+{
+	const char	* name;
+	uint32_t	sector_size;
+	uint64_t	nr_sectors;
+	int		(* read)(struct block_device * dev, uint64_t lba, uint32_t count, void * buffer);
+	int		(* write)(struct block_device * dev, uint64_t lba, uint32_t count, const void * buffer);
+	/* writes any data cached by the device to the medium */
+	int		(* flush)(struct block_device * dev);
+	/* optional; performs a batch of independent requests, which devices capable of
+	 * command queuing keep outstanding concurrently; returns after all requests
+	 * in the batch have completed */
+	int		(* submit)(struct block_device * dev, struct blockdev_request * requests, int nr_requests);
+	/* optional, and supplied together; 'start' starts a batch of independent requests, and
+	 * returns without waiting for them to complete; 'poll' is then called repeatedly, until
+	 * it returns true, when all requests in the batch have completed; this lets batches on
+	 * several devices - e.g. on different ata channels - proceed concurrently; the 'done'
+	 * callbacks of completed requests may do blocking i/o on any device while batches
+	 * of other devices are started, so a device sharing hardware with another one - e.g.
+	 * the two drives of an ata channel - must make progress in its own 'poll', and in its
+	 * synchronous operations, without waiting for the 'poll' of the other device */
+	int		(* start)(struct block_device * dev, struct blockdev_request * requests, int nr_requests);
+	bool		(* poll)(struct block_device * dev);
+	void		* driver_data;
+};
+
+/* returns the block device number, or -1 if there is no room for the device */
+int blockdev_register(struct block_device * dev);
+struct block_device * blockdev_get(int device_number);
+int blockdev_count(void);
+int blockdev_read(int device_number, uint64_t lba, uint32_t count, void * buffer);
+int blockdev_write(int device_number, uint64_t lba, uint32_t count, const void * buffer);
+int blockdev_flush(int device_number);
+/* performs a batch of requests; the requests are done one after another for devices
+ * not supplying a 'submit' operation; returns 0 if all requests succeeded */
+int blockdev_submit(int device_number, struct blockdev_request * requests, int nr_requests);
+
+/* queues a request, and returns without waiting for it to complete; the request, and its
+ * buffer, must remain valid until the request completes; queued requests are sorted in
+ * elevator order, merged when adjacent, and passed to the device in batches - when waited
+ * for, and when the system is idle; requests are only ever dispatched by the process that
+ * queued them, as the request and its buffer may reside in the memory private to that
+ * process; returns 0 if the request was queued (or completed), -1 on invalid requests */
+int blockdev_queue(int device_number, struct blockdev_request * request);
+/* dispatches the queued requests of a device until 'request' completes; returns its status */
+int blockdev_wait(int device_number, struct blockdev_request * request);
+/* dispatches all requests queued by the current process */
+void blockdev_run_queues(void);
+bool blockdev_queues_pending(void);
+
+#endif /* __BLOCKDEV_H__ */
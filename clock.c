@@ -0,0 +1,334 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* timekeeping; the processor timestamp counter is the clock source, it is
+ * calibrated at startup against channel 2 of the 8254 programmable interval
+ * timer (pit). Channel 0 of the pit generates the system timer tick, which
+ * drives a hierarchical timer wheel - a wheel of TIMER_WHEEL_ROOT_SIZE slots,
+ * one slot per tick, for timers expiring in the near future, and cascaded
+ * wheels for timers further away, which get redistributed to the finer grained
+ * wheels as time passes; starting, cancelling, and expiring a timer are thus
+ * all constant time operations.
+ * All state here is common to all kernel processes */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "clock.h"
+#include "irq.h"
+#include "utils.h"
+
+enum
+{
+	PIT_FREQUENCY_HZ		=	1193182,
+	PIT_CHANNEL0_DATA		=	0x40,
+	PIT_CHANNEL2_DATA		=	0x42,
+	PIT_MODE_COMMAND		=	0x43,
+	/* channel 0, low byte/high byte access, mode 2 (rate generator) */
+	PIT_CHANNEL0_RATE_GENERATOR	=	0x34,
+	/* channel 2, low byte/high byte access, mode 0 (interrupt on terminal count) */
+	PIT_CHANNEL2_ONE_SHOT		=	0xb0,
+	/* channel 2 gate and speaker control, and channel 2 output status */
+	PIT_CHANNEL2_CONTROL		=	0x61,
+	PIT_CHANNEL2_GATE		=	1 << 0,
+	PIT_SPEAKER_ENABLE		=	1 << 1,
+	PIT_CHANNEL2_OUTPUT		=	1 << 5,
+
+	CALIBRATION_MS			=	10,
+	CALIBRATION_RUNS		=	3,
+};
+
+struct timer_wheel_slot
+{
+	struct timer	* first;
+};
+
+static struct
+{
+	uint32_t	tsc_khz;
+	uint64_t	tsc_base;
+	volatile uint32_t	ticks;
+	/* the tick up to which timers have been processed */
+	uint32_t	timer_ticks;
+	struct timer_wheel_slot	root[TIMER_WHEEL_ROOT_SIZE];
+	struct timer_wheel_slot	cascades[TIMER_WHEEL_NR_CASCADES][TIMER_WHEEL_SIZE];
+}
+clock __attribute__((section(".common-data")));
+
+/*
+ * timestamp counter
+ */
+
+static uint32_t calibrate_tsc(void)
+{
+int i;
+uint32_t count = PIT_FREQUENCY_HZ / 1000 * CALIBRATION_MS, cycles, min_cycles = -1;
+uint64_t start;
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	for (i = 0; i < CALIBRATION_RUNS; i ++)
+	{
+		write_io_port_byte(PIT_CHANNEL2_CONTROL,
+				(read_io_port_byte(PIT_CHANNEL2_CONTROL) & ~ PIT_SPEAKER_ENABLE) | PIT_CHANNEL2_GATE);
+		write_io_port_byte(PIT_MODE_COMMAND, PIT_CHANNEL2_ONE_SHOT);
+		write_io_port_byte(PIT_CHANNEL2_DATA, count);
+		write_io_port_byte(PIT_CHANNEL2_DATA, count >> 8);
+		start = rdtsc();
+		while (!(read_io_port_byte(PIT_CHANNEL2_CONTROL) & PIT_CHANNEL2_OUTPUT))
+			;
+		/* the shortest run is the one least disturbed by anything else */
+		if ((cycles = rdtsc() - start) < min_cycles)
+			min_cycles = cycles;
+	}
+	write_io_port_byte(PIT_CHANNEL2_CONTROL, read_io_port_byte(PIT_CHANNEL2_CONTROL) & ~ PIT_CHANNEL2_GATE);
+	restore_irq_flag(irqflag);
+	return min_cycles / CALIBRATION_MS;
+}
+
+uint32_t clock_tsc_khz(void)
+{
+	return clock.tsc_khz;
+}
+
+uint64_t clock_us(void)
+{
+	if (!clock.tsc_khz)
+		return 0;
+	return (rdtsc() - clock.tsc_base) * 1000 / clock.tsc_khz;
+}
+
+uint32_t clock_ticks(void)
+{
+	return clock.ticks;
+}
+
+uint64_t clock_deadline_ms(uint32_t timeout_ms)
+{
+	return clock_us() + (uint64_t) timeout_ms * 1000;
+}
+
+bool clock_deadline_expired(uint64_t deadline)
+{
+	/* with an uncalibrated clock source, deadlines never expire */
+	return clock.tsc_khz && clock_us() >= deadline;
+}
+
+void clock_delay_us(uint32_t us)
+{
+uint64_t deadline = clock_us() + us;
+
+	while (!clock_deadline_expired(deadline))
+		asm("pause");
+}
+
+void clock_sleep_ms(uint32_t ms)
+{
+uint64_t deadline = clock_deadline_ms(ms);
+int irqs_enabled = interrupts_enabled();
+
+	while (!clock_deadline_expired(deadline))
+		/* the timer tick wakes the processor up, if interrupts are enabled */
+		if (irqs_enabled)
+			asm("hlt");
+		else
+			asm("pause");
+}
+
+/*
+ * timer wheel
+ */
+
+static void timer_link(struct timer * timer, struct timer_wheel_slot * slot)
+{
+	if ((timer->next = slot->first))
+		slot->first->pprev = & timer->next;
+	slot->first = timer;
+	timer->pprev = & slot->first;
+}
+
+static void timer_unlink(struct timer * timer)
+{
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	* timer->pprev = timer->next;
+	timer->pprev = 0;
+}
+
+static void timer_enqueue(struct timer * timer)
+{
+uint32_t expires = timer->expires, delta = expires - clock.timer_ticks;
+int i, shift;
+
+	if ((int32_t) delta < 0)
+	{
+		/* already expired, process it at the next tick */
+		timer_link(timer, clock.root + (clock.timer_ticks & (TIMER_WHEEL_ROOT_SIZE - 1)));
+		return;
+	}
+	if (delta < TIMER_WHEEL_ROOT_SIZE)
+	{
+		timer_link(timer, clock.root + (expires & (TIMER_WHEEL_ROOT_SIZE - 1)));
+		return;
+	}
+	for (i = 0, shift = TIMER_WHEEL_ROOT_BITS; i < TIMER_WHEEL_NR_CASCADES - 1; i ++, shift += TIMER_WHEEL_BITS)
+		if (delta < 1 << (shift + TIMER_WHEEL_BITS))
+			break;
+	if (delta > TIMER_MAX_DELAY)
+		expires = clock.timer_ticks + TIMER_MAX_DELAY;
+	timer_link(timer, clock.cascades[i] + ((expires >> shift) & (TIMER_WHEEL_SIZE - 1)));
+}
+
+/* redistributes the timers in a slot of a cascaded wheel to the finer grained wheels;
+ * returns the slot index, zero means that the next coarser wheel must also be cascaded */
+static int timer_cascade(int wheel)
+{
+int index = (clock.timer_ticks >> (TIMER_WHEEL_ROOT_BITS + wheel * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SIZE - 1);
+struct timer * t = clock.cascades[wheel][index].first, * next;
+
+	clock.cascades[wheel][index].first = 0;
+	for (; t; t = next)
+	{
+		next = t->next;
+		timer_enqueue(t);
+	}
+	return index;
+}
+
+static void run_timers(void)
+{
+int index, i;
+struct timer * t;
+
+	while ((int32_t) (clock.ticks - clock.timer_ticks) >= 0)
+	{
+		index = clock.timer_ticks & (TIMER_WHEEL_ROOT_SIZE - 1);
+		if (!index)
+			for (i = 0; i < TIMER_WHEEL_NR_CASCADES && !timer_cascade(i); i ++)
+				;
+		clock.timer_ticks ++;
+		while ((t = clock.root[index].first))
+		{
+			timer_unlink(t);
+			if (t->period)
+			{
+				t->expires += t->period;
+				timer_enqueue(t);
+			}
+			t->callback(t->argument);
+		}
+	}
+}
+
+static void clock_tick(void * argument)
+{
+	clock.ticks ++;
+	run_timers();
+}
+
+void timer_start(struct timer * timer, uint32_t delay, uint32_t period, void (* callback)(void * argument), void * argument)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	if (timer->pprev)
+		timer_unlink(timer);
+	timer->expires = clock.ticks + delay;
+	timer->period = period;
+	timer->callback = callback;
+	timer->argument = argument;
+	timer_enqueue(timer);
+	restore_irq_flag(irqflag);
+}
+
+void timer_cancel(struct timer * timer)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	if (timer->pprev)
+		timer_unlink(timer);
+	restore_irq_flag(irqflag);
+}
+
+bool timer_pending(struct timer * timer)
+{
+	return timer->pprev != 0;
+}
+
+void init_clock(void)
+{
+uint32_t divisor = (PIT_FREQUENCY_HZ + CLOCK_TICK_HZ / 2) / CLOCK_TICK_HZ;
+
+	clock.tsc_khz = calibrate_tsc();
+	clock.tsc_base = rdtsc();
+
+	write_io_port_byte(PIT_MODE_COMMAND, PIT_CHANNEL0_RATE_GENERATOR);
+	write_io_port_byte(PIT_CHANNEL0_DATA, divisor);
+	write_io_port_byte(PIT_CHANNEL0_DATA, divisor >> 8);
+	irq_attach(IRQ_TIMER, clock_tick, 0);
+}
+
+/*
+ * forth words
+ */
+
+static void do_ms(void) { /* ( n --) */ clock_sleep_ms(sf_pop()); }
+static void do_us_fetch(void) { /* ( -- us) */ sf_push(clock_us()); }
+static void do_ticks(void) { /* ( -- ticks) */ sf_push(clock.ticks); }
+static void do_tsc_khz(void) { /* ( -- khz) */ sf_push(clock.tsc_khz); }
+
+static void do_with_timeout(void)
+{
+/* ( xt timeout-ms -- t=xt returned true|f=timeout)
+ * repeatedly executes xt ( -- flag) until it returns true, or the timeout expires */
+uint64_t deadline = clock_deadline_ms(sf_pop());
+cell xt = sf_pop();
+
+	do
+	{
+		sf_push(xt);
+		sf_eval("execute");
+		if (sf_pop())
+		{
+			sf_push(-1);
+			return;
+		}
+	}
+	while (!clock_deadline_expired(deadline));
+	sf_push(0);
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"ms",		do_ms),
+	MKWORD(custom_dict,	__COUNTER__,	"us@",			do_us_fetch),
+	MKWORD(custom_dict,	__COUNTER__,	"ticks",			do_ticks),
+	MKWORD(custom_dict,	__COUNTER__,	"tsc-khz",			do_tsc_khz),
+	MKWORD(custom_dict,	__COUNTER__,	"with-timeout",			do_with_timeout),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
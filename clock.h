@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	/* the system timer tick rate; timer wheel expiry times are in ticks */
+	CLOCK_TICK_HZ		=	1000,
+	/* timer wheel geometry - a 256 slot wheel of single ticks, and
+	 * three cascaded 64 slot wheels of progressively coarser granularity */
+	TIMER_WHEEL_ROOT_BITS	=	8,
+	TIMER_WHEEL_BITS	=	6,
+	TIMER_WHEEL_ROOT_SIZE	=	1 << TIMER_WHEEL_ROOT_BITS,
+	TIMER_WHEEL_SIZE	=	1 << TIMER_WHEEL_BITS,
+	TIMER_WHEEL_NR_CASCADES	=	3,
+	/* timers cannot be set further than this number of ticks in the future */
+	TIMER_MAX_DELAY		=	(1 << (TIMER_WHEEL_ROOT_BITS + TIMER_WHEEL_NR_CASCADES * TIMER_WHEEL_BITS)) - 1,
+};
+
+/* timer callbacks run in interrupt context, and must not block; timers are
+ * accessed in interrupt context, regardless of which kernel process is active,
+ * so they must reside in common data, or in extended memory */
+struct timer
+{
+	struct timer	* next, ** pprev;
+	/* expiry time, in ticks */
+	uint32_t	expires;
+	/* reload period, in ticks, for periodic timers; zero for one-shot timers */
+	uint32_t	period;
+	void		(* callback)(void * argument);
+	void		* argument;
+};
+
+/* calibrates the timestamp counter, and starts the system timer tick */
+void init_clock(void);
+/* timestamp counter frequency, in kHz; zero if the timestamp counter has not been calibrated */
+uint32_t clock_tsc_khz(void);
+/* time since the timestamp counter was calibrated */
+uint64_t clock_us(void);
+/* system timer ticks elapsed */
+uint32_t clock_ticks(void);
+/* deadlines are absolute clock_us() values; waits bounded by deadlines work with interrupts disabled */
+uint64_t clock_deadline_ms(uint32_t timeout_ms);
+bool clock_deadline_expired(uint64_t deadline);
+void clock_delay_us(uint32_t us);
+/* sleeps with the processor halted between timer ticks, if interrupts are enabled, busy waits otherwise */
+void clock_sleep_ms(uint32_t ms);
+
+/* starts a timer, expiring 'delay' ticks from now; a timer already pending is restarted */
+void timer_start(struct timer * timer, uint32_t delay, uint32_t period, void (* callback)(void * argument), void * argument);
+void timer_cancel(struct timer * timer);
+bool timer_pending(struct timer * timer);
+
+#endif /* __CLOCK_H__ */
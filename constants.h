@@ -26,6 +26,20 @@ THE SOFTWARE.
 enum
 {
 	NUMBER_OF_KERNEL_PROCESSES	= 4,
+	/* physical memory between the end of the kernel process images and
+	 * this address is identity mapped, and is handed out in page-sized
+	 * frames by the page frame allocator - see 'frame-alloc.c' */
+	EXTENDED_MEMORY_TOP		= 16 << 20,
+	EXTENDED_MEMORY_BASE		= (NUMBER_OF_KERNEL_PROCESSES + 1) << 20,
+};
+
+/* boot information left in low memory by the low-level kernel initialization
+ * code ('kinit.s'); these must be kept in sync with 'constants.s' */
+enum
+{
+	VBE_BOOT_INFO_PHYSICAL_ADDRESS	= 0x1000,
+	VBE_BOOT_INFO_SIGNATURE		= 0x32454256,	/* "VBE2" */
+	VBE_FONT_PHYSICAL_ADDRESS	= 0x2000,
 };
 
 #endif /* __CONSTANTS_H__ */
@@ -24,8 +24,30 @@ THE SOFTWARE.
 VIDEO_SEG_BASE			= 0xb800
 
 KERNEL_PHYSICAL_BASE_ADDRESS	= 0x100000
-KERNEL_PHYSICAL_TOP_ADDRESS	= KERNEL_PHYSICAL_BASE_ADDRESS + 256 * 1024
+KERNEL_PHYSICAL_TOP_ADDRESS	= KERNEL_PHYSICAL_BASE_ADDRESS + 384 * 1024
 
 KINIT_PHYSICAL_BASE_ADDRESS	= 0xa0000 - 16 * 1024
 
 DISK_SECTOR_SIZE		= 512
+
+/* vbe linear frame buffer console support; when enabled, the kernel initialization
+ * code sets the largest 32 bits per pixel vbe 2.0 mode that fits in
+ * VBE_MAX_WIDTH x VBE_MAX_HEIGHT, and leaves the mode information and the bios
+ * 8x16 font in low memory for the kernel frame buffer console; these must be kept
+ * in sync with 'constants.h' */
+VBE_CONSOLE_ENABLED		= 1
+VBE_MAX_WIDTH			= 1280
+VBE_MAX_HEIGHT			= 1024
+
+VBE_BOOT_INFO_PHYSICAL_ADDRESS	= 0x1000
+VBE_BOOT_INFO_SIGNATURE		= 0x32454256	/* "VBE2" */
+VBE_BOOT_INFO_LFB_ADDRESS	= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 4
+VBE_BOOT_INFO_WIDTH		= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 8
+VBE_BOOT_INFO_HEIGHT		= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 10
+VBE_BOOT_INFO_PITCH		= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 12
+VBE_BOOT_INFO_BPP		= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 14
+VBE_BOOT_INFO_MODE		= VBE_BOOT_INFO_PHYSICAL_ADDRESS + 16
+VBE_FONT_PHYSICAL_ADDRESS	= 0x2000
+/* scratch areas for the vbe bios calls */
+VBE_CONTROLLER_INFO		= 0x3000
+VBE_MODE_INFO			= 0x3200
@@ -39,6 +39,12 @@ void do_inpw(void);
 void do_outpw(void);
 void do_inpl(void);
 void do_outpl(void);
+void do_inpb_n(void);
+void do_outpb_n(void);
+void do_inpw_n(void);
+void do_outpw_n(void);
+void do_inpl_n(void);
+void do_outpl_n(void);
 void sf_ext_reset(void);
 
 /*
@@ -125,6 +131,68 @@ uint32_t port_nr = sf_pop();
 write_io_port_long(port_nr, sf_pop());
 }
 
+/* string io port words; these transfer 'count' bytes, words (16 bit),
+ * or longs (32 bit), between a buffer and an io port */
+/* inpb-n
+
+( buffer-address count port-number --)
+ */
+void do_inpb_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+read_io_port_byte_string(port_nr, sf_pop(), count);
+}
+
+/* outpb-n
+
+( buffer-address count port-number --)
+ */
+void do_outpb_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+write_io_port_byte_string(port_nr, sf_pop(), count);
+}
+
+/* inpw-n
+
+( buffer-address count port-number --)
+ */
+void do_inpw_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+read_io_port_word_string(port_nr, sf_pop(), count);
+}
+
+/* outpw-n
+
+( buffer-address count port-number --)
+ */
+void do_outpw_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+write_io_port_word_string(port_nr, sf_pop(), count);
+}
+
+/* inpl-n
+
+( buffer-address count port-number --)
+ */
+void do_inpl_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+read_io_port_long_string(port_nr, sf_pop(), count);
+}
+
+/* outpl-n
+
+( buffer-address count port-number --)
+ */
+void do_outpl_n(void)
+{
+uint32_t port_nr = sf_pop(), count = sf_pop();
+write_io_port_long_string(port_nr, sf_pop(), count);
+}
+
 extern unsigned int _bss_start, _bss_end;
 static void do_bss_start(void) { sf_push(& _bss_start); }
 static void do_bss_end(void) { sf_push(& _bss_end); }
@@ -145,6 +213,12 @@ static const struct word custom_dict[] = {
 	MKWORD(custom_dict,	__COUNTER__,	"outpw",	do_outpw),
 	MKWORD(custom_dict,	__COUNTER__,	"inpl",	do_inpl),
 	MKWORD(custom_dict,	__COUNTER__,	"outpl",	do_outpl),
+	MKWORD(custom_dict,	__COUNTER__,	"inpb-n",	do_inpb_n),
+	MKWORD(custom_dict,	__COUNTER__,	"outpb-n",	do_outpb_n),
+	MKWORD(custom_dict,	__COUNTER__,	"inpw-n",	do_inpw_n),
+	MKWORD(custom_dict,	__COUNTER__,	"outpw-n",	do_outpw_n),
+	MKWORD(custom_dict,	__COUNTER__,	"inpl-n",	do_inpl_n),
+	MKWORD(custom_dict,	__COUNTER__,	"outpl-n",	do_outpl_n),
 
 	MKWORD(custom_dict,	__COUNTER__,	"dump-mouse-bytes",	do_dump_mouse_bytes),
 
@@ -0,0 +1,1103 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* fat12/16/32 filesystem; the volume is accessed through the block buffer cache,
+ * which caches file data, directories and the file allocation table alike, and
+ * reads ahead sequential accesses. Each open file remembers the runs of
+ * consecutive clusters of its cluster chain walked so far, so that the file
+ * allocation table is only read again for heavily fragmented files, and keeps
+ * a buffer for the sector last accessed by a transfer of a part of a sector,
+ * so that reading a file a few bytes at a time (e.g. with 'sffgetc()') does not
+ * go through the buffer cache for each byte.
+ *
+ * Only 8.3 short file names are supported - long file name directory entries
+ * are skipped. There is a single mounted volume, its description is common to
+ * all kernel processes; open files are private to each kernel process */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "fat.h"
+#include "bcache.h"
+#include "blockdev.h"
+#include "utils.h"
+
+enum
+{
+	/* boot sector (bios parameter block) field offsets */
+	BPB_BYTES_PER_SECTOR		=	11,
+	BPB_SECTORS_PER_CLUSTER		=	13,
+	BPB_RESERVED_SECTORS		=	14,
+	BPB_NR_FATS			=	16,
+	BPB_ROOT_ENTRIES		=	17,
+	BPB_TOTAL_SECTORS16		=	19,
+	BPB_FAT_SECTORS16		=	22,
+	BPB_TOTAL_SECTORS32		=	32,
+	BPB_FAT_SECTORS32		=	36,
+	BPB_ROOT_CLUSTER		=	44,
+	BOOT_SIGNATURE			=	510,
+	/* master boot record partition table */
+	MBR_PARTITION_TABLE		=	0x1be,
+	MBR_PARTITION_ENTRY_SIZE	=	16,
+	MBR_NR_PARTITIONS		=	4,
+	MBR_PARTITION_TYPE		=	4,
+	MBR_PARTITION_START		=	8,
+
+	/* directory entry field offsets */
+	DIRENT_NAME			=	0,
+	DIRENT_ATTRIBUTES		=	11,
+	DIRENT_CREATION_DATE		=	16,
+	DIRENT_ACCESS_DATE		=	18,
+	DIRENT_CLUSTER_HIGH		=	20,
+	DIRENT_WRITE_DATE		=	24,
+	DIRENT_CLUSTER_LOW		=	26,
+	DIRENT_SIZE			=	28,
+	DIRENT_FREE			=	0xe5,
+	DIRENT_END			=	0,
+	/* a name starting with the free marker value is stored with this value instead */
+	DIRENT_KANJI_E5			=	0x05,
+
+	FAT_ATTR_READ_ONLY		=	0x01,
+	FAT_ATTR_VOLUME_ID		=	0x08,
+	FAT_ATTR_DIRECTORY		=	0x10,
+	FAT_ATTR_ARCHIVE		=	0x20,
+
+	/* there is no real time clock support, all files are dated 2018-01-01 */
+	FAT_DEFAULT_DATE		=	((2018 - 1980) << 9) | (1 << 5) | 1,
+
+	/* returned by 'fat_get()' on errors */
+	FAT_BAD_ENTRY			=	0xffffffff,
+
+	/* forth file i/o results */
+	IOR_SUCCESS			=	0,
+	IOR_FILE_IO			=	-37,
+	IOR_NONEXISTENT_FILE		=	-38,
+};
+
+static struct
+{
+	bool		mounted;
+	int		device;
+	/* the volume start sector on the device; all other sector numbers are relative to this */
+	uint32_t	first_sector;
+	/* 12, 16, or 32 */
+	int		type;
+	uint32_t	sectors_per_cluster;
+	uint32_t	cluster_bytes;
+	uint32_t	reserved_sectors;
+	uint32_t	nr_fats;
+	uint32_t	fat_sectors;
+	/* the fixed size root directory of fat12/16 volumes */
+	uint32_t	root_entries;
+	uint32_t	root_dir_sector;
+	/* the first cluster of the root directory of fat32 volumes */
+	uint32_t	root_cluster;
+	uint32_t	first_data_sector;
+	uint32_t	nr_clusters;
+	/* cluster allocation starts searching from here */
+	uint32_t	next_free;
+}
+volume __attribute__((section(".common-data")));
+
+static struct fat_file files[FAT_MAX_OPEN_FILES];
+
+static uint32_t le16(const uint8_t * p) { return p[0] | (p[1] << 8); }
+static uint32_t le32(const uint8_t * p) { return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24); }
+static void put_le16(uint8_t * p, uint32_t x) { p[0] = x; p[1] = x >> 8; }
+static void put_le32(uint8_t * p, uint32_t x) { p[0] = x; p[1] = x >> 8; p[2] = x >> 16; p[3] = x >> 24; }
+
+static int vol_read(uint32_t sector, uint32_t count, void * buffer)
+{
+	return bcache_read(volume.device, volume.first_sector + sector, count, buffer);
+}
+
+static int vol_write(uint32_t sector, uint32_t count, const void * buffer)
+{
+	return bcache_write(volume.device, volume.first_sector + sector, count, buffer);
+}
+
+static uint32_t cluster_sector(uint32_t cluster)
+{
+	return volume.first_data_sector + (cluster - 2) * volume.sectors_per_cluster;
+}
+
+static bool cluster_valid(uint32_t cluster)
+{
+	return cluster >= 2 && cluster < volume.nr_clusters + 2;
+}
+
+static uint32_t end_of_chain_mark(void)
+{
+	return volume.type == 12 ? 0xfff : volume.type == 16 ? 0xffff : 0x0fffffff;
+}
+
+/*
+ * file allocation table access
+ */
+
+static void fat_entry_location(uint32_t cluster, uint32_t * sector, uint32_t * offset)
+{
+uint32_t byte_offset;
+
+	if (volume.type == 12)
+		byte_offset = cluster + cluster / 2;
+	else
+		byte_offset = cluster * (volume.type / 8);
+	* sector = volume.reserved_sectors + byte_offset / FAT_SECTOR_SIZE;
+	* offset = byte_offset % FAT_SECTOR_SIZE;
+}
+
+static uint32_t fat_get(uint32_t cluster)
+{
+uint8_t data[2 * FAT_SECTOR_SIZE];
+uint32_t sector, offset, x;
+
+	fat_entry_location(cluster, & sector, & offset);
+	/* fat12 entries may straddle a sector boundary */
+	if (vol_read(sector, offset == FAT_SECTOR_SIZE - 1 ? 2 : 1, data))
+		return FAT_BAD_ENTRY;
+	switch (volume.type)
+	{
+		case 12: x = le16(data + offset); return (cluster & 1) ? x >> 4 : x & 0xfff;
+		case 16: return le16(data + offset);
+		default: return le32(data + offset) & 0x0fffffff;
+	}
+}
+
+/* updates an entry in all copies of the file allocation table */
+static int fat_set(uint32_t cluster, uint32_t value)
+{
+uint8_t data[2 * FAT_SECTOR_SIZE];
+uint32_t sector, offset, nr_sectors, x;
+int i;
+
+	fat_entry_location(cluster, & sector, & offset);
+	nr_sectors = offset == FAT_SECTOR_SIZE - 1 ? 2 : 1;
+	for (i = 0; i < volume.nr_fats; i ++, sector += volume.fat_sectors)
+	{
+		if (vol_read(sector, nr_sectors, data))
+			return -1;
+		switch (volume.type)
+		{
+			case 12:
+				x = le16(data + offset);
+				x = (cluster & 1) ? (x & 0x000f) | (value << 4) : (x & 0xf000) | (value & 0xfff);
+				put_le16(data + offset, x);
+				break;
+			case 16:
+				put_le16(data + offset, value);
+				break;
+			default:
+				/* the top four bits of fat32 entries are reserved, and must be preserved */
+				put_le32(data + offset, (le32(data + offset) & 0xf0000000) | (value & 0x0fffffff));
+				break;
+		}
+		if (vol_write(sector, nr_sectors, data))
+			return -1;
+	}
+	return 0;
+}
+
+/* returns the next cluster in a chain, or 0 at the end of the chain, and on errors */
+static uint32_t fat_next(uint32_t cluster)
+{
+uint32_t next = fat_get(cluster);
+
+	return cluster_valid(next) ? next : 0;
+}
+
+/* allocates a cluster, and links it after 'previous', if not zero; returns 0 if the volume is full */
+static uint32_t fat_alloc_cluster(uint32_t previous)
+{
+uint32_t i, cluster, x;
+
+	for (i = 0; i < volume.nr_clusters; i ++)
+	{
+		cluster = 2 + (volume.next_free + i) % volume.nr_clusters;
+		if ((x = fat_get(cluster)) == FAT_BAD_ENTRY)
+			return 0;
+		if (x)
+			continue;
+		if (fat_set(cluster, end_of_chain_mark()) || (previous && fat_set(previous, cluster)))
+			return 0;
+		volume.next_free = cluster - 2 + 1;
+		return cluster;
+	}
+	return 0;
+}
+
+static int fat_free_chain(uint32_t cluster)
+{
+uint32_t next;
+
+	for (; cluster_valid(cluster); cluster = next)
+	{
+		next = fat_get(cluster);
+		if (fat_set(cluster, 0))
+			return -1;
+		if (cluster - 2 < volume.next_free)
+			volume.next_free = cluster - 2;
+	}
+	return 0;
+}
+
+static int zero_cluster(uint32_t cluster)
+{
+static const uint8_t zero_sector[FAT_SECTOR_SIZE];
+int i;
+
+	for (i = 0; i < volume.sectors_per_cluster; i ++)
+		if (vol_write(cluster_sector(cluster) + i, 1, zero_sector))
+			return -1;
+	return 0;
+}
+
+/*
+ * cluster chain cache
+ */
+
+static void file_reset_chain_cache(struct fat_file * f)
+{
+	f->nr_extents = 0;
+	f->cursor_index = f->cursor_cluster = 0;
+	f->chain_length = 0;
+}
+
+/* returns the cluster holding the 'index'-th cluster of a file, or 0 if the chain is shorter;
+ * the end of the chain is remembered, so that looking past it does not read the file
+ * allocation table again - the clusters allocated for the file must reset it */
+static uint32_t file_cluster(struct fat_file * f, uint32_t index)
+{
+struct fat_extent * e;
+uint32_t n, cluster, next;
+int i;
+
+	if (!cluster_valid(f->first_cluster))
+		return 0;
+	if (!f->nr_extents)
+	{
+		f->extents[0] = (struct fat_extent) { .file_cluster = 0, .cluster = f->first_cluster, .length = 1, };
+		f->nr_extents = 1;
+	}
+	for (i = 0, e = f->extents; i < f->nr_extents; i ++, e ++)
+		if (index - e->file_cluster < e->length)
+			return e->cluster + index - e->file_cluster;
+	if (f->chain_length && index >= f->chain_length)
+		return 0;
+
+	/* walk the chain from the end of the extents, or from the cursor, if it is closer */
+	e = f->extents + f->nr_extents - 1;
+	n = e->file_cluster + e->length - 1;
+	cluster = e->cluster + e->length - 1;
+	if (f->cursor_index > n && f->cursor_index <= index)
+		n = f->cursor_index, cluster = f->cursor_cluster;
+	while (n < index)
+	{
+		if (!(next = fat_next(cluster)))
+		{
+			f->cursor_index = n;
+			f->cursor_cluster = cluster;
+			f->chain_length = n + 1;
+			return 0;
+		}
+		n ++;
+		/* extend the extents, while walking right past them */
+		if (n == e->file_cluster + e->length)
+		{
+			if (next == e->cluster + e->length)
+				e->length ++;
+			else if (f->nr_extents < FAT_MAX_EXTENTS)
+				* ++ e = (struct fat_extent) { .file_cluster = n, .cluster = next, .length = 1, }, f->nr_extents ++;
+		}
+		cluster = next;
+	}
+	f->cursor_index = n;
+	f->cursor_cluster = cluster;
+	return cluster;
+}
+
+/* locates a file position on the volume; 'run_bytes', unless null, is set to the number of bytes
+ * from the position that are consecutive on the volume, up to FAT_MAX_RUN_BYTES - that takes
+ * looking up the clusters following the position, so it is only asked for whole sector transfers;
+ * returns 0 on success */
+static int file_locate(struct fat_file * f, uint32_t position, uint32_t * sector, uint32_t * run_bytes)
+{
+uint32_t index = position / volume.cluster_bytes, offset = position % volume.cluster_bytes, cluster, n;
+
+	if (!(cluster = file_cluster(f, index)))
+		return -1;
+	* sector = cluster_sector(cluster) + offset / FAT_SECTOR_SIZE;
+	if (!run_bytes)
+		return 0;
+	for (n = volume.cluster_bytes - offset; n < FAT_MAX_RUN_BYTES && file_cluster(f, ++ index) == ++ cluster; n += volume.cluster_bytes)
+		;
+	* run_bytes = n;
+	return 0;
+}
+
+static int file_load_buffer(struct fat_file * f, uint32_t sector)
+{
+	if (f->buffer_valid && f->buffer_sector == sector)
+		return 0;
+	f->buffer_valid = false;
+	if (vol_read(sector, 1, f->buffer))
+		return -1;
+	f->buffer_sector = sector;
+	f->buffer_position = FAT_NO_POSITION;
+	f->buffer_valid = true;
+	return 0;
+}
+
+/*
+ * directories
+ */
+
+static void dir_open(struct fat_file * dir, uint32_t first_cluster)
+{
+	xmemset(dir, 0, sizeof * dir);
+	/* a zero cluster number in a '..' entry refers to the root directory */
+	dir->first_cluster = first_cluster ? first_cluster : (volume.type == 32 ? volume.root_cluster : 0);
+}
+
+static uint32_t dirent_cluster(const uint8_t * entry)
+{
+	return le16(entry + DIRENT_CLUSTER_LOW) | (volume.type == 32 ? le16(entry + DIRENT_CLUSTER_HIGH) << 16 : 0);
+}
+
+/* reads a directory entry; returns 1 on success, 0 past the end of the directory, -1 on errors */
+static int dir_read_entry(struct fat_file * dir, uint32_t index, uint8_t * entry, uint32_t * sector, uint32_t * offset)
+{
+uint32_t byte_offset = index * FAT_DIRENT_SIZE, cluster;
+
+	if (!dir->first_cluster)
+	{
+		if (index >= volume.root_entries)
+			return 0;
+		* sector = volume.root_dir_sector + byte_offset / FAT_SECTOR_SIZE;
+	}
+	else
+	{
+		if (!(cluster = file_cluster(dir, byte_offset / volume.cluster_bytes)))
+			return 0;
+		* sector = cluster_sector(cluster) + (byte_offset % volume.cluster_bytes) / FAT_SECTOR_SIZE;
+	}
+	* offset = byte_offset % FAT_SECTOR_SIZE;
+	if (file_load_buffer(dir, * sector))
+		return -1;
+	xmemcpy(entry, dir->buffer + * offset, FAT_DIRENT_SIZE);
+	return 1;
+}
+
+static bool names_equal(const uint8_t * a, const uint8_t * b)
+{
+int i;
+
+	for (i = 0; i < 11; i ++)
+		if (a[i] != b[i])
+			return false;
+	return true;
+}
+
+/* searches a directory for a short name; returns 1 if found, 0 if not found, -1 on errors */
+static int dir_lookup(struct fat_file * dir, const uint8_t * name, uint8_t * entry, uint32_t * sector, uint32_t * offset)
+{
+uint32_t i;
+int result;
+
+	for (i = 0; (result = dir_read_entry(dir, i, entry, sector, offset)) == 1; i ++)
+	{
+		if (entry[DIRENT_NAME] == DIRENT_END)
+			return 0;
+		/* long file name entries have the volume id attribute set */
+		if (entry[DIRENT_NAME] == DIRENT_FREE || (entry[DIRENT_ATTRIBUTES] & FAT_ATTR_VOLUME_ID))
+			continue;
+		if (names_equal(entry, name))
+			return 1;
+	}
+	return result;
+}
+
+/* adds a directory entry, extending the directory if needed; returns 0 on success */
+static int dir_add_entry(struct fat_file * dir, const uint8_t * name, int attributes, uint32_t * sector, uint32_t * offset)
+{
+uint8_t entry[FAT_DIRENT_SIZE];
+uint32_t i, cluster;
+int result;
+
+	for (i = 0; ; i ++)
+	{
+		if ((result = dir_read_entry(dir, i, entry, sector, offset)) == -1)
+			return -1;
+		if (!result)
+		{
+			/* the directory is full; the fixed size root directory can not be extended */
+			if (!dir->first_cluster)
+				return -1;
+			cluster = file_cluster(dir, i * FAT_DIRENT_SIZE / volume.cluster_bytes - 1);
+			if (!(cluster = fat_alloc_cluster(cluster)) || zero_cluster(cluster))
+				return -1;
+			dir->chain_length = 0;
+			i --;
+			continue;
+		}
+		if (entry[DIRENT_NAME] == DIRENT_END || entry[DIRENT_NAME] == DIRENT_FREE)
+			break;
+	}
+	xmemset(entry, 0, sizeof entry);
+	xmemcpy(entry, name, 11);
+	entry[DIRENT_ATTRIBUTES] = attributes;
+	put_le16(entry + DIRENT_CREATION_DATE, FAT_DEFAULT_DATE);
+	put_le16(entry + DIRENT_ACCESS_DATE, FAT_DEFAULT_DATE);
+	put_le16(entry + DIRENT_WRITE_DATE, FAT_DEFAULT_DATE);
+	/* the sector is in the directory buffer, after reading the entry */
+	xmemcpy(dir->buffer + * offset, entry, FAT_DIRENT_SIZE);
+	return vol_write(* sector, 1, dir->buffer);
+}
+
+/* converts a path component to the directory entry name form; returns false for
+ * names that are not valid short names */
+static bool short_name(const char * s, int length, uint8_t * name)
+{
+static const char invalid_characters[] = "\"*+,/:;<=>?[\\]|";
+int i, j;
+const char * p;
+
+	xmemset(name, ' ', 11);
+	if ((length == 1 || length == 2) && s[0] == '.' && s[length - 1] == '.')
+	{
+		name[0] = name[length - 1] = '.';
+		return true;
+	}
+	for (i = 0; i < length; i ++)
+	{
+		if (s[i] < ' ')
+			return false;
+		for (p = invalid_characters; * p; p ++)
+			if (s[i] == * p)
+				return false;
+	}
+	for (i = j = 0; i < length && s[i] != '.'; i ++)
+	{
+		if (j == 8)
+			return false;
+		name[j ++] = (s[i] >= 'a' && s[i] <= 'z') ? s[i] - 'a' + 'A' : s[i];
+	}
+	if (!j)
+		return false;
+	if (i ++ < length)
+		for (j = 8; i < length; i ++)
+		{
+			if (j == 11 || s[i] == '.')
+				return false;
+			name[j ++] = (s[i] >= 'a' && s[i] <= 'z') ? s[i] - 'a' + 'A' : s[i];
+		}
+	if (name[0] == DIRENT_FREE)
+		name[0] = DIRENT_KANJI_E5;
+	return true;
+}
+
+static bool is_separator(char c) { return c == '/' || c == '\\'; }
+
+/* opens the directory holding the last component of a path, and converts the
+ * last component to the directory entry name form; returns 0 on success */
+static int resolve_parent(const char * path, int length, struct fat_file * dir, uint8_t * name)
+{
+uint8_t entry[FAT_DIRENT_SIZE];
+uint32_t sector, offset;
+int n, i;
+
+	dir_open(dir, 0);
+	while (1)
+	{
+		for (; length && is_separator(* path); path ++, length --)
+			;
+		for (n = 0; n < length && !is_separator(path[n]); n ++)
+			;
+		if (!n || !short_name(path, n, name))
+			return -1;
+		path += n;
+		length -= n;
+		for (i = 0; i < length && is_separator(path[i]); i ++)
+			;
+		if (i == length)
+			return 0;
+		if (dir_lookup(dir, name, entry, & sector, & offset) != 1 || !(entry[DIRENT_ATTRIBUTES] & FAT_ATTR_DIRECTORY))
+			return -1;
+		dir_open(dir, dirent_cluster(entry));
+	}
+}
+
+/*
+ * files
+ */
+
+static struct fat_file * get_file(int handle)
+{
+	if (handle < 0 || handle >= FAT_MAX_OPEN_FILES || !files[handle].in_use || !volume.mounted)
+		return 0;
+	return files + handle;
+}
+
+static int file_update_dirent(struct fat_file * f)
+{
+uint8_t data[FAT_SECTOR_SIZE], * entry = data + f->dirent_offset;
+
+	if (!f->dirty)
+		return 0;
+	if (vol_read(f->dirent_sector, 1, data))
+		return -1;
+	put_le16(entry + DIRENT_CLUSTER_LOW, f->first_cluster);
+	if (volume.type == 32)
+		put_le16(entry + DIRENT_CLUSTER_HIGH, f->first_cluster >> 16);
+	put_le32(entry + DIRENT_SIZE, f->size);
+	put_le16(entry + DIRENT_WRITE_DATE, FAT_DEFAULT_DATE);
+	if (vol_write(f->dirent_sector, 1, data))
+		return -1;
+	f->dirty = false;
+	return 0;
+}
+
+int fat_open(const char * path, int length, int flags)
+{
+struct fat_file dir, * f;
+uint8_t name[11], entry[FAT_DIRENT_SIZE];
+uint32_t sector, offset;
+int handle, result;
+
+	if (!volume.mounted)
+		return -1;
+	for (handle = 0; handle < FAT_MAX_OPEN_FILES && files[handle].in_use; handle ++)
+		;
+	if (handle == FAT_MAX_OPEN_FILES || resolve_parent(path, length, & dir, name))
+		return -1;
+	if ((result = dir_lookup(& dir, name, entry, & sector, & offset)) == -1)
+		return -1;
+	if (!result)
+	{
+		if (!(flags & FAT_CREATE) || dir_add_entry(& dir, name, FAT_ATTR_ARCHIVE, & sector, & offset))
+			return -1;
+		xmemset(entry, 0, sizeof entry);
+	}
+	else if ((entry[DIRENT_ATTRIBUTES] & FAT_ATTR_DIRECTORY)
+			|| ((flags & (FAT_WRITE | FAT_CREATE)) && (entry[DIRENT_ATTRIBUTES] & FAT_ATTR_READ_ONLY)))
+		return -1;
+
+	f = files + handle;
+	xmemset(f, 0, sizeof * f);
+	f->in_use = true;
+	f->writable = flags & (FAT_WRITE | FAT_CREATE);
+	f->first_cluster = dirent_cluster(entry);
+	f->size = le32(entry + DIRENT_SIZE);
+	f->dirent_sector = sector;
+	f->dirent_offset = offset;
+	if (result && (flags & FAT_CREATE) && (f->size || f->first_cluster))
+	{
+		/* truncate an existing file */
+		if (fat_free_chain(f->first_cluster))
+		{
+			f->in_use = false;
+			return -1;
+		}
+		f->first_cluster = f->size = 0;
+		f->dirty = true;
+		file_update_dirent(f);
+	}
+	return handle;
+}
+
+int fat_close(int handle)
+{
+struct fat_file * f = get_file(handle);
+int result;
+
+	if (!f)
+		return -1;
+	result = file_update_dirent(f);
+	f->in_use = false;
+	return result;
+}
+
+int fat_read(int handle, void * buffer, uint32_t count)
+{
+struct fat_file * f = get_file(handle);
+uint32_t sector, run_bytes, offset, n, done;
+uint8_t * p = buffer;
+
+	if (!f)
+		return -1;
+	if (f->position >= f->size)
+		return 0;
+	if (count > f->size - f->position)
+		count = f->size - f->position;
+	for (done = 0; done < count; done += n, p += n, f->position += n)
+	{
+		offset = f->position % FAT_SECTOR_SIZE;
+		n = count - done;
+		if (!offset && n >= FAT_SECTOR_SIZE)
+		{
+			/* whole sectors are read directly into the destination buffer */
+			if (file_locate(f, f->position, & sector, & run_bytes))
+				return -1;
+			if (n > run_bytes)
+				n = run_bytes;
+			n &= ~ (FAT_SECTOR_SIZE - 1);
+			if (vol_read(sector, n / FAT_SECTOR_SIZE, p))
+				return -1;
+		}
+		else
+		{
+			if (n > FAT_SECTOR_SIZE - offset)
+				n = FAT_SECTOR_SIZE - offset;
+			/* when reading a few bytes at a time, the sector is usually the one in the
+			 * buffer already, and the cluster chain is not looked up at all */
+			if (!f->buffer_valid || f->buffer_position != f->position - offset)
+			{
+				if (file_locate(f, f->position, & sector, 0) || file_load_buffer(f, sector))
+					return -1;
+				f->buffer_position = f->position - offset;
+			}
+			xmemcpy(p, f->buffer + offset, n);
+		}
+	}
+	return count;
+}
+
+/* makes sure that the chain of a file reaches cluster 'index', allocating clusters if needed;
+ * the clusters allocated are zeroed, unless they are wholly overwritten by the write
+ * of the bytes from 'start' to 'end', so that they do not expose stale volume contents */
+static int file_extend(struct fat_file * f, uint32_t index, uint32_t start, uint32_t end)
+{
+uint32_t i, cluster;
+
+	for (i = 0; i <= index; i ++)
+	{
+		if (file_cluster(f, i))
+			continue;
+		if (!(cluster = fat_alloc_cluster(i ? file_cluster(f, i - 1) : 0)))
+			return -1;
+		f->chain_length = 0;
+		if (!i)
+		{
+			f->first_cluster = cluster;
+			f->dirty = true;
+			file_reset_chain_cache(f);
+		}
+		if ((uint64_t) i * volume.cluster_bytes < start || (uint64_t) (i + 1) * volume.cluster_bytes > end)
+		{
+			if (zero_cluster(cluster))
+				return -1;
+			if (f->buffer_valid && f->buffer_sector - cluster_sector(cluster) < volume.sectors_per_cluster)
+				f->buffer_valid = false;
+		}
+	}
+	return 0;
+}
+
+/* zeroes the bytes of a file from 'from' to 'to', which must be in clusters already allocated */
+static int file_zero(struct fat_file * f, uint32_t from, uint32_t to)
+{
+uint32_t sector, offset, n;
+
+	for (; from < to; from += n)
+	{
+		if (file_locate(f, from, & sector, 0) || file_load_buffer(f, sector))
+			return -1;
+		offset = from % FAT_SECTOR_SIZE;
+		f->buffer_position = from - offset;
+		n = FAT_SECTOR_SIZE - offset;
+		if (n > to - from)
+			n = to - from;
+		xmemset(f->buffer + offset, 0, n);
+		if (vol_write(sector, 1, f->buffer))
+			return -1;
+	}
+	return 0;
+}
+
+int fat_write(int handle, const void * buffer, uint32_t count)
+{
+struct fat_file * f = get_file(handle);
+uint32_t sector, run_bytes, offset, n, done;
+const uint8_t * p = buffer;
+
+	if (!f || !f->writable)
+		return -1;
+	/* when writing past the end of the file, the rest of its last cluster - up to the
+	 * write position - is zeroed; the clusters allocated for the gap are zeroed when allocated */
+	if (count && f->position > f->size && f->size % volume.cluster_bytes)
+	{
+		n = f->size - f->size % volume.cluster_bytes + volume.cluster_bytes;
+		if (file_zero(f, f->size, (f->position < n) ? f->position : n))
+			return -1;
+	}
+	for (done = 0; done < count; done += n, p += n, f->position += n)
+	{
+		if (file_extend(f, f->position / volume.cluster_bytes, f->position, f->position + (count - done)))
+			return -1;
+		offset = f->position % FAT_SECTOR_SIZE;
+		n = count - done;
+		if (!offset && n >= FAT_SECTOR_SIZE)
+		{
+			if (file_locate(f, f->position, & sector, & run_bytes))
+				return -1;
+			if (n > run_bytes)
+				n = run_bytes;
+			n &= ~ (FAT_SECTOR_SIZE - 1);
+			if (vol_write(sector, n / FAT_SECTOR_SIZE, p))
+				return -1;
+			if (f->buffer_valid && f->buffer_sector - sector < n / FAT_SECTOR_SIZE)
+				f->buffer_valid = false;
+		}
+		else
+		{
+			if (n > FAT_SECTOR_SIZE - offset)
+				n = FAT_SECTOR_SIZE - offset;
+			/* partial sector writes go through the file buffer */
+			if (file_locate(f, f->position, & sector, 0) || file_load_buffer(f, sector))
+				return -1;
+			f->buffer_position = f->position - offset;
+			xmemcpy(f->buffer + offset, p, n);
+			if (vol_write(sector, 1, f->buffer))
+				return -1;
+		}
+		if (f->position + n > f->size)
+		{
+			f->size = f->position + n;
+			f->dirty = true;
+		}
+	}
+	return count;
+}
+
+int fat_seek(int handle, uint32_t position)
+{
+struct fat_file * f = get_file(handle);
+
+	if (!f)
+		return -1;
+	f->position = position;
+	return 0;
+}
+
+int fat_tell(int handle, uint32_t * position)
+{
+struct fat_file * f = get_file(handle);
+
+	if (!f)
+		return -1;
+	* position = f->position;
+	return 0;
+}
+
+int fat_size(int handle, uint32_t * size)
+{
+struct fat_file * f = get_file(handle);
+
+	if (!f)
+		return -1;
+	* size = f->size;
+	return 0;
+}
+
+int fat_flush(int handle)
+{
+struct fat_file * f = get_file(handle);
+
+	if (!f || file_update_dirent(f))
+		return -1;
+	return bcache_sync(volume.device);
+}
+
+int fat_delete(const char * path, int length)
+{
+struct fat_file dir;
+uint8_t name[11], entry[FAT_DIRENT_SIZE];
+uint32_t sector, offset;
+int i;
+
+	if (!volume.mounted || resolve_parent(path, length, & dir, name) || dir_lookup(& dir, name, entry, & sector, & offset) != 1)
+		return -1;
+	if (entry[DIRENT_ATTRIBUTES] & (FAT_ATTR_DIRECTORY | FAT_ATTR_READ_ONLY))
+		return -1;
+	for (i = 0; i < FAT_MAX_OPEN_FILES; i ++)
+		if (files[i].in_use && files[i].dirent_sector == sector && files[i].dirent_offset == offset)
+			/* the file is open */
+			return -1;
+	dir.buffer[offset] = DIRENT_FREE;
+	if (vol_write(sector, 1, dir.buffer))
+		return -1;
+	return fat_free_chain(dirent_cluster(entry));
+}
+
+/*
+ * mounting
+ */
+
+static bool parse_boot_sector(const uint8_t * bs)
+{
+uint32_t bytes_per_sector = le16(bs + BPB_BYTES_PER_SECTOR), total_sectors, root_dir_sectors, data_sectors;
+
+	volume.sectors_per_cluster = bs[BPB_SECTORS_PER_CLUSTER];
+	volume.reserved_sectors = le16(bs + BPB_RESERVED_SECTORS);
+	volume.nr_fats = bs[BPB_NR_FATS];
+	volume.root_entries = le16(bs + BPB_ROOT_ENTRIES);
+	volume.fat_sectors = le16(bs + BPB_FAT_SECTORS16);
+	if (!volume.fat_sectors)
+		volume.fat_sectors = le32(bs + BPB_FAT_SECTORS32);
+	total_sectors = le16(bs + BPB_TOTAL_SECTORS16);
+	if (!total_sectors)
+		total_sectors = le32(bs + BPB_TOTAL_SECTORS32);
+	/* only volumes with sectors the size of the buffer cache sectors are supported */
+	if (bytes_per_sector != FAT_SECTOR_SIZE || !volume.sectors_per_cluster
+			|| (volume.sectors_per_cluster & (volume.sectors_per_cluster - 1))
+			|| !volume.reserved_sectors || !volume.nr_fats || !volume.fat_sectors)
+		return false;
+	root_dir_sectors = (volume.root_entries * FAT_DIRENT_SIZE + FAT_SECTOR_SIZE - 1) / FAT_SECTOR_SIZE;
+	volume.root_dir_sector = volume.reserved_sectors + volume.nr_fats * volume.fat_sectors;
+	volume.first_data_sector = volume.root_dir_sector + root_dir_sectors;
+	if (total_sectors <= volume.first_data_sector)
+		return false;
+	data_sectors = total_sectors - volume.first_data_sector;
+	volume.nr_clusters = data_sectors / volume.sectors_per_cluster;
+	volume.cluster_bytes = volume.sectors_per_cluster * FAT_SECTOR_SIZE;
+	/* the fat type is determined by the number of clusters alone */
+	volume.type = volume.nr_clusters < 4085 ? 12 : volume.nr_clusters < 65525 ? 16 : 32;
+	volume.root_cluster = 0;
+	if (volume.type == 32)
+	{
+		volume.root_cluster = le32(bs + BPB_ROOT_CLUSTER);
+		volume.root_entries = 0;
+		if (!cluster_valid(volume.root_cluster))
+			return false;
+	}
+	volume.next_free = 0;
+	return true;
+}
+
+int fat_mount(int device_number)
+{
+uint8_t sector[FAT_SECTOR_SIZE];
+const uint8_t * partition;
+int i;
+
+	for (i = 0; i < FAT_MAX_OPEN_FILES; i ++)
+		files[i].in_use = false;
+	volume.mounted = false;
+	volume.device = device_number;
+	volume.first_sector = 0;
+	if (vol_read(0, 1, sector) || le16(sector + BOOT_SIGNATURE) != 0xaa55)
+		return -1;
+	if (!parse_boot_sector(sector))
+	{
+		/* not a fat volume, look for a fat partition in a master boot record partition table */
+		for (i = 0; i < MBR_NR_PARTITIONS; i ++)
+		{
+			partition = sector + MBR_PARTITION_TABLE + i * MBR_PARTITION_ENTRY_SIZE;
+			switch (partition[MBR_PARTITION_TYPE])
+			{
+				case 0x01: case 0x04: case 0x06: case 0x0b: case 0x0c: case 0x0e:
+					break;
+				default:
+					continue;
+			}
+			break;
+		}
+		if (i == MBR_NR_PARTITIONS)
+			return -1;
+		volume.first_sector = le32(partition + MBR_PARTITION_START);
+		if (vol_read(0, 1, sector) || !parse_boot_sector(sector))
+			return -1;
+	}
+	volume.mounted = true;
+	return 0;
+}
+
+void init_fat(void)
+{
+int i;
+
+	for (i = 0; i < blockdev_count(); i ++)
+		if (!fat_mount(i))
+		{
+			print_str(blockdev_get(i)->name);
+			print_str(volume.type == 12 ? ": fat12 volume mounted\n" : volume.type == 16 ? ": fat16 volume mounted\n" : ": fat32 volume mounted\n");
+			return;
+		}
+}
+
+/*
+ * forth file access words
+ */
+
+static void do_open_file(void)
+{
+/* ( c-addr u fam -- fileid ior) */
+int flags = sf_pop(), length = sf_pop(), handle = fat_open((const char *) sf_pop(), length, flags & ~ FAT_CREATE);
+
+	sf_push(handle);
+	sf_push(handle == -1 ? IOR_NONEXISTENT_FILE : IOR_SUCCESS);
+}
+
+static void do_create_file(void)
+{
+/* ( c-addr u fam -- fileid ior) */
+int flags = sf_pop(), length = sf_pop(), handle = fat_open((const char *) sf_pop(), length, flags | FAT_CREATE);
+
+	sf_push(handle);
+	sf_push(handle == -1 ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_close_file(void) { /* ( fileid -- ior) */ sf_push(fat_close(sf_pop()) ? IOR_FILE_IO : IOR_SUCCESS); }
+
+static void do_read_file(void)
+{
+/* ( c-addr u1 fileid -- u2 ior) */
+int handle = sf_pop(), count = sf_pop(), result = fat_read(handle, (void *) sf_pop(), count);
+
+	sf_push(result == -1 ? 0 : result);
+	sf_push(result == -1 ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_read_line(void)
+{
+/* ( c-addr u1 fileid -- u2 flag ior) */
+int handle = sf_pop(), count = sf_pop(), n = 0, result;
+char * p = (char *) sf_pop(), c;
+
+	while (n < count)
+	{
+		if ((result = fat_read(handle, & c, 1)) == -1)
+		{
+			sf_push(n);
+			sf_push(0);
+			sf_push(IOR_FILE_IO);
+			return;
+		}
+		if (!result)
+		{
+			/* the end of the file */
+			sf_push(n);
+			sf_push(n ? -1 : 0);
+			sf_push(IOR_SUCCESS);
+			return;
+		}
+		if (c == '\n')
+			break;
+		if (c != '\r')
+			p[n ++] = c;
+	}
+	sf_push(n);
+	sf_push(-1);
+	sf_push(IOR_SUCCESS);
+}
+
+static void do_write_file(void)
+{
+/* ( c-addr u fileid -- ior) */
+int handle = sf_pop(), count = sf_pop();
+
+	sf_push(fat_write(handle, (void *) sf_pop(), count) == count ? IOR_SUCCESS : IOR_FILE_IO);
+}
+
+static void do_write_line(void)
+{
+/* ( c-addr u fileid -- ior) */
+int handle = sf_pop(), count = sf_pop();
+
+	sf_push(fat_write(handle, (void *) sf_pop(), count) == count && fat_write(handle, "\n", 1) == 1 ? IOR_SUCCESS : IOR_FILE_IO);
+}
+
+static void do_file_position(void)
+{
+/* ( fileid -- ud ior) */
+uint32_t position = 0;
+int result = fat_tell(sf_pop(), & position);
+
+	sf_push(position);
+	sf_push(0);
+	sf_push(result ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_reposition_file(void)
+{
+/* ( ud fileid -- ior) */
+int handle = sf_pop(), high = sf_pop(), low = sf_pop();
+
+	sf_push(high || fat_seek(handle, low) ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_file_size(void)
+{
+/* ( fileid -- ud ior) */
+uint32_t size = 0;
+int result = fat_size(sf_pop(), & size);
+
+	sf_push(size);
+	sf_push(0);
+	sf_push(result ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_delete_file(void)
+{
+/* ( c-addr u -- ior) */
+int length = sf_pop();
+
+	sf_push(fat_delete((const char *) sf_pop(), length) ? IOR_FILE_IO : IOR_SUCCESS);
+}
+
+static void do_flush_file(void) { /* ( fileid -- ior) */ sf_push(fat_flush(sf_pop()) ? IOR_FILE_IO : IOR_SUCCESS); }
+static void do_read_only(void) { /* ( -- fam) */ sf_push(FAT_READ); }
+static void do_write_only(void) { /* ( -- fam) */ sf_push(FAT_WRITE); }
+static void do_read_write(void) { /* ( -- fam) */ sf_push(FAT_READ | FAT_WRITE); }
+/* files are always binary */
+static void do_bin(void) { /* ( fam1 -- fam2) */ }
+static void do_fat_mount(void) { /* ( device -- t=success|f=failure) */ sf_push(fat_mount(sf_pop()) ? 0 : -1); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"open-file",		do_open_file),
+	MKWORD(custom_dict,	__COUNTER__,	"create-file",			do_create_file),
+	MKWORD(custom_dict,	__COUNTER__,	"close-file",			do_close_file),
+	MKWORD(custom_dict,	__COUNTER__,	"read-file",			do_read_file),
+	MKWORD(custom_dict,	__COUNTER__,	"read-line",			do_read_line),
+	MKWORD(custom_dict,	__COUNTER__,	"write-file",			do_write_file),
+	MKWORD(custom_dict,	__COUNTER__,	"write-line",			do_write_line),
+	MKWORD(custom_dict,	__COUNTER__,	"file-position",		do_file_position),
+	MKWORD(custom_dict,	__COUNTER__,	"reposition-file",		do_reposition_file),
+	MKWORD(custom_dict,	__COUNTER__,	"file-size",			do_file_size),
+	MKWORD(custom_dict,	__COUNTER__,	"delete-file",			do_delete_file),
+	MKWORD(custom_dict,	__COUNTER__,	"flush-file",			do_flush_file),
+	MKWORD(custom_dict,	__COUNTER__,	"r/o",				do_read_only),
+	MKWORD(custom_dict,	__COUNTER__,	"w/o",				do_write_only),
+	MKWORD(custom_dict,	__COUNTER__,	"r/w",				do_read_write),
+	MKWORD(custom_dict,	__COUNTER__,	"bin",				do_bin),
+	MKWORD(custom_dict,	__COUNTER__,	"fat-mount",			do_fat_mount),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
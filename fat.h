@@ -0,0 +1,111 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __FAT_H__
+#define __FAT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	FAT_SECTOR_SIZE			=	512,
+	FAT_DIRENT_SIZE			=	32,
+	/* maximum number of files open at the same time, per kernel process */
+	FAT_MAX_OPEN_FILES		=	8,
+	/* number of runs of consecutive clusters of a file's cluster chain, remembered
+	 * when the chain is walked; a file not fragmented in more runs than this is
+	 * accessed without reading the file allocation table again */
+	FAT_MAX_EXTENTS			=	16,
+	/* maximum number of bytes transferred by a single device access */
+	FAT_MAX_RUN_BYTES		=	64 * 1024,
+	FAT_NO_POSITION			=	0xffffffff,
+
+	/* file open flags; these are also the forth file access method values */
+	FAT_READ			=	1 << 0,
+	FAT_WRITE			=	1 << 1,
+	/* creates the file if it does not exist, truncates it if it does */
+	FAT_CREATE			=	1 << 2,
+};
+
+/* a run of consecutive clusters in a file's cluster chain */
+struct fat_extent
+{
+	/* the index, in the file, of the first cluster of the run */
+	uint32_t	file_cluster;
+	uint32_t	cluster;
+	uint32_t	length;
+};
+
+/* an open file, or a directory being searched */
+struct fat_file
+{
+	bool		in_use;
+	bool		writable;
+	/* true if the size, or first cluster, have changed, and the directory entry must be updated */
+	bool		dirty;
+	/* zero for empty files, and for the fixed size root directory of fat12/16 volumes */
+	uint32_t	first_cluster;
+	uint32_t	size;
+	uint32_t	position;
+	/* location of the directory entry of the file */
+	uint32_t	dirent_sector;
+	uint32_t	dirent_offset;
+
+	/* cluster chain cache - the extents cover the start of the chain, the
+	 * cursor is the last position reached when walking the chain past them */
+	struct fat_extent	extents[FAT_MAX_EXTENTS];
+	int		nr_extents;
+	uint32_t	cursor_index;
+	uint32_t	cursor_cluster;
+	/* the number of clusters in the chain, once a walk has reached its end, zero before */
+	uint32_t	chain_length;
+
+	/* the sector last accessed by a transfer of a part of a sector, and its position
+	 * in the file, FAT_NO_POSITION if that is not known */
+	bool		buffer_valid;
+	uint32_t	buffer_sector;
+	uint32_t	buffer_position;
+	uint8_t		buffer[FAT_SECTOR_SIZE];
+};
+
+/* mounts the first fat volume found on the block devices */
+void init_fat(void);
+/* mounts the fat volume on a block device - either the whole device, or the
+ * first fat partition of a device with a master boot record; returns 0 on success */
+int fat_mount(int device_number);
+/* paths are absolute, with '/' or '\' separators, file names are 8.3 short names;
+ * returns a file handle, or -1 on failure */
+int fat_open(const char * path, int length, int flags);
+int fat_close(int handle);
+/* return the number of bytes transferred, or -1 on failure */
+int fat_read(int handle, void * buffer, uint32_t count);
+int fat_write(int handle, const void * buffer, uint32_t count);
+/* positions past the end of a file are allowed, writing there extends the file */
+int fat_seek(int handle, uint32_t position);
+int fat_tell(int handle, uint32_t * position);
+int fat_size(int handle, uint32_t * size);
+/* updates the file's directory entry, and syncs the buffer cache */
+int fat_flush(int handle);
+int fat_delete(const char * path, int length);
+
+#endif /* __FAT_H__ */
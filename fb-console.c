@@ -0,0 +1,293 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* vbe linear frame buffer console; the kernel initialization code ('kinit.s')
+ * sets a 32 bits per pixel vbe 2.0 graphics mode, and leaves the mode information
+ * and the bios 8x16 font in low memory. Characters are drawn from expanded
+ * glyph rows - for each of the few character attributes in use, every one of the
+ * 256 possible glyph row bit patterns is expanded in advance to 8 pixels, so drawing
+ * a glyph is just 16 copies of 32 bytes. The frame buffer is never read back
+ * (reads from video memory are very slow), instead, a shadow copy of the displayed
+ * character cells is kept, and only cells that have changed are redrawn */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "constants.h"
+#include "pgtable.h"
+#include "frame-alloc.h"
+#include "fb-console.h"
+
+/* boot information left by 'kinit.s'; see 'constants.s' */
+struct vbe_boot_info
+{
+	uint32_t	signature;
+	uint32_t	lfb_address;
+	uint16_t	width;
+	uint16_t	height;
+	/* bytes per scanline */
+	uint16_t	pitch;
+	uint16_t	bits_per_pixel;
+	uint16_t	mode;
+};
+
+/* eight expanded pixels, a glyph row */
+struct pixel_row
+{
+	uint32_t	pixels[FB_GLYPH_WIDTH];
+};
+
+struct glyph_cache_entry
+{
+	/* character attributes for which the rows are expanded, -1 if the entry is unused */
+	int		attributes;
+	struct pixel_row	(* rows)[256];
+};
+
+static struct
+{
+	bool		active;
+	uint32_t	* lfb;
+	int		width, height;
+	/* in pixels */
+	int		pitch;
+	int		rows, columns;
+	uint8_t		* font;
+	/* the character cells currently displayed */
+	struct video_memory	* shadow;
+	struct glyph_cache_entry	glyph_cache[FB_GLYPH_CACHE_ENTRIES];
+	/* next glyph cache entry to replace */
+	int		next_victim;
+}
+fb __attribute__((section(".common-data")));
+
+/* the standard vga text mode palette */
+static const uint32_t vga_palette[16] =
+{
+	0x000000, 0x0000aa, 0x00aa00, 0x00aaaa, 0xaa0000, 0xaa00aa, 0xaa5500, 0xaaaaaa,
+	0x555555, 0x5555ff, 0x55ff55, 0x55ffff, 0xff5555, 0xff55ff, 0xffff55, 0xffffff,
+};
+
+static struct pixel_row (* expanded_glyph_rows(uint8_t attributes))[256]
+{
+int i, j, bits;
+uint32_t fg, bg;
+struct glyph_cache_entry * e;
+
+	for (i = 0; i < FB_GLYPH_CACHE_ENTRIES; i ++)
+		if (fb.glyph_cache[i].attributes == attributes)
+			return fb.glyph_cache[i].rows;
+	e = fb.glyph_cache + fb.next_victim;
+	fb.next_victim = (fb.next_victim + 1) % FB_GLYPH_CACHE_ENTRIES;
+
+	e->attributes = attributes;
+	fg = vga_palette[attributes & 15];
+	bg = vga_palette[(attributes >> 4) & 7];
+	for (bits = 0; bits < 256; bits ++)
+		for (i = 0, j = 0x80; i < FB_GLYPH_WIDTH; i ++, j >>= 1)
+			(* e->rows)[bits].pixels[i] = (bits & j) ? fg : bg;
+	return e->rows;
+}
+
+static void draw_glyph(int row, int column, uint8_t character, uint8_t attributes)
+{
+int i;
+struct pixel_row (* rows)[256] = expanded_glyph_rows(attributes);
+struct pixel_row * p = (struct pixel_row *) (fb.lfb + row * FB_GLYPH_HEIGHT * fb.pitch + column * FB_GLYPH_WIDTH);
+uint8_t * glyph = fb.font + character * FB_GLYPH_HEIGHT;
+
+	for (i = 0; i < FB_GLYPH_HEIGHT; i ++, p = (struct pixel_row *) ((uint32_t *) p + fb.pitch))
+		* p = (* rows)[glyph[i]];
+}
+
+void fb_console_put_cell(int row, int column, uint8_t character, uint8_t attributes)
+{
+struct video_memory * s;
+
+	if (!fb.active || row >= fb.rows || column >= fb.columns)
+		return;
+	s = fb.shadow + row * fb.columns + column;
+	if (s->character == character && s->attributes == attributes)
+		return;
+	s->character = character;
+	s->attributes = attributes;
+	draw_glyph(row, column, character, attributes);
+}
+
+void fb_console_update(struct video_memory cells[][CONSOLE_MAX_COLUMNS], int first_row, int last_row)
+{
+int i, j;
+
+	if (last_row >= fb.rows)
+		last_row = fb.rows - 1;
+	for (i = first_row; i <= last_row; i ++)
+		for (j = 0; j < fb.columns; j ++)
+			fb_console_put_cell(i, j, cells[i][j].character, cells[i][j].attributes);
+}
+
+bool fb_console_init(int * rows, int * columns)
+{
+struct vbe_boot_info * info = (struct vbe_boot_info *) VBE_BOOT_INFO_PHYSICAL_ADDRESS;
+int i;
+
+	if (info->signature != VBE_BOOT_INFO_SIGNATURE || info->bits_per_pixel != 32)
+		return false;
+	fb.width = info->width;
+	fb.height = info->height;
+	fb.pitch = info->pitch / sizeof(uint32_t);
+	fb.rows = fb.height / FB_GLYPH_HEIGHT;
+	fb.columns = fb.width / FB_GLYPH_WIDTH;
+	if (fb.rows > CONSOLE_MAX_ROWS)
+		fb.rows = CONSOLE_MAX_ROWS;
+	if (fb.columns > CONSOLE_MAX_COLUMNS)
+		fb.columns = CONSOLE_MAX_COLUMNS;
+
+	/* the frame buffer is mapped cacheable, the memory type range registers, as
+	 * programmed by the bios, normally make it uncacheable or write-combining */
+	if (!(fb.lfb = mem_map_mmio_region(info->lfb_address, info->pitch * fb.height, false)))
+		return false;
+	/* copy the font and the shadow cells to extended memory, so that they are shared by all kernel processes */
+	if (!(fb.font = frame_alloc(256 * FB_GLYPH_HEIGHT / FRAME_SIZE)))
+		return false;
+	xmemcpy(fb.font, (void *) VBE_FONT_PHYSICAL_ADDRESS, 256 * FB_GLYPH_HEIGHT);
+	if (!(fb.shadow = frame_alloc((fb.rows * fb.columns * sizeof * fb.shadow + FRAME_SIZE - 1) / FRAME_SIZE)))
+		return false;
+	for (i = 0; i < FB_GLYPH_CACHE_ENTRIES; i ++)
+	{
+		fb.glyph_cache[i].attributes = -1;
+		if (!(fb.glyph_cache[i].rows = frame_alloc(sizeof * fb.glyph_cache[i].rows / FRAME_SIZE)))
+			return false;
+	}
+	/* the shadow cells are all zeroes, which is a black character on a black background - clear the screen to match */
+	for (i = 0; i < fb.height; i ++)
+		xmemset(fb.lfb + i * fb.pitch, 0, fb.width * sizeof(uint32_t));
+
+	fb.active = true;
+	* rows = fb.rows;
+	* columns = fb.columns;
+	return true;
+}
+
+/*
+ * graphics primitives
+ */
+
+static void put_pixel(int x, int y, uint32_t color)
+{
+	if ((unsigned) x < fb.width && (unsigned) y < fb.height)
+		fb.lfb[y * fb.pitch + x] = color;
+}
+
+static void fill_rect(int x, int y, int w, int h, uint32_t color)
+{
+uint32_t * p;
+int d0, d1;
+
+	if (x < 0)
+		w += x, x = 0;
+	if (y < 0)
+		h += y, y = 0;
+	if (x + w > fb.width)
+		w = fb.width - x;
+	if (y + h > fb.height)
+		h = fb.height - y;
+	if (w <= 0 || h <= 0)
+		return;
+	for (p = fb.lfb + y * fb.pitch + x; h --; p += fb.pitch)
+		asm volatile ("cld\n" "rep stosl\n" : "=D" (d0), "=c" (d1) : "D" (p), "c" (w), "a" (color) : "memory");
+}
+
+/* bresenham's line algorithm */
+static void draw_line(int x0, int y0, int x1, int y1, uint32_t color)
+{
+int dx = x1 > x0 ? x1 - x0 : x0 - x1, sx = x0 < x1 ? 1 : -1;
+int dy = y1 > y0 ? y0 - y1 : y1 - y0, sy = y0 < y1 ? 1 : -1;
+int err = dx + dy, e2;
+
+	while (1)
+	{
+		put_pixel(x0, y0, color);
+		if (x0 == x1 && y0 == y1)
+			break;
+		e2 = 2 * err;
+		if (e2 >= dy)
+			err += dy, x0 += sx;
+		if (e2 <= dx)
+			err += dx, y0 += sy;
+	}
+}
+
+static void do_fb_width(void) { /* ( -- width) */ sf_push(fb.active ? fb.width : 0); }
+static void do_fb_height(void) { /* ( -- height) */ sf_push(fb.active ? fb.height : 0); }
+static void do_fb_rgb(void) { /* ( r g b -- color) */ uint32_t b = sf_pop() & 255, g = sf_pop() & 255; sf_push(((sf_pop() & 255) << 16) | (g << 8) | b); }
+
+static void do_fb_pixel(void)
+{
+/* ( x y color --) */
+uint32_t color = sf_pop();
+int y = sf_pop();
+int x = sf_pop();
+
+	if (fb.active)
+		put_pixel(x, y, color);
+}
+
+static void do_fb_line(void)
+{
+/* ( x0 y0 x1 y1 color --) */
+uint32_t color = sf_pop();
+int y1 = sf_pop(), x1 = sf_pop();
+int y0 = sf_pop(), x0 = sf_pop();
+
+	if (fb.active)
+		draw_line(x0, y0, x1, y1, color);
+}
+
+static void do_fb_fill_rect(void)
+{
+/* ( x y w h color --) */
+uint32_t color = sf_pop();
+int h = sf_pop(), w = sf_pop();
+int y = sf_pop(), x = sf_pop();
+
+	if (fb.active)
+		fill_rect(x, y, w, h, color);
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"fb-width",		do_fb_width),
+	MKWORD(custom_dict,	__COUNTER__,	"fb-height",			do_fb_height),
+	MKWORD(custom_dict,	__COUNTER__,	"fb-rgb",			do_fb_rgb),
+	MKWORD(custom_dict,	__COUNTER__,	"fb-pixel",			do_fb_pixel),
+	MKWORD(custom_dict,	__COUNTER__,	"fb-line",			do_fb_line),
+	MKWORD(custom_dict,	__COUNTER__,	"fb-fill-rect",			do_fb_fill_rect),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -0,0 +1,48 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __FB_CONSOLE_H__
+#define __FB_CONSOLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "simple-console.h"
+
+enum
+{
+	/* glyph dimensions, in pixels */
+	FB_GLYPH_WIDTH		=	8,
+	FB_GLYPH_HEIGHT		=	16,
+	/* number of character attributes for which expanded glyph rows are kept */
+	FB_GLYPH_CACHE_ENTRIES	=	4,
+};
+
+/* initializes the frame buffer console, if the kernel initialization code
+ * has set a vbe graphics mode; returns true, and the console dimensions
+ * in characters, on success, false if the frame buffer is not available */
+bool fb_console_init(int * rows, int * columns);
+/* draws a single character cell, if it differs from what is already displayed */
+void fb_console_put_cell(int row, int column, uint8_t character, uint8_t attributes);
+/* redraws the cells in the given (inclusive) row range that differ from what is already displayed */
+void fb_console_update(struct video_memory cells[][CONSOLE_MAX_COLUMNS], int first_row, int last_row);
+
+#endif /* __FB_CONSOLE_H__ */
@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* page frame allocator for the extended memory, i.e. the memory above the
+ * kernel process images; the allocation bitmap lives in the common data
+ * area, so that all kernel processes share the same view of the extended
+ * memory, and memory allocated here is identity mapped, so it is also
+ * suitable for use by bus-mastering devices */
+
+#include <stdint.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "frame-alloc.h"
+#include "common-data.h"
+
+static struct
+{
+	/* a set bit marks a frame as allocated */
+	uint32_t	bitmap[(NR_EXTENDED_MEMORY_FRAMES + 31) / 32];
+	/* frame number at which to start searching for a free run of frames */
+	unsigned	next_fit;
+	unsigned	nr_free_frames;
+}
+frames __attribute__((section(".common-data"))) =
+{
+	.nr_free_frames	= NR_EXTENDED_MEMORY_FRAMES,
+};
+
+static int is_frame_used(unsigned frame) { return frames.bitmap[frame >> 5] & (1 << (frame & 31)); }
+
+static void mark_frames(unsigned frame, unsigned nr_frames, int used)
+{
+	while (nr_frames --)
+	{
+		if (used)
+			frames.bitmap[frame >> 5] |= 1 << (frame & 31);
+		else
+			frames.bitmap[frame >> 5] &=~ (1 << (frame & 31));
+		frame ++;
+	}
+}
+
+/* returns the first frame of a free run of frames, or -1 if none was found;
+ * fully allocated bitmap words are skipped at once */
+static int find_free_run(unsigned start, unsigned end, unsigned nr_frames)
+{
+unsigned i, run;
+
+	for (i = start, run = 0; i < end;)
+	{
+		if (!(i & 31) && frames.bitmap[i >> 5] == 0xffffffff)
+		{
+			i += 32, run = 0;
+			continue;
+		}
+		if (is_frame_used(i ++))
+			run = 0;
+		else if (++ run == nr_frames)
+			return i - nr_frames;
+	}
+	return -1;
+}
+
+void * frame_alloc(unsigned nr_frames)
+{
+int frame;
+unsigned irqflag;
+void * p;
+
+	if (!nr_frames || nr_frames > NR_EXTENDED_MEMORY_FRAMES)
+		return 0;
+	irqflag = get_irq_flag_and_disable_irqs();
+	if ((frame = find_free_run(frames.next_fit, NR_EXTENDED_MEMORY_FRAMES, nr_frames)) == -1)
+		frame = find_free_run(0, NR_EXTENDED_MEMORY_FRAMES, nr_frames);
+	if (frame != -1)
+	{
+		mark_frames(frame, nr_frames, 1);
+		frames.next_fit = frame + nr_frames;
+		frames.nr_free_frames -= nr_frames;
+	}
+	restore_irq_flag(irqflag);
+
+	if (frame == -1)
+		return 0;
+	p = (void *) (EXTENDED_MEMORY_BASE + frame * FRAME_SIZE);
+	xmemset(p, 0, nr_frames * FRAME_SIZE);
+	return p;
+}
+
+void frame_free(void * frames_base, unsigned nr_frames)
+{
+unsigned frame = ((uint32_t) frames_base - EXTENDED_MEMORY_BASE) / FRAME_SIZE;
+unsigned irqflag;
+
+	if ((uint32_t) frames_base & (FRAME_SIZE - 1) || (uint32_t) frames_base < EXTENDED_MEMORY_BASE
+			|| frame + nr_frames > NR_EXTENDED_MEMORY_FRAMES)
+	{
+		print_str(__func__);
+		print_str("(): bad address\n");
+		return;
+	}
+	irqflag = get_irq_flag_and_disable_irqs();
+	mark_frames(frame, nr_frames, 0);
+	frames.nr_free_frames += nr_frames;
+	if (frame < frames.next_fit)
+		frames.next_fit = frame;
+	restore_irq_flag(irqflag);
+}
+
+unsigned frame_free_count(void)
+{
+	return frames.nr_free_frames;
+}
+
+static void do_frame_alloc(void) { /* ( nr-frames -- address|0) */ sf_push((cell) frame_alloc(sf_pop())); }
+static void do_frame_free(void) { /* ( address nr-frames --) */ unsigned n = sf_pop(); frame_free((void *) sf_pop(), n); }
+static void do_frames_free(void) { /* ( -- nr-free-frames) */ sf_push(frame_free_count()); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"frame-alloc",		do_frame_alloc),
+	MKWORD(custom_dict,	__COUNTER__,	"frame-free",			do_frame_free),
+	MKWORD(custom_dict,	__COUNTER__,	"frames-free",			do_frames_free),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
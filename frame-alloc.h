@@ -0,0 +1,43 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __FRAME_ALLOC_H__
+#define __FRAME_ALLOC_H__
+
+#include <stdint.h>
+#include "constants.h"
+
+enum
+{
+	FRAME_SIZE		= 4096,
+	NR_EXTENDED_MEMORY_FRAMES	= (EXTENDED_MEMORY_TOP - EXTENDED_MEMORY_BASE) / FRAME_SIZE,
+};
+
+/* allocates a physically contiguous run of page frames from the extended
+ * memory, returns the (identity mapped) address of the first frame, or
+ * zero if there is no free run of the requested length; the memory
+ * returned is cleared */
+void * frame_alloc(unsigned nr_frames);
+void frame_free(void * frames, unsigned nr_frames);
+unsigned frame_free_count(void);
+
+#endif /* __FRAME_ALLOC_H__ */
@@ -21,14 +21,16 @@ THE SOFTWARE.
 */
 #include "pgtable.h"
 #include "common-data.h"
+#include "frame-alloc.h"
 
 /* initial page directory and table used during the death track
- * kernel initialization; it is meant to identity map the first
- * 4 megabytes of memory */
+ * kernel initialization; it is meant to identity map all memory
+ * up to EXTENDED_MEMORY_TOP - the first megabyte, the kernel process
+ * images, and the extended memory managed by the page frame allocator */
 static struct
 {
 	struct pgde pgdir[1024];
-	struct pgte pgtab[(NUMBER_OF_KERNEL_PROCESSES >> 2) + /* always have at least one page table */ 1][1024];
+	struct pgte pgtab[EXTENDED_MEMORY_TOP >> 22][1024];
 }
 init_pgdir_tab __attribute__((section(".init-pgdir")));
 
@@ -45,8 +47,9 @@ void populate_initial_page_directory(void)
 	};
 	xmemset(& init_pgdir_tab, 0, sizeof init_pgdir_tab);
 
-	/* identity map 1 MB for the shared kernel code, and 1 MB for each kernel process */
-	for (i = 0; i < NUMBER_OF_KERNEL_PROCESSES + /* always map the first MB of memory */ 1; i ++)
+	/* identity map 1 MB for the shared kernel code, 1 MB for each kernel process,
+	 * and the extended memory above the kernel process images */
+	for (i = 0; i < EXTENDED_MEMORY_TOP >> 20; i ++)
 	{
 		if (!(i & 3))
 		{
@@ -122,3 +125,69 @@ void mem_map_physical_page(uint32_t virtual_address, uint32_t physical_address)
 	asm("wbinvd\n");
 }
 
+void * mem_map_mmio_region(uint32_t physical_address, uint32_t size, bool disable_cache)
+{
+uint32_t address, end;
+struct pgte * pgtab;
+unsigned irqflag;
+
+	end = physical_address + size;
+	if (physical_address < EXTENDED_MEMORY_TOP || !size || (end && end < physical_address))
+	{
+		print_str(__func__);
+		print_str("(): bad address\n");
+		return 0;
+	}
+	irqflag = get_irq_flag_and_disable_irqs();
+	for (address = physical_address & ~ 0xfff; address != ((end + 0xfff) & ~ 0xfff); address += 0x1000)
+	{
+		if (!init_pgdir_tab.pgdir[address >> 22].present)
+		{
+			/* page tables for mmio regions are allocated from extended memory,
+			 * which is identity mapped, and is common to all kernel processes */
+			if (!(pgtab = frame_alloc(1)))
+			{
+				restore_irq_flag(irqflag);
+				print_str(__func__);
+				print_str("(): out of memory\n");
+				return 0;
+			}
+			init_pgdir_tab.pgdir[address >> 22] = (struct pgde)
+			{
+				.present			= PGDE_PRESENT,
+				.read_write			= PGDE_READ_WRITE,
+				.user_supervisor		= PGDE_USER_ACCESS_NOT_ALLOWED,
+				.page_write_through		= PGDE_PAGE_WRITE_THROUGH,
+				.page_level_cache_disable	= PGDE_PAGE_LEVEL_CACHE_ENABLED,
+				.page_size			= 0,
+				.physical_address		= (uint32_t) pgtab >> 12,
+			};
+		}
+		pgtab = (struct pgte *) (init_pgdir_tab.pgdir[address >> 22].physical_address << 12);
+		pgtab[(address >> 12) & 1023] = (struct pgte)
+		{
+			.present			= PGTE_PRESENT,
+			.read_write			= PGTE_READ_WRITE,
+			.user_supervisor		= PGTE_USER_ACCESS_NOT_ALLOWED,
+			.page_write_through		= PGTE_PAGE_WRITE_THROUGH,
+			.page_level_cache_disable	= disable_cache ? PGTE_PAGE_LEVEL_CACHE_DISABLED : PGTE_PAGE_LEVEL_CACHE_ENABLED,
+			.physical_address		= address >> 12,
+		};
+	}
+	invalidate_paging_tlb();
+	restore_irq_flag(irqflag);
+	return (void *) physical_address;
+}
+
+uint32_t mem_virtual_to_physical(const void * virtual_address)
+{
+uint32_t address = (uint32_t) virtual_address;
+struct pgte * pgte;
+
+	if (address >= EXTENDED_MEMORY_TOP)
+		return 0;
+	pgte = & init_pgdir_tab.pgtab[address >> 22][(address >> 12) & 1023];
+	if (!pgte->present)
+		return 0;
+	return (pgte->physical_address << 12) | (address & 0xfff);
+}
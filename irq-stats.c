@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* interrupt statistics - per vector interrupt counts, and histograms of
+ * the time (in processor timestamp counter cycles) spent servicing each
+ * vector, with power of two histogram buckets; also tracked is the longest
+ * window during which interrupts were disabled by a
+ * 'get_irq_flag_and_disable_irqs()'/'restore_irq_flag()' pair - the
+ * timestamp of disabling interrupts is recorded in 'klow.s' */
+
+#include <stdint.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "irq.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+struct irq_vector_stats
+{
+	uint32_t	count;
+	uint32_t	max_cycles;
+	/* bucket n counts the interrupts serviced in [2^n, 2^(n + 1)) cycles */
+	uint32_t	histogram[IRQ_STATS_HISTOGRAM_BUCKETS];
+};
+
+enum
+{
+	IRQ_STATS_FRAMES	=	(NR_INTERRUPT_VECTORS * sizeof(struct irq_vector_stats) + FRAME_SIZE - 1) / FRAME_SIZE,
+};
+
+static struct
+{
+	/* allocated from extended memory, one entry per vector */
+	struct irq_vector_stats	* vectors;
+	uint32_t		irqs_off_max_cycles;
+	uint32_t		irqs_off_max_caller;
+}
+irq_stats __attribute__((section(".common-data")));
+
+/* set by 'get_irq_flag_and_disable_irqs()' in 'klow.s', when it disables interrupts;
+ * the timestamp is zero when no interrupts-disabled window is being timed */
+uint32_t irqs_off_start_tsc __attribute__((section(".common-data")));
+uint32_t irqs_off_start_caller __attribute__((section(".common-data")));
+
+void init_irq_stats(void)
+{
+	irq_stats.vectors = frame_alloc(IRQ_STATS_FRAMES);
+}
+
+void irq_stats_account(int vector, uint32_t cycles)
+{
+struct irq_vector_stats * s;
+
+	if (!irq_stats.vectors)
+		return;
+	s = irq_stats.vectors + vector;
+	s->count ++;
+	if (cycles > s->max_cycles)
+		s->max_cycles = cycles;
+	s->histogram[31 - __builtin_clz(cycles | 1)] ++;
+}
+
+/* called by 'restore_irq_flag()' in 'klow.s', with interrupts still disabled, when it reenables interrupts */
+void irq_stats_irqs_enabled(void)
+{
+uint32_t cycles;
+
+	if (!irqs_off_start_tsc)
+		return;
+	cycles = (uint32_t) rdtsc() - irqs_off_start_tsc;
+	irqs_off_start_tsc = 0;
+	if (cycles > irq_stats.irqs_off_max_cycles)
+	{
+		irq_stats.irqs_off_max_cycles = cycles;
+		irq_stats.irqs_off_max_caller = irqs_off_start_caller;
+	}
+}
+
+static void irq_stats_reset(void)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	if (irq_stats.vectors)
+		xmemset(irq_stats.vectors, 0, IRQ_STATS_FRAMES * FRAME_SIZE);
+	irq_stats.irqs_off_max_cycles = irq_stats.irqs_off_max_caller = 0;
+	restore_irq_flag(irqflag);
+}
+
+static void do_irq_stats_dump(void)
+{
+int i, j;
+struct irq_vector_stats * s;
+
+	if (!irq_stats.vectors)
+		return;
+	print_str("vector      count  max cycles  histogram (log2 cycles:count)\n");
+	for (i = 0, s = irq_stats.vectors; i < NR_INTERRUPT_VECTORS; i ++, s ++)
+	{
+		if (!s->count)
+			continue;
+		print_number(i, 6, true);
+		print_number(s->count, 11, false);
+		print_number(s->max_cycles, 12, false);
+		print_str(" ");
+		for (j = 0; j < IRQ_STATS_HISTOGRAM_BUCKETS; j ++)
+			if (s->histogram[j])
+			{
+				print_str(" ");
+				print_number(j, 0, false);
+				print_str(":");
+				print_number(s->histogram[j], 0, false);
+			}
+		print_str("\n");
+	}
+	print_str("longest interrupts disabled window: ");
+	print_number(irq_stats.irqs_off_max_cycles, 0, false);
+	print_str(" cycles, disabled at address ");
+	print_number(irq_stats.irqs_off_max_caller, 0, true);
+	print_str("\n");
+}
+
+static void do_irq_count(void) { /* ( vector -- count) */ unsigned v = sf_pop(); sf_push((irq_stats.vectors && v < NR_INTERRUPT_VECTORS) ? irq_stats.vectors[v].count : 0); }
+static void do_irqs_off_max(void) { /* ( -- cycles caller-address) */ sf_push(irq_stats.irqs_off_max_cycles); sf_push(irq_stats.irqs_off_max_caller); }
+static void do_irq_stats_reset(void) { /* ( --) */ irq_stats_reset(); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	".irq-stats",		do_irq_stats_dump),
+	MKWORD(custom_dict,	__COUNTER__,	"irq-count",			do_irq_count),
+	MKWORD(custom_dict,	__COUNTER__,	"irqs-off-max",			do_irqs_off_max),
+	MKWORD(custom_dict,	__COUNTER__,	"irq-stats-reset",		do_irq_stats_reset),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -0,0 +1,418 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* interrupt dispatching; all interrupt vectors enter the kernel through the
+ * entry stubs in 'klow.s', which save the processor state and call
+ * 'irq_dispatch()' below, which in turn invokes the handler attached to the
+ * vector, and acknowledges the interrupt at the interrupt controller - the
+ * 8259a controllers here, or the apics, when available (see 'apic.c').
+ * Forth interrupt handlers cannot run in interrupt context, so for these,
+ * the interrupt request line is masked, and the handler is marked as pending
+ * and is run later, outside of interrupt context, by the kernel process that
+ * attached it; the line is unmasked again after the handler has run */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "idt.h"
+#include "irq.h"
+#include "common-data.h"
+#include "utils.h"
+
+extern struct x86_idt_gate_descriptor x86_idt[NR_INTERRUPT_VECTORS];
+extern void load_idtr(void);
+extern void _8259a_remap(unsigned pic1_irq_base, unsigned pic2_irq_base);
+/* the interrupt entry stubs in 'klow.s', IRQ_ENTRY_STUB_SIZE bytes each, one for each vector */
+extern char irq_entry_stubs[];
+
+enum
+{
+	IRQ_ENTRY_STUB_SIZE	=	16,
+
+	PIC1_COMMAND		=	0x20,
+	PIC1_DATA		=	0x21,
+	PIC2_COMMAND		=	0xa0,
+	PIC2_DATA		=	0xa1,
+	PIC_EOI			=	0x20,
+	/* operation command word 3 - read the in-service register on the next read from the command port */
+	PIC_READ_ISR		=	0x0b,
+};
+
+static struct
+{
+	struct
+	{
+		irq_handler_t	handler;
+		void		* argument;
+	}
+	vectors[NR_INTERRUPT_VECTORS];
+	/* a set bit masks the corresponding legacy interrupt request line */
+	uint16_t	line_mask;
+	const struct irq_controller	* controller;
+}
+irq __attribute__((section(".common-data")));
+
+static struct forth_irq_handler
+{
+	bool		in_use;
+	int		irq;
+	/* forth handler execution token */
+	cell		xt;
+	/* the kernel process that attached the handler; only this process can run it */
+	int		owner_process;
+	volatile bool	pending;
+}
+forth_irq_handlers[MAX_FORTH_IRQ_HANDLERS] __attribute__((section(".common-data")));
+
+int irq_to_vector(int irq)
+{
+	if (irq < 0 || irq >= NR_LEGACY_IRQS)
+		return -1;
+	return (irq < 8) ? PIC1_VECTOR_BASE + irq : PIC2_VECTOR_BASE + irq - 8;
+}
+
+static int vector_to_irq(int vector)
+{
+	if (vector >= PIC1_VECTOR_BASE && vector < PIC1_VECTOR_BASE + 8)
+		return vector - PIC1_VECTOR_BASE;
+	if (vector >= PIC2_VECTOR_BASE && vector < PIC2_VECTOR_BASE + 8)
+		return vector - PIC2_VECTOR_BASE + 8;
+	return -1;
+}
+
+/*
+ * 8259a interrupt controller operations
+ */
+
+static void pic_write_mask(uint16_t mask)
+{
+	/* the cascade line must be unmasked if any of the slave controller lines is unmasked */
+	if ((mask & 0xff00) != 0xff00)
+		mask &=~ (1 << IRQ_CASCADE);
+	write_io_port_byte(PIC1_DATA, mask);
+	write_io_port_byte(PIC2_DATA, mask >> 8);
+}
+
+static int pic_read_isr(int command_port)
+{
+	write_io_port_byte(command_port, PIC_READ_ISR);
+	return read_io_port_byte(command_port);
+}
+
+static void pic_mask(int irq_number, bool mask)
+{
+	/* the masks of all lines are kept by the generic code */
+	pic_write_mask(irq.line_mask);
+}
+
+static void pic_eoi(int vector, int irq_number)
+{
+	if (irq_number >= 8)
+		write_io_port_byte(PIC2_COMMAND, PIC_EOI);
+	if (irq_number != -1)
+		write_io_port_byte(PIC1_COMMAND, PIC_EOI);
+}
+
+static bool pic_is_spurious(int vector, int irq_number)
+{
+	if (irq_number == 7 && !(pic_read_isr(PIC1_COMMAND) & (1 << 7)))
+		/* spurious interrupt, must not be acknowledged */
+		return true;
+	if (irq_number == 15 && !(pic_read_isr(PIC2_COMMAND) & (1 << 7)))
+	{
+		/* spurious interrupt, only the master controller must be acknowledged */
+		write_io_port_byte(PIC1_COMMAND, PIC_EOI);
+		return true;
+	}
+	return false;
+}
+
+static const struct irq_controller pic_controller =
+{
+	.name		= "8259a",
+	.mask		= pic_mask,
+	.eoi		= pic_eoi,
+	.is_spurious	= pic_is_spurious,
+};
+
+void irq_mask(int irq_number, bool mask)
+{
+unsigned irqflag;
+
+	if (irq_number < 0 || irq_number >= NR_LEGACY_IRQS)
+		return;
+	irqflag = get_irq_flag_and_disable_irqs();
+	if (mask)
+		irq.line_mask |= 1 << irq_number;
+	else
+		irq.line_mask &=~ (1 << irq_number);
+	irq.controller->mask(irq_number, mask);
+	restore_irq_flag(irqflag);
+}
+
+void irq_set_controller(const struct irq_controller * controller)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+int i;
+
+	for (i = 0; i < NR_LEGACY_IRQS; i ++)
+		irq.controller->mask(i, true);
+	/* make sure the 8259a controllers stay silent when not in use */
+	pic_write_mask(0xffff);
+	irq.controller = controller;
+	for (i = 0; i < NR_LEGACY_IRQS; i ++)
+		controller->mask(i, irq.line_mask & (1 << i));
+	restore_irq_flag(irqflag);
+}
+
+int irq_attach_vector(int vector, irq_handler_t handler, void * argument)
+{
+unsigned irqflag;
+int result = -1;
+
+	if (vector < NR_EXCEPTION_VECTORS || vector >= NR_INTERRUPT_VECTORS || !handler)
+		return -1;
+	irqflag = get_irq_flag_and_disable_irqs();
+	if (!irq.vectors[vector].handler)
+	{
+		irq.vectors[vector].handler = handler;
+		irq.vectors[vector].argument = argument;
+		result = 0;
+	}
+	restore_irq_flag(irqflag);
+	return result;
+}
+
+int irq_alloc_vector(irq_handler_t handler, void * argument)
+{
+int vector;
+
+	for (vector = FIRST_DYNAMIC_VECTOR; vector <= LAST_DYNAMIC_VECTOR; vector ++)
+		if (vector_to_irq(vector) == -1 && !irq_attach_vector(vector, handler, argument))
+			return vector;
+	return -1;
+}
+
+void irq_detach_vector(int vector)
+{
+unsigned irqflag;
+
+	if (vector < NR_EXCEPTION_VECTORS || vector >= NR_INTERRUPT_VECTORS)
+		return;
+	irqflag = get_irq_flag_and_disable_irqs();
+	irq.vectors[vector].handler = 0;
+	irq.vectors[vector].argument = 0;
+	restore_irq_flag(irqflag);
+}
+
+int irq_attach(int irq_number, irq_handler_t handler, void * argument)
+{
+	if (irq_attach_vector(irq_to_vector(irq_number), handler, argument))
+		return -1;
+	irq_mask(irq_number, false);
+	return 0;
+}
+
+void irq_detach(int irq_number)
+{
+	irq_mask(irq_number, true);
+	irq_detach_vector(irq_to_vector(irq_number));
+}
+
+/* this is called in interrupt context, so it must not use the forth interpreter - that
+ * would change the data stack, and the number base, of the code interrupted */
+static void print_hex(const char * label, uint32_t x)
+{
+char digits[10];
+int i;
+
+	print_str(label);
+	for (i = 0; i < 8; i ++, x <<= 4)
+		digits[i] = "0123456789abcdef"[x >> 28];
+	digits[8] = ' ';
+	digits[9] = 0;
+	print_str(digits);
+}
+
+static void unhandled_exception(struct irq_frame * frame)
+{
+	print_str("UNHANDLED EXCEPTION");
+	print_hex(", vector: ", frame->vector);
+	print_hex("error code: ", frame->error_code);
+	print_hex("eip: ", frame->eip);
+	print_str("\n");
+	while (1)
+		asm("cli\nhlt");
+}
+
+/* called by the common interrupt entry code in 'klow.s' */
+void irq_dispatch(struct irq_frame * frame)
+{
+int vector = frame->vector, irq_number = vector_to_irq(vector);
+uint32_t start = rdtsc();
+
+	if (vector >= NR_EXCEPTION_VECTORS && irq.controller->is_spurious(vector, irq_number))
+	{
+		irq_stats_account(vector, (uint32_t) rdtsc() - start);
+		return;
+	}
+
+	if (irq.vectors[vector].handler)
+		irq.vectors[vector].handler(irq.vectors[vector].argument);
+	else if (vector < NR_EXCEPTION_VECTORS)
+		unhandled_exception(frame);
+	else
+	{
+		print_hex("UNHANDLED INTERRUPT, vector: ", vector);
+		print_str("\n");
+		/* keep an unhandled interrupt request line from firing again */
+		if (irq_number != -1)
+			irq.line_mask |= 1 << irq_number, irq.controller->mask(irq_number, true);
+	}
+
+	if (vector >= NR_EXCEPTION_VECTORS)
+		irq.controller->eoi(vector, irq_number);
+	irq_stats_account(vector, (uint32_t) rdtsc() - start);
+}
+
+void init_irq(void)
+{
+struct x86_idt_gate_descriptor idesc =
+{
+	.segment_selector = 0x10,
+	.set_to_zero = 0,
+	.type = INTERRUPT_GATE_32_BITS,
+	.dpl	= 0,
+	.present = 1,
+};
+uint32_t x;
+int i;
+
+	for (i = 0; i < NR_INTERRUPT_VECTORS; i ++)
+	{
+		x = (uint32_t) (irq_entry_stubs + i * IRQ_ENTRY_STUB_SIZE);
+		idesc.offset_15_0 = x;
+		idesc.offset_31_16 = x >> 16;
+		x86_idt[i] = idesc;
+	}
+	load_idtr();
+	init_irq_stats();
+
+	_8259a_remap(PIC1_VECTOR_BASE, PIC2_VECTOR_BASE);
+	irq.controller = & pic_controller;
+	irq.line_mask = 0xffff;
+	pic_write_mask(irq.line_mask);
+}
+
+/*
+ * forth interrupt handlers
+ */
+
+static void forth_irq_trampoline(void * argument)
+{
+struct forth_irq_handler * h = argument;
+
+	/* mask the line until the forth handler has had a chance to service the device */
+	irq.line_mask |= 1 << h->irq;
+	irq.controller->mask(h->irq, true);
+	h->pending = true;
+}
+
+void irq_run_deferred_handlers(void)
+{
+int i;
+struct forth_irq_handler * h;
+
+	for (i = 0, h = forth_irq_handlers; i < MAX_FORTH_IRQ_HANDLERS; i ++, h ++)
+	{
+		if (!h->in_use || !h->pending || h->owner_process != active_process)
+			continue;
+		h->pending = false;
+		sf_push(h->xt);
+		sf_eval("execute");
+		if (h->in_use)
+			irq_mask(h->irq, false);
+	}
+}
+
+bool irq_deferred_handlers_pending(void)
+{
+int i;
+
+	for (i = 0; i < MAX_FORTH_IRQ_HANDLERS; i ++)
+		if (forth_irq_handlers[i].in_use && forth_irq_handlers[i].pending && forth_irq_handlers[i].owner_process == active_process)
+			return true;
+	return false;
+}
+
+static void forth_irq_detach(int irq_number)
+{
+int i;
+
+	irq_detach(irq_number);
+	for (i = 0; i < MAX_FORTH_IRQ_HANDLERS; i ++)
+		if (forth_irq_handlers[i].in_use && forth_irq_handlers[i].irq == irq_number)
+			forth_irq_handlers[i].in_use = false;
+}
+
+static void do_irq_attach(void)
+{
+/* ( xt irq -- t=success|f=failure) */
+int irq_number = sf_pop(), i;
+cell xt = sf_pop();
+struct forth_irq_handler * h;
+
+	for (i = 0, h = forth_irq_handlers; i < MAX_FORTH_IRQ_HANDLERS && h->in_use; i ++, h ++)
+		;
+	if (i == MAX_FORTH_IRQ_HANDLERS || irq_to_vector(irq_number) == -1)
+	{
+		sf_push(0);
+		return;
+	}
+	* h = (struct forth_irq_handler) { .in_use = true, .irq = irq_number, .xt = xt, .owner_process = active_process, };
+	if (irq_attach(irq_number, forth_irq_trampoline, h))
+	{
+		h->in_use = false;
+		sf_push(0);
+		return;
+	}
+	sf_push(-1);
+}
+
+static void do_irq_detach(void) { /* ( irq --) */ forth_irq_detach(sf_pop()); }
+static void do_irq_mask(void) { /* ( t=mask|f=unmask irq --) */ int irq_number = sf_pop(); irq_mask(irq_number, sf_pop()); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"irq-attach",		do_irq_attach),
+	MKWORD(custom_dict,	__COUNTER__,	"irq-detach",			do_irq_detach),
+	MKWORD(custom_dict,	__COUNTER__,	"irq-mask",			do_irq_mask),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
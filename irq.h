@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __IRQ_H__
+#define __IRQ_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	NR_INTERRUPT_VECTORS		=	256,
+	/* vectors below this number are reserved for processor exceptions */
+	NR_EXCEPTION_VECTORS		=	32,
+	/* number of legacy (8259a) interrupt request lines */
+	NR_LEGACY_IRQS			=	16,
+	/* the 8259a interrupt controllers are remapped to these vectors */
+	PIC1_VECTOR_BASE		=	0x30,
+	PIC2_VECTOR_BASE		=	0x40,
+
+	IRQ_TIMER			=	0,
+	IRQ_KEYBOARD			=	1,
+	IRQ_CASCADE			=	2,
+	IRQ_MOUSE			=	12,
+	IRQ_PRIMARY_ATA			=	14,
+	IRQ_SECONDARY_ATA		=	15,
+
+	/* vectors handed out by 'irq_alloc_vector()', e.g. for message signalled interrupts */
+	FIRST_DYNAMIC_VECTOR		=	0x50,
+	LAST_DYNAMIC_VECTOR		=	0xef,
+	/* local apic spurious interrupt vector */
+	SPURIOUS_VECTOR			=	0xff,
+
+	/* maximum number of forth interrupt handlers that can be attached at the same time */
+	MAX_FORTH_IRQ_HANDLERS		=	8,
+
+	/* number of power of two buckets in the per vector histograms of interrupt servicing times */
+	IRQ_STATS_HISTOGRAM_BUCKETS	=	32,
+};
+
+/* the state saved by the interrupt entry code; the layout must match 'klow.s' */
+struct irq_frame
+{
+	/* saved by 'pushal' */
+	uint32_t	edi, esi, ebp, esp, ebx, edx, ecx, eax;
+	uint32_t	vector;
+	/* zero for vectors for which the processor does not push an error code */
+	uint32_t	error_code;
+	/* saved by the processor */
+	uint32_t	eip, cs, eflags;
+};
+
+/* interrupt handlers are invoked with interrupts disabled, and must not block;
+ * as interrupts may happen while any kernel process is active, handlers and their
+ * arguments should only reference code, common data, or extended memory */
+typedef void (* irq_handler_t)(void * argument);
+
+/* interrupt controller operations; the legacy interrupt request lines are always
+ * routed to the same vectors (see 'irq_to_vector()'), regardless of the controller in use */
+struct irq_controller
+{
+	const char	* name;
+	/* masks/unmasks a legacy interrupt request line */
+	void		(* mask)(int irq, bool mask);
+	/* acknowledges the interrupt being serviced; called for all non-exception vectors,
+	 * 'irq' is the legacy interrupt request line for the vector, or -1 if none */
+	void		(* eoi)(int vector, int irq);
+	/* returns true if the interrupt is spurious, and must not be serviced */
+	bool		(* is_spurious)(int vector, int irq);
+};
+
+/* installs the interrupt entry code for all vectors, and reinitializes the
+ * 8259a interrupt controllers with all interrupt request lines masked */
+void init_irq(void);
+/* attaches a handler to an interrupt vector; returns 0 on success, -1 if
+ * the vector is invalid, or already has a handler attached */
+int irq_attach_vector(int vector, irq_handler_t handler, void * argument);
+void irq_detach_vector(int vector);
+/* attach/detach a handler to a legacy interrupt request line; attaching
+ * unmasks the line, detaching masks it */
+int irq_attach(int irq, irq_handler_t handler, void * argument);
+void irq_detach(int irq);
+void irq_mask(int irq, bool mask);
+int irq_to_vector(int irq);
+/* attaches a handler to a free vector not associated with a legacy interrupt request line;
+ * returns the vector, or -1 if there are no free vectors */
+int irq_alloc_vector(irq_handler_t handler, void * argument);
+/* switches interrupt controllers; the masked state of the legacy interrupt request lines is preserved */
+void irq_set_controller(const struct irq_controller * controller);
+/* runs any pending forth interrupt handlers owned by the active kernel process;
+ * must be called from outside interrupt context */
+void irq_run_deferred_handlers(void);
+bool irq_deferred_handlers_pending(void);
+
+/* interrupt statistics, see 'irq-stats.c' */
+void init_irq_stats(void);
+void irq_stats_account(int vector, uint32_t cycles);
+
+#endif /* __IRQ_H__ */
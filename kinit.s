@@ -309,6 +309,114 @@ read_sectors:
 display_image_and_halt:	.long	0
 force_load_kernel:	.word	0
 
+/* sets the largest 32 bits per pixel vbe 2.0 linear frame buffer mode that
+ * fits in VBE_MAX_WIDTH x VBE_MAX_HEIGHT, copies the bios 8x16 font to
+ * VBE_FONT_PHYSICAL_ADDRESS, and fills in the vbe boot information for the
+ * kernel frame buffer console; if no suitable mode is found, the video mode
+ * is left unchanged; expects ds to address the kernel loader */
+setup_vbe_console:
+	pushw	%es
+	pushw	%fs
+	xorw	%ax,	%ax
+	movw	%ax,	%es
+	/* retrieve the vbe controller information */
+	movl	$VBE_BOOT_INFO_SIGNATURE,	%es:VBE_CONTROLLER_INFO
+	movw	$0x4f00,	%ax
+	movw	$VBE_CONTROLLER_INFO,	%di
+	int	$0x10
+	cmpw	$0x004f,	%ax
+	jne	9f
+	cmpw	$0x0200,	%es:VBE_CONTROLLER_INFO + 4
+	jb	9f
+	/* walk the video mode list; bx holds the best mode found so far, dx - its width */
+	lfs	%es:VBE_CONTROLLER_INFO + 14,	%si
+	xorw	%bx,	%bx
+	xorw	%dx,	%dx
+1:
+	movw	%fs:(%si),	%cx
+	cmpw	$0xffff,	%cx
+	je	2f
+	addw	$2,	%si
+	pushw	%si
+	pushw	%dx
+	pushw	%bx
+	movw	$0x4f01,	%ax
+	movw	$VBE_MODE_INFO,	%di
+	int	$0x10
+	popw	%bx
+	popw	%dx
+	popw	%si
+	cmpw	$0x004f,	%ax
+	jne	1b
+	/* the mode must be supported, be a graphics mode, and have a linear frame buffer */
+	movw	%es:VBE_MODE_INFO,	%ax
+	andw	$0x91,	%ax
+	cmpw	$0x91,	%ax
+	jne	1b
+	/* the mode must be a 32 bits per pixel direct color mode */
+	cmpb	$32,	%es:VBE_MODE_INFO + 25
+	jne	1b
+	cmpb	$6,	%es:VBE_MODE_INFO + 27
+	jne	1b
+	cmpw	$VBE_MAX_HEIGHT,	%es:VBE_MODE_INFO + 20
+	ja	1b
+	movw	%es:VBE_MODE_INFO + 18,	%ax
+	cmpw	$VBE_MAX_WIDTH,	%ax
+	ja	1b
+	cmpw	%dx,	%ax
+	jbe	1b
+	movw	%ax,	%dx
+	movw	%cx,	%bx
+	jmp	1b
+2:
+	testw	%bx,	%bx
+	jz	9f
+	pushw	%bx
+	/* re-read the information for the selected mode */
+	movw	%bx,	%cx
+	movw	$0x4f01,	%ax
+	movw	$VBE_MODE_INFO,	%di
+	int	$0x10
+	/* copy the bios 8x16 font; it is returned in es:bp */
+	pushw	%ds
+	movw	$0x1130,	%ax
+	movb	$6,	%bh
+	int	$0x10
+	pushw	%es
+	popw	%ds
+	movw	%bp,	%si
+	xorw	%ax,	%ax
+	movw	%ax,	%es
+	movw	$VBE_FONT_PHYSICAL_ADDRESS,	%di
+	movw	$(256 * 16 / 2),	%cx
+	cld
+	rep	movsw
+	popw	%ds
+	popw	%bx
+	/* set the mode, with the linear frame buffer enabled */
+	orw	$0x4000,	%bx
+	movw	$0x4f02,	%ax
+	int	$0x10
+	cmpw	$0x004f,	%ax
+	jne	9f
+	/* fill in the vbe boot information */
+	movl	%es:VBE_MODE_INFO + 40,	%eax
+	movl	%eax,	%es:VBE_BOOT_INFO_LFB_ADDRESS
+	movw	%es:VBE_MODE_INFO + 18,	%ax
+	movw	%ax,	%es:VBE_BOOT_INFO_WIDTH
+	movw	%es:VBE_MODE_INFO + 20,	%ax
+	movw	%ax,	%es:VBE_BOOT_INFO_HEIGHT
+	movw	%es:VBE_MODE_INFO + 16,	%ax
+	movw	%ax,	%es:VBE_BOOT_INFO_PITCH
+	movzbw	%es:VBE_MODE_INFO + 25,	%ax
+	movw	%ax,	%es:VBE_BOOT_INFO_BPP
+	movw	%bx,	%es:VBE_BOOT_INFO_MODE
+	movl	$VBE_BOOT_INFO_SIGNATURE,	%es:VBE_BOOT_INFO_PHYSICAL_ADDRESS
+9:
+	popw	%fs
+	popw	%es
+	ret
+
 .align	4
 
 load_kernel_proper:
@@ -428,6 +536,18 @@ load_kernel_from_disk:
 1:
 	movb	$'-',	0
 3:
+	pushw	%cs
+	popw	%ds
+	/* invalidate the vbe boot information, so that the kernel does not
+	 * find stale data there if no graphics mode gets set below */
+	xorw	%ax,	%ax
+	movw	%ax,	%es
+	movl	$0,	%es:VBE_BOOT_INFO_PHYSICAL_ADDRESS
+.if VBE_CONSOLE_ENABLED
+	cmpl	$0,	display_image_and_halt
+	jne	enter_protected_mode
+	call	setup_vbe_console
+.endif
 
 enter_protected_mode:
 	cli
@@ -34,8 +34,11 @@ UART1_LSR		= UART1_PORT_BASE + 5 /* byte access, line status register, r/w acces
 UART1_MSR		= UART1_PORT_BASE + 6 /* byte access, modem status register, r/w access */
 
 .extern	x86_idt
-.extern	translate_scancode
 .extern	kmain
+.extern	irq_dispatch
+.extern	irq_stats_irqs_enabled
+.extern	irqs_off_start_tsc
+.extern	irqs_off_start_caller
 
 .global next_task_low
 .global invalidate_paging_tlb
@@ -43,14 +46,19 @@ UART1_MSR		= UART1_PORT_BASE + 6 /* byte access, modem status register, r/w acce
 .global _8259a_remap
 .global _8259a_set_mask
 .global _8042_init
-.global keyboard_interrupt_handler
-.global mouse_interrupt_handler
+.global irq_entry_stubs
 .global read_io_port_byte
 .global write_io_port_byte
 .global read_io_port_word
 .global write_io_port_word
 .global read_io_port_long
 .global write_io_port_long
+.global read_io_port_byte_string
+.global write_io_port_byte_string
+.global read_io_port_word_string
+.global write_io_port_word_string
+.global read_io_port_long_string
+.global write_io_port_long_string
 .global enable_paging_low
 .global get_irq_flag_and_disable_irqs
 .global restore_irq_flag
@@ -126,6 +134,51 @@ write_io_port_long:
 	popl	%edx
 	ret
 
+/* string io port transfers; these move a whole buffer with a single 'rep ins'/'rep outs'
+ * instruction; 3 parameters - io port (16 bit), buffer address, number of transfer units */
+.macro	IO_PORT_STRING_INPUT	insn
+	pushl	%edi
+	pushl	%edx
+	pushl	%ecx
+	movl	16(%esp),	%edx
+	movl	20(%esp),	%edi
+	movl	24(%esp),	%ecx
+	cld
+	rep	\insn
+	popl	%ecx
+	popl	%edx
+	popl	%edi
+	ret
+.endm
+
+.macro	IO_PORT_STRING_OUTPUT	insn
+	pushl	%esi
+	pushl	%edx
+	pushl	%ecx
+	movl	16(%esp),	%edx
+	movl	20(%esp),	%esi
+	movl	24(%esp),	%ecx
+	cld
+	rep	\insn
+	popl	%ecx
+	popl	%edx
+	popl	%esi
+	ret
+.endm
+
+read_io_port_byte_string:
+	IO_PORT_STRING_INPUT	insb
+write_io_port_byte_string:
+	IO_PORT_STRING_OUTPUT	outsb
+read_io_port_word_string:
+	IO_PORT_STRING_INPUT	insw
+write_io_port_word_string:
+	IO_PORT_STRING_OUTPUT	outsw
+read_io_port_long_string:
+	IO_PORT_STRING_INPUT	insl
+write_io_port_long_string:
+	IO_PORT_STRING_OUTPUT	outsl
+
 
 /* reinitialize the PIC controllers, giving them specified vector offsets
    rather than 8h and 70h, as configured by default */
@@ -428,51 +481,68 @@ keyboard_interrupt_handler_raw:
 
 	iret
 
-keyboard_interrupt_handler:
-	pushal
-	/* read scancode */
-	inb	$I8042_DATA_PORT,	%al
-	andl	$0xff,	%eax
-	pushl	%eax
-	call	translate_scancode
-	movb	%al,	0xb8000
-	popl	%eax
-
-	movb	$0x20,	%al
-	outb	%al,	$PIC1_COMMAND
-	popal
-
-	iret
-
-mouse_interrupt_handler:
+/* interrupt entry stubs, one for each of the 256 interrupt vectors, IRQ_ENTRY_STUB_SIZE
+ * bytes each; each stub pushes a zero error code for the vectors for which the processor
+ * does not push one, then pushes the vector number, and jumps to the common interrupt
+ * entry code, so that all vectors present the same frame to 'irq_dispatch()' - see
+ * 'struct irq_frame' in 'irq.h' */
+IRQ_ENTRY_STUB_SIZE	=	16
+
+.align	IRQ_ENTRY_STUB_SIZE
+irq_entry_stubs:
+vector = 0
+.rept	256
+	.align	IRQ_ENTRY_STUB_SIZE
+	/* the processor pushes an error code for the double fault, invalid tss, segment not present,
+	 * stack fault, general protection, page fault and alignment check exceptions */
+	.if	!((vector == 8) || ((vector >= 10) && (vector <= 14)) || (vector == 17))
+	pushl	$0
+	.endif
+	pushl	$vector
+	jmp	irq_common_entry
+	vector = vector + 1
+.endr
+
+irq_common_entry:
 	pushal
-	/* read mouse byte */
-	inb	$I8042_DATA_PORT,	%al
-	andl	$0xff,	%eax
-	pushl	%eax
-	call	mouse_handler
-	popl	%eax
-	movb	$'M',	0xb8000
-
-	movb	$0x20,	%al
-	outb	%al,	$PIC2_COMMAND
-	outb	%al,	$PIC1_COMMAND
+	cld
+	/* pass the address of the saved state */
+	pushl	%esp
+	call	irq_dispatch
+	addl	$4,	%esp
 	popal
-
+	/* discard the vector number and the error code */
+	addl	$8,	%esp
 	iret
 
 get_irq_flag_and_disable_irqs:
 	pushfl
 	cli
 	popl	%eax
-	shl	$9,	%eax
+	shrl	$9,	%eax
 	andl	$1,	%eax
+	jz	1f
+	/* interrupts were enabled - start timing the interrupts disabled window,
+	 * see 'irq-stats.c'; the timestamp must not be zero, zero means no timing */
+	pushl	%eax
+	pushl	%edx
+	rdtsc
+	orl	$1,	%eax
+	movl	%eax,	irqs_off_start_tsc
+	movl	8(%esp),	%eax
+	movl	%eax,	irqs_off_start_caller
+	popl	%edx
+	popl	%eax
+1:
 	ret
 
 restore_irq_flag:
 	movl	4(%esp),	%eax
 	orl	%eax,	%eax
 	jz	1f
+	pushal
+	call	irq_stats_irqs_enabled
+	popal
 	sti
 	ret
 1:
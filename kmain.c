@@ -23,6 +23,19 @@ THE SOFTWARE.
 #include "graphics-image.h"
 #include "physical-mem-map.h"
 #include "idt.h"
+#include "irq.h"
+#include "apic.h"
+#include "clock.h"
+#include "pci.h"
+#include "acpi.h"
+#include "ata.h"
+#include "ahci.h"
+#include "virtio-blk.h"
+#include "usb.h"
+#include "usb-storage.h"
+#include "usb-hid.h"
+#include "bcache.h"
+#include "fat.h"
 #include "setjmp.h"
 
 static uint8_t INITIAL_DT_SFORTH_CODE[] =
@@ -34,38 +47,25 @@ static uint8_t INITIAL_DT_SFORTH_CODE[] =
 #include "vga.efs"
 #include "pci.efs"
 #include "ata.efs"
+#include "block.efs"
 #include "ohci.efs"
 #include "arena.efs"
 " cr .( modules loaded) cr "
 //" source type "
 };
 
-static int int_handler(void);
 extern void asm_handler();
-extern struct x86_idt_gate_descriptor x86_idt[256];
-extern void load_idtr();
-extern void _8259a_remap(unsigned pic1_irq_base, unsigned pic2_irq_base);
-extern void _8259a_set_mask(unsigned mask);
 extern void _8042_init(void);
 extern void init_console(void);
-extern void keyboard_interrupt_handler();
-extern void mouse_interrupt_handler();
+extern void init_framebuffer_console(void);
+static void keyboard_irq_handler(void * argument);
+static void mouse_irq_handler(void * argument);
 
 jmp_buf jbuf;
 
 static uint8_t mouse_bytes[3], mouse_idx;
 void kmain(bool display_image_and_halt)
 {
-struct x86_idt_gate_descriptor idesc =
-{
-	.segment_selector = 0x10,
-	.set_to_zero = 0,
-	.type = INTERRUPT_GATE_32_BITS,
-	.dpl	= 0,
-	.present = 1,
-
-};
-uint32_t x;
 int i;
 unsigned char * bss, * data_src, * data_dest;
 extern void (* const _init_startup) (void), (* const _init_startup_end) (void);
@@ -99,26 +99,9 @@ void (* const * finit) (void);
 	if (display_image_and_halt)
 		load_dt_image();
 
-	x = (uint32_t) int_handler;
-	idesc.offset_15_0 = x;
-	idesc.offset_31_16 = x >> 16;
-	for (i = 0; i < 256; i ++)
-		x86_idt[i] = idesc;
-
-	x = (uint32_t) keyboard_interrupt_handler;
-	idesc.offset_15_0 = x;
-	idesc.offset_31_16 = x >> 16;
-	x86_idt[0x31] = idesc;
-
-	x = (uint32_t) mouse_interrupt_handler;
-	idesc.offset_15_0 = x;
-	idesc.offset_31_16 = x >> 16;
-	x86_idt[0x44] = idesc;
-
-	load_idtr();
-
-	_8259a_remap(0x30, 0x40);
-	_8259a_set_mask(~ 6); // enable keyboard only
+	init_irq();
+	irq_attach(IRQ_KEYBOARD, keyboard_irq_handler, 0);
+	irq_attach(IRQ_MOUSE, mouse_irq_handler, 0);
 	/*! \todo	the 8042 initialization is currently buggy... debug it */
 	if (0) _8042_init();
 
@@ -129,13 +112,27 @@ void (* const * finit) (void);
 	populate_initial_page_directory();
 	enable_paging();
 	init_physical_mem_map();
+	init_framebuffer_console();
+	init_acpi();
+	/* switch to the apics, if available; the 8259a controllers are used otherwise */
+	init_apic();
+	init_clock();
+	init_pci();
+	init_ata();
+	init_ahci();
+	init_virtio_blk();
+	init_ohci();
+	init_usb_storage();
+	init_usb_hid();
+	init_bcache();
+	init_fat();
 
 	fork();
 
 	sf_init();
 	sf_eval(INITIAL_DT_SFORTH_CODE);
 
-	init_ohci();
+	pci_bind_deferred_drivers();
 
 	do_quit();
 
@@ -153,20 +150,31 @@ void do_dump_mouse_bytes(void)
 }
 
 
-static int int_handler(void)
+/* the 8042 keyboard controller data port */
+enum { I8042_DATA_PORT = 0x60, };
+
+static void keyboard_irq_handler(void * argument)
 {
-	* (unsigned char *) 0xb8002 = 'X';
-	sf_eval(".( UNHANDLED INTERRUPT)");
-	while (1)
-		asm("hlt");
+	translate_scancode(read_io_port_byte(I8042_DATA_PORT));
 }
 
-void mouse_handler(uint8_t byte)
+static void mouse_irq_handler(void * argument)
 {
-	mouse_bytes[mouse_idx ++] = byte;
+	mouse_bytes[mouse_idx ++] = read_io_port_byte(I8042_DATA_PORT);
 	mouse_idx %= sizeof mouse_bytes;
 }
 
+/* usb mice pass their reports here, these are stored as ps/2 mouse packets */
+void mouse_report(int buttons, int dx, int dy)
+{
+	/* the y axis of ps/2 mice points up, that of usb mice points down */
+	dy = - dy;
+	mouse_bytes[0] = (buttons & 7) | 0x08 | ((dx < 0) ? 0x10 : 0) | ((dy < 0) ? 0x20 : 0);
+	mouse_bytes[1] = dx;
+	mouse_bytes[2] = dy;
+	mouse_idx = 0;
+}
+
 int load_dt_image(void)
 {
 unsigned char * p;
@@ -0,0 +1,759 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* pci configuration space access, device enumeration, and message signalled
+ * interrupt support
+ *
+ * the configuration space is accessed through the pci express enhanced
+ * configuration access mechanism (the memory mapped configuration space
+ * described by the acpi mcfg table) when available - this takes a single memory
+ * access per register, and reaches the extended configuration space at offsets
+ * 256 - 4095; the legacy i/o port mechanism is used otherwise
+ *
+ * the functions present are enumerated once, at boot, by walking the buses
+ * reachable through pci-to-pci bridges from the host bridges, and only probing
+ * the functions of multifunction devices; the table built is searched by the c
+ * code, and by the forth words in 'pci.fs'; drivers register match tables with
+ * 'pci_register_driver()', and are bound to the functions they match, with the
+ * resources of the functions set up by the pci core */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "pci.h"
+#include "frame-alloc.h"
+#include "apic.h"
+#include "acpi.h"
+#include "pgtable.h"
+#include "constants.h"
+
+enum
+{
+	/* x86 pci configuration mechanism #1 io ports */
+	IO_PCI_CONFIG_ADDRESS	=	0xcf8,
+	IO_PCI_CONFIG_DATA	=	0xcfc,
+
+	/* msi capability register offsets, relative to the capability */
+	MSI_CONTROL		=	2,
+	MSI_ADDRESS_LOW		=	4,
+	MSI_ADDRESS_HIGH	=	8,
+	MSI_DATA_32		=	8,
+	MSI_DATA_64		=	12,
+	MSI_CONTROL_ENABLE	=	1 << 0,
+	MSI_CONTROL_MULTIPLE_MESSAGE_ENABLE	=	7 << 4,
+	MSI_CONTROL_64_BIT	=	1 << 7,
+
+	/* each bus takes 1 MByte of the enhanced configuration access mechanism region */
+	ECAM_BUS_SHIFT		=	20,
+	ECAM_DEVICE_SHIFT	=	15,
+	ECAM_FUNCTION_SHIFT	=	12,
+
+	PCI_FUNCTION_TABLE_FRAMES	=	(PCI_MAX_FUNCTIONS * sizeof(struct pci_function) + FRAME_SIZE - 1) / FRAME_SIZE,
+	/* capacity of the table of drivers registered from forth */
+	MAX_FORTH_DRIVERS	=	4,
+};
+
+/* a driver registered from forth; the probe word is executed with the index of the
+ * function in the function table on the stack, and leaves a flag - true if the
+ * driver takes the function */
+struct forth_driver
+{
+	/* must be first, a pointer to the driver is a pointer to the forth driver */
+	struct pci_driver	driver;
+	struct pci_match	match[2];
+	cell			xt;
+};
+
+static struct
+{
+	/* allocated at boot, so that the table does not take room in the kernel image */
+	struct pci_function	* functions;
+	int			nr_functions;
+	/* buses already enumerated, guarding against misconfigured bridges */
+	uint32_t		buses_visited[(PCI_MAX_BUS + 1) / 32];
+	/* the memory mapped configuration space of pci segment 0, null if not available */
+	volatile uint8_t	* ecam;
+	int			ecam_start_bus;
+	int			ecam_end_bus;
+	const struct pci_driver	* drivers[PCI_MAX_DRIVERS];
+	int			nr_drivers;
+	/* bitmap of the registered deferred drivers not yet bound */
+	uint32_t		deferred_drivers;
+	struct forth_driver	forth_drivers[MAX_FORTH_DRIVERS];
+	int			nr_forth_drivers;
+}
+pci __attribute__((section(".common-data")));
+
+static uint32_t make_config_address(int bus, int device, int function, int offset)
+{
+	return (1 << 31) | ((bus & PCI_MAX_BUS) << 16) | ((device & PCI_MAX_DEVICE) << 11)
+		| ((function & PCI_MAX_FUNCTION) << 8) | (offset & 0xfc);
+}
+
+static volatile uint32_t * ecam_address(int bus, int device, int function, int offset)
+{
+	if (!pci.ecam || bus < pci.ecam_start_bus || bus > pci.ecam_end_bus)
+		return 0;
+	return (volatile uint32_t *) (pci.ecam + ((bus - pci.ecam_start_bus) << ECAM_BUS_SHIFT)
+		+ ((device & PCI_MAX_DEVICE) << ECAM_DEVICE_SHIFT) + ((function & PCI_MAX_FUNCTION) << ECAM_FUNCTION_SHIFT)
+		+ (offset & (PCI_EXTENDED_CONFIG_SPACE_SIZE - 4)));
+}
+
+uint32_t pci_config_read32(int bus, int device, int function, int offset)
+{
+volatile uint32_t * ecam = ecam_address(bus, device, function, offset);
+unsigned irqflag;
+uint32_t x;
+
+	if (ecam)
+		return * ecam;
+	/* the extended configuration space is not reachable through the i/o ports */
+	if (offset >= PCI_CONFIG_SPACE_SIZE)
+		return 0xffffffff;
+	irqflag = get_irq_flag_and_disable_irqs();
+	write_io_port_long(IO_PCI_CONFIG_ADDRESS, make_config_address(bus, device, function, offset));
+	x = read_io_port_long(IO_PCI_CONFIG_DATA);
+	restore_irq_flag(irqflag);
+	return x;
+}
+
+void pci_config_write32(int bus, int device, int function, int offset, uint32_t value)
+{
+volatile uint32_t * ecam = ecam_address(bus, device, function, offset);
+unsigned irqflag;
+
+	if (ecam)
+	{
+		* ecam = value;
+		return;
+	}
+	if (offset >= PCI_CONFIG_SPACE_SIZE)
+		return;
+	irqflag = get_irq_flag_and_disable_irqs();
+	write_io_port_long(IO_PCI_CONFIG_ADDRESS, make_config_address(bus, device, function, offset));
+	write_io_port_long(IO_PCI_CONFIG_DATA, value);
+	restore_irq_flag(irqflag);
+}
+
+uint16_t pci_config_read16(int bus, int device, int function, int offset)
+{
+	return pci_config_read32(bus, device, function, offset) >> ((offset & 2) << 3);
+}
+
+uint8_t pci_config_read8(int bus, int device, int function, int offset)
+{
+	return pci_config_read32(bus, device, function, offset) >> ((offset & 3) << 3);
+}
+
+/* a 16 bit access is used, rather than a read-modify-write of the enclosing 32 bit
+ * register; writing back the other half would clear the write-one-to-clear bits
+ * set in it, such as the bits of the status register, when writing the command register */
+void pci_config_write16(int bus, int device, int function, int offset, uint16_t value)
+{
+volatile uint32_t * ecam = ecam_address(bus, device, function, offset);
+unsigned irqflag;
+
+	if (ecam)
+	{
+		* (volatile uint16_t *) ((volatile uint8_t *) ecam + (offset & 2)) = value;
+		return;
+	}
+	if (offset >= PCI_CONFIG_SPACE_SIZE)
+		return;
+	irqflag = get_irq_flag_and_disable_irqs();
+	write_io_port_long(IO_PCI_CONFIG_ADDRESS, make_config_address(bus, device, function, offset));
+	write_io_port_word(IO_PCI_CONFIG_DATA + (offset & 2), value);
+	restore_irq_flag(irqflag);
+}
+
+int pci_find_capability(int bus, int device, int function, int capability_id)
+{
+int offset, i;
+
+	if (!(pci_config_read16(bus, device, function, PCI_STATUS) & PCI_STATUS_CAPABILITY_LIST))
+		return 0;
+	offset = pci_config_read8(bus, device, function, PCI_CAPABILITY_LIST) & 0xfc;
+	/* guard against malformed capability lists */
+	for (i = 0; offset && i < 48; i ++)
+	{
+		if (pci_config_read8(bus, device, function, offset) == capability_id)
+			return offset;
+		offset = pci_config_read8(bus, device, function, offset + 1) & 0xfc;
+	}
+	return 0;
+}
+
+int pci_find_extended_capability(int bus, int device, int function, int capability_id)
+{
+int offset = PCI_CONFIG_SPACE_SIZE, i;
+uint32_t header;
+
+	/* guard against malformed capability lists */
+	for (i = 0; offset >= PCI_CONFIG_SPACE_SIZE && i < (PCI_EXTENDED_CONFIG_SPACE_SIZE - PCI_CONFIG_SPACE_SIZE) / 4; i ++)
+	{
+		/* the header reads as all ones without the enhanced configuration access mechanism, and as zero without extended capabilities */
+		if ((header = pci_config_read32(bus, device, function, offset)) == 0xffffffff || !header)
+			return 0;
+		if ((header & 0xffff) == capability_id)
+			return offset;
+		offset = (header >> 20) & 0xffc;
+	}
+	return 0;
+}
+
+/* maps the memory mapped configuration space of pci segment 0, if described by the acpi mcfg table */
+static void pci_init_ecam(void)
+{
+const struct acpi_mcfg * mcfg = acpi_get_mcfg();
+int i;
+
+	if (pci.ecam || !mcfg)
+		return;
+	for (i = 0; i < mcfg->nr_entries; i ++)
+	{
+		if (mcfg->entries[i].segment || mcfg->entries[i].base >> 32 || mcfg->entries[i].end_bus < mcfg->entries[i].start_bus)
+			continue;
+		pci.ecam_start_bus = mcfg->entries[i].start_bus;
+		pci.ecam_end_bus = mcfg->entries[i].end_bus;
+		/* the region of the buses before the start bus is not used */
+		pci.ecam = mem_map_mmio_region(mcfg->entries[i].base + (pci.ecam_start_bus << ECAM_BUS_SHIFT),
+				(pci.ecam_end_bus - pci.ecam_start_bus + 1) << ECAM_BUS_SHIFT, true);
+		return;
+	}
+}
+
+static int nr_bars(const struct pci_function * f)
+{
+	switch (f->header_type & PCI_HEADER_TYPE_MASK)
+	{
+		case 0: return PCI_NR_BARS;
+		case PCI_HEADER_TYPE_BRIDGE: return 2;
+		default: return 0;
+	}
+}
+
+static void pci_enumerate_bus(int bus);
+
+static void pci_add_function(int bus, int device, int function)
+{
+struct pci_function * f;
+uint32_t id = pci_config_read32(bus, device, function, PCI_VENDOR_ID);
+uint32_t class_revision = pci_config_read32(bus, device, function, PCI_CLASS_REVISION);
+int i;
+
+	if (pci.nr_functions == PCI_MAX_FUNCTIONS)
+	{
+		print_str(__func__);
+		print_str("(): too many pci functions\n");
+		return;
+	}
+	f = pci.functions + pci.nr_functions ++;
+	* f = (struct pci_function)
+	{
+		.bus = bus, .device = device, .function = function,
+		.header_type = pci_config_read8(bus, device, function, PCI_HEADER_TYPE),
+		.vendor_id = id, .device_id = id >> 16,
+		.class_code = class_revision >> 24, .subclass = class_revision >> 16,
+		.prog_if = class_revision >> 8, .revision = class_revision,
+		.irq_line = pci_config_read8(bus, device, function, PCI_INTERRUPT_LINE),
+		.irq_pin = pci_config_read8(bus, device, function, PCI_INTERRUPT_PIN),
+	};
+	for (i = 0; i < nr_bars(f); i ++)
+		f->bars[i] = pci_config_read32(bus, device, function, PCI_BAR0 + i * 4);
+
+	if ((f->header_type & PCI_HEADER_TYPE_MASK) == PCI_HEADER_TYPE_BRIDGE)
+		pci_enumerate_bus(pci_config_read8(bus, device, function, PCI_SECONDARY_BUS));
+}
+
+static void pci_enumerate_bus(int bus)
+{
+int device, function, nr_functions;
+
+	if (pci.buses_visited[bus / 32] & (1 << (bus % 32)))
+		return;
+	pci.buses_visited[bus / 32] |= 1 << (bus % 32);
+	for (device = 0; device <= PCI_MAX_DEVICE; device ++)
+	{
+		if (pci_config_read16(bus, device, 0, PCI_VENDOR_ID) == 0xffff)
+			continue;
+		nr_functions = (pci_config_read8(bus, device, 0, PCI_HEADER_TYPE) & PCI_HEADER_TYPE_MULTIFUNCTION) ? PCI_MAX_FUNCTION + 1 : 1;
+		for (function = 0; function < nr_functions; function ++)
+			if (pci_config_read16(bus, device, function, PCI_VENDOR_ID) != 0xffff)
+				pci_add_function(bus, device, function);
+	}
+}
+
+void init_pci(void)
+{
+int function;
+
+	pci_init_ecam();
+	pci.nr_functions = 0;
+	if (!pci.functions && !(pci.functions = frame_alloc(PCI_FUNCTION_TABLE_FRAMES)))
+	{
+		print_str(__func__);
+		print_str("(): out of memory\n");
+		return;
+	}
+	xmemset(pci.buses_visited, 0, sizeof pci.buses_visited);
+	/* a multifunction host bridge at 00:00.0 means that there are several host
+	 * bridges, function 'n' of the host bridge device is the one for bus 'n' */
+	if (!(pci_config_read8(0, 0, 0, PCI_HEADER_TYPE) & PCI_HEADER_TYPE_MULTIFUNCTION))
+		pci_enumerate_bus(0);
+	else
+		for (function = 0; function <= PCI_MAX_FUNCTION; function ++)
+			if (pci_config_read16(0, 0, function, PCI_VENDOR_ID) != 0xffff)
+				pci_enumerate_bus(function);
+}
+
+int pci_function_count(void)
+{
+	return pci.nr_functions;
+}
+
+const struct pci_function * pci_get_function(int index)
+{
+	return (index < 0 || index >= pci.nr_functions) ? 0 : pci.functions + index;
+}
+
+bool pci_find_class(int class_code, int subclass, int index, int * bus, int * device, int * function)
+{
+const struct pci_function * f;
+
+	for (f = pci.functions; f < pci.functions + pci.nr_functions; f ++)
+		if (f->class_code == class_code && f->subclass == subclass && !index --)
+		{
+			* bus = f->bus, * device = f->device, * function = f->function;
+			return true;
+		}
+	return false;
+}
+
+bool pci_find_device(int vendor_id, int device_id, int index, int * bus, int * device, int * function)
+{
+const struct pci_function * f;
+
+	for (f = pci.functions; f < pci.functions + pci.nr_functions; f ++)
+		if (f->vendor_id == vendor_id && f->device_id == device_id && !index --)
+		{
+			* bus = f->bus, * device = f->device, * function = f->function;
+			return true;
+		}
+	return false;
+}
+
+/* decodes and sizes the base address registers of a function; the bars are
+ * sized by writing all ones to them, and reading back the address bits the
+ * function implements */
+static void pci_decode_resources(struct pci_function * f)
+{
+uint16_t command = pci_config_read16(f->bus, f->device, f->function, PCI_COMMAND);
+uint32_t bar, mask;
+struct pci_resource * r;
+int i, offset;
+
+	/* the regions must not be decoded at the addresses written while sizing */
+	pci_config_write16(f->bus, f->device, f->function, PCI_COMMAND, command & ~ (PCI_COMMAND_IO_SPACE | PCI_COMMAND_MEMORY_SPACE));
+	for (i = 0; i < nr_bars(f); i ++)
+	{
+		r = f->resources + i;
+		offset = PCI_BAR0 + i * 4;
+		bar = pci_config_read32(f->bus, f->device, f->function, offset);
+		pci_config_write32(f->bus, f->device, f->function, offset, 0xffffffff);
+		mask = pci_config_read32(f->bus, f->device, f->function, offset);
+		pci_config_write32(f->bus, f->device, f->function, offset, bar);
+		if (bar & PCI_BAR_IO_SPACE)
+		{
+			r->io = true;
+			r->base = bar & ~ 3;
+			/* the upper half of i/o base address registers may read as zero */
+			mask = mask ? (mask & ~ 3) | 0xffff0000 : 0;
+		}
+		else
+		{
+			r->base = bar & ~ 0xf;
+			r->prefetchable = bar & PCI_BAR_PREFETCHABLE;
+			mask &= ~ 0xf;
+			if ((bar & PCI_BAR_MEMORY_TYPE_MASK) == PCI_BAR_MEMORY_TYPE_64 && ++ i < nr_bars(f)
+					/* regions above 4 GBytes are not reachable */
+					&& pci_config_read32(f->bus, f->device, f->function, offset + 4))
+				mask = 0;
+		}
+		/* a base address of zero means that the firmware has not assigned the region */
+		r->size = (mask && r->base) ? ~ mask + 1 : 0;
+	}
+	pci_config_write16(f->bus, f->device, f->function, PCI_COMMAND, command);
+	f->resources_decoded = true;
+}
+
+/* maps the memory regions of a function, and enables the decoding of its regions, and bus mastering */
+static void pci_enable_resources(struct pci_function * f)
+{
+uint16_t command = pci_config_read16(f->bus, f->device, f->function, PCI_COMMAND) | PCI_COMMAND_BUS_MASTER;
+struct pci_resource * r;
+
+	if (!f->resources_decoded)
+		pci_decode_resources(f);
+	for (r = f->resources; r < f->resources + PCI_NR_BARS; r ++)
+	{
+		if (!r->size)
+			continue;
+		if (r->io)
+		{
+			command |= PCI_COMMAND_IO_SPACE;
+			continue;
+		}
+		command |= PCI_COMMAND_MEMORY_SPACE;
+		/* memory below EXTENDED_MEMORY_TOP is identity mapped */
+		if (!r->mmio)
+			r->mmio = (r->base < EXTENDED_MEMORY_TOP) ? (volatile void *) r->base
+				: mem_map_mmio_region(r->base, r->size, !r->prefetchable);
+	}
+	pci_config_write16(f->bus, f->device, f->function, PCI_COMMAND, command);
+}
+
+static bool pci_match_function(const struct pci_match * m, const struct pci_function * f)
+{
+	for (; m->vendor_id; m ++)
+		if ((m->vendor_id == PCI_ANY_ID || m->vendor_id == f->vendor_id)
+				&& (m->device_id == PCI_ANY_ID || m->device_id == f->device_id)
+				&& (m->class_code == PCI_ANY_ID || m->class_code == f->class_code)
+				&& (m->subclass == PCI_ANY_ID || m->subclass == f->subclass)
+				&& (m->prog_if == PCI_ANY_ID || m->prog_if == f->prog_if))
+			return true;
+	return false;
+}
+
+static int pci_bind_driver(const struct pci_driver * driver)
+{
+struct pci_function * f;
+uint16_t command;
+int nr_bound = 0;
+
+	for (f = pci.functions; f < pci.functions + pci.nr_functions; f ++)
+	{
+		if (f->driver || !pci_match_function(driver->match, f))
+			continue;
+		command = pci_config_read16(f->bus, f->device, f->function, PCI_COMMAND);
+		pci_enable_resources(f);
+		f->driver = driver;
+		if (driver->probe(f))
+			nr_bound ++;
+		else
+		{
+			/* the driver declined the function; do not leave it decoding, and mastering
+			 * the bus, with no driver - a later driver enables it again */
+			pci_config_write16(f->bus, f->device, f->function, PCI_COMMAND, command);
+			f->driver = 0;
+		}
+	}
+	return nr_bound;
+}
+
+int pci_register_driver(const struct pci_driver * driver)
+{
+	if (pci.nr_drivers == PCI_MAX_DRIVERS)
+	{
+		print_str(__func__);
+		print_str("(): too many pci drivers\n");
+		return 0;
+	}
+	pci.drivers[pci.nr_drivers ++] = driver;
+	if (!driver->deferred)
+		return pci_bind_driver(driver);
+	pci.deferred_drivers |= 1 << (pci.nr_drivers - 1);
+	return 0;
+}
+
+int pci_bind_deferred_drivers(void)
+{
+int i, nr_bound = 0;
+
+	for (i = 0; i < pci.nr_drivers; i ++)
+		if (pci.deferred_drivers & (1 << i))
+		{
+			pci.deferred_drivers &=~ (1 << i);
+			nr_bound += pci_bind_driver(pci.drivers[i]);
+		}
+	return nr_bound;
+}
+
+static bool forth_driver_probe(const struct pci_function * f)
+{
+const struct forth_driver * d = (const struct forth_driver *) f->driver;
+
+	sf_push(f - pci.functions);
+	sf_push(d->xt);
+	sf_eval("execute");
+	return sf_pop() != 0;
+}
+
+bool pci_enable_msi(int bus, int device, int function, int vector)
+{
+int msi = pci_find_capability(bus, device, function, PCI_CAPABILITY_MSI);
+uint16_t control;
+
+	if (!msi || !apic_enabled())
+		return false;
+	control = pci_config_read16(bus, device, function, msi + MSI_CONTROL);
+	/* request a single message */
+	control &=~ (MSI_CONTROL_ENABLE | MSI_CONTROL_MULTIPLE_MESSAGE_ENABLE);
+	pci_config_write16(bus, device, function, msi + MSI_CONTROL, control);
+
+	pci_config_write32(bus, device, function, msi + MSI_ADDRESS_LOW, apic_msi_address());
+	if (control & MSI_CONTROL_64_BIT)
+	{
+		pci_config_write32(bus, device, function, msi + MSI_ADDRESS_HIGH, 0);
+		pci_config_write16(bus, device, function, msi + MSI_DATA_64, apic_msi_data(vector));
+	}
+	else
+		pci_config_write16(bus, device, function, msi + MSI_DATA_32, apic_msi_data(vector));
+
+	pci_config_write16(bus, device, function, msi + MSI_CONTROL, control | MSI_CONTROL_ENABLE);
+	pci_config_write16(bus, device, function, PCI_COMMAND,
+			pci_config_read16(bus, device, function, PCI_COMMAND) | PCI_COMMAND_INTX_DISABLE);
+	return true;
+}
+
+void pci_disable_msi(int bus, int device, int function)
+{
+int msi = pci_find_capability(bus, device, function, PCI_CAPABILITY_MSI);
+
+	if (!msi)
+		return;
+	pci_config_write16(bus, device, function, msi + MSI_CONTROL,
+			pci_config_read16(bus, device, function, msi + MSI_CONTROL) & ~ MSI_CONTROL_ENABLE);
+	pci_config_write16(bus, device, function, PCI_COMMAND,
+			pci_config_read16(bus, device, function, PCI_COMMAND) & ~ PCI_COMMAND_INTX_DISABLE);
+}
+
+static void do_pci_find_capability(void)
+{
+/* ( bus-nr device-nr function-nr capability-id -- offset|0) */
+int id = sf_pop(), function = sf_pop(), device = sf_pop();
+
+	sf_push(pci_find_capability(sf_pop(), device, function, id));
+}
+
+static void push_function(const struct pci_function * f)
+{
+	if (!f)
+	{
+		sf_push(0);
+		return;
+	}
+	sf_push(f->bus);
+	sf_push(f->device);
+	sf_push(f->function);
+	sf_push(-1);
+}
+
+static void do_pci_function_count(void) { /* ( -- n) */ sf_push(pci.nr_functions); }
+static void do_pci_function(void) { /* ( index -- bus-nr device-nr function-nr t | f) */ push_function(pci_get_function(sf_pop())); }
+
+static void do_pci_find_device(void)
+{
+/* ( vendor-id device-id index -- bus-nr device-nr function-nr t | f) */
+int bus, device, function, index = sf_pop(), device_id = sf_pop();
+
+	if (!pci_find_device(sf_pop(), device_id, index, & bus, & device, & function))
+		sf_push(0);
+	else
+		sf_push(bus), sf_push(device), sf_push(function), sf_push(-1);
+}
+
+static void do_pci_find_class(void)
+{
+/* ( class-code subclass index -- bus-nr device-nr function-nr t | f) */
+int bus, device, function, index = sf_pop(), subclass = sf_pop();
+
+	if (!pci_find_class(sf_pop(), subclass, index, & bus, & device, & function))
+		sf_push(0);
+	else
+		sf_push(bus), sf_push(device), sf_push(function), sf_push(-1);
+}
+
+static void do_pci_bar(void)
+{
+/* ( index bar-nr -- bar-value) */
+int bar = sf_pop();
+const struct pci_function * f = pci_get_function(sf_pop());
+
+	sf_push((f && bar >= 0 && bar < PCI_NR_BARS) ? f->bars[bar] : 0);
+}
+
+static void do_pci_irq(void)
+{
+/* ( index -- irq-line irq-pin) */
+const struct pci_function * f = pci_get_function(sf_pop());
+
+	sf_push(f ? f->irq_line : 0);
+	sf_push(f ? f->irq_pin : 0);
+}
+
+static void do_pci_rescan(void)
+{
+/* ( --) */
+int i;
+
+	/* the bindings of the drivers would be lost */
+	for (i = 0; i < pci.nr_functions; i ++)
+		if (pci.functions[i].driver)
+		{
+			print_str("pci functions are bound to drivers, not rescanning\n");
+			return;
+		}
+	init_pci();
+}
+
+static void do_pci_ecam(void) { /* ( -- t=memory mapped configuration space in use|f=i/o ports in use) */ sf_push(pci.ecam ? -1 : 0); }
+
+static void do_pci_config_fetch(void)
+{
+/* ( bus-nr device-nr function-nr offset -- x) */
+int offset = sf_pop(), function = sf_pop(), device = sf_pop();
+
+	sf_push(pci_config_read32(sf_pop(), device, function, offset));
+}
+
+static void do_pci_config_store(void)
+{
+/* ( x bus-nr device-nr function-nr offset --) */
+int offset = sf_pop(), function = sf_pop(), device = sf_pop(), bus = sf_pop();
+
+	pci_config_write32(bus, device, function, offset, sf_pop());
+}
+
+static void do_pci_find_extended_capability(void)
+{
+/* ( bus-nr device-nr function-nr capability-id -- offset|0) */
+int id = sf_pop(), function = sf_pop(), device = sf_pop();
+
+	sf_push(pci_find_extended_capability(sf_pop(), device, function, id));
+}
+
+static void do_pci_driver(void)
+{
+/* ( xt vendor-id device-id class-code subclass prog-if -- n) registers a driver, with
+ * the probe word 'xt' ( function-index -- t=function taken|f=function not taken),
+ * for the functions matching the identifiers and class codes given (-1 matches any
+ * value); leaves the number of functions bound to the driver */
+struct forth_driver * d;
+int prog_if = sf_pop(), subclass = sf_pop(), class_code = sf_pop(), device_id = sf_pop(), vendor_id = sf_pop();
+cell xt = sf_pop();
+
+	if (pci.nr_forth_drivers == MAX_FORTH_DRIVERS)
+	{
+		print_str(__func__);
+		print_str("(): too many forth pci drivers\n");
+		sf_push(0);
+		return;
+	}
+	d = pci.forth_drivers + pci.nr_forth_drivers ++;
+	* d = (struct forth_driver)
+	{
+		.driver = { .name = "forth", .match = d->match, .probe = forth_driver_probe, },
+		.match = { { vendor_id, device_id, class_code, subclass, prog_if, }, },
+		.xt = xt,
+	};
+	sf_push(pci_register_driver(& d->driver));
+}
+
+static void do_pci_function_driver(void)
+{
+/* ( index -- t=function bound to a driver|f=function not bound) */
+const struct pci_function * f = pci_get_function(sf_pop());
+
+	sf_push((f && f->driver) ? -1 : 0);
+}
+
+static void do_pci_resource(void)
+{
+/* ( index bar-nr -- mapped-address|io-base size) leaves the base i/o port address of
+ * i/o regions, and the address at which memory regions are mapped; the size is zero
+ * if the region is not implemented, or the function is not bound to a driver */
+int bar = sf_pop();
+const struct pci_function * f = pci_get_function(sf_pop());
+const struct pci_resource * r = (f && bar >= 0 && bar < PCI_NR_BARS) ? f->resources + bar : 0;
+
+	sf_push(r ? (r->io ? r->base : (cell) r->mmio) : 0);
+	sf_push(r ? r->size : 0);
+}
+
+static void do_pci_drivers(void)
+{
+/* ( --) lists the registered drivers, and the functions bound to them */
+const struct pci_function * f;
+int i;
+
+	print_str("registered pci drivers:");
+	for (i = 0; i < pci.nr_drivers; i ++)
+	{
+		print_str(" ");
+		print_str(pci.drivers[i]->name);
+		if (pci.deferred_drivers & (1 << i))
+			print_str("(deferred)");
+	}
+	print_str("\nbus dev func vendor device driver\n");
+	for (f = pci.functions; f < pci.functions + pci.nr_functions; f ++)
+	{
+		if (!f->driver)
+			continue;
+		sf_push(f->bus);
+		sf_push(f->device);
+		sf_push(f->function);
+		sf_push(f->vendor_id);
+		sf_push(f->device_id);
+		sf_eval("base @ >r hex >r >r rot 3 .r swap 4 .r 5 .r r> 7 .r r> 7 .r space r> base !");
+		print_str(f->driver->name);
+		print_str("\n");
+	}
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"pci-find-capability",		do_pci_find_capability),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-function-count",		do_pci_function_count),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-function",			do_pci_function),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-find-device",		do_pci_find_device),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-find-class",		do_pci_find_class),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-bar",			do_pci_bar),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-irq",			do_pci_irq),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-rescan",			do_pci_rescan),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-ecam?",			do_pci_ecam),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-config@",			do_pci_config_fetch),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-config!",			do_pci_config_store),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-find-extended-capability",	do_pci_find_extended_capability),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-driver",			do_pci_driver),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-function-driver?",		do_pci_function_driver),
+	MKWORD(custom_dict,	__COUNTER__,	"pci-resource",			do_pci_resource),
+	MKWORD(custom_dict,	__COUNTER__,	".pci-drivers",			do_pci_drivers),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
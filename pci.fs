@@ -40,9 +40,8 @@ $cfc constant IO-PCIDATA
 	31 bit or
 	;
 : read-id ( bus-nr device-nr function-nr -- id-register)
-	make-pci-config-address
-	IO-PCICFG outpl
-	IO-PCIDATA inpl
+	\ the c accessors use the memory mapped configuration space, when available
+	0 pci-config@
 	;
 
 : read-class-code ( bus-nr device-nr function-nr -- class-code-register)
@@ -51,9 +50,7 @@ $cfc constant IO-PCIDATA
 \ byte 2 - subclass
 \ byte 1 - device-dependent interface level
 \ byte 0 - revision id
-	make-pci-config-address ( pci class register offset) 8 +
-	IO-PCICFG outpl
-	IO-PCIDATA inpl
+	( pci class register offset) 8 pci-config@
 	;
 
 : ?pci-dev-present ( bus-nr device-nr function-nr -- t=device found|f=device not found)
@@ -73,27 +70,19 @@ false value abort-scanning
 \ execute iterator-xt for every pci device found
 \ stack picture of iterator-xt ( -- t:abort scanning|f:continue scanning)
 \ current device bus device and function are stored in the values above
+\ the pci buses are not scanned here - the functions found by the
+\ enumeration done at boot are looked up in the c device table instead;
+\ use 'pci-rescan' to enumerate the pci buses again
 
 	to pci-bus-iterator-xt
 	false to abort-scanning
 	base @ hex
 	0 to pci-dev-total
-	\ scans all pci buses for devices
-	MAX-PCIBUS 1+ 0 do
-		i to current-bus-nr
-		MAX-PCIDEV 1+ 0 do
-			i to current-device-nr
-			MAX-PCIFUNC 1+ 0 do
-				i to current-function-nr
-				current-bus-nr current-device-nr current-function-nr ?pci-dev-present
-				if
-					pci-dev-total 1+ to pci-dev-total
-					pci-bus-iterator-xt execute to abort-scanning
-				then
-				abort-scanning if leave then
-			loop
-			abort-scanning if leave then
-		loop
+	pci-function-count 0 ?do
+		i pci-function drop
+		to current-function-nr to current-device-nr to current-bus-nr
+		pci-dev-total 1+ to pci-dev-total
+		pci-bus-iterator-xt execute to abort-scanning
 		abort-scanning if leave then
 	loop
 	base !
@@ -129,7 +118,7 @@ variable found-pci-device-classes-bitmap
 
 : pci-list-devices ( --)
 	0 found-pci-device-classes-bitmap !
-	." scanning all pci buses for devices..." cr cr
+	." listing the pci devices found at boot..." cr cr
 	s" bus | dev | func | vendor | device | base class | subclass |" print-table-glyphs cr
 	[ ' pci-dump-device literal ] pci-scan
 	s" ----^-----^------^--------^--------^------------^----------]"
@@ -174,7 +163,7 @@ variable found-pci-device-classes-bitmap
 : pci-locate-device ( vendor-id product-id -- pci-device-base-io-address t|f)
 	to searched-product-id to searched-vendor-id
 	base @ hex
-	." searching all pci buses for device with vendor-id:product-id: "
+	." searching the pci devices for vendor-id:product-id: "
 	searched-vendor-id . searched-product-id . ." ..."
 	base !
 	literal pci-scan
@@ -0,0 +1,199 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	PCI_MAX_BUS			=	255,
+	PCI_MAX_DEVICE			=	31,
+	PCI_MAX_FUNCTION		=	7,
+	/* capacity of the table of functions found at boot */
+	PCI_MAX_FUNCTIONS		=	256,
+	PCI_NR_BARS			=	6,
+	/* capacity of the table of registered drivers */
+	PCI_MAX_DRIVERS			=	16,
+	/* matches any value of a field of a 'struct pci_match' */
+	PCI_ANY_ID			=	-1,
+	PCI_CONFIG_SPACE_SIZE		=	256,
+	/* the configuration space size of pci express functions, reachable only
+	 * through the memory mapped enhanced configuration access mechanism */
+	PCI_EXTENDED_CONFIG_SPACE_SIZE	=	4096,
+
+	/* configuration space register offsets */
+	PCI_VENDOR_ID			=	0x00,
+	PCI_COMMAND			=	0x04,
+	PCI_STATUS			=	0x06,
+	PCI_CLASS_REVISION		=	0x08,
+	PCI_PROG_IF			=	0x09,
+	PCI_HEADER_TYPE			=	0x0e,
+	PCI_BAR0			=	0x10,
+	PCI_BAR4			=	0x20,
+	PCI_BAR5			=	0x24,
+	PCI_CAPABILITY_LIST		=	0x34,
+	PCI_INTERRUPT_LINE		=	0x3c,
+	PCI_INTERRUPT_PIN		=	0x3d,
+	/* pci-to-pci bridge (header type 1) registers */
+	PCI_SECONDARY_BUS		=	0x19,
+
+	PCI_HEADER_TYPE_MASK		=	0x7f,
+	PCI_HEADER_TYPE_BRIDGE		=	0x01,
+	PCI_HEADER_TYPE_MULTIFUNCTION	=	0x80,
+
+	PCI_COMMAND_IO_SPACE		=	1 << 0,
+	PCI_COMMAND_MEMORY_SPACE	=	1 << 1,
+	PCI_COMMAND_BUS_MASTER		=	1 << 2,
+	PCI_COMMAND_INTX_DISABLE	=	1 << 10,
+	PCI_STATUS_CAPABILITY_LIST	=	1 << 4,
+	/* set in base address registers mapping i/o space */
+	PCI_BAR_IO_SPACE		=	1 << 0,
+	PCI_BAR_MEMORY_TYPE_MASK	=	3 << 1,
+	PCI_BAR_MEMORY_TYPE_64		=	2 << 1,
+	PCI_BAR_PREFETCHABLE		=	1 << 3,
+
+	/* class codes */
+	PCI_CLASS_MASS_STORAGE		=	0x01,
+	PCI_SUBCLASS_IDE		=	0x01,
+	PCI_SUBCLASS_SATA		=	0x06,
+	/* serial ata programming interfaces */
+	PCI_PROG_IF_AHCI		=	0x01,
+	PCI_CLASS_SERIAL_BUS		=	0x0c,
+	PCI_SUBCLASS_USB		=	0x03,
+	/* usb programming interfaces */
+	PCI_PROG_IF_OHCI		=	0x10,
+
+	/* capability identifiers */
+	PCI_CAPABILITY_MSI		=	0x05,
+	PCI_CAPABILITY_MSIX		=	0x11,
+};
+
+/* a decoded base address register; the resources of a function are only
+ * decoded, and sized, when a driver matching the function is found */
+struct pci_resource
+{
+	uint32_t	base;
+	/* 0 if the base address register is not implemented, or is unusable
+	 * (e.g. a 64 bit memory region above 4 GBytes) */
+	uint32_t	size;
+	bool		io;
+	bool		prefetchable;
+	/* the mapping of a memory region, null for i/o regions */
+	volatile void	* mmio;
+};
+
+struct pci_driver;
+
+/* a function found by the enumeration at boot */
+struct pci_function
+{
+	uint8_t		bus;
+	uint8_t		device;
+	uint8_t		function;
+	uint8_t		header_type;
+	uint16_t	vendor_id;
+	uint16_t	device_id;
+	uint8_t		class_code;
+	uint8_t		subclass;
+	uint8_t		prog_if;
+	uint8_t		revision;
+	uint8_t		irq_line;
+	/* 0 if the function does not use an interrupt pin, 1 - 4 for pins a - d */
+	uint8_t		irq_pin;
+	/* the base address register values; bridges only have the first two */
+	uint32_t	bars[PCI_NR_BARS];
+	/* the base address registers, decoded when binding a driver; the second half
+	 * of a 64 bit memory base address register is left unused */
+	struct pci_resource	resources[PCI_NR_BARS];
+	bool		resources_decoded;
+	/* the driver the function is bound to, null if none */
+	const struct pci_driver	* driver;
+};
+
+/* an entry of a driver match table; the fields set to PCI_ANY_ID match any value,
+ * a zero 'vendor_id' terminates the table */
+struct pci_match
+{
+	int	vendor_id;
+	int	device_id;
+	int	class_code;
+	int	subclass;
+	int	prog_if;
+};
+
+/* a pci device driver; for each function not yet bound to a driver, and matched by
+ * an entry of the match table, the pci core decodes and sizes the base address
+ * registers, maps the memory regions, enables the i/o and memory space decoding and
+ * bus mastering of the function, and calls 'probe()', which returns true if the
+ * driver takes the function; while the driver is being probed, the 'driver' field
+ * of the function points to it */
+struct pci_driver
+{
+	const char		* name;
+	const struct pci_match	* match;
+	bool			(* probe)(const struct pci_function * f);
+	/* drivers whose initialization is not needed for booting (or which need the
+	 * forth environment already set up) are bound by 'pci_bind_deferred_drivers()',
+	 * and not on registration */
+	bool			deferred;
+};
+
+/* maps the memory mapped configuration space, if available, and enumerates the pci functions, following the buses behind pci-to-pci bridges, and
+ * builds the table of functions, which the 'pci_find_...()' functions search */
+void init_pci(void);
+int pci_function_count(void);
+const struct pci_function * pci_get_function(int index);
+
+/* registers a driver, and binds it to the matching functions, unless the
+ * driver is deferred; returns the number of functions bound */
+int pci_register_driver(const struct pci_driver * driver);
+/* binds the deferred drivers registered so far; returns the number of functions bound */
+int pci_bind_deferred_drivers(void);
+
+/* configuration space accesses; offsets must be naturally aligned for the access size;
+ * offsets of 256 and above are only reachable when the memory mapped configuration
+ * space is in use - otherwise such reads return all ones, and writes are ignored */
+uint32_t pci_config_read32(int bus, int device, int function, int offset);
+uint16_t pci_config_read16(int bus, int device, int function, int offset);
+uint8_t pci_config_read8(int bus, int device, int function, int offset);
+void pci_config_write32(int bus, int device, int function, int offset, uint32_t value);
+void pci_config_write16(int bus, int device, int function, int offset, uint16_t value);
+
+/* returns the configuration space offset of a capability, or 0 if the device does not have it */
+int pci_find_capability(int bus, int device, int function, int capability_id);
+/* the same, for pci express extended capabilities */
+int pci_find_extended_capability(int bus, int device, int function, int capability_id);
+/* finds the 'index'-th (counting from 0) function with the given base class code
+ * and subclass; returns false if there is no such function */
+bool pci_find_class(int class_code, int subclass, int index, int * bus, int * device, int * function);
+/* the same, for functions with the given vendor and device identifiers */
+bool pci_find_device(int vendor_id, int device_id, int index, int * bus, int * device, int * function);
+/* programs the device's msi capability to deliver the given vector to this processor,
+ * and disables the legacy interrupt pin of the device; returns false if the device
+ * does not support msi, or the apics are not in use */
+bool pci_enable_msi(int bus, int device, int function, int vector);
+void pci_disable_msi(int bus, int device, int function);
+
+#endif /* __PCI_H__ */
@@ -19,7 +19,11 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
+#ifndef __PGTABLE_H__
+#define __PGTABLE_H__
+
 #include <stdint.h>
+#include <stdbool.h>
 
 enum
 {
@@ -127,3 +131,17 @@ struct pgte
 	/* physical address of the 4-KByte page referenced by this entry */
 	uint32_t	physical_address	: 20;
 };
+
+/* identity maps a memory mapped device region located above the
+ * memory mapped by the initial page tables (e.g. a frame buffer, or
+ * some controller's registers); returns the address to use for accessing
+ * the region, or null on failure */
+void * mem_map_mmio_region(uint32_t physical_address, uint32_t size, bool disable_cache);
+
+/* returns the physical address a kernel virtual address below EXTENDED_MEMORY_TOP
+ * is currently mapped to, e.g. for programming dma transfers; the per-process data
+ * of the active process is mapped away from its link address; returns 0 for
+ * unmapped addresses, and for addresses at or above EXTENDED_MEMORY_TOP */
+uint32_t mem_virtual_to_physical(const void * virtual_address);
+
+#endif /* __PGTABLE_H__ */
@@ -22,13 +22,15 @@ THE SOFTWARE.
 
 #include "sf-cfg.h"
 #include "sf-arch.h"
+#include "fat.h"
 
 //int sfgetc(void) { return -1; }
 int sfgetc(void) { return user_getchar(); }
-int sffgetc(cell file_id) { return -1; }
+int sffgetc(cell file_id) { unsigned char c; return fat_read(file_id, & c, 1) == 1 ? c : -1; }
 //int sfputc(int c) { static int xyz = 0; unsigned char * x = 0xb8000 + 160; x[xyz += 2] = c; return 0; }
 int sfputc(int c) { user_putchar(c); return 0; }
 int sfsync(void) { return -1; }
-cell sfopen(const char * pathname, int flags) { return -1; }
-int sfclose(cell file_id) { return -1; }
-int sffseek(cell stream, long offset) { return -1; }
+/* files are opened read-only by the engine, for including source code */
+cell sfopen(const char * pathname, int flags) { int length = 0; while (pathname[length]) length ++; return fat_open(pathname, length, FAT_READ); }
+int sfclose(cell file_id) { return fat_close(file_id); }
+int sffseek(cell stream, long offset) { return fat_seek(stream, offset); }
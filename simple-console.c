@@ -23,6 +23,11 @@ THE SOFTWARE.
 #include "constants.h"
 #include "simple-console.h"
 #include "common-data.h"
+#include "frame-alloc.h"
+#include "fb-console.h"
+#include "irq.h"
+#include "bcache.h"
+#include "blockdev.h"
 
 static struct
 {
@@ -36,6 +41,8 @@ console_state __attribute__((section(".common-data"))) =
 };
 
 static struct video_console video_console;
+/* set when the console is displayed on a vbe linear frame buffer, instead of vga text mode memory */
+static bool fb_console_active;
 
 static struct
 {
@@ -45,14 +52,142 @@ static struct
 }
 console_ring_buffer;
 
+/* console scrollback history; lines scrolled off the top of the console
+ * are kept here, with trailing spaces stripped, in a ring of text in
+ * extended memory; the ring is allocated on first use, by each kernel
+ * process for itself */
+static struct
+{
+	/* the kernel process that allocated the history buffers below; the
+	 * console state is duplicated by 'fork()', and each kernel process
+	 * must have a history of its own */
+	int		owner_process;
+	/* ring of history text, CONSOLE_SCROLLBACK_TEXT_BYTES in size */
+	uint8_t		* text;
+	/* rings of history line start offsets in the text ring, and of history line lengths */
+	uint32_t	* line_start;
+	uint8_t		* line_length;
+	/* total number of text bytes, and of lines, ever pushed to the history;
+	 * these wrap around, and are only used modulo the ring sizes */
+	uint32_t	text_head, line_head;
+	/* number of lines currently available in the history */
+	int		nr_lines;
+	/* number of lines the display is currently scrolled back; zero
+	 * when the live console contents are being displayed */
+	int		view_offset;
+}
+scrollback;
+
+enum
+{
+	SCROLLBACK_NR_FRAMES	= (CONSOLE_SCROLLBACK_TEXT_BYTES + CONSOLE_SCROLLBACK_LINES * (sizeof(uint32_t) + sizeof(uint8_t))
+					+ FRAME_SIZE - 1) / FRAME_SIZE,
+};
+
+/* displays a single console cell, either in text mode video memory, or on the frame buffer */
+static void display_cell(int row, int column, struct video_memory cell)
+{
+	if (fb_console_active)
+		fb_console_put_cell(row, column, cell.character, cell.attributes);
+	else
+		video_console.raw_video_memory[row * video_console.columns + column] = cell;
+}
+
+static void display_console_cell(int row, int column)
+{
+	display_cell(row, column, video_console.video_memory[row][column]);
+}
+
 void do_console_refresh(void)
 {
 unsigned irqflag = get_irq_flag_and_disable_irqs();
+int i;
 
-	xmemcpy(video_console.raw_video_memory, video_console.raw_video_contents, sizeof video_console.raw_video_contents);
+	scrollback.view_offset = 0;
+	if (fb_console_active)
+		fb_console_update(video_console.video_memory, 0, video_console.rows - 1);
+	else for (i = 0; i < video_console.rows; i ++)
+		xmemcpy((void *) (video_console.raw_video_memory + i * video_console.columns),
+				video_console.video_memory[i], video_console.columns * sizeof(struct video_memory));
 	restore_irq_flag(irqflag);
 }
 
+static bool scrollback_alloc(void)
+{
+uint8_t * p;
+
+	if (scrollback.text && scrollback.owner_process == active_process)
+		return true;
+	if (!(p = frame_alloc(SCROLLBACK_NR_FRAMES)))
+		return false;
+	scrollback.owner_process = active_process;
+	scrollback.text = p;
+	scrollback.line_start = (uint32_t *) (p + CONSOLE_SCROLLBACK_TEXT_BYTES);
+	scrollback.line_length = (uint8_t *) (scrollback.line_start + CONSOLE_SCROLLBACK_LINES);
+	scrollback.text_head = scrollback.line_head = 0;
+	scrollback.nr_lines = scrollback.view_offset = 0;
+	return true;
+}
+
+/* returns the index in the line rings of a history line; line 0 is the oldest line in the history */
+static int scrollback_line_index(int line)
+{
+	return (scrollback.line_head - scrollback.nr_lines + line) & (CONSOLE_SCROLLBACK_LINES - 1);
+}
+
+/* appends a console row to the history, discarding the oldest history lines as needed */
+static void scrollback_push_row(int row)
+{
+int i, len;
+
+	if (!scrollback_alloc())
+		return;
+	for (len = video_console.columns; len && video_console.video_memory[row][len - 1].character == ' '; len --)
+		;
+	while (scrollback.nr_lines == CONSOLE_SCROLLBACK_LINES || (scrollback.nr_lines
+			&& scrollback.text_head + len - scrollback.line_start[scrollback_line_index(0)] > CONSOLE_SCROLLBACK_TEXT_BYTES))
+		scrollback.nr_lines --;
+
+	scrollback.line_start[scrollback.line_head & (CONSOLE_SCROLLBACK_LINES - 1)] = scrollback.text_head;
+	scrollback.line_length[scrollback.line_head & (CONSOLE_SCROLLBACK_LINES - 1)] = len;
+	for (i = 0; i < len; i ++)
+		scrollback.text[scrollback.text_head ++ & (CONSOLE_SCROLLBACK_TEXT_BYTES - 1)] = video_console.video_memory[row][i].character;
+	scrollback.line_head ++;
+	scrollback.nr_lines ++;
+}
+
+/* displays the console contents, scrolled back by 'scrollback.view_offset' lines;
+ * history lines are rendered straight from the text ring to video memory */
+static void scrollback_render(void)
+{
+int row, i, line, len;
+uint32_t start;
+struct video_memory cell = { .attributes = CHARACTER_ATTRIBUTE_NORMAL, };
+
+	for (row = 0; row < video_console.rows; row ++)
+	{
+		if ((line = scrollback.nr_lines - scrollback.view_offset + row) >= scrollback.nr_lines)
+		{
+			for (i = 0; i < video_console.columns; i ++)
+				display_console_cell(row, i);
+			continue;
+		}
+		start = scrollback.line_start[scrollback_line_index(line)];
+		len = scrollback.line_length[scrollback_line_index(line)];
+		for (i = 0; i < video_console.columns; i ++)
+		{
+			cell.character = (i < len) ? scrollback.text[(start + i) & (CONSOLE_SCROLLBACK_TEXT_BYTES - 1)] : ' ';
+			display_cell(row, i, cell);
+		}
+	}
+}
+
+static void scrollback_snap_to_bottom(void)
+{
+	if (scrollback.view_offset)
+		do_console_refresh();
+}
+
 /* assumed is that this is called from within interrupt context, and thus cannot block */
 static bool console_ring_buffer_try_push(int c)
 {
@@ -72,9 +207,17 @@ static int console_ring_buffer_pull(void)
 int c;
 	while (1)
 	{
+		irq_run_deferred_handlers();
+		bcache_background_writeback();
+		blockdev_run_queues();
 		asm("cli");
 		if (!console_ring_buffer.level)
 		{
+			if (irq_deferred_handlers_pending() || bcache_writeback_pending() || blockdev_queues_pending())
+			{
+				asm("sti");
+				continue;
+			}
 			asm("sti");
 			asm("hlt");
 			continue;
@@ -92,22 +235,23 @@ int c;
 
 static void do_draw_cursor(void)
 {
-	video_console.raw_video_memory[0][video_console.cursor_row][video_console.cursor_column].attributes
-		= video_console.video_memory[video_console.cursor_row][video_console.cursor_column].attributes = CHARACTER_ATTRIBUTE_CURSOR;
+	video_console.video_memory[video_console.cursor_row][video_console.cursor_column].attributes = CHARACTER_ATTRIBUTE_CURSOR;
+	display_console_cell(video_console.cursor_row, video_console.cursor_column);
 }
 static void do_hide_cursor(void)
 {
-	video_console.raw_video_memory[0][video_console.cursor_row][video_console.cursor_column].attributes
-		= video_console.video_memory[video_console.cursor_row][video_console.cursor_column].attributes = CHARACTER_ATTRIBUTE_NORMAL;
+	video_console.video_memory[video_console.cursor_row][video_console.cursor_column].attributes = CHARACTER_ATTRIBUTE_NORMAL;
+	display_console_cell(video_console.cursor_row, video_console.cursor_column);
 }
 
 static void do_console_scroll(void)
 {
 int i;
 	do_hide_cursor();
-	xmemcpy(video_console.video_memory, video_console.video_memory[1], (CONSOLE_ROWS - 1) * sizeof * video_console.video_memory);
-	for (i = 0; i < CONSOLE_COLUMNS; i ++)
-		video_console.video_memory[CONSOLE_ROWS - 1][i].character = ' ';
+	scrollback_push_row(0);
+	xmemcpy(video_console.video_memory, video_console.video_memory[1], (video_console.rows - 1) * sizeof * video_console.video_memory);
+	for (i = 0; i < video_console.columns; i ++)
+		video_console.video_memory[video_console.rows - 1][i].character = ' ';
 	do_console_refresh();
 	do_draw_cursor();
 }
@@ -117,9 +261,11 @@ void do_console_cleanup(void)
 int i, j;
 
 	do_hide_cursor();
+	for (i = 0; i < video_console.cursor_row; i ++)
+		scrollback_push_row(i);
 	xmemcpy(video_console.video_memory, video_console.video_memory[video_console.cursor_row], sizeof * video_console.video_memory);
-	for (i = 1; i < CONSOLE_ROWS; i ++)
-		for (j = 0; j < CONSOLE_COLUMNS; j ++)
+	for (i = 1; i < video_console.rows; i ++)
+		for (j = 0; j < video_console.columns; j ++)
 			video_console.video_memory[i][j].character = ' ';
 	do_console_refresh();
 	do_draw_cursor();
@@ -302,9 +448,7 @@ int i, j;
 	if (j > video_console.cursor_lock_position)
 	{
 		j --;
-		(* video_console.raw_video_memory)[i][j].character
-			= video_console.video_memory[i][j].character
-				= ' ';
+		video_console.video_memory[i][j].character = ' ';
 		do_hide_cursor();
 		video_console.cursor_column = j;
 		do_draw_cursor();
@@ -351,7 +495,7 @@ static void put_enter(void)
 int i;
 
 	i = video_console.cursor_row;
-	if (i != CONSOLE_ROWS - 1)
+	if (i != video_console.rows - 1)
 		i ++;
 	else
 		do_console_scroll();
@@ -374,6 +518,28 @@ int i;
 	return 0;
 }
 
+static int handle_page_up(int scancode)
+{
+	if (scrollback.view_offset == scrollback.nr_lines)
+		return 0;
+	scrollback.view_offset += video_console.rows - 1;
+	if (scrollback.view_offset > scrollback.nr_lines)
+		scrollback.view_offset = scrollback.nr_lines;
+	scrollback_render();
+	return 0;
+}
+
+static int handle_page_down(int scancode)
+{
+	if (!scrollback.view_offset)
+		return 0;
+	if ((scrollback.view_offset -= video_console.rows - 1) <= 0)
+		do_console_refresh();
+	else
+		scrollback_render();
+	return 0;
+}
+
 static int handle_fn_keys(int scancode)
 {
 	if (console_state.alt_active)
@@ -449,6 +615,9 @@ translation_table[256] =
 	[0x43]	=	{ 	0, 0, handle_fn_keys, },
 	[0x44]	=	{ 	0, 0, handle_fn_keys, },
 
+	[0x49]	=	{ 	0, 0, handle_page_up, },
+	[0x51]	=	{ 	0, 0, handle_page_down, },
+
 	[0x39]	=	{ 	' ', ' ', 0, },
 	[0x38]	=	{ 	0, 0, handle_alt_pressed, handle_alt_released, },
 	[0x0e]	=	{ 	0, 0, handle_backspace, },
@@ -466,10 +635,8 @@ int i, j;
 	i = video_console.cursor_row;
 	j = video_console.cursor_column;
 
-	(* video_console.raw_video_memory)[i][j].character
-		= video_console.video_memory[i][j].character
-			= c;
-	if (++ j == CONSOLE_COLUMNS)
+	video_console.video_memory[i][j].character = c;
+	if (++ j == video_console.columns)
 		j --;
 	do_hide_cursor();
 	video_console.cursor_column = j;
@@ -486,6 +653,8 @@ struct keyboard_scancode_entry e;
 	if (!(scancode & 0x80))
 	{
 		/* make code */
+		if (e.make_handler != handle_page_up && e.make_handler != handle_page_down)
+			scrollback_snap_to_bottom();
 		if (e.make_handler)
 			c = e.make_handler(scancode);
 		else
@@ -507,16 +676,44 @@ void init_console(void)
 int i, j;
 
 	video_console.raw_video_memory = (void *) 0xb8000;
-	for (i = 0; i < CONSOLE_ROWS; i ++)
-		for (j = 0; j < CONSOLE_COLUMNS; j ++)
+	video_console.rows = CONSOLE_ROWS;
+	video_console.columns = CONSOLE_COLUMNS;
+	for (i = 0; i < CONSOLE_MAX_ROWS; i ++)
+		for (j = 0; j < CONSOLE_MAX_COLUMNS; j ++)
 		{
-			(* video_console.raw_video_memory)[i][j].character
-				= video_console.video_memory[i][j].character
-					= ' ';
-			(* video_console.raw_video_memory)[i][j].attributes
-				= video_console.video_memory[i][j].attributes
-					= CHARACTER_ATTRIBUTE_NORMAL;
+			video_console.video_memory[i][j].character = ' ';
+			video_console.video_memory[i][j].attributes = CHARACTER_ATTRIBUTE_NORMAL;
 		}
+	do_console_refresh();
+}
+
+/* switches the console over to the vbe frame buffer, if the loader has set up a graphics mode;
+ * this must be called after the physical memory map has been initialized, and before any processes are forked */
+void init_framebuffer_console(void)
+{
+int rows, columns, delta, i;
+
+	if (!fb_console_init(& rows, & columns))
+		return;
+	if (rows > CONSOLE_MAX_ROWS)
+		rows = CONSOLE_MAX_ROWS;
+	if (columns > CONSOLE_MAX_COLUMNS)
+		columns = CONSOLE_MAX_COLUMNS;
+	/* keep the cursor line visible, if the frame buffer console has less rows than the text mode console */
+	if ((delta = video_console.cursor_row - (rows - 1)) > 0)
+	{
+		xmemcpy(video_console.video_memory, video_console.video_memory[delta], (video_console.rows - delta) * sizeof * video_console.video_memory);
+		for (; delta; delta --)
+			for (i = 0; i < CONSOLE_MAX_COLUMNS; i ++)
+				video_console.video_memory[video_console.rows - delta][i].character = ' ';
+		video_console.cursor_row = rows - 1;
+	}
+	if (video_console.cursor_column >= columns)
+		video_console.cursor_column = columns - 1;
+	video_console.rows = rows;
+	video_console.columns = columns;
+	fb_console_active = true;
+	do_console_refresh();
 }
 
 /*! \todo	this sucks... */
@@ -524,6 +721,7 @@ void user_putchar(int c)
 {
 unsigned irqflag = get_irq_flag_and_disable_irqs();
 
+	scrollback_snap_to_bottom();
 	c == '\n' ? (put_enter(), video_console.cursor_lock_position = 0)
 		: (console_character_input(c), video_console.cursor_lock_position = video_console.cursor_column);
 	restore_irq_flag(irqflag);
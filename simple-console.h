@@ -27,30 +27,37 @@ THE SOFTWARE.
 
 enum
 {
+	/* vga text mode console dimensions */
 	CONSOLE_ROWS			=	50,
 	CONSOLE_COLUMNS			=	80,
+	/* maximum console dimensions, when the console is displayed on a
+	 * vbe linear frame buffer - see 'fb-console.c' */
+	CONSOLE_MAX_ROWS		=	64,
+	CONSOLE_MAX_COLUMNS		=	160,
 	CONSOLE_RING_BUFFER_SIZE	=	1024,
+	/* scrollback history limits; the history is kept as a ring of
+	 * lines with trailing spaces stripped, so the text ring is normally
+	 * exhausted well after the line limit is reached; both must be powers of two */
+	CONSOLE_SCROLLBACK_LINES	=	4096,
+	CONSOLE_SCROLLBACK_TEXT_BYTES	=	256 * 1024,
 
 	CHARACTER_ATTRIBUTE_NORMAL	=	6 + 8,
 	CHARACTER_ATTRIBUTE_CURSOR	=	19,
 };
 
+struct video_memory
+{
+	uint8_t	character;
+	uint8_t attributes;
+};
+
 struct video_console
 {
-	struct
-	{
-		union
-		{
-			struct video_memory
-			{
-				uint8_t	character;
-				uint8_t attributes;
-			}
-			video_memory[CONSOLE_ROWS][CONSOLE_COLUMNS];
-			uint16_t raw_video_contents[CONSOLE_ROWS * CONSOLE_COLUMNS];
-		};
-		volatile struct video_memory (* raw_video_memory)[CONSOLE_ROWS][CONSOLE_COLUMNS];
-	};
+	struct video_memory video_memory[CONSOLE_MAX_ROWS][CONSOLE_MAX_COLUMNS];
+	/* the actual console dimensions, these depend on the video mode in use */
+	int	rows, columns;
+	/* vga text mode video memory; not used when the console is displayed on a frame buffer */
+	volatile struct video_memory * raw_video_memory;
 	int	cursor_row, cursor_column;
 	int	cursor_lock_position;
 
@@ -0,0 +1,318 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* storage benchmark - measures the sequential and random read and write throughput,
+ * the number of requests per second, and the request latency of a block device;
+ * requests go straight to the block device request queue, bypassing the buffer
+ * cache, with a configurable number of requests kept outstanding; latencies are
+ * measured with the timestamp counter, and are collected in histograms with power
+ * of two (microsecond) buckets; the results are printed on the console, and are
+ * also sent to the first serial port, for collecting them from another machine */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "blockdev.h"
+#include "bcache.h"
+#include "clock.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+enum
+{
+	/* bucket n counts the requests completed in [2^n, 2^(n + 1)) microseconds, bucket 0 also counts the ones under a microsecond */
+	BENCH_HISTOGRAM_BUCKETS		=	24,
+	BENCH_MAX_QUEUE_DEPTH		=	BLOCKDEV_QUEUE_DEPTH,
+	BENCH_MAX_BLOCK_SECTORS		=	BLOCKDEV_MAX_MERGE_SECTORS,
+	BENCH_DEFAULT_DURATION_MS	=	3000,
+	/* only devices with this sector size are benchmarked */
+	BENCH_SECTOR_SIZE		=	512,
+};
+
+struct bench_slot
+{
+	struct blockdev_request	request;
+	bool			active;
+	uint64_t		submit_us;
+	uint64_t		complete_us;
+};
+
+struct bench_result
+{
+	uint32_t	nr_requests;
+	uint32_t	nr_errors;
+	uint64_t	bytes;
+	uint64_t	elapsed_us;
+	uint64_t	total_latency_us;
+	uint32_t	min_latency_us;
+	uint32_t	max_latency_us;
+	uint32_t	histogram[BENCH_HISTOGRAM_BUCKETS];
+};
+
+/* benchmark parameters; a zero lba count stands for the rest of the device */
+static struct
+{
+	uint32_t	block_sectors;
+	uint32_t	queue_depth;
+	uint32_t	duration_ms;
+	uint32_t	first_lba;
+	uint32_t	nr_lbas;
+}
+params = { .block_sectors = 8, .queue_depth = 1, .duration_ms = BENCH_DEFAULT_DURATION_MS, };
+
+/* the requests are only ever dispatched by the process that queued them, so these may be private to each process */
+static struct bench_slot slots[BENCH_MAX_QUEUE_DEPTH];
+static uint32_t random_state;
+
+/* both console and serial port output */
+static void report(const char * s)
+{
+	print_str(s);
+	for (; * s; s ++)
+	{
+		if (* s == '\n')
+			uart1_putchar('\r');
+		uart1_putchar(* s);
+	}
+}
+
+static void report_number(uint64_t x)
+{
+char buffer[24], * p = buffer + sizeof buffer;
+
+	* -- p = 0;
+	do
+		* -- p = '0' + x % 10;
+	while (x /= 10);
+	report(p);
+}
+
+static void report_field(const char * label, uint64_t x, const char * unit)
+{
+	report(label);
+	report_number(x);
+	report(unit);
+}
+
+/* xorshift32 pseudorandom numbers; the sequence is restarted for each run, so that runs are repeatable */
+static uint32_t random_next(void)
+{
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 17;
+	random_state ^= random_state << 5;
+	return random_state;
+}
+
+static void bench_done(struct blockdev_request * request)
+{
+	((struct bench_slot *) request->argument)->complete_us = clock_us();
+}
+
+static void bench_account(struct bench_slot * slot, struct bench_result * result)
+{
+uint32_t latency = slot->complete_us - slot->submit_us;
+int bucket;
+
+	result->nr_requests ++;
+	if (slot->request.status)
+		result->nr_errors ++;
+	else
+		result->bytes += slot->request.count * BENCH_SECTOR_SIZE;
+	result->total_latency_us += latency;
+	if (result->nr_requests == 1 || latency < result->min_latency_us)
+		result->min_latency_us = latency;
+	if (latency > result->max_latency_us)
+		result->max_latency_us = latency;
+	for (bucket = 0; bucket < BENCH_HISTOGRAM_BUCKETS - 1 && latency >> (bucket + 1); bucket ++)
+		;
+	result->histogram[bucket] ++;
+}
+
+/* returns the upper bound of the latency histogram bucket holding the given percentile */
+static uint64_t bench_percentile(struct bench_result * result, int percent)
+{
+uint64_t n = 0, target = ((uint64_t) result->nr_requests * percent + 99) / 100;
+int bucket;
+
+	for (bucket = 0; bucket < BENCH_HISTOGRAM_BUCKETS - 1; bucket ++)
+		if ((n += result->histogram[bucket]) >= target)
+			break;
+	return (uint64_t) 2 << bucket;
+}
+
+static int bench_run(int device_number, bool write, bool random, uint8_t * buffers, struct bench_result * result)
+{
+struct block_device * dev = blockdev_get(device_number);
+uint64_t start, end;
+uint32_t nr_blocks, next_block = 0, block;
+int i, nr_active = 0;
+
+	nr_blocks = (params.nr_lbas ? params.nr_lbas : dev->nr_sectors - params.first_lba) / params.block_sectors;
+	if (!nr_blocks)
+		return -1;
+	xmemset(result, 0, sizeof * result);
+	random_state = 0x12345678;
+	start = clock_us();
+	end = start + (uint64_t) params.duration_ms * 1000;
+	for (i = 0; ; i = (i + 1) % params.queue_depth)
+	{
+		if (slots[i].active)
+		{
+			blockdev_wait(device_number, & slots[i].request);
+			slots[i].active = false;
+			nr_active --;
+			bench_account(slots + i, result);
+		}
+		if (clock_us() >= end)
+		{
+			if (!nr_active)
+				break;
+			continue;
+		}
+		block = random ? random_next() % nr_blocks : next_block ++ % nr_blocks;
+		slots[i] = (struct bench_slot)
+		{
+			.request = { .lba = params.first_lba + (uint64_t) block * params.block_sectors, .count = params.block_sectors,
+				.buffer = buffers + i * params.block_sectors * BENCH_SECTOR_SIZE, .write = write,
+				.done = bench_done, .argument = slots + i, },
+			.active = true,
+			.submit_us = clock_us(),
+		};
+		if (blockdev_queue(device_number, & slots[i].request))
+			return -1;
+		nr_active ++;
+	}
+	result->elapsed_us = clock_us() - start;
+	return 0;
+}
+
+static void bench_report(const char * name, struct bench_result * result)
+{
+int i;
+
+	report(name);
+	report_field(": ", result->nr_requests, " requests");
+	report_field(", ", result->nr_errors, " errors");
+	report_field(", ", result->elapsed_us ? result->bytes * 1000000 / 1024 / result->elapsed_us : 0, " KB/s");
+	report_field(", ", result->elapsed_us ? (uint64_t) result->nr_requests * 1000000 / result->elapsed_us : 0, " iops\n");
+	if (!result->nr_requests)
+		return;
+	report_field("  latency us: min ", result->min_latency_us, "");
+	report_field(", avg ", result->total_latency_us / result->nr_requests, "");
+	report_field(", max ", result->max_latency_us, "");
+	report_field(", p50 < ", bench_percentile(result, 50), "");
+	report_field(", p99 < ", bench_percentile(result, 99), "\n");
+	report("  histogram (log2 us:count)");
+	for (i = 0; i < BENCH_HISTOGRAM_BUCKETS; i ++)
+		if (result->histogram[i])
+		{
+			report_field(" ", i, ":");
+			report_number(result->histogram[i]);
+		}
+	report("\n");
+}
+
+static void storage_bench(int device_number, bool write)
+{
+struct block_device * dev = blockdev_get(device_number);
+struct bench_result result;
+uint32_t nr_frames;
+uint8_t * buffers;
+
+	if (!dev || dev->sector_size != BENCH_SECTOR_SIZE || params.first_lba >= dev->nr_sectors
+			|| (params.nr_lbas && params.nr_lbas > dev->nr_sectors - params.first_lba))
+	{
+		print_str(__func__);
+		print_str("(): bad device, or bad lba range\n");
+		return;
+	}
+	/* the benchmark accesses the device directly; the cache must neither keep blocks of the
+	 * device, which the writes would make stale, nor dirty blocks, which would be written
+	 * back over the benchmark range */
+	if (bcache_invalidate(device_number))
+	{
+		print_str(__func__);
+		print_str("(): can not invalidate the block cache\n");
+		return;
+	}
+	nr_frames = (params.queue_depth * params.block_sectors * BENCH_SECTOR_SIZE + FRAME_SIZE - 1) / FRAME_SIZE;
+	if (!(buffers = frame_alloc(nr_frames)))
+	{
+		print_str(__func__);
+		print_str("(): out of memory\n");
+		return;
+	}
+	report("storage benchmark, device ");
+	report(dev->name);
+	report_field(", block size ", params.block_sectors * BENCH_SECTOR_SIZE, " bytes");
+	report_field(", queue depth ", params.queue_depth, "");
+	report_field(", lba ", params.first_lba, "");
+	report_field(" +", params.nr_lbas ? params.nr_lbas : dev->nr_sectors - params.first_lba, "\n");
+	if (!bench_run(device_number, write, false, buffers, & result))
+		bench_report(write ? "sequential write" : "sequential read", & result);
+	if (!bench_run(device_number, write, true, buffers, & result))
+		bench_report(write ? "random write" : "random read", & result);
+	frame_free(buffers, nr_frames);
+}
+
+/*
+ * forth words
+ */
+
+static void do_bench_params(void)
+{
+/* ( block-sectors queue-depth first-lba lba-count --) */
+uint32_t nr_lbas = sf_pop(), first_lba = sf_pop(), queue_depth = sf_pop(), block_sectors = sf_pop();
+
+	if (!block_sectors || block_sectors > BENCH_MAX_BLOCK_SECTORS || !queue_depth || queue_depth > BENCH_MAX_QUEUE_DEPTH)
+	{
+		print_str(__func__);
+		print_str("(): bad block size, or bad queue depth\n");
+		return;
+	}
+	params.block_sectors = block_sectors;
+	params.queue_depth = queue_depth;
+	params.first_lba = first_lba;
+	params.nr_lbas = nr_lbas;
+}
+
+static void do_bench_duration(void) { /* ( ms --) */ params.duration_ms = sf_pop(); }
+static void do_bench_read(void) { /* ( device --) */ storage_bench(sf_pop(), false); }
+/* destroys the data in the benchmarked lba range */
+static void do_bench_write(void) { /* ( device --) */ storage_bench(sf_pop(), true); }
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"bench-params",		do_bench_params),
+	MKWORD(custom_dict,	__COUNTER__,	"bench-duration",		do_bench_duration),
+	MKWORD(custom_dict,	__COUNTER__,	"bench-read",			do_bench_read),
+	MKWORD(custom_dict,	__COUNTER__,	"bench-write",			do_bench_write),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
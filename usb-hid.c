@@ -0,0 +1,205 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* usb keyboard and mouse driver, using the boot protocol of the hid class, with
+ * its fixed report formats, so that no report descriptor need be parsed; the
+ * reports are read from an interrupt endpoint, polled by the host controller at
+ * the interval the device asks for, and are handled by the interrupt handler of
+ * the host controller. Keyboard reports are translated to the scancodes of ps/2
+ * keyboards, and are passed to the console as keys pressed on a ps/2 keyboard
+ * are; mouse reports are stored as ps/2 mouse packets */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "engine.h"
+#include "clock.h"
+#include "usb.h"
+#include "usb-hid.h"
+
+extern int translate_scancode(int scancode);
+extern void mouse_report(int buttons, int dx, int dy);
+
+static struct usb_hid devices[MAX_USB_HID_DEVICES] __attribute__((section(".common-data")));
+static int nr_devices __attribute__((section(".common-data")));
+
+enum
+{
+	/* the bit of a scancode set for a key released */
+	SCANCODE_BREAK	=	0x80,
+};
+
+/* ps/2 scancode set 1 make codes of the key usages of the keyboard usage page */
+static const uint8_t usage_scancodes[] =
+{
+	/* a - z */
+	[0x04] = 0x1e, [0x05] = 0x30, [0x06] = 0x2e, [0x07] = 0x20, [0x08] = 0x12, [0x09] = 0x21,
+	[0x0a] = 0x22, [0x0b] = 0x23, [0x0c] = 0x17, [0x0d] = 0x24, [0x0e] = 0x25, [0x0f] = 0x26,
+	[0x10] = 0x32, [0x11] = 0x31, [0x12] = 0x18, [0x13] = 0x19, [0x14] = 0x10, [0x15] = 0x13,
+	[0x16] = 0x1f, [0x17] = 0x14, [0x18] = 0x16, [0x19] = 0x2f, [0x1a] = 0x11, [0x1b] = 0x2d,
+	[0x1c] = 0x15, [0x1d] = 0x2c,
+	/* 1 - 9, 0 */
+	[0x1e] = 0x02, [0x1f] = 0x03, [0x20] = 0x04, [0x21] = 0x05, [0x22] = 0x06, [0x23] = 0x07,
+	[0x24] = 0x08, [0x25] = 0x09, [0x26] = 0x0a, [0x27] = 0x0b,
+	/* enter, escape, backspace, tab, space */
+	[0x28] = 0x1c, [0x29] = 0x01, [0x2a] = 0x0e, [0x2b] = 0x0f, [0x2c] = 0x39,
+	/* - = [ ] \ # ; ' ` , . / */
+	[0x2d] = 0x0c, [0x2e] = 0x0d, [0x2f] = 0x1a, [0x30] = 0x1b, [0x31] = 0x2b, [0x32] = 0x2b,
+	[0x33] = 0x27, [0x34] = 0x28, [0x35] = 0x29, [0x36] = 0x33, [0x37] = 0x34, [0x38] = 0x35,
+	/* caps lock, f1 - f12 */
+	[0x39] = 0x3a, [0x3a] = 0x3b, [0x3b] = 0x3c, [0x3c] = 0x3d, [0x3d] = 0x3e, [0x3e] = 0x3f,
+	[0x3f] = 0x40, [0x40] = 0x41, [0x41] = 0x42, [0x42] = 0x43, [0x43] = 0x44, [0x44] = 0x57,
+	[0x45] = 0x58,
+	/* insert, home, page up, delete, end, page down, right, left, down, up */
+	[0x49] = 0x52, [0x4a] = 0x47, [0x4b] = 0x49, [0x4c] = 0x53, [0x4d] = 0x4f, [0x4e] = 0x51,
+	[0x4f] = 0x4d, [0x50] = 0x4b, [0x51] = 0x50, [0x52] = 0x48,
+};
+
+/* the scancodes of the modifier keys, by their bit in the keyboard report - the left
+ * and right control, shift, alt and gui keys; the right keys use the scancodes of the
+ * left ones, but for shift, as the console does not tell them apart */
+static const uint8_t modifier_scancodes[8] = { 0x1d, 0x2a, 0x38, 0, 0x1d, 0x36, 0x38, 0, };
+
+static int usage_scancode(int usage)
+{
+	return (usage < sizeof usage_scancodes) ? usage_scancodes[usage] : 0;
+}
+
+static bool key_pressed(const uint8_t * report, int usage)
+{
+int i;
+
+	for (i = USB_HID_KEYBOARD_FIRST_KEY; i < USB_HID_KEYBOARD_REPORT_SIZE; i ++)
+		if (report[i] == usage)
+			return true;
+	return false;
+}
+
+static void usb_hid_repeat(void * argument)
+{
+struct usb_hid * hid = argument;
+
+	translate_scancode(hid->repeat_scancode);
+}
+
+static void usb_hid_keyboard_report(struct usb_hid * hid, int length)
+{
+const uint8_t * report = hid->report, * previous = hid->previous;
+int i, scancode, changed;
+
+	if (length < USB_HID_KEYBOARD_REPORT_SIZE || report[USB_HID_KEYBOARD_FIRST_KEY] == USB_HID_USAGE_ROLLOVER_ERROR)
+		return;
+	changed = report[0] ^ previous[0];
+	for (i = 0; i < 8; i ++)
+		if ((changed & (1 << i)) && modifier_scancodes[i])
+			translate_scancode(modifier_scancodes[i] | ((report[0] & (1 << i)) ? 0 : SCANCODE_BREAK));
+	/* the keys released are handled before the keys pressed */
+	for (i = USB_HID_KEYBOARD_FIRST_KEY; i < USB_HID_KEYBOARD_REPORT_SIZE; i ++)
+		if (previous[i] >= USB_HID_USAGE_FIRST_KEY && !key_pressed(report, previous[i])
+				&& (scancode = usage_scancode(previous[i])))
+		{
+			translate_scancode(scancode | SCANCODE_BREAK);
+			if (scancode == hid->repeat_scancode)
+			{
+				timer_cancel(& hid->repeat_timer);
+				hid->repeat_scancode = 0;
+			}
+		}
+	for (i = USB_HID_KEYBOARD_FIRST_KEY; i < USB_HID_KEYBOARD_REPORT_SIZE; i ++)
+		if (report[i] >= USB_HID_USAGE_FIRST_KEY && !key_pressed(previous, report[i])
+				&& (scancode = usage_scancode(report[i])))
+		{
+			translate_scancode(scancode);
+			/* the key pressed last is the one repeated */
+			hid->repeat_scancode = scancode;
+			timer_start(& hid->repeat_timer, USB_HID_REPEAT_DELAY_MS * CLOCK_TICK_HZ / 1000,
+					USB_HID_REPEAT_PERIOD_MS * CLOCK_TICK_HZ / 1000, usb_hid_repeat, hid);
+		}
+	xmemcpy(hid->previous, hid->report, sizeof hid->previous);
+}
+
+/* called from the interrupt handler of the host controller */
+static bool usb_hid_complete(struct usb_endpoint * endpoint, void * buffer, int length, void * argument)
+{
+struct usb_hid * hid = argument;
+
+	if (length < 0)
+	{
+		print_str("usb hid: report transfer failed\n");
+		if (hid->keyboard)
+			timer_cancel(& hid->repeat_timer);
+		return false;
+	}
+	if (hid->keyboard)
+		usb_hid_keyboard_report(hid, length);
+	else if (length >= USB_HID_MOUSE_REPORT_SIZE)
+		mouse_report(hid->report[0], (int8_t) hid->report[1], (int8_t) hid->report[2]);
+	return true;
+}
+
+static bool usb_hid_probe(struct usb_device * device, const uint8_t * interface)
+{
+struct usb_hid * hid = devices + nr_devices;
+const uint8_t * endpoint;
+uint8_t setup[USB_SETUP_PACKET_SIZE];
+int length;
+
+	if (nr_devices == MAX_USB_HID_DEVICES
+			|| (interface[USB_INTERFACE_PROTOCOL] != USB_HID_PROTOCOL_KEYBOARD && interface[USB_INTERFACE_PROTOCOL] != USB_HID_PROTOCOL_MOUSE)
+			|| !(endpoint = usb_find_endpoint(device, interface, USB_ENDPOINT_TYPE_INTERRUPT, true, 0)))
+		return false;
+	* hid = (struct usb_hid) { .device = device, .keyboard = interface[USB_INTERFACE_PROTOCOL] == USB_HID_PROTOCOL_KEYBOARD, };
+
+	usb_setup_packet(setup, USB_REQUEST_TYPE_CLASS | USB_REQUEST_RECIPIENT_INTERFACE, USB_HID_REQUEST_SET_PROTOCOL,
+			USB_HID_BOOT_PROTOCOL, interface[USB_INTERFACE_NUMBER], 0);
+	if (usb_control_transfer(device, setup, 0, 0) < 0)
+		return false;
+	/* only have reports sent when they change; mice need not support the request */
+	usb_setup_packet(setup, USB_REQUEST_TYPE_CLASS | USB_REQUEST_RECIPIENT_INTERFACE, USB_HID_REQUEST_SET_IDLE,
+			0, interface[USB_INTERFACE_NUMBER], 0);
+	usb_control_transfer(device, setup, 0, 0);
+
+	if (!(hid->endpoint = usb_open_endpoint(device, endpoint)))
+		return false;
+	length = (endpoint[USB_ENDPOINT_MAX_PACKET_SIZE] | (endpoint[USB_ENDPOINT_MAX_PACKET_SIZE + 1] << 8)) & USB_ENDPOINT_MAX_PACKET_SIZE_MASK;
+	if (length > USB_HID_REPORT_SIZE)
+		length = USB_HID_REPORT_SIZE;
+	if (usb_interrupt_start(hid->endpoint, hid->report, length, usb_hid_complete, hid) < 0)
+		return false;
+	nr_devices ++;
+	print_str(hid->keyboard ? "usb keyboard found\n" : "usb mouse found\n");
+	return true;
+}
+
+static const struct usb_driver usb_hid_driver =
+{
+	.name		= "usb-hid",
+	.class_code	= USB_CLASS_HID,
+	.subclass	= USB_HID_SUBCLASS_BOOT,
+	.protocol	= USB_ANY,
+	.probe		= usb_hid_probe,
+};
+
+void init_usb_hid(void)
+{
+	usb_register_driver(& usb_hid_driver);
+}
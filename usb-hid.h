@@ -0,0 +1,78 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __USB_HID_H__
+#define __USB_HID_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "clock.h"
+#include "usb.h"
+
+enum
+{
+	MAX_USB_HID_DEVICES		=	4,
+	/* the boot interface subclass, and its protocols */
+	USB_HID_SUBCLASS_BOOT		=	1,
+	USB_HID_PROTOCOL_KEYBOARD	=	1,
+	USB_HID_PROTOCOL_MOUSE		=	2,
+	/* hid class requests */
+	USB_HID_REQUEST_SET_IDLE	=	0x0a,
+	USB_HID_REQUEST_SET_PROTOCOL	=	0x0b,
+	USB_HID_BOOT_PROTOCOL		=	0,
+
+	/* boot protocol reports; a keyboard report holds the modifier key bits, a reserved
+	 * byte, and the usages of up to six keys pressed; a mouse report holds the button
+	 * bits, and the x and y displacements */
+	USB_HID_REPORT_SIZE		=	8,
+	USB_HID_KEYBOARD_REPORT_SIZE	=	8,
+	USB_HID_KEYBOARD_FIRST_KEY	=	2,
+	USB_HID_MOUSE_REPORT_SIZE	=	3,
+	/* the key usages of a keyboard report, when too many keys are pressed */
+	USB_HID_USAGE_ROLLOVER_ERROR	=	1,
+	/* the usages below this are not keys */
+	USB_HID_USAGE_FIRST_KEY		=	4,
+
+	/* boot protocol keyboards do not repeat keys held down; the repeat is done here,
+	 * as the typematic of ps/2 keyboards does, in milliseconds */
+	USB_HID_REPEAT_DELAY_MS		=	500,
+	USB_HID_REPEAT_PERIOD_MS	=	33,
+};
+
+/* a boot protocol keyboard, or mouse; accessed from the interrupt handler, so
+ * these reside in common data */
+struct usb_hid
+{
+	struct usb_device	* device;
+	struct usb_endpoint	* endpoint;
+	bool			keyboard;
+	uint8_t			report[USB_HID_REPORT_SIZE];
+	/* the last keyboard report, the keys pressed and released are found by comparing against it */
+	uint8_t			previous[USB_HID_KEYBOARD_REPORT_SIZE];
+	/* the scancode of the key repeated, zero if none */
+	int			repeat_scancode;
+	struct timer		repeat_timer;
+};
+
+void init_usb_hid(void);
+
+#endif /* __USB_HID_H__ */
@@ -20,24 +20,130 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
 
+/* usb ohci host controller driver; transfers are queued on the endpoint
+ * descriptor lists of the host controller as chains of transfer descriptors,
+ * only the last descriptor of a transfer requests an interrupt when it is
+ * retired - the interrupts of the other descriptors are delayed, and so
+ * coalesced, into it. The interrupt handler reaps the done queue the host
+ * controller writes back to the hcca, and completes the transfers whose
+ * descriptors have all been retired, or which have failed; the processor is
+ * halted while waiting for a transfer to complete. The done queue is polled
+ * instead when no interrupt could be attached, or interrupts are disabled.
+ * An endpoint has at most a single transfer in progress. The descriptors are
+ * allocated from pools growing a page frame at a time, the descriptors of a
+ * transfer are allocated as a batch before it is queued. The descriptors, and
+ * the hcca, are in identity mapped memory shared by all processes, and are
+ * accessible from the interrupt handler regardless of the process active.
+ * Interrupt endpoints are linked in the periodic schedule, a tree of dummy
+ * endpoints with a level per polling interval, each interrupt endpoint is
+ * linked at the least loaded node of the level of its interval; the transfers
+ * of interrupt endpoints are completed by the interrupt handler, which passes
+ * them to their drivers, and queues them again.
+ * The devices attached to the root hub ports are enumerated, and configured,
+ * when the controller is initialized, and are then bound to the usb drivers
+ * registered; hubs, and hot plugging, are not supported */
+
 #include <stdint.h>
+#include <stdbool.h>
 #include "utils.h"
 #include "engine.h"
+#include <sf-word-wizard.h>
+#include "clock.h"
+#include "pci.h"
+#include "irq.h"
+#include "pgtable.h"
+#include "frame-alloc.h"
+#include "usb.h"
 
-/*
- * this value was obtained by reading the BAR0 pci register of the virtualbox
- * ohci device
- */
 enum
 {
-#define SFORTH_OHCI_PHYSICAL_MEM_BASE	"$f0804000"
-	OHCI_PHYSICAL_MEM_BASE	=	0xf0804000,
-	/*! \todo	init this from the root hub status register */
-	OHCI_NR_HUB_PORTS	=	12,
-	OHCI_MAX_NR_HUB_PORTS	=	12,
-	/* number of endpoint descriptor groups to statically allocate;
-	 * each group contains 32 endpoint descriptors */
-	OHCI_NR_ED_GROUPS,
+	OHCI_MAX_NR_HUB_PORTS	=	15,
+	/* the maximum number of page frames of a descriptor pool */
+	OHCI_MAX_POOL_FRAMES	=	16,
+	/* the number of hcca interrupt table entries, and of the nodes of the periodic
+	 * schedule tree - with levels for intervals of 1, 2, 4, 8, 16 and 32 ms */
+	OHCI_NR_INTERRUPT_ENTRIES	=	32,
+	OHCI_NR_PERIODIC_NODES		=	2 * OHCI_NR_INTERRUPT_ENTRIES - 1,
+	/* timeouts, in milliseconds; the host controller reset must complete in 10 us, the
+	 * root hub port reset takes about 10 ms */
+	OHCI_RESET_TIMEOUT_MS		=	10,
+	OHCI_OWNERSHIP_TIMEOUT_MS	=	100,
+	OHCI_PORT_RESET_TIMEOUT_MS	=	100,
+	OHCI_TRANSFER_TIMEOUT_MS	=	1000,
+	/* the host controller may access a skipped endpoint until the end of the current frame */
+	OHCI_FRAME_WAIT_MS		=	2,
+	/* the device must accept requests 2 ms after its address has been set */
+	USB_SET_ADDRESS_RECOVERY_MS	=	2,
+
+	/* frame interval, and the largest full speed data packet, in bits, that may be started in a frame */
+	OHCI_FM_INTERVAL		=	0x27792edf,
+	/* 90 % of the frame interval */
+	OHCI_PERIODIC_START		=	0x2a2f,
+
+	/* HcControl bits */
+	OHCI_CONTROL_PLE		=	1 << 2,
+	OHCI_CONTROL_CLE		=	1 << 4,
+	OHCI_CONTROL_BLE		=	1 << 5,
+	OHCI_CONTROL_HCFS_MASK		=	3 << 6,
+	OHCI_CONTROL_HCFS_OPERATIONAL	=	2 << 6,
+	/* set while the system management mode firmware owns the host controller */
+	OHCI_CONTROL_IR			=	1 << 8,
+	/* HcCommandStatus bits */
+	OHCI_COMMAND_HCR		=	1 << 0,
+	OHCI_COMMAND_CLF		=	1 << 1,
+	OHCI_COMMAND_BLF		=	1 << 2,
+	OHCI_COMMAND_OCR		=	1 << 3,
+	/* HcInterruptStatus, HcInterruptEnable and HcInterruptDisable bits */
+	OHCI_INTERRUPT_WDH		=	1 << 1,
+	OHCI_INTERRUPT_UE		=	1 << 4,
+	OHCI_INTERRUPT_MIE		=	1 << 31,
+	OHCI_INTERRUPT_ALL		=	0xc000007f,
+	/* root hub registers */
+	OHCI_RH_A_NDP_MASK		=	0xff,
+	OHCI_RH_A_POTPGT_SHIFT		=	24,
+	/* writing this to HcRhStatus turns the power of all ports on */
+	OHCI_RH_STATUS_LPSC		=	1 << 16,
+	OHCI_PORT_CCS			=	1 << 0,
+	OHCI_PORT_PES			=	1 << 1,
+	OHCI_PORT_PRS			=	1 << 4,
+	OHCI_PORT_LSDA			=	1 << 9,
+	OHCI_PORT_PRSC			=	1 << 20,
+	OHCI_PORT_CHANGE_BITS		=	0x1f << 16,
+
+	/* transfer descriptor flags */
+	OHCI_TD_ROUNDING		=	1 << 18,
+	OHCI_TD_PID_SETUP		=	0 << 19,
+	OHCI_TD_PID_OUT			=	1 << 19,
+	OHCI_TD_PID_IN			=	2 << 19,
+	OHCI_TD_DELAY_INTERRUPT_MASK	=	7 << 21,
+	/* the descriptor does not interrupt when retired */
+	OHCI_TD_NO_INTERRUPT		=	7 << 21,
+	/* the toggle is taken from the toggle carry of the endpoint when neither is given */
+	OHCI_TD_TOGGLE_MASK		=	3 << 24,
+	OHCI_TD_TOGGLE_DATA0		=	2 << 24,
+	OHCI_TD_TOGGLE_DATA1		=	3 << 24,
+	OHCI_TD_CC_SHIFT		=	28,
+	/* condition codes */
+	OHCI_CC_NO_ERROR		=	0,
+	OHCI_CC_STALL			=	4,
+	OHCI_CC_DATA_UNDERRUN		=	9,
+	OHCI_CC_NOT_ACCESSED		=	15,
+
+	/* endpoint descriptor flags */
+	OHCI_ED_ENDPOINT_SHIFT		=	7,
+	OHCI_ED_DIRECTION_OUT		=	1 << 11,
+	OHCI_ED_DIRECTION_IN		=	2 << 11,
+	OHCI_ED_LOW_SPEED		=	1 << 13,
+	OHCI_ED_SKIP			=	1 << 14,
+	OHCI_ED_MAX_PACKET_SHIFT	=	16,
+	OHCI_ED_MAX_PACKET_MASK		=	0x7ff << 16,
+	/* bits of the endpoint descriptor head pointer */
+	OHCI_ED_HEAD_HALTED		=	1 << 0,
+	OHCI_ED_HEAD_TOGGLE_CARRY	=	1 << 1,
+	OHCI_ED_HEAD_MASK		=	~ 0xf,
+
+	/* a transfer descriptor buffer may cross a single page boundary */
+	OHCI_PAGE_SIZE			=	4096,
 };
 
 
@@ -67,9 +173,88 @@ struct ohci_registers
 	uint32_t	HcRhPortStatus[OHCI_MAX_NR_HUB_PORTS];
 };
 
+/* descriptor pools; descriptors are carved out of page frames, which are identity
+ * mapped, and naturally aligned, so that the descriptors keep the alignment that
+ * the host controller requires; the free descriptors are linked in a list through
+ * their first word, so that allocating and freeing a descriptor takes constant
+ * time; a pool grows a frame at a time, when it runs out of descriptors */
+struct ohci_pool
+{
+	const char	* name;
+	uint32_t	element_size;
+	void		* free_list;
+	int		nr_free;
+	int		nr_used;
+	int		max_used;
+	int		nr_frames;
+	/* the number of allocations failed */
+	int		nr_failures;
+};
+
+static bool ohci_pool_grow(struct ohci_pool * pool)
+{
+uint8_t * frame;
+uint32_t offset;
+
+	if (pool->nr_frames == OHCI_MAX_POOL_FRAMES || !(frame = frame_alloc(1)))
+		return false;
+	pool->nr_frames ++;
+	for (offset = 0; offset + pool->element_size <= FRAME_SIZE; offset += pool->element_size)
+	{
+		* (void **) (frame + offset) = pool->free_list;
+		pool->free_list = frame + offset;
+		pool->nr_free ++;
+	}
+	return true;
+}
+
+/* allocates a batch of descriptors - either all of them, or none; the descriptors
+ * are linked through their first word, the last one links to null */
+static void * ohci_pool_alloc(struct ohci_pool * pool, int count)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+void * first, ** last;
+int i;
+
+	while (pool->nr_free < count)
+		if (!ohci_pool_grow(pool))
+		{
+			pool->nr_failures ++;
+			restore_irq_flag(irqflag);
+			print_str("usb ohci: out of ");
+			print_str(pool->name);
+			print_str("\n");
+			return 0;
+		}
+	first = pool->free_list;
+	for (last = first, i = 1; i < count; i ++)
+		last = * last;
+	pool->free_list = * last;
+	* last = 0;
+	pool->nr_free -= count;
+	if ((pool->nr_used += count) > pool->max_used)
+		pool->max_used = pool->nr_used;
+	restore_irq_flag(irqflag);
+	return first;
+}
+
+/* descriptors are also freed by the interrupt handler */
+static void ohci_pool_free(struct ohci_pool * pool, void * element)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	* (void **) element = pool->free_list;
+	pool->free_list = element;
+	pool->nr_free ++;
+	pool->nr_used --;
+	restore_irq_flag(irqflag);
+}
+
+struct ohci_ed;
+
 /* ohci transfer descriptor */
 struct ohci_td
-{	
+{
 	union
 	{
 		struct
@@ -85,7 +270,7 @@ struct ohci_td
 			uint32_t	delay_interrupt	:	3;
 			uint32_t	data_toggle	:	2;
 			uint32_t	error_count	:	2;
-			uint32_t	condition_code	:	2;
+			uint32_t	condition_code	:	4;
 		};
 		uint32_t	flags;
 	};
@@ -101,23 +286,27 @@ struct ohci_td
 	struct ohci_td * next;
 	/* points to the last byte of the buffer */
 	void	* buffer_end;
+	/* the fields below are not accessed by the host controller */
+	/* the endpoint the descriptor is queued on */
+	volatile struct ohci_ed	* ed;
+	/* the size of the buffer */
+	uint32_t	length;
+	/* the sequence number of the transfer the descriptor belongs to */
+	uint32_t	transfer;
 } __attribute__ ((aligned (16), packed));
-static uint32_t bitmap_used_tds;
-static volatile struct ohci_td tds[32];
+static struct ohci_pool td_pool __attribute__((section(".common-data"))) =
+	{ .name = "transfer descriptors", .element_size = sizeof(struct ohci_td), };
+static volatile struct ohci_td * allot_tds(int count)
+{
+	return ohci_pool_alloc(& td_pool, count);
+}
 static volatile struct ohci_td * allot_td(void)
 {
-int x;
-	if ((x = find_first_clear(bitmap_used_tds)) == -1)
-	{
-		*(int*)0=0;
-		return 0;
-	}
-	bitmap_used_tds |= 1 << x;
-	return tds + x;
+	return allot_tds(1);
 }
 static void free_td(volatile struct ohci_td * td)
 {
-	bitmap_used_tds &=~ (1 << (td - tds));
+	ohci_pool_free(& td_pool, (void *) td);
 }
 
 /* ohci endpoint descriptor */
@@ -145,7 +334,7 @@ struct ohci_ed
 			uint32_t	skip		:	1;
 			/* format of the descriptors linked to this ED:
 			 * 0 - general transfer descriptor format - used for bulk, control, interrupt endpoints
-			 * 1 - isochronous transfer descriptor	 
+			 * 1 - isochronous transfer descriptor
 			 */
 			uint32_t	format		:	1;
 			uint32_t	max_packet_size	:	11;
@@ -167,260 +356,941 @@ struct ohci_ed
 	};
 	/* this is 0 for the last entry in the list */
 	struct ohci_ed	* next;
+	/* the fields below are not accessed by the host controller, they
+	 * describe the transfer in progress on the endpoint */
+	/* the last descriptor queued for a transfer not yet started */
+	volatile struct ohci_td	* last_td;
+	/* the sequence number of the last transfer queued; descriptors of a cancelled
+	 * transfer may still be retired by the host controller afterwards, and must not
+	 * be accounted to the transfer following it */
+	volatile uint32_t	transfer;
+	/* the endpoint the descriptor is set up for */
+	struct usb_endpoint	* endpoint;
+	/* the descriptors allocated for the transfer, and not yet queued, linked through their first word */
+	volatile struct ohci_td	* spare_tds;
+	/* the number of descriptors of the transfer not yet retired */
+	volatile int		nr_pending;
+	/* the number of bytes transferred by the descriptors retired */
+	volatile uint32_t	transferred;
+	/* the condition code of the first descriptor retired with an error */
+	volatile int		condition_code;
+	/* set when all descriptors of the transfer have been retired, or one has failed */
+	volatile bool		done;
 } __attribute__ ((aligned (16), packed));
-static uint32_t bitmap_used_eds[OHCI_NR_ED_GROUPS];
-static volatile struct ohci_ed eds[32 * OHCI_NR_ED_GROUPS];
+static struct ohci_pool ed_pool __attribute__((section(".common-data"))) =
+	{ .name = "endpoint descriptors", .element_size = sizeof(struct ohci_ed), };
 static volatile struct ohci_ed * allot_ed(void)
 {
-int x, i;
-struct ohci_ed * ed;
-	for (i = 0; i < OHCI_NR_ED_GROUPS; i ++)
-		if ((x = find_first_clear(bitmap_used_eds[i])) != -1)
-			break;
-	if (i == OHCI_NR_ED_GROUPS)
-	{
-		print_str("OUT OF ENDPOINT DESCRIPTORS");
-		while (1)
-			asm("hlt");
-		return 0;
-	}
-	bitmap_used_eds[i] |= 1 << x;
+volatile struct ohci_ed * ed;
 
-	ed = eds + x + (i << 5);
-	ed->flags = /* skip */ bit(14);
-	ed->next = 0;
-	ed->tail = 0;
-	ed->head = 0;
+	if (!(ed = ohci_pool_alloc(& ed_pool, 1)))
+		return 0;
+	xmemset((void *) ed, 0, sizeof * ed);
+	ed->flags = OHCI_ED_SKIP;
 	return ed;
 }
 static void free_ed(volatile struct ohci_ed * ed)
 {
-int i = ed - eds;
-	bitmap_used_eds[i >> 5] &=~ (1 << (i & ((1 << 5) - 1)));
+	ohci_pool_free(& ed_pool, (void *) ed);
 }
 
 /* HCCA - host controller communications area */
 struct ohci_hcca
 {
-	volatile struct ohci_ed	* interrupt_table[32];
+	volatile struct ohci_ed	* interrupt_table[OHCI_NR_INTERRUPT_ENTRIES];
 	/* note: this field is 16 bit, the most significant 16 bits are set to zero by the hardware */
 	uint32_t	frame_number;
-	struct ohci_td	done_head;
+	/* the host controller sets bit 0 when other interrupts are also pending */
+	uint32_t	done_head;
 	uint32_t	reserved[116 / 4];
 } __attribute__ ((aligned (256), packed));
-static volatile struct ohci_hcca ohci_hcca;
+static volatile struct ohci_hcca ohci_hcca __attribute__((section(".common-data")));
+
+static volatile struct ohci_registers * ohci __attribute__((section(".common-data")));
+/* true if no interrupt handler could be attached, and the done queue must be polled */
+static bool ohci_polled __attribute__((section(".common-data")));
+
+/* the first endpoints of the control and bulk lists are skipped dummies, so
+ * that endpoints are appended to the lists without touching the list head registers */
+static volatile struct ohci_ed * ohci_control_list __attribute__((section(".common-data")));
+static volatile struct ohci_ed * ohci_bulk_list __attribute__((section(".common-data")));
+/* the periodic schedule; the nodes of the level of interval n are at indices n - 1
+ * to 2n - 2, node n - 1 + i is reached from the interrupt table entries i, i + n,
+ * i + 2n..., and so is visited every n frames; the nodes are skipped dummy
+ * endpoints, the interrupt endpoints are linked after them */
+static volatile struct ohci_ed * ohci_periodic_nodes[OHCI_NR_PERIODIC_NODES] __attribute__((section(".common-data")));
+/* the number of interrupt endpoints linked at each node */
+static int ohci_periodic_load[OHCI_NR_PERIODIC_NODES] __attribute__((section(".common-data")));
+/* polls the done queue, for interrupt endpoints, when no interrupt handler could be attached */
+static struct timer ohci_poll_timer __attribute__((section(".common-data")));
+
+struct usb_endpoint
+{
+	volatile struct ohci_ed	* ed;
+	struct usb_device	* device;
+	/* the endpoint address, including the direction bit */
+	int		address;
+	int		type;
+	int		max_packet_size;
+	int		interval;
+	/* the completion handler of the transfers on an interrupt endpoint, and their buffer */
+	bool		(* complete)(struct usb_endpoint * endpoint, void * buffer, int length, void * argument);
+	void		* buffer;
+	uint32_t	length;
+	void		* argument;
+};
+
+static int ohci_queue_interrupt(struct usb_endpoint * endpoint);
 
-static volatile struct ohci_registers * ohci;
+/* devices and endpoints are never released, as hot plugging is not supported; the
+ * tables are allocated when the controller is bound, so that they do not take room
+ * in the kernel image */
+static struct usb_device * usb_devices __attribute__((section(".common-data")));
+static int nr_usb_devices __attribute__((section(".common-data")));
+static struct usb_endpoint * usb_endpoints __attribute__((section(".common-data")));
+static int nr_usb_endpoints __attribute__((section(".common-data")));
+static const struct usb_driver * usb_drivers[USB_MAX_DRIVERS] __attribute__((section(".common-data")));
+static int nr_usb_drivers __attribute__((section(".common-data")));
 
-static uint8_t device_descriptor[18];
-static const struct
+/* returns the number of bytes of the buffer of a retired descriptor the host controller has not transferred */
+static uint32_t ohci_td_residue(volatile struct ohci_td * td)
 {
-	uint8_t set_address[8];
-	uint8_t get_device_descriptor[8];
+uint32_t current_buffer = (uint32_t) td->current_buffer, buffer_end = (uint32_t) td->buffer_end;
+
+	if (!current_buffer)
+		return 0;
+	if ((current_buffer ^ buffer_end) & ~ (OHCI_PAGE_SIZE - 1))
+		return OHCI_PAGE_SIZE - (current_buffer & (OHCI_PAGE_SIZE - 1)) + (buffer_end & (OHCI_PAGE_SIZE - 1)) + 1;
+	return buffer_end - current_buffer + 1;
 }
-usb_request_packets =
+
+/* passes a completed transfer on an interrupt endpoint to its handler, and queues
+ * the transfer again if the handler asks for it; a failed transfer leaves the
+ * endpoint halted, and is not queued again */
+static void ohci_complete_interrupt(struct usb_endpoint * endpoint)
 {
-	.set_address = { 0x00, 0x05, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, },
-	.get_device_descriptor = { 0x80, 0x06, 0x00, 0x01, 0x00, 0x00, 0x12, 0x00, },
-};
+volatile struct ohci_ed * ed = endpoint->ed;
+int length = ed->transferred;
 
+	if (ed->condition_code != OHCI_CC_NO_ERROR)
+		length = (ed->condition_code == OHCI_CC_STALL) ? USB_TRANSFER_STALLED : USB_TRANSFER_ERROR;
+	if (endpoint->complete(endpoint, endpoint->buffer, length, endpoint->argument) && length >= 0)
+		ohci_queue_interrupt(endpoint);
+}
 
-void init_ohci(void)
+/* processes the descriptors the host controller has retired; the host controller
+ * links them in a list, most recently retired first, which is reversed here, so that
+ * the descriptors are processed in the order they were retired */
+static void ohci_reap_done_queue(void)
 {
-volatile struct ohci_ed * ed = 0, * control_ed = 0;
-volatile struct ohci_td * td = 0;
-int i;
+volatile struct ohci_td * td = (volatile struct ohci_td *) (ohci_hcca.done_head & OHCI_ED_HEAD_MASK), * next, * reversed = 0;
+volatile struct ohci_ed * ed;
+int condition_code;
 
-	/* enable usb ohci bus mastering */
-	/*! \todo	this is specific for virtual box, fix it to be more generic */
-	sf_eval("0 6 0 make-pci-config-address 4 + dup");
-	sf_eval("IO-PCICFG outpl IO-PCIDATA inpw 6 ( memory space, and bus master) or swap");
-	sf_eval("IO-PCICFG outpl IO-PCIDATA outpw");
+	ohci_hcca.done_head = 0;
+	while (td)
+	{
+		next = td->next;
+		td->next = (struct ohci_td *) reversed;
+		reversed = td;
+		td = next;
+	}
+	for (td = reversed; td; td = next)
+	{
+		next = td->next;
+		ed = td->ed;
+		if (td->transfer != ed->transfer)
+		{
+			free_td(td);
+			continue;
+		}
+		condition_code = td->flags >> OHCI_TD_CC_SHIFT;
+		ed->transferred += td->length - ohci_td_residue(td);
+		ed->nr_pending --;
+		/* the host controller halts the endpoint when a descriptor fails, the
+		 * remaining descriptors of the transfer are not retired */
+		if (condition_code != OHCI_CC_NO_ERROR && ed->condition_code == OHCI_CC_NO_ERROR)
+			ed->condition_code = condition_code;
+		if (!ed->nr_pending || condition_code != OHCI_CC_NO_ERROR)
+			ed->done = true;
+		/* the descriptor freed here is available for queuing the transfer again */
+		free_td(td);
+		if (ed->done && ed->endpoint && ed->endpoint->complete)
+			ohci_complete_interrupt(ed->endpoint);
+	}
+}
 
-	/* disable caching for the ohci data page */
-	sf_push(((cell) & ohci_hcca) & ~ ((1 << 12) - 1));
-	sf_eval("mem-page-disable-caching");
+static void ohci_irq_handler(void * argument)
+{
+uint32_t status = ohci->HcInterruptStatus & ohci->HcInterruptEnable;
+
+	/* the done queue must be reaped before acknowledging the interrupt, the host
+	 * controller does not write back a new done queue until then */
+	if (status & OHCI_INTERRUPT_WDH)
+		ohci_reap_done_queue();
+	if (status & OHCI_INTERRUPT_UE)
+		print_str("usb ohci: unrecoverable error\n");
+	ohci->HcInterruptStatus = status;
+}
+
+static void ohci_poll(void)
+{
+unsigned irqflag = get_irq_flag_and_disable_irqs();
+
+	ohci_irq_handler(0);
+	restore_irq_flag(irqflag);
+}
+
+/* fills in the buffer pointers of a descriptor with the physical addresses of the
+ * buffer; the buffer must not cross more than a single page boundary, the pages
+ * need not be physically contiguous */
+static int ohci_td_set_buffer(volatile struct ohci_td * td, const void * buffer, uint32_t length)
+{
+	td->current_buffer = td->buffer_end = 0;
+	td->length = length;
+	if (!length)
+		return 0;
+	td->current_buffer = (void *) mem_virtual_to_physical(buffer);
+	td->buffer_end = (void *) mem_virtual_to_physical((const uint8_t *) buffer + length - 1);
+	return (td->current_buffer && td->buffer_end) ? 0 : -1;
+}
+
+static void ohci_free_spare_tds(volatile struct ohci_ed * ed)
+{
+volatile struct ohci_td * td;
 
-	sf_eval(SFORTH_OHCI_PHYSICAL_MEM_BASE " " "phys-mem-map phys-mem-window-base");
-	ohci = (void *) sf_pop();
-	if (ohci->HcRevision != 0x10)
+	while ((td = ed->spare_tds))
 	{
-		print_str("bad usb ohci address\n");
+		ed->spare_tds = * (volatile struct ohci_td **) td;
+		free_td(td);
+	}
+}
+
+/* drops the descriptors queued for a transfer not yet started */
+static void ohci_unqueue(volatile struct ohci_ed * ed)
+{
+volatile struct ohci_td * td, * next, * placeholder;
+
+	ohci_free_spare_tds(ed);
+	if (!ed->last_td)
 		return;
+	placeholder = ed->last_td->next;
+	for (td = ed->tail->next; ; td = next)
+	{
+		next = td->next;
+		free_td(td);
+		if (td == placeholder)
+			break;
 	}
-	print_str("detected usb ohci 1.0\n");
-	ohci->HcInterruptDisable = 0xc000007f;
-	/*! \todo only make sure here that the usb functional state is USBReset */ 
-	if (ohci->HcControl != 0x200) 
+	ed->tail->next = 0;
+	ed->last_td = 0;
+	ed->nr_pending = 0;
+}
+
+/* allocates the descriptors for a transfer; the placeholder descriptor at the tail
+ * of the endpoint is used for the first descriptor of the transfer, and each
+ * descriptor queued takes a descriptor from the ones allocated here as the new
+ * placeholder */
+static int ohci_reserve_tds(volatile struct ohci_ed * ed, int count)
+{
+	ohci_free_spare_tds(ed);
+	return (ed->spare_tds = allot_tds(count)) ? 0 : -1;
+}
+
+/* queues a descriptor for a transfer on an endpoint; the descriptors are only
+ * seen by the host controller after the transfer is started with 'ohci_start()' */
+static int ohci_queue_td(volatile struct ohci_ed * ed, uint32_t flags, const void * buffer, uint32_t length)
+{
+volatile struct ohci_td * td = ed->last_td ? ed->last_td->next : ed->tail, * placeholder;
+
+	if (!ed->last_td)
 	{
-abort:		
-		print_str("unexpected usb ohci register value, aborting\n");
-		return;
+		ed->nr_pending = 0;
+		ed->transfer ++;
 	}
-	ohci->HcCommandStatus = 1;
-	while (ohci->HcCommandStatus & 1);
-	ohci->HcFmInterval = 0x27792edf;
-	ohci->HcPeriodicStart = 0x2a2f;
-	/* initialize ohci hcca */
-	ed = allot_ed();
-	for (i = 0; i < 32; ohci_hcca.interrupt_table[i ++] = ed);
+	if (ohci_td_set_buffer(td, buffer, length) == -1 || (!ed->spare_tds && ohci_reserve_tds(ed, 1) == -1))
+		return -1;
+	placeholder = ed->spare_tds;
+	ed->spare_tds = * (volatile struct ohci_td **) placeholder;
+	td->flags = flags | OHCI_TD_NO_INTERRUPT | (OHCI_CC_NOT_ACCESSED << OHCI_TD_CC_SHIFT);
+	td->next = (struct ohci_td *) placeholder;
+	td->ed = ed;
+	td->transfer = ed->transfer;
+	ed->last_td = td;
+	ed->nr_pending ++;
+	return 0;
+}
 
-	ohci->HcHCCA = (uint32_t) & ohci_hcca;
+/* as a descriptor's buffer may cross a single page boundary, data buffers are split
+ * into descriptors of up to two pages, each holding a whole number of packets, but
+ * the last one; returns the length of the next descriptor's buffer */
+static uint32_t ohci_data_td_length(volatile struct ohci_ed * ed, const uint8_t * buffer, uint32_t length)
+{
+uint32_t n, max_packet_size = (ed->flags & OHCI_ED_MAX_PACKET_MASK) >> OHCI_ED_MAX_PACKET_SHIFT;
 
-	/* move to USBOperational state */
-	ohci->HcControl = (ohci->HcControl & ~(3 << 6)) | (2 << 6);
+	/* page offsets are the same in the virtual and physical addresses */
+	n = 2 * OHCI_PAGE_SIZE - ((uint32_t) buffer & (OHCI_PAGE_SIZE - 1));
+	return (n < length) ? n - n % max_packet_size : length;
+}
 
-	/* fill control list head */
-	control_ed = allot_ed();
-	control_ed->flags = (/* max packet size */ 0x40 << 16) | /* skip */ bit(14);
-	control_ed->next = 0;
-	control_ed->head = td = allot_td();
+/* returns the number of descriptors needed for a data buffer */
+static int ohci_data_td_count(volatile struct ohci_ed * ed, const uint8_t * buffer, uint32_t length)
+{
+uint32_t n;
+int count;
 
-	/*
-	   set address:
+	for (count = 0; length; count ++, buffer += n, length -= n)
+		n = ohci_data_td_length(ed, buffer, length);
+	return count;
+}
 
-transfer descriptor ready:
-hardware descriptor fields: flags: $f2000000; CBP: $004f59a0; NextTD: $007ab030; BE: $004f59a7; 
-; #8 bytes in transfer:
-0005010000000000
-transfer descriptor ready:
-hardware descriptor fields: flags: $f3100000; CBP: $00000000; NextTD: $007ab060; BE: $00000000; 
-; #0 bytes in transfer:
-*/
-	/* setup stage of control transfer */
-	td->flags = 0xf2000000;
-	td->current_buffer = usb_request_packets.set_address;
-	td->buffer_end = usb_request_packets.set_address + sizeof usb_request_packets.set_address - 1;
-	td = td->next = allot_td();
-	/* no data stage for control trasfer */
-	{{{{{{{{{{{{{{{;;;;;;;;;;;;;;;;;}}}}}}}}}}}}}}}
-	/* status stage of control trasfer */
-	td->flags = 0xf3100000;
-	td->current_buffer = td->buffer_end = 0;
-	td->next = /* empty place holder transfer descriptor */ control_ed->tail = allot_td();
-#if 0
-	/* issue a 'read device descriptor' control transfer */
-	/* control setup stage */
-	td = td->next;
-	td->flags = 0xf2000000;
-	td->current_buffer = usb_request_packets.get_device_descriptor;
-	td->buffer_end = usb_request_packets.get_device_descriptor + sizeof usb_request_packets.get_device_descriptor - 1;
-	td = td->next = allot_td();
-	/* control data IN stage */
-	td->flags = 0xf3100000;
-	td->current_buffer = device_descriptor;
-	td->buffer_end = device_descriptor + sizeof device_descriptor - 1;
-	td->next = allot_td();
-	td = td->next;
-	/* control handshake stage */
-	td->flags = 0xf3080000;
-	td->current_buffer = td->buffer_end = 0;
-	td->next = /* empty place holder transfer descriptor */ control_ed->tail = allot_td();
-#endif
+/* queues the descriptors for a data buffer; only the last descriptor of an input
+ * buffer may end with a short packet, a short packet in the others is an error,
+ * which stops the transfer */
+static int ohci_queue_data(volatile struct ohci_ed * ed, uint32_t flags, uint8_t * buffer, uint32_t length)
+{
+uint32_t n;
 
-	ohci->HcControlHeadED = control_ed;
+	while (length)
+	{
+		n = ohci_data_td_length(ed, buffer, length);
+		if (ohci_queue_td(ed, flags | ((n == length && (flags & OHCI_TD_PID_IN)) ? OHCI_TD_ROUNDING : 0), buffer, n) == -1)
+			return -1;
+		buffer += n;
+		length -= n;
+		/* the toggle of the following descriptors is taken from the toggle carry of the endpoint */
+		flags &=~ OHCI_TD_TOGGLE_MASK;
+	}
+	return 0;
+}
 
-	ohci->HcControl &=~ /* control list enable bit */ bit(4);
-	ohci->HcControlCurrentED = 0;
-	ohci->HcBulkCurrentED = 0;
-	ohci->HcControl |= /* control list enable bit */ bit(4);
+/* hands the descriptors queued on an endpoint to the host controller; the last
+ * descriptor interrupts at the end of the frame it is retired in */
+static void ohci_start(volatile struct ohci_ed * ed, uint32_t list_filled)
+{
+	ed->last_td->flags &=~ OHCI_TD_DELAY_INTERRUPT_MASK;
+	ed->transferred = 0;
+	ed->condition_code = OHCI_CC_NO_ERROR;
+	ed->done = false;
+	ed->tail = (struct ohci_td *) ed->last_td->next;
+	ed->last_td = 0;
+	ohci->HcCommandStatus = list_filled;
+	ohci_free_spare_tds(ed);
+}
 
-	if (ohci->HcRhDescriptorA != 0x20c) 
-		goto abort;
-	/* power on hub ports */
-	ohci->HcRhStatus = 0x10000;
+/* removes the descriptors of a failed, or timed out, transfer from an endpoint,
+ * and clears the endpoint halt; the data toggle carry is kept */
+static void ohci_cancel(volatile struct ohci_ed * ed)
+{
+volatile struct ohci_td * td, * next;
+uint64_t deadline;
 
-	/* try to drive the first port */
-	if (!(ohci->HcRhPortStatus[0] & 1))
+	ed->flags |= OHCI_ED_SKIP;
+	deadline = clock_deadline_ms(OHCI_FRAME_WAIT_MS);
+	while (!clock_deadline_expired(deadline))
+		;
+	/* the descriptors already retired must not be left for later */
+	ohci_poll();
+	for (td = (volatile struct ohci_td *) ((uint32_t) ed->head & OHCI_ED_HEAD_MASK); td != ed->tail; td = next)
 	{
-		print_str("usb port 0 not connected, giving up\n");
-		goto abort;
+		next = td->next;
+		free_td(td);
 	}
-	/* reset port 0 */
-	ohci->HcRhPortStatus[0] = 1 << 4;
-	while (!(ohci->HcRhPortStatus[0] & (1 << 20)))
+	ed->head = (struct ohci_td *) ((uint32_t) ed->tail | ((uint32_t) ed->head & OHCI_ED_HEAD_TOGGLE_CARRY));
+	ed->nr_pending = 0;
+	ed->flags &=~ OHCI_ED_SKIP;
+}
+
+/* waits for the transfer in progress on an endpoint to complete; returns the
+ * number of bytes transferred, USB_TRANSFER_STALLED if the endpoint stalled, or
+ * USB_TRANSFER_ERROR on other errors and on timeout; a short input transfer is not an error */
+static int ohci_wait(volatile struct ohci_ed * ed, int timeout_ms)
+{
+uint64_t deadline = clock_deadline_ms(timeout_ms);
+
+	while (!ed->done && !clock_deadline_expired(deadline))
+	{
+		if (ohci_polled || !interrupts_enabled())
+		{
+			ohci_poll();
+			continue;
+		}
+		asm("cli");
+		if (ed->done)
+		{
+			asm("sti");
+			break;
+		}
+		/* the timer tick bounds the wait, should the interrupt be lost */
+		asm("sti\n" "hlt\n");
+	}
+	if (ed->done && ed->condition_code == OHCI_CC_NO_ERROR)
+		return ed->transferred;
+	ohci_cancel(ed);
+	if (ed->done && ed->condition_code == OHCI_CC_DATA_UNDERRUN)
+		return ed->transferred;
+	return (ed->done && ed->condition_code == OHCI_CC_STALL) ? USB_TRANSFER_STALLED : USB_TRANSFER_ERROR;
+}
+
+/* issues a control transfer on a default control endpoint; returns the number of
+ * data bytes transferred, or a negative error code */
+static int ohci_control_transfer(volatile struct ohci_ed * ed, const uint8_t setup[USB_SETUP_PACKET_SIZE], void * data, uint16_t length)
+{
+bool in = setup[0] & USB_REQUEST_DIRECTION_IN;
+int n;
+
+	/* the setup, data and status stages - the last descriptor allocated is the new placeholder */
+	if (ohci_reserve_tds(ed, ohci_data_td_count(ed, data, length) + 2) == -1
+			|| ohci_queue_td(ed, OHCI_TD_PID_SETUP | OHCI_TD_TOGGLE_DATA0, setup, USB_SETUP_PACKET_SIZE) == -1
+			|| ohci_queue_data(ed, (in ? OHCI_TD_PID_IN : OHCI_TD_PID_OUT) | OHCI_TD_TOGGLE_DATA1, data, length) == -1
+			/* the status stage is in the direction opposite to the data stage */
+			|| ohci_queue_td(ed, (in ? OHCI_TD_PID_OUT : OHCI_TD_PID_IN) | OHCI_TD_TOGGLE_DATA1, 0, 0) == -1)
+	{
+		ohci_unqueue(ed);
+		return USB_TRANSFER_ERROR;
+	}
+	ohci_start(ed, OHCI_COMMAND_CLF);
+	if ((n = ohci_wait(ed, OHCI_TRANSFER_TIMEOUT_MS)) < 0)
+		return n;
+	return n - USB_SETUP_PACKET_SIZE;
+}
+
+static void ohci_busy_wait_ms(int milliseconds)
+{
+uint64_t deadline = clock_deadline_ms(milliseconds);
+
+	while (!clock_deadline_expired(deadline))
 		;
-	ohci->HcRhPortStatus[0] = 0x001f0000;
-	if (ohci->HcRhPortStatus[0] != 0x103)
-		goto abort;
-	control_ed->flags = 0x40 << 16;
-	/* set CLF (control list filled flag) - issue a usb host controller transfer request */
-	ohci->HcCommandStatus = bit(1);
+}
 
-	print_str("usb ohci initialization successful\n");
+/* resets a root hub port, returns the port status, or -1 on failure */
+static int ohci_reset_port(int port)
+{
+uint64_t deadline;
+uint32_t status;
+
+	ohci->HcRhPortStatus[port] = OHCI_PORT_CHANGE_BITS;
+	ohci->HcRhPortStatus[port] = OHCI_PORT_PRS;
+	deadline = clock_deadline_ms(OHCI_PORT_RESET_TIMEOUT_MS);
+	while (!(ohci->HcRhPortStatus[port] & OHCI_PORT_PRSC))
+		if (clock_deadline_expired(deadline))
+			return -1;
+	ohci->HcRhPortStatus[port] = OHCI_PORT_CHANGE_BITS;
+	status = ohci->HcRhPortStatus[port];
+	return (status & OHCI_PORT_PES) ? status : -1;
+}
+
+/* allocates an endpoint descriptor, with the placeholder transfer descriptor of its empty queue */
+static volatile struct ohci_ed * ohci_open_ed(uint32_t flags)
+{
+volatile struct ohci_ed * ed;
+volatile struct ohci_td * td;
+
+	if (!(ed = allot_ed()))
+		return 0;
+	if (!(td = allot_td()))
+	{
+		free_ed(ed);
+		return 0;
+	}
+	td->next = 0;
+	ed->tail = ed->head = (struct ohci_td *) td;
+	ed->flags = flags;
+	return ed;
+}
 
-	print_str("waiting for set address transfer to complete...");
-	while (control_ed->head != control_ed->tail)
+/* appends an endpoint to a list; the host controller sees the endpoint as soon as it is linked */
+static void ohci_append_ed(volatile struct ohci_ed * list, volatile struct ohci_ed * ed)
+{
+	while (list->next)
+		list = list->next;
+	ed->next = 0;
+	list->next = (struct ohci_ed *) ed;
+}
+
+static bool ohci_init_periodic_schedule(void)
+{
+int interval, i;
+
+	for (i = 0; i < OHCI_NR_PERIODIC_NODES; i ++)
+		if (!(ohci_periodic_nodes[i] = allot_ed()))
+			return false;
+	/* a node links to the node, of the level of half its interval, visited in the same frames */
+	for (interval = 2; interval <= OHCI_NR_INTERRUPT_ENTRIES; interval <<= 1)
+		for (i = 0; i < interval; i ++)
+			ohci_periodic_nodes[interval - 1 + i]->next =
+				(struct ohci_ed *) ohci_periodic_nodes[interval / 2 - 1 + i % (interval / 2)];
+	for (i = 0; i < OHCI_NR_INTERRUPT_ENTRIES; i ++)
+		ohci_hcca.interrupt_table[i] = ohci_periodic_nodes[OHCI_NR_INTERRUPT_ENTRIES - 1 + i];
+	return true;
+}
+
+/* links an interrupt endpoint in the periodic schedule, at the least loaded node of the
+ * level of the longest interval not exceeding the polling interval of the endpoint */
+static void ohci_schedule_interrupt_ed(volatile struct ohci_ed * ed, int interval)
+{
+volatile struct ohci_ed * node;
+int n, i, best;
+
+	for (n = OHCI_NR_INTERRUPT_ENTRIES; n > 1 && n > interval; n >>= 1)
 		;
-	print_str("done\n");
-	if (ohci->HcCommandStatus & bit(1))
-		goto abort;
+	for (best = i = n - 1; i < 2 * n - 1; i ++)
+		if (ohci_periodic_load[i] < ohci_periodic_load[best])
+			best = i;
+	ohci_periodic_load[best] ++;
+	node = ohci_periodic_nodes[best];
+	ed->next = node->next;
+	node->next = (struct ohci_ed *) ed;
+}
+
+void usb_setup_packet(uint8_t setup[USB_SETUP_PACKET_SIZE], int request_type, int request, int value, int index, int length)
+{
+	setup[0] = request_type;
+	setup[1] = request;
+	setup[2] = value;
+	setup[3] = value >> 8;
+	setup[4] = index;
+	setup[5] = index >> 8;
+	setup[6] = length;
+	setup[7] = length >> 8;
+}
+
+int usb_control_transfer(struct usb_device * device, const uint8_t setup[USB_SETUP_PACKET_SIZE], void * data, uint16_t length)
+{
+	return ohci_control_transfer(device->control->ed, setup, data, length);
+}
+
+int usb_bulk_transfer(struct usb_endpoint * endpoint, void * buffer, uint32_t length, int timeout_ms)
+{
+volatile struct ohci_ed * ed = endpoint->ed;
+
+	if (endpoint->type != USB_ENDPOINT_TYPE_BULK || length > USB_MAX_TRANSFER_SIZE)
+		return USB_TRANSFER_ERROR;
+	if (!length)
+		return 0;
+	/* the direction is taken from the endpoint descriptor, and the toggle from its toggle carry */
+	if (ohci_reserve_tds(ed, ohci_data_td_count(ed, buffer, length)) == -1
+			|| ohci_queue_data(ed, (endpoint->address & USB_ENDPOINT_DIRECTION_IN) ? OHCI_TD_PID_IN : OHCI_TD_PID_OUT, buffer, length) == -1)
+	{
+		ohci_unqueue(ed);
+		return USB_TRANSFER_ERROR;
+	}
+	ohci_start(ed, OHCI_COMMAND_BLF);
+	return ohci_wait(ed, timeout_ms);
+}
+
+/* queues the transfer of an interrupt endpoint; called with interrupts disabled, the
+ * transfer is otherwise also queued from the interrupt handler */
+static int ohci_queue_interrupt(struct usb_endpoint * endpoint)
+{
+volatile struct ohci_ed * ed = endpoint->ed;
+
+	if (ohci_reserve_tds(ed, 1) == -1
+			|| ohci_queue_td(ed, ((endpoint->address & USB_ENDPOINT_DIRECTION_IN) ? OHCI_TD_PID_IN | OHCI_TD_ROUNDING : OHCI_TD_PID_OUT),
+				endpoint->buffer, endpoint->length) == -1)
+	{
+		ohci_unqueue(ed);
+		return USB_TRANSFER_ERROR;
+	}
+	/* the periodic list is processed every frame, it needs no list filled command */
+	ohci_start(ed, 0);
+	return 0;
+}
+
+int usb_interrupt_start(struct usb_endpoint * endpoint, void * buffer, uint32_t length,
+		bool (* complete)(struct usb_endpoint * endpoint, void * buffer, int length, void * argument), void * argument)
+{
+unsigned irqflag;
+int result;
+
+	/* a transfer is a single packet, so that it takes a single descriptor */
+	if (endpoint->type != USB_ENDPOINT_TYPE_INTERRUPT || !length || length > endpoint->max_packet_size)
+		return USB_TRANSFER_ERROR;
+	irqflag = get_irq_flag_and_disable_irqs();
+	endpoint->complete = complete;
+	endpoint->buffer = buffer;
+	endpoint->length = length;
+	endpoint->argument = argument;
+	result = ohci_queue_interrupt(endpoint);
+	restore_irq_flag(irqflag);
+	if (!result && ohci_polled && !timer_pending(& ohci_poll_timer))
+		timer_start(& ohci_poll_timer, 1, 1, ohci_irq_handler, 0);
+	return result;
+}
+
+int usb_clear_halt(struct usb_endpoint * endpoint)
+{
+uint8_t setup[USB_SETUP_PACKET_SIZE];
+int result;
+
+	usb_setup_packet(setup, USB_REQUEST_RECIPIENT_ENDPOINT, USB_REQUEST_CLEAR_FEATURE, USB_FEATURE_ENDPOINT_HALT, endpoint->address, 0);
+	result = usb_control_transfer(endpoint->device, setup, 0, 0);
+	/* clearing the halt resets the data toggle of the device endpoint to DATA0; the
+	 * endpoint is idle, as 'ohci_wait()' has already removed the failed transfer */
+	endpoint->ed->head = (struct ohci_td *) ((uint32_t) endpoint->ed->head & ~ (OHCI_ED_HEAD_TOGGLE_CARRY | OHCI_ED_HEAD_HALTED));
+	return (result < 0) ? result : 0;
+}
+
+/* returns the descriptor following 'descriptor' in the configuration of a device - the
+ * first one if 'descriptor' is null - or null at the end of the configuration */
+static const uint8_t * usb_next_descriptor(struct usb_device * device, const uint8_t * descriptor)
+{
+const uint8_t * end = device->configuration + device->configuration_length;
+
+	descriptor = descriptor ? descriptor + descriptor[0] : device->configuration;
+	return (descriptor + 2 <= end && descriptor[0] >= 2 && descriptor + descriptor[0] <= end) ? descriptor : 0;
+}
+
+const uint8_t * usb_find_endpoint(struct usb_device * device, const uint8_t * interface, int type, bool in, int index)
+{
+const uint8_t * d;
+
+	/* the endpoints of an interface follow its descriptor, up to the next interface descriptor */
+	for (d = usb_next_descriptor(device, interface); d && d[1] != USB_DESCRIPTOR_INTERFACE; d = usb_next_descriptor(device, d))
+		if (d[1] == USB_DESCRIPTOR_ENDPOINT && d[0] >= USB_ENDPOINT_DESCRIPTOR_SIZE
+				&& (d[USB_ENDPOINT_ATTRIBUTES] & USB_ENDPOINT_TYPE_MASK) == type
+				&& !(d[USB_ENDPOINT_ADDRESS] & USB_ENDPOINT_DIRECTION_IN) == !in
+				&& !index --)
+			return d;
+	return 0;
+}
+
+struct usb_endpoint * usb_open_endpoint(struct usb_device * device, const uint8_t * endpoint_descriptor)
+{
+struct usb_endpoint * endpoint;
+volatile struct ohci_ed * ed;
+int address = endpoint_descriptor[USB_ENDPOINT_ADDRESS];
+int type = endpoint_descriptor[USB_ENDPOINT_ATTRIBUTES] & USB_ENDPOINT_TYPE_MASK;
+int max_packet_size = (endpoint_descriptor[USB_ENDPOINT_MAX_PACKET_SIZE]
+		| (endpoint_descriptor[USB_ENDPOINT_MAX_PACKET_SIZE + 1] << 8)) & USB_ENDPOINT_MAX_PACKET_SIZE_MASK;
+
+	if ((type != USB_ENDPOINT_TYPE_BULK && type != USB_ENDPOINT_TYPE_INTERRUPT)
+			|| !max_packet_size || nr_usb_endpoints == USB_MAX_ENDPOINTS)
+		return 0;
+	if (!(ed = ohci_open_ed(device->address | ((address & USB_ENDPOINT_NUMBER_MASK) << OHCI_ED_ENDPOINT_SHIFT)
+				| ((address & USB_ENDPOINT_DIRECTION_IN) ? OHCI_ED_DIRECTION_IN : OHCI_ED_DIRECTION_OUT)
+				| (device->low_speed ? OHCI_ED_LOW_SPEED : 0)
+				| (max_packet_size << OHCI_ED_MAX_PACKET_SHIFT))))
+		return 0;
+	endpoint = usb_endpoints + nr_usb_endpoints ++;
+	* endpoint = (struct usb_endpoint) { .ed = ed, .device = device, .address = address, .type = type,
+		.max_packet_size = max_packet_size, .interval = endpoint_descriptor[USB_ENDPOINT_INTERVAL], };
+	ed->endpoint = endpoint;
+	if (type == USB_ENDPOINT_TYPE_BULK)
+		ohci_append_ed(ohci_bulk_list, ed);
+	else
+		ohci_schedule_interrupt_ed(ed, endpoint->interval);
+	return endpoint;
+}
+
+static bool usb_driver_matches(const struct usb_driver * driver, const uint8_t * interface)
+{
+	return (driver->class_code == USB_ANY || driver->class_code == interface[USB_INTERFACE_CLASS])
+		&& (driver->subclass == USB_ANY || driver->subclass == interface[USB_INTERFACE_SUBCLASS])
+		&& (driver->protocol == USB_ANY || driver->protocol == interface[USB_INTERFACE_PROTOCOL]);
+}
+
+/* binds a driver to the interfaces of a device it matches, and that have no driver yet;
+ * only the default alternate settings of the interfaces are considered */
+static void usb_bind_driver(struct usb_device * device, const struct usb_driver * driver)
+{
+const uint8_t * d;
+int number;
+
+	for (d = usb_next_descriptor(device, 0); d; d = usb_next_descriptor(device, d))
+		if (d[1] == USB_DESCRIPTOR_INTERFACE && d[0] >= USB_INTERFACE_DESCRIPTOR_SIZE
+				&& !d[USB_INTERFACE_ALTERNATE_SETTING]
+				&& (number = d[USB_INTERFACE_NUMBER]) < USB_MAX_INTERFACES
+				&& !device->drivers[number]
+				&& usb_driver_matches(driver, d)
+				&& driver->probe(device, d))
+			device->drivers[number] = driver;
+}
+
+int usb_register_driver(const struct usb_driver * driver)
+{
+int i;
+
+	if (nr_usb_drivers == USB_MAX_DRIVERS)
+	{
+		print_str(__func__);
+		print_str("(): too many usb drivers\n");
+		return -1;
+	}
+	usb_drivers[nr_usb_drivers ++] = driver;
+	for (i = 0; i < nr_usb_devices; i ++)
+		usb_bind_driver(usb_devices + i, driver);
+	return 0;
+}
+
+/* resets a root hub port, and assigns an address to the device attached to it, reads its
+ * descriptors, and selects its first configuration; returns null on failure */
+static struct usb_device * usb_enumerate_port(int port)
+{
+struct usb_device * device = usb_devices + nr_usb_devices;
+struct usb_endpoint * control = usb_endpoints + nr_usb_endpoints;
+volatile struct ohci_ed * ed;
+uint8_t setup[USB_SETUP_PACKET_SIZE];
+int status, length;
+
+	if (nr_usb_devices == USB_MAX_DEVICES || nr_usb_endpoints == USB_MAX_ENDPOINTS)
+	{
+		print_str("too many usb devices\n");
+		return 0;
+	}
+	if ((status = ohci_reset_port(port)) == -1)
+	{
+		print_str("usb port reset failed\n");
+		return 0;
+	}
+	xmemset(device, 0, sizeof * device);
+	device->port = port;
+	device->low_speed = status & OHCI_PORT_LSDA;
+
+	/* the maximum packet size of the default control endpoint is only known
+	 * after reading the first 8 bytes of the device descriptor */
+	if (!(ed = ohci_open_ed((device->low_speed ? OHCI_ED_LOW_SPEED : 0) | (8 << OHCI_ED_MAX_PACKET_SHIFT))))
+		return 0;
+	ohci_append_ed(ohci_control_list, ed);
+	* control = (struct usb_endpoint) { .ed = ed, .device = device, .type = USB_ENDPOINT_TYPE_CONTROL, .max_packet_size = 8, };
+	ed->endpoint = control;
+	device->control = control;
+	usb_setup_packet(setup, USB_REQUEST_DIRECTION_IN, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_DEVICE << 8, 0, 8);
+	if (ohci_control_transfer(ed, setup, device->device_descriptor, 8) < 8)
+		goto failed;
+	control->max_packet_size = device->device_descriptor[USB_DEVICE_MAX_PACKET_SIZE0];
+	ed->flags = (ed->flags & ~ OHCI_ED_MAX_PACKET_MASK) | (control->max_packet_size << OHCI_ED_MAX_PACKET_SHIFT);
+
+	/* without hubs, the port number makes a unique address */
+	device->address = port + 1;
+	usb_setup_packet(setup, 0, USB_REQUEST_SET_ADDRESS, device->address, 0, 0);
+	if (ohci_control_transfer(ed, setup, 0, 0) < 0)
+		goto failed;
+	ohci_busy_wait_ms(USB_SET_ADDRESS_RECOVERY_MS);
+	ed->flags |= device->address;
+
+	usb_setup_packet(setup, USB_REQUEST_DIRECTION_IN, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_DEVICE << 8, 0, USB_DEVICE_DESCRIPTOR_SIZE);
+	if (ohci_control_transfer(ed, setup, device->device_descriptor, USB_DEVICE_DESCRIPTOR_SIZE) != USB_DEVICE_DESCRIPTOR_SIZE)
+		goto failed;
+
+	/* the total length of the configuration is in the configuration descriptor; configurations
+	 * not fitting in the buffer are truncated, the interfaces at the end are then ignored */
+	usb_setup_packet(setup, USB_REQUEST_DIRECTION_IN, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_CONFIGURATION << 8, 0, USB_CONFIGURATION_DESCRIPTOR_SIZE);
+	if (ohci_control_transfer(ed, setup, device->configuration, USB_CONFIGURATION_DESCRIPTOR_SIZE) != USB_CONFIGURATION_DESCRIPTOR_SIZE)
+		goto failed;
+	length = device->configuration[USB_CONFIGURATION_TOTAL_LENGTH] | (device->configuration[USB_CONFIGURATION_TOTAL_LENGTH + 1] << 8);
+	if (length > USB_MAX_CONFIGURATION_SIZE)
+		length = USB_MAX_CONFIGURATION_SIZE;
+	usb_setup_packet(setup, USB_REQUEST_DIRECTION_IN, USB_REQUEST_GET_DESCRIPTOR, USB_DESCRIPTOR_CONFIGURATION << 8, 0, length);
+	if ((device->configuration_length = ohci_control_transfer(ed, setup, device->configuration, length)) < USB_CONFIGURATION_DESCRIPTOR_SIZE)
+		goto failed;
+	usb_setup_packet(setup, 0, USB_REQUEST_SET_CONFIGURATION, device->configuration[USB_CONFIGURATION_VALUE], 0, 0);
+	if (ohci_control_transfer(ed, setup, 0, 0) < 0)
+		goto failed;
+
+	nr_usb_endpoints ++;
+	nr_usb_devices ++;
+	print_str("usb device found, vendor:product ");
+	sf_push(device->device_descriptor[USB_DEVICE_VENDOR_ID] | (device->device_descriptor[USB_DEVICE_VENDOR_ID + 1] << 8));
+	sf_push(device->device_descriptor[USB_DEVICE_PRODUCT_ID] | (device->device_descriptor[USB_DEVICE_PRODUCT_ID + 1] << 8));
+	sf_eval("base @ >r hex swap u. u. cr r> base !");
+	return device;
+
+failed:
+	/* the endpoint is left on the control list, skipped; it is not reused */
+	ed->flags |= OHCI_ED_SKIP;
+	print_str("usb device enumeration failed\n");
+	return 0;
+}
+
+/* the pci core has enabled bus mastering, and mapped the operational registers */
+static bool ohci_init_controller(void)
+{
+struct usb_device * device;
+int i, port, nr_ports;
+uint64_t deadline;
+
+	/* disable caching for the ohci data page */
+	sf_push(((cell) & ohci_hcca) & ~ ((1 << 12) - 1));
+	sf_eval("mem-page-disable-caching");
 
+	if ((ohci->HcRevision & 0xff) != 0x10)
 	{
-		struct ohci_td * t = ohci->HcDoneHead;
-		while (t)
-			print_str("retired transfer descriptor at: "), sf_push(t), sf_eval("base @ hex swap u. cr base !"), t = t->next;
+		print_str("bad usb ohci address\n");
+		return false;
 	}
+	print_str("detected usb ohci 1.0\n");
+	ohci->HcInterruptDisable = OHCI_INTERRUPT_ALL;
+	/* take the host controller over from the system management mode firmware */
+	if (ohci->HcControl & OHCI_CONTROL_IR)
+	{
+		ohci->HcCommandStatus = OHCI_COMMAND_OCR;
+		deadline = clock_deadline_ms(OHCI_OWNERSHIP_TIMEOUT_MS);
+		while (ohci->HcControl & OHCI_CONTROL_IR)
+			if (clock_deadline_expired(deadline))
+			{
+				print_str("usb ohci ownership change timed out\n");
+				return false;
+			}
+	}
+	ohci->HcCommandStatus = OHCI_COMMAND_HCR;
+	deadline = clock_deadline_ms(OHCI_RESET_TIMEOUT_MS);
+	while (ohci->HcCommandStatus & OHCI_COMMAND_HCR)
+		if (clock_deadline_expired(deadline))
+		{
+			print_str("usb ohci reset timed out\n");
+			return false;
+		}
+	ohci->HcFmInterval = OHCI_FM_INTERVAL;
+	ohci->HcPeriodicStart = OHCI_PERIODIC_START;
+	/* initialize ohci hcca */
+	if (!ohci_init_periodic_schedule())
+		return false;
+	ohci_hcca.done_head = 0;
+	ohci->HcHCCA = (uint32_t) & ohci_hcca;
 
-	///////xxxxxxxxxx??????????????
-	ohci->HcInterruptStatus = ohci->HcInterruptStatus;
-	ohci->HcControl &=~ /* control list enable bit */ bit(4);
+	/* the heads of the control and bulk lists */
+	if (!(ohci_control_list = ohci_open_ed(OHCI_ED_SKIP)) || !(ohci_bulk_list = ohci_open_ed(OHCI_ED_SKIP)))
+		return false;
+	ohci->HcControlHeadED = (uint32_t) ohci_control_list;
 	ohci->HcControlCurrentED = 0;
-	/* set function address */
-	control_ed->flags |= 1;
-
-#if 1
-
-	/* issue a 'read device descriptor' control transfer */
-	/* control setup stage */
-	td = td->next;
-	control_ed->head = td;
-	//////// redundant control_ed->head = td;
-	td->flags = 0xf2000000;
-	td->current_buffer = usb_request_packets.get_device_descriptor;
-	td->buffer_end = usb_request_packets.get_device_descriptor + sizeof usb_request_packets.get_device_descriptor - 1;
-	td = td->next = allot_td();
-	/* control data IN stage */
-	td->flags = 0xf3100000;
-	td->current_buffer = device_descriptor;
-	td->buffer_end = device_descriptor + sizeof device_descriptor - 1;
-	td->next = allot_td();
-	td = td->next;
-	/* control handshake stage */
-	td->flags = 0xf3080000;
-	td->current_buffer = td->buffer_end = 0;
-	td->next = /* empty place holder transfer descriptor */ control_ed->tail = allot_td();
+	ohci->HcBulkHeadED = (uint32_t) ohci_bulk_list;
+	ohci->HcBulkCurrentED = 0;
 
-	ohci->HcControl |= /* control list enable bit */ bit(4);
-	/* set CLF (control list filled flag) - issue a usb host controller transfer request */
-	ohci->HcCommandStatus = bit(1);
+	ohci->HcInterruptStatus = OHCI_INTERRUPT_ALL;
+	ohci->HcInterruptEnable = OHCI_INTERRUPT_MIE | OHCI_INTERRUPT_WDH | OHCI_INTERRUPT_UE;
+	/* move to USBOperational state */
+	ohci->HcControl = (ohci->HcControl & ~ OHCI_CONTROL_HCFS_MASK) | OHCI_CONTROL_HCFS_OPERATIONAL
+		| OHCI_CONTROL_PLE | OHCI_CONTROL_CLE | OHCI_CONTROL_BLE;
 
-#endif
+	/* power on hub ports, and wait for the power to become good */
+	ohci->HcRhStatus = OHCI_RH_STATUS_LPSC;
+	ohci_busy_wait_ms(2 * (ohci->HcRhDescriptorA >> OHCI_RH_A_POTPGT_SHIFT));
+	print_str("usb ohci initialization successful\n");
+	if ((nr_ports = ohci->HcRhDescriptorA & OHCI_RH_A_NDP_MASK) > OHCI_MAX_NR_HUB_PORTS)
+		nr_ports = OHCI_MAX_NR_HUB_PORTS;
+	/* devices are enumerated one at a time, as they all respond at address 0 until
+	 * their address is set */
+	for (port = 0; port < nr_ports; port ++)
+		if ((ohci->HcRhPortStatus[port] & OHCI_PORT_CCS) && (device = usb_enumerate_port(port)))
+			for (i = 0; i < nr_usb_drivers; i ++)
+				usb_bind_driver(device, usb_drivers[i]);
+	if (!nr_usb_devices)
+		print_str("no usb device connected\n");
+	return true;
+}
 
-#if 1
-	print_str("waiting for read device descriptor transfer to complete...");
-	while (control_ed->head != control_ed->tail)
-		;
-	print_str("done\n");
-#endif
-	print_str("xxx???\n");
-	sf_push((cell) device_descriptor);
+static bool ohci_probe(const struct pci_function * f)
+{
+	/* only a single controller is supported; the operational registers are in the memory region of base address register 0 */
+	if (ohci || f->resources[0].io || !f->resources[0].mmio)
+		return false;
+	if (!usb_devices)
+	{
+		if (!(usb_devices = frame_alloc((USB_MAX_DEVICES * sizeof * usb_devices
+				+ USB_MAX_ENDPOINTS * sizeof * usb_endpoints + FRAME_SIZE - 1) / FRAME_SIZE)))
+		{
+			print_str(__func__);
+			print_str("(): out of memory\n");
+			return false;
+		}
+		usb_endpoints = (struct usb_endpoint *) (usb_devices + USB_MAX_DEVICES);
+	}
+	ohci = f->resources[0].mmio;
+	ohci_polled = f->irq_line >= NR_LEGACY_IRQS || irq_attach(f->irq_line, ohci_irq_handler, 0);
+	if (ohci_init_controller())
+		return true;
+	if (!ohci_polled)
+		irq_detach(f->irq_line);
+	ohci = 0;
+	return false;
+}
 
+static const struct pci_match ohci_match[] =
+{
+	{ PCI_ANY_ID, PCI_ANY_ID, PCI_CLASS_SERIAL_BUS, PCI_SUBCLASS_USB, PCI_PROG_IF_OHCI, },
+	{ 0, },
+};
 
-/*
-   read device descriptor:
-transfer descriptor ready:
-hardware descriptor fields: flags: $f2000000; CBP: $002dc724; NextTD: $007ab000; BE: $002dc72b; 
-; #8 bytes in transfer:
-8006000100001200
-transfer descriptor ready:
-hardware descriptor fields: flags: $f3100000; CBP: $002dc724; NextTD: $007ab030; BE: $002dc735; 
-; #18 bytes in transfer:
-800600010000120000000000000000000000
-transfer descriptor ready:
-hardware descriptor fields: flags: $f3080000; CBP: $00000000; NextTD: $007ab060; BE: $00000000; 
-; #0 bytes in transfer:
-*/
+/* the controller initialization uses the forth environment, so the
+ * driver is only bound after the forth environment has been set up */
+static const struct pci_driver ohci_driver = { .name = "ohci", .match = ohci_match, .probe = ohci_probe, .deferred = true, };
+
+void init_ohci(void)
+{
+	pci_register_driver(& ohci_driver);
+}
+
+static void do_ohci_registers(void) { /* ( -- ohci-registers-address|0) */ sf_push((cell) ohci); }
+
+static void print_pool(const struct ohci_pool * pool)
+{
+	print_str(pool->name);
+	print_str(": used ");
+	sf_push(pool->nr_used);
+	sf_eval("base @ >r decimal u. r> base !");
+	print_str(", free ");
+	sf_push(pool->nr_free);
+	sf_eval("base @ >r decimal u. r> base !");
+	print_str(", peak ");
+	sf_push(pool->max_used);
+	sf_eval("base @ >r decimal u. r> base !");
+	print_str(", frames ");
+	sf_push(pool->nr_frames);
+	sf_eval("base @ >r decimal u. r> base !");
+	print_str(", failed allocations ");
+	sf_push(pool->nr_failures);
+	sf_eval("base @ >r decimal u. cr r> base !");
+}
+
+static void do_ohci_pools(void)
+{
+/* ( --) prints the usage counters of the descriptor pools */
+	print_pool(& td_pool);
+	print_pool(& ed_pool);
+}
+
+static void do_usb_devices(void)
+{
+/* ( --) prints the usb devices found, and the drivers bound to their interfaces */
+struct usb_device * device;
+int i, j;
+
+	for (i = 0; i < nr_usb_devices; i ++)
+	{
+		device = usb_devices + i;
+		print_str("port ");
+		sf_push(device->port);
+		sf_eval("base @ >r decimal u. r> base !");
+		print_str("address ");
+		sf_push(device->address);
+		sf_eval("base @ >r decimal u. r> base !");
+		print_str(device->low_speed ? "low speed, vendor:product " : "full speed, vendor:product ");
+		sf_push(device->device_descriptor[USB_DEVICE_VENDOR_ID] | (device->device_descriptor[USB_DEVICE_VENDOR_ID + 1] << 8));
+		sf_push(device->device_descriptor[USB_DEVICE_PRODUCT_ID] | (device->device_descriptor[USB_DEVICE_PRODUCT_ID + 1] << 8));
+		sf_eval("base @ >r hex swap u. u. r> base !");
+		for (j = 0; j < USB_MAX_INTERFACES; j ++)
+			if (device->drivers[j])
+			{
+				print_str(device->drivers[j]->name);
+				print_str(" ");
+			}
+		print_str("\n");
+	}
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"ohci-registers",	do_ohci_registers),
+	MKWORD(custom_dict,	__COUNTER__,	".ohci-pools",		do_ohci_pools),
+	MKWORD(custom_dict,	__COUNTER__,	".usb-devices",		do_usb_devices),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
 }
 
 #if 0
@@ -0,0 +1,305 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* usb mass storage driver, for devices using the bulk-only transport and the
+ * scsi transparent command set, such as usb flash drives; each command is sent
+ * in a command block wrapper on the bulk output endpoint, followed by its data,
+ * and the status of the command is then read in a command status wrapper from
+ * the bulk input endpoint. Data transfers are split into commands of up to
+ * USB_MAX_TRANSFER_SIZE bytes, each queued on the host controller as a single
+ * transfer. Only the first logical unit of a device is used. The devices are
+ * registered as block devices */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "utils.h"
+#include "engine.h"
+#include <sf-word-wizard.h>
+#include "clock.h"
+#include "usb.h"
+#include "usb-storage.h"
+
+static struct usb_storage devices[MAX_USB_STORAGE_DEVICES] __attribute__((section(".common-data")));
+static int nr_devices __attribute__((section(".common-data")));
+
+static const char * const device_names[MAX_USB_STORAGE_DEVICES] = { "usb0", "usb1", "usb2", "usb3", };
+
+static void usb_storage_delay_ms(int milliseconds)
+{
+uint64_t deadline = clock_deadline_ms(milliseconds);
+
+	while (!clock_deadline_expired(deadline))
+		;
+}
+
+/* the reset recovery of the bulk-only transport, after a command has failed at the
+ * transport level; resets the device, and clears the halts of both bulk endpoints */
+static void usb_storage_reset_recovery(struct usb_storage * us)
+{
+uint8_t setup[USB_SETUP_PACKET_SIZE];
+
+	usb_setup_packet(setup, USB_REQUEST_TYPE_CLASS | USB_REQUEST_RECIPIENT_INTERFACE, USB_STORAGE_REQUEST_RESET, 0, us->interface_number, 0);
+	usb_control_transfer(us->device, setup, 0, 0);
+	usb_clear_halt(us->bulk_in);
+	usb_clear_halt(us->bulk_out);
+}
+
+/* performs a scsi command; returns the number of data bytes transferred, or -1 on failure */
+static int usb_storage_command(struct usb_storage * us, const uint8_t * command, int command_length, void * data, uint32_t length, bool in)
+{
+struct usb_endpoint * endpoint = in ? us->bulk_in : us->bulk_out;
+int n, transferred = 0;
+
+	xmemset(& us->cbw, 0, sizeof us->cbw);
+	us->cbw.signature = USB_STORAGE_CBW_SIGNATURE;
+	us->cbw.tag = ++ us->tag;
+	us->cbw.data_transfer_length = length;
+	us->cbw.flags = in ? USB_STORAGE_CBW_DIRECTION_IN : 0;
+	us->cbw.command_length = command_length;
+	xmemcpy(us->cbw.command, command, command_length);
+	if (usb_bulk_transfer(us->bulk_out, & us->cbw, USB_STORAGE_CBW_SIZE, USB_STORAGE_TIMEOUT_MS) != USB_STORAGE_CBW_SIZE)
+		goto reset;
+
+	if (length)
+	{
+		/* the device stalls the data stage of a command it fails; the status
+		 * is still read, once the halt is cleared */
+		if ((n = usb_bulk_transfer(endpoint, data, length, USB_STORAGE_TIMEOUT_MS)) == USB_TRANSFER_STALLED)
+			usb_clear_halt(endpoint);
+		else if (n < 0)
+			goto reset;
+		else
+			transferred = n;
+	}
+
+	/* the device may also stall the status stage; it is then retried once */
+	if ((n = usb_bulk_transfer(us->bulk_in, & us->csw, USB_STORAGE_CSW_SIZE, USB_STORAGE_TIMEOUT_MS)) == USB_TRANSFER_STALLED)
+	{
+		usb_clear_halt(us->bulk_in);
+		n = usb_bulk_transfer(us->bulk_in, & us->csw, USB_STORAGE_CSW_SIZE, USB_STORAGE_TIMEOUT_MS);
+	}
+	if (n != USB_STORAGE_CSW_SIZE || us->csw.signature != USB_STORAGE_CSW_SIGNATURE
+			|| us->csw.tag != us->cbw.tag || us->csw.status == USB_STORAGE_CSW_PHASE_ERROR)
+		goto reset;
+	return (us->csw.status == USB_STORAGE_CSW_PASSED) ? transferred : -1;
+
+reset:
+	usb_storage_reset_recovery(us);
+	return -1;
+}
+
+static int usb_storage_transfer(struct usb_storage * us, uint64_t lba, uint32_t count, uint8_t * buffer, bool write)
+{
+uint8_t command[10];
+uint32_t n, max_blocks = USB_MAX_TRANSFER_SIZE / us->block_size;
+
+	/* the ten byte commands take 32 bit block numbers, and READ CAPACITY(10)
+	 * never reports more blocks than these address */
+	if (lba >= us->nr_blocks || count > us->nr_blocks - lba)
+		return -1;
+	while (count)
+	{
+		n = (count < max_blocks) ? count : max_blocks;
+		xmemset(command, 0, sizeof command);
+		command[0] = write ? SCSI_WRITE_10 : SCSI_READ_10;
+		command[2] = lba >> 24;
+		command[3] = lba >> 16;
+		command[4] = lba >> 8;
+		command[5] = lba;
+		command[7] = n >> 8;
+		command[8] = n;
+		if (usb_storage_command(us, command, sizeof command, buffer, n * us->block_size, !write) != (int) (n * us->block_size))
+			return -1;
+		lba += n;
+		count -= n;
+		buffer += n * us->block_size;
+	}
+	return 0;
+}
+
+static int usb_storage_read(struct block_device * dev, uint64_t lba, uint32_t count, void * buffer)
+{
+	return usb_storage_transfer(dev->driver_data, lba, count, buffer, false);
+}
+
+static int usb_storage_write(struct block_device * dev, uint64_t lba, uint32_t count, const void * buffer)
+{
+	return usb_storage_transfer(dev->driver_data, lba, count, (uint8_t *) buffer, true);
+}
+
+static int usb_storage_flush(struct block_device * dev)
+{
+static const uint8_t command[10] = { SCSI_SYNCHRONIZE_CACHE_10, };
+
+	/* many flash drives do not implement the command, as they have no write
+	 * cache; a failure of the command is therefore not reported */
+	usb_storage_command(dev->driver_data, command, sizeof command, 0, 0, false);
+	return 0;
+}
+
+/* waits for the medium to become ready; the sense data of a failed TEST UNIT READY
+ * must be read, which also clears the unit attention condition devices report after a reset */
+static bool usb_storage_wait_ready(struct usb_storage * us)
+{
+static const uint8_t test_unit_ready[6] = { SCSI_TEST_UNIT_READY, };
+static const uint8_t request_sense[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, SCSI_SENSE_SIZE, 0, };
+int i;
+
+	for (i = 0; i < USB_STORAGE_READY_RETRIES; i ++)
+	{
+		if (usb_storage_command(us, test_unit_ready, sizeof test_unit_ready, 0, 0, false) == 0)
+			return true;
+		usb_storage_command(us, request_sense, sizeof request_sense, us->scratch, SCSI_SENSE_SIZE, true);
+		usb_storage_delay_ms(USB_STORAGE_READY_DELAY_MS);
+	}
+	return false;
+}
+
+static bool usb_storage_probe(struct usb_device * device, const uint8_t * interface)
+{
+static const uint8_t inquiry[6] = { SCSI_INQUIRY, 0, 0, 0, SCSI_INQUIRY_SIZE, 0, };
+static const uint8_t read_capacity[10] = { SCSI_READ_CAPACITY_10, };
+struct usb_storage * us = devices + nr_devices;
+const uint8_t * in, * out;
+char product[25];
+uint32_t last_block;
+
+	if (nr_devices == MAX_USB_STORAGE_DEVICES
+			|| !(in = usb_find_endpoint(device, interface, USB_ENDPOINT_TYPE_BULK, true, 0))
+			|| !(out = usb_find_endpoint(device, interface, USB_ENDPOINT_TYPE_BULK, false, 0)))
+		return false;
+	* us = (struct usb_storage) { .device = device, .interface_number = interface[USB_INTERFACE_NUMBER], };
+	if (!(us->bulk_in = usb_open_endpoint(device, in)) || !(us->bulk_out = usb_open_endpoint(device, out)))
+		return false;
+
+	/* only direct access block devices are supported */
+	if (usb_storage_command(us, inquiry, sizeof inquiry, us->scratch, SCSI_INQUIRY_SIZE, true) < SCSI_INQUIRY_SIZE
+			|| (us->scratch[0] & 0x1f))
+	{
+		print_str("usb storage: not a direct access device\n");
+		return false;
+	}
+	/* the vendor and product identification strings */
+	xmemcpy(product, us->scratch + 8, sizeof product - 1);
+	product[sizeof product - 1] = 0;
+
+	if (!usb_storage_wait_ready(us)
+			|| usb_storage_command(us, read_capacity, sizeof read_capacity, us->scratch, SCSI_READ_CAPACITY_10_SIZE, true) != SCSI_READ_CAPACITY_10_SIZE)
+	{
+		print_str("usb storage: no medium\n");
+		return false;
+	}
+	last_block = (us->scratch[0] << 24) | (us->scratch[1] << 16) | (us->scratch[2] << 8) | us->scratch[3];
+	us->block_size = (us->scratch[4] << 24) | (us->scratch[5] << 16) | (us->scratch[6] << 8) | us->scratch[7];
+	/* a last block of 0xffffffff means that the device is too large for the ten byte commands */
+	if (last_block == 0xffffffff || !us->block_size || us->block_size > USB_MAX_TRANSFER_SIZE)
+	{
+		print_str("usb storage: unsupported capacity\n");
+		return false;
+	}
+	us->nr_blocks = (uint64_t) last_block + 1;
+
+	us->blockdev = (struct block_device)
+	{
+		.name		= device_names[nr_devices],
+		.sector_size	= us->block_size,
+		.nr_sectors	= us->nr_blocks,
+		.read		= usb_storage_read,
+		.write		= usb_storage_write,
+		.flush		= usb_storage_flush,
+		.driver_data	= us,
+	};
+	nr_devices ++;
+	blockdev_register(& us->blockdev);
+	print_str(us->blockdev.name);
+	print_str(": ");
+	print_str(product);
+	print_str(", MBytes ");
+	sf_push((us->nr_blocks * us->block_size) >> 20);
+	sf_eval("base @ >r decimal u. cr r> base !");
+	return true;
+}
+
+static const struct usb_driver usb_storage_driver =
+{
+	.name		= "usb-storage",
+	.class_code	= USB_CLASS_MASS_STORAGE,
+	.subclass	= USB_STORAGE_SUBCLASS_SCSI,
+	.protocol	= USB_STORAGE_PROTOCOL_BULK_ONLY,
+	.probe		= usb_storage_probe,
+};
+
+void init_usb_storage(void)
+{
+	usb_register_driver(& usb_storage_driver);
+}
+
+/*
+ * forth words
+ */
+
+static struct usb_storage * usb_storage_device(int device)
+{
+	return (device >= 0 && device < nr_devices) ? devices + device : 0;
+}
+
+static void do_usb_read(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+struct usb_storage * us = usb_storage_device(sf_pop());
+uint32_t count = sf_pop(), lba = sf_pop();
+void * buffer = (void *) sf_pop();
+
+	sf_push((us && !usb_storage_transfer(us, lba, count, buffer, false)) ? -1 : 0);
+}
+
+static void do_usb_write(void)
+{
+/* ( buffer lba count device -- t=success|f=failure) */
+struct usb_storage * us = usb_storage_device(sf_pop());
+uint32_t count = sf_pop(), lba = sf_pop();
+void * buffer = (void *) sf_pop();
+
+	sf_push((us && !usb_storage_transfer(us, lba, count, buffer, true)) ? -1 : 0);
+}
+
+static void do_usb_flush(void)
+{
+/* ( device -- t=success|f=failure) */
+struct usb_storage * us = usb_storage_device(sf_pop());
+
+	sf_push((us && !usb_storage_flush(& us->blockdev)) ? -1 : 0);
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"usb-read",		do_usb_read),
+	MKWORD(custom_dict,	__COUNTER__,	"usb-write",			do_usb_write),
+	MKWORD(custom_dict,	__COUNTER__,	"usb-flush",			do_usb_flush),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
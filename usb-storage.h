@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __USB_STORAGE_H__
+#define __USB_STORAGE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+#include "usb.h"
+
+enum
+{
+	MAX_USB_STORAGE_DEVICES		=	4,
+	/* the mass storage class, scsi transparent command set, bulk-only transport */
+	USB_STORAGE_SUBCLASS_SCSI	=	0x06,
+	USB_STORAGE_PROTOCOL_BULK_ONLY	=	0x50,
+	/* the bulk-only transport mass storage reset class request */
+	USB_STORAGE_REQUEST_RESET	=	0xff,
+
+	USB_STORAGE_CBW_SIGNATURE	=	0x43425355,
+	USB_STORAGE_CSW_SIGNATURE	=	0x53425355,
+	USB_STORAGE_CBW_DIRECTION_IN	=	0x80,
+	USB_STORAGE_CBW_SIZE		=	31,
+	USB_STORAGE_CSW_SIZE		=	13,
+	/* command status wrapper status values */
+	USB_STORAGE_CSW_PASSED		=	0,
+	USB_STORAGE_CSW_FAILED		=	1,
+	USB_STORAGE_CSW_PHASE_ERROR	=	2,
+
+	/* scsi commands */
+	SCSI_TEST_UNIT_READY		=	0x00,
+	SCSI_REQUEST_SENSE		=	0x03,
+	SCSI_INQUIRY			=	0x12,
+	SCSI_READ_CAPACITY_10		=	0x25,
+	SCSI_READ_10			=	0x28,
+	SCSI_WRITE_10			=	0x2a,
+	SCSI_SYNCHRONIZE_CACHE_10	=	0x35,
+	SCSI_INQUIRY_SIZE		=	36,
+	SCSI_SENSE_SIZE			=	18,
+	SCSI_READ_CAPACITY_10_SIZE	=	8,
+
+	/* devices may take a few seconds to spin up, or to load their medium */
+	USB_STORAGE_TIMEOUT_MS		=	5000,
+	USB_STORAGE_READY_RETRIES	=	10,
+	USB_STORAGE_READY_DELAY_MS	=	100,
+};
+
+/* command block wrapper */
+struct usb_storage_cbw
+{
+	uint32_t	signature;
+	uint32_t	tag;
+	uint32_t	data_transfer_length;
+	uint8_t		flags;
+	uint8_t		lun;
+	uint8_t		command_length;
+	uint8_t		command[16];
+} __attribute__((packed));
+
+/* command status wrapper */
+struct usb_storage_csw
+{
+	uint32_t	signature;
+	uint32_t	tag;
+	uint32_t	data_residue;
+	uint8_t		status;
+} __attribute__((packed));
+
+/* a bulk-only transport mass storage device; only logical unit 0 is used */
+struct usb_storage
+{
+	struct usb_device	* device;
+	int			interface_number;
+	struct usb_endpoint	* bulk_in;
+	struct usb_endpoint	* bulk_out;
+	uint32_t		tag;
+	uint32_t		block_size;
+	uint64_t		nr_blocks;
+	/* the command wrappers, and a buffer for the short replies of the device */
+	struct usb_storage_cbw	cbw;
+	struct usb_storage_csw	csw;
+	uint8_t			scratch[SCSI_INQUIRY_SIZE];
+	struct block_device	blockdev;
+};
+
+void init_usb_storage(void);
+
+#endif /* __USB_STORAGE_H__ */
@@ -0,0 +1,159 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __USB_H__
+#define __USB_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum
+{
+	/* maximum number of devices, and of drivers, supported */
+	USB_MAX_DEVICES			=	8,
+	USB_MAX_DRIVERS			=	8,
+	USB_MAX_ENDPOINTS		=	32,
+	/* the size of the buffer holding the descriptors of the configuration of a device */
+	USB_MAX_CONFIGURATION_SIZE	=	512,
+	USB_MAX_INTERFACES		=	8,
+	/* the maximum size of a single bulk transfer */
+	USB_MAX_TRANSFER_SIZE		=	64 * 1024,
+	/* matches any class, subclass or protocol value of a 'struct usb_driver' */
+	USB_ANY				=	-1,
+
+	/* transfer errors; transfer functions otherwise return the number of bytes transferred */
+	USB_TRANSFER_ERROR		=	-1,
+	USB_TRANSFER_STALLED		=	-2,
+
+	USB_SETUP_PACKET_SIZE		=	8,
+	/* bmRequestType fields */
+	USB_REQUEST_DIRECTION_IN	=	0x80,
+	USB_REQUEST_TYPE_CLASS		=	1 << 5,
+	USB_REQUEST_RECIPIENT_INTERFACE	=	1,
+	USB_REQUEST_RECIPIENT_ENDPOINT	=	2,
+	/* standard requests */
+	USB_REQUEST_CLEAR_FEATURE	=	1,
+	USB_REQUEST_SET_ADDRESS		=	5,
+	USB_REQUEST_GET_DESCRIPTOR	=	6,
+	USB_REQUEST_SET_CONFIGURATION	=	9,
+	USB_FEATURE_ENDPOINT_HALT	=	0,
+
+	/* descriptor types, and sizes */
+	USB_DESCRIPTOR_DEVICE		=	1,
+	USB_DESCRIPTOR_CONFIGURATION	=	2,
+	USB_DESCRIPTOR_INTERFACE	=	4,
+	USB_DESCRIPTOR_ENDPOINT		=	5,
+	USB_DEVICE_DESCRIPTOR_SIZE	=	18,
+	USB_CONFIGURATION_DESCRIPTOR_SIZE	=	9,
+	USB_INTERFACE_DESCRIPTOR_SIZE	=	9,
+	USB_ENDPOINT_DESCRIPTOR_SIZE	=	7,
+	/* device descriptor field offsets */
+	USB_DEVICE_MAX_PACKET_SIZE0	=	7,
+	USB_DEVICE_VENDOR_ID		=	8,
+	USB_DEVICE_PRODUCT_ID		=	10,
+	/* configuration descriptor field offsets */
+	USB_CONFIGURATION_TOTAL_LENGTH	=	2,
+	USB_CONFIGURATION_VALUE		=	5,
+	/* interface descriptor field offsets */
+	USB_INTERFACE_NUMBER		=	2,
+	USB_INTERFACE_ALTERNATE_SETTING	=	3,
+	USB_INTERFACE_CLASS		=	5,
+	USB_INTERFACE_SUBCLASS		=	6,
+	USB_INTERFACE_PROTOCOL		=	7,
+	/* endpoint descriptor field offsets, and values */
+	USB_ENDPOINT_ADDRESS		=	2,
+	USB_ENDPOINT_ATTRIBUTES		=	3,
+	USB_ENDPOINT_MAX_PACKET_SIZE	=	4,
+	USB_ENDPOINT_INTERVAL		=	6,
+	USB_ENDPOINT_MAX_PACKET_SIZE_MASK	=	0x7ff,
+	USB_ENDPOINT_DIRECTION_IN	=	0x80,
+	USB_ENDPOINT_NUMBER_MASK	=	0x0f,
+	USB_ENDPOINT_TYPE_MASK		=	3,
+	USB_ENDPOINT_TYPE_CONTROL	=	0,
+	USB_ENDPOINT_TYPE_BULK		=	2,
+	USB_ENDPOINT_TYPE_INTERRUPT	=	3,
+
+	/* interface classes */
+	USB_CLASS_HID			=	0x03,
+	USB_CLASS_MASS_STORAGE		=	0x08,
+};
+
+/* an endpoint of a device; allocated by the host controller driver */
+struct usb_endpoint;
+struct usb_driver;
+
+/* a device attached to a root hub port; hubs are not supported */
+struct usb_device
+{
+	int		address;
+	int		port;
+	bool		low_speed;
+	uint8_t		device_descriptor[USB_DEVICE_DESCRIPTOR_SIZE];
+	/* the descriptors of the configuration selected */
+	uint8_t		configuration[USB_MAX_CONFIGURATION_SIZE];
+	int		configuration_length;
+	/* the default control endpoint */
+	struct usb_endpoint	* control;
+	/* the drivers bound to the interfaces of the device, indexed by interface number */
+	const struct usb_driver	* drivers[USB_MAX_INTERFACES];
+};
+
+/* a usb interface driver; drivers are bound to the interfaces matching their
+ * class, subclass and protocol (USB_ANY matches any value), of devices already
+ * configured at registration, and of devices configured afterwards; 'probe()' is
+ * passed the interface descriptor, and returns true if the driver takes the interface */
+struct usb_driver
+{
+	const char	* name;
+	int		class_code;
+	int		subclass;
+	int		protocol;
+	bool		(* probe)(struct usb_device * device, const uint8_t * interface);
+};
+
+void init_ohci(void);
+int usb_register_driver(const struct usb_driver * driver);
+
+/* returns the descriptor of the 'index'-th endpoint (counting from 0) of an interface
+ * with the given type and direction, or null if there is no such endpoint */
+const uint8_t * usb_find_endpoint(struct usb_device * device, const uint8_t * interface, int type, bool in, int index);
+/* sets up a bulk, or an interrupt, endpoint for transfers, from its descriptor; interrupt
+ * endpoints are polled at the interval in the descriptor; returns null on failure */
+struct usb_endpoint * usb_open_endpoint(struct usb_device * device, const uint8_t * endpoint_descriptor);
+
+/* fills in a setup packet */
+void usb_setup_packet(uint8_t setup[USB_SETUP_PACKET_SIZE], int request_type, int request, int value, int index, int length);
+/* transfers return the number of bytes transferred, or a negative error code */
+int usb_control_transfer(struct usb_device * device, const uint8_t setup[USB_SETUP_PACKET_SIZE], void * data, uint16_t length);
+/* transfers up to USB_MAX_TRANSFER_SIZE bytes on a bulk endpoint, in the direction of the
+ * endpoint; a short input transfer is not an error */
+int usb_bulk_transfer(struct usb_endpoint * endpoint, void * buffer, uint32_t length, int timeout_ms);
+/* starts the transfers on an interrupt endpoint, of up to its maximum packet size; 'complete()'
+ * is called from the interrupt handler, with the number of bytes transferred, or a negative
+ * error code, and the transfer is queued again if it returns true; the buffer is accessed
+ * regardless of the process active, so it must reside in common data, or in extended memory */
+int usb_interrupt_start(struct usb_endpoint * endpoint, void * buffer, uint32_t length,
+		bool (* complete)(struct usb_endpoint * endpoint, void * buffer, int length, void * argument), void * argument);
+/* clears the halt of a stalled endpoint, at the device and at the host controller */
+int usb_clear_halt(struct usb_endpoint * endpoint);
+
+#endif /* __USB_H__ */
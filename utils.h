@@ -21,8 +21,27 @@ THE SOFTWARE.
 */
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
 static unsigned bit(unsigned n) { return 1 << n; }
 static unsigned extract_bitfield(unsigned data, unsigned offset, unsigned bitsize) { return (data >> offset) & ((1 << bitsize) - 1); }
 static unsigned make_bitfield(unsigned data, unsigned offset, unsigned bitsize) { return (data & ((1 << bitsize) - 1)) << offset; }
 static int find_first_clear(unsigned x) { int i; if (x == -1) return -1; i = 0; while (1) { if (!((1 << i) & x)) return i; i ++; } }
+static uint64_t rdtsc(void) { uint32_t low, high; asm volatile ("rdtsc" : "=a" (low), "=d" (high)); return ((uint64_t) high << 32) | low; }
+static int interrupts_enabled(void) { uint32_t eflags; asm volatile ("pushfl\n" "popl	%0\n" : "=r" (eflags)); return eflags & (1 << 9); }
 
+/* prints a number right aligned in a field of 'width' characters; this does not go through the
+ * forth interpreter, so that it can be used before the interpreter is initialized */
+static void print_number(uint32_t x, int width, bool hex)
+{
+char digits[12], * p = digits + sizeof digits - 1;
+unsigned base = hex ? 16 : 10;
+
+	* p = 0;
+	do
+		* -- p = "0123456789abcdef"[x % base];
+	while (x /= base);
+	while (p > digits && digits + sizeof digits - 1 - p < width)
+		* -- p = ' ';
+	print_str(p);
+}
@@ -0,0 +1,490 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* virtio block device driver, for the legacy virtio pci interface. Requests are
+ * placed in a single split virtqueue, as descriptor chains - a request header, the
+ * data segments (a segment per physically contiguous part of the data buffer), and
+ * a status byte. The requests of a batch are all queued first, and then published
+ * to the device at once, with a single notification - which is skipped if the
+ * device does not need it. Completions are signalled by the device interrupt, or
+ * polled - when the device has no usable interrupt, when interrupts are disabled,
+ * or when polling is selected with the 'virtio-blk-polled' word */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <engine.h>
+#include <sf-word-wizard.h>
+
+#include "virtio-blk.h"
+#include "irq.h"
+#include "pci.h"
+#include "clock.h"
+#include "pgtable.h"
+#include "frame-alloc.h"
+#include "utils.h"
+
+enum
+{
+	VIRTIO_VENDOR_ID		=	0x1af4,
+	/* the transitional (legacy interface) block device */
+	VIRTIO_BLK_LEGACY_DEVICE_ID	=	0x1001,
+
+	/* legacy virtio i/o register offsets */
+	VIRTIO_REG_DEVICE_FEATURES	=	0x00,
+	VIRTIO_REG_GUEST_FEATURES	=	0x04,
+	VIRTIO_REG_QUEUE_ADDRESS	=	0x08,
+	VIRTIO_REG_QUEUE_SIZE		=	0x0c,
+	VIRTIO_REG_QUEUE_SELECT		=	0x0e,
+	VIRTIO_REG_QUEUE_NOTIFY		=	0x10,
+	VIRTIO_REG_DEVICE_STATUS	=	0x12,
+	VIRTIO_REG_ISR_STATUS		=	0x13,
+	/* device specific configuration, when msi-x is disabled */
+	VIRTIO_REG_DEVICE_CONFIG	=	0x14,
+	VIRTIO_BLK_CONFIG_CAPACITY	=	VIRTIO_REG_DEVICE_CONFIG + 0,
+	VIRTIO_BLK_CONFIG_SEG_MAX	=	VIRTIO_REG_DEVICE_CONFIG + 12,
+
+	/* device status bits */
+	VIRTIO_STATUS_ACKNOWLEDGE	=	1 << 0,
+	VIRTIO_STATUS_DRIVER		=	1 << 1,
+	VIRTIO_STATUS_DRIVER_OK		=	1 << 2,
+	VIRTIO_STATUS_FAILED		=	1 << 7,
+
+	/* feature bits */
+	VIRTIO_BLK_F_SEG_MAX		=	1 << 2,
+	VIRTIO_BLK_F_RO			=	1 << 5,
+	VIRTIO_BLK_F_FLUSH		=	1 << 9,
+
+	/* legacy virtqueues are aligned on a page boundary, the used ring on a page boundary too */
+	VIRTIO_QUEUE_ALIGN		=	4096,
+
+	VRING_DESC_F_NEXT		=	1 << 0,
+	/* the buffer is written by the device */
+	VRING_DESC_F_WRITE		=	1 << 1,
+	VRING_AVAIL_F_NO_INTERRUPT	=	1 << 0,
+	VRING_USED_F_NO_NOTIFY		=	1 << 0,
+
+	/* request types */
+	VIRTIO_BLK_T_IN			=	0,
+	VIRTIO_BLK_T_OUT		=	1,
+	VIRTIO_BLK_T_FLUSH		=	4,
+	VIRTIO_BLK_S_OK			=	0,
+};
+
+static struct virtio_blk devices[MAX_VIRTIO_BLK_DEVICES] __attribute__((section(".common-data")));
+static int nr_devices __attribute__((section(".common-data")));
+
+static const char * const device_names[MAX_VIRTIO_BLK_DEVICES] = { "vblk0", "vblk1", "vblk2", "vblk3", };
+
+static void memory_barrier(void) { asm volatile("lock; addl $0, (%%esp)" ::: "memory"); }
+
+static void virtio_blk_irq_handler(void * argument)
+{
+struct virtio_blk * vb = argument;
+
+	/* reading the isr status register acknowledges the interrupt; completions
+	 * are processed outside interrupt context, from the used ring */
+	read_io_port_byte(vb->io_base + VIRTIO_REG_ISR_STATUS);
+}
+
+/*
+ * descriptor management
+ */
+
+static int virtio_blk_alloc_desc(struct virtio_blk * vb)
+{
+int i = vb->free_head;
+
+	vb->free_head = vb->desc[i].next;
+	vb->nr_free --;
+	return i;
+}
+
+static void virtio_blk_free_chain(struct virtio_blk * vb, int head)
+{
+int i = head, n = 1;
+
+	while (vb->desc[i].flags & VRING_DESC_F_NEXT)
+		i = vb->desc[i].next, n ++;
+	vb->desc[i].next = vb->free_head;
+	vb->free_head = head;
+	vb->nr_free += n;
+}
+
+/* splits a buffer into physically contiguous segments; returns the number of
+ * segments, or -1 if the buffer can not be used for dma, or has too many segments */
+static int virtio_blk_segments(struct virtio_blk * vb, uint8_t * buffer, uint32_t size,
+		uint32_t * addresses, uint32_t * lengths)
+{
+uint32_t physical_address, n;
+int nr_segments = 0;
+
+	for (; size; size -= n, buffer += n)
+	{
+		n = 0x1000 - ((uint32_t) buffer & 0xfff);
+		if (n > size)
+			n = size;
+		if (!(physical_address = mem_virtual_to_physical(buffer)))
+			return -1;
+		if (nr_segments && addresses[nr_segments - 1] + lengths[nr_segments - 1] == physical_address)
+		{
+			lengths[nr_segments - 1] += n;
+			continue;
+		}
+		if (nr_segments == vb->max_segments)
+			return -1;
+		addresses[nr_segments] = physical_address;
+		lengths[nr_segments ++] = n;
+	}
+	return nr_segments;
+}
+
+/*
+ * request submission and completion
+ */
+
+/* processes the completed requests in the used ring */
+static void virtio_blk_reap(struct virtio_blk * vb)
+{
+struct virtio_blk_request_slot * slot;
+int head;
+
+	while (vb->last_used_idx != vb->used->idx)
+	{
+		/* read the used ring entry only after reading the index */
+		memory_barrier();
+		head = vb->used->ring[vb->last_used_idx % vb->queue_size].id;
+		slot = vb->slots + head;
+		if (slot->status != VIRTIO_BLK_S_OK && slot->request)
+			slot->request->status = -1;
+		slot->request = 0;
+		virtio_blk_free_chain(vb, head);
+		vb->last_used_idx ++;
+		vb->nr_outstanding --;
+	}
+}
+
+/* publishes the requests queued to the device, and notifies it if necessary */
+static void virtio_blk_kick(struct virtio_blk * vb)
+{
+	if (vb->avail->idx == vb->avail_idx)
+		return;
+	memory_barrier();
+	vb->avail->idx = vb->avail_idx;
+	memory_barrier();
+	if (!(vb->used->flags & VRING_USED_F_NO_NOTIFY))
+		write_io_port_word(vb->io_base + VIRTIO_REG_QUEUE_NOTIFY, 0);
+}
+
+/* waits for at least one request to complete, and processes the completed requests;
+ * returns false on timeout */
+static bool virtio_blk_wait(struct virtio_blk * vb, uint64_t deadline)
+{
+	virtio_blk_kick(vb);
+	while (vb->last_used_idx == vb->used->idx)
+	{
+		if (clock_deadline_expired(deadline))
+			return false;
+		if (vb->polled || !interrupts_enabled())
+			continue;
+		asm("cli");
+		if (vb->last_used_idx == vb->used->idx)
+			/* the timer tick bounds the wait, should the interrupt be lost */
+			asm("sti\n" "hlt\n");
+		else
+			asm("sti");
+	}
+	virtio_blk_reap(vb);
+	return true;
+}
+
+/* queues a request, without publishing it to the device; waits for free descriptors
+ * if necessary; returns 0 on success, -1 on failure */
+static int virtio_blk_queue(struct virtio_blk * vb, int type, uint64_t sector, void * buffer,
+		uint32_t size, struct blockdev_request * request, uint64_t deadline)
+{
+uint32_t addresses[VIRTIO_BLK_MAX_SEGMENTS], lengths[VIRTIO_BLK_MAX_SEGMENTS];
+int nr_segments, head, i, d;
+struct virtio_blk_request_slot * slot;
+
+	if ((nr_segments = virtio_blk_segments(vb, buffer, size, addresses, lengths)) == -1)
+		return -1;
+	while (vb->nr_free < nr_segments + 2)
+		if (!virtio_blk_wait(vb, deadline))
+			return -1;
+
+	/* the request header, and status byte, are in the slot of the first descriptor */
+	head = d = virtio_blk_alloc_desc(vb);
+	slot = vb->slots + head;
+	* slot = (struct virtio_blk_request_slot) { .type = type, .sector = sector, .status = 0xff, .request = request, };
+	vb->desc[d] = (struct vring_desc) { .address = (uint32_t) slot, .length = 16, .flags = VRING_DESC_F_NEXT, };
+	for (i = 0; i < nr_segments; i ++)
+	{
+		vb->desc[d].next = virtio_blk_alloc_desc(vb);
+		d = vb->desc[d].next;
+		vb->desc[d] = (struct vring_desc) { .address = addresses[i], .length = lengths[i],
+			.flags = VRING_DESC_F_NEXT | (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0), };
+	}
+	vb->desc[d].next = virtio_blk_alloc_desc(vb);
+	d = vb->desc[d].next;
+	vb->desc[d] = (struct vring_desc) { .address = (uint32_t) & slot->status, .length = 1, .flags = VRING_DESC_F_WRITE, };
+
+	vb->avail->ring[vb->avail_idx ++ % vb->queue_size] = head;
+	vb->nr_outstanding ++;
+	return 0;
+}
+
+/* resets the device, and sets up its virtqueue again, empty; the requests outstanding
+ * are failed, and their slots are released, so that the requests - which the caller may
+ * reuse - are not touched by completions the device may still have had pending */
+static void virtio_blk_reset(struct virtio_blk * vb)
+{
+int i;
+
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+	for (i = 0; i < vb->queue_size; i ++)
+	{
+		if (vb->slots[i].request)
+			vb->slots[i].request->status = -1;
+		vb->slots[i].request = 0;
+		vb->desc[i].next = i + 1;
+	}
+	vb->free_head = 0;
+	vb->nr_free = vb->queue_size;
+	vb->avail_idx = vb->last_used_idx = 0;
+	vb->nr_outstanding = 0;
+	vb->avail->idx = 0;
+	vb->used->idx = 0;
+
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	write_io_port_long(vb->io_base + VIRTIO_REG_GUEST_FEATURES, vb->features);
+	write_io_port_word(vb->io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+	write_io_port_long(vb->io_base + VIRTIO_REG_QUEUE_ADDRESS, (uint32_t) vb->desc / VIRTIO_QUEUE_ALIGN);
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS,
+			VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+/* waits for all outstanding requests to complete; on timeout, the device is reset,
+ * and the requests outstanding are failed */
+static int virtio_blk_drain(struct virtio_blk * vb, uint64_t deadline)
+{
+	while (vb->nr_outstanding)
+		if (!virtio_blk_wait(vb, deadline))
+		{
+			print_str(vb->blockdev.name);
+			print_str(": request timeout, resetting the device\n");
+			virtio_blk_reset(vb);
+			return -1;
+		}
+	return 0;
+}
+
+static int virtio_blk_submit(struct block_device * dev, struct blockdev_request * requests, int nr_requests)
+{
+struct virtio_blk * vb = dev->driver_data;
+uint64_t deadline = clock_deadline_ms(VIRTIO_BLK_TIMEOUT_MS), lba;
+uint32_t count, n;
+uint8_t * buffer;
+int i, result = 0;
+
+	for (i = 0; i < nr_requests; i ++)
+	{
+		requests[i].status = 0;
+		if (requests[i].write && vb->read_only)
+		{
+			requests[i].status = -1;
+			continue;
+		}
+		for (lba = requests[i].lba, count = requests[i].count, buffer = requests[i].buffer;
+				count; count -= n, lba += n, buffer += n * VIRTIO_BLK_SECTOR_SIZE)
+		{
+			n = count < VIRTIO_BLK_MAX_SECTORS ? count : VIRTIO_BLK_MAX_SECTORS;
+			if (virtio_blk_queue(vb, requests[i].write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+						lba, buffer, n * VIRTIO_BLK_SECTOR_SIZE, requests + i, deadline))
+			{
+				requests[i].status = -1;
+				break;
+			}
+		}
+	}
+	if (virtio_blk_drain(vb, deadline))
+		return -1;
+	for (i = 0; i < nr_requests; i ++)
+		result |= requests[i].status;
+	return result;
+}
+
+static int virtio_blk_read(struct block_device * dev, uint64_t lba, uint32_t count, void * buffer)
+{
+struct blockdev_request request = { .lba = lba, .count = count, .buffer = buffer, .write = false, };
+
+	return virtio_blk_submit(dev, & request, 1);
+}
+
+static int virtio_blk_write(struct block_device * dev, uint64_t lba, uint32_t count, const void * buffer)
+{
+struct blockdev_request request = { .lba = lba, .count = count, .buffer = (void *) buffer, .write = true, };
+
+	return virtio_blk_submit(dev, & request, 1);
+}
+
+static int virtio_blk_flush(struct block_device * dev)
+{
+struct virtio_blk * vb = dev->driver_data;
+uint64_t deadline = clock_deadline_ms(VIRTIO_BLK_TIMEOUT_MS);
+struct blockdev_request request = { .status = 0, };
+
+	if (!vb->flush_supported)
+		/* the device has no write cache */
+		return 0;
+	if (virtio_blk_queue(vb, VIRTIO_BLK_T_FLUSH, 0, 0, 0, & request, deadline) || virtio_blk_drain(vb, deadline))
+		return -1;
+	return request.status;
+}
+
+/*
+ * initialization
+ */
+
+static bool virtio_blk_probe(const struct pci_function * f)
+{
+struct virtio_blk * vb = devices + nr_devices;
+uint32_t features, ring_size;
+uint8_t * queue;
+int i;
+
+	/* legacy devices have their registers in the i/o space region of base address register 0 */
+	if (nr_devices == MAX_VIRTIO_BLK_DEVICES || !f->resources[0].io || !f->resources[0].size)
+		return false;
+	* vb = (struct virtio_blk) { .io_base = f->resources[0].base, .max_segments = VIRTIO_BLK_MAX_SEGMENTS, };
+
+	/* reset the device, and negotiate features */
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, 0);
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+	features = read_io_port_long(vb->io_base + VIRTIO_REG_DEVICE_FEATURES)
+		& (VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | VIRTIO_BLK_F_FLUSH);
+	write_io_port_long(vb->io_base + VIRTIO_REG_GUEST_FEATURES, features);
+	vb->features = features;
+	vb->flush_supported = features & VIRTIO_BLK_F_FLUSH;
+	vb->read_only = features & VIRTIO_BLK_F_RO;
+	if ((features & VIRTIO_BLK_F_SEG_MAX) && read_io_port_long(vb->io_base + VIRTIO_BLK_CONFIG_SEG_MAX) < vb->max_segments)
+		vb->max_segments = read_io_port_long(vb->io_base + VIRTIO_BLK_CONFIG_SEG_MAX);
+	vb->capacity = read_io_port_long(vb->io_base + VIRTIO_BLK_CONFIG_CAPACITY)
+		| ((uint64_t) read_io_port_long(vb->io_base + VIRTIO_BLK_CONFIG_CAPACITY + 4) << 32);
+
+	/* set up the request virtqueue */
+	write_io_port_word(vb->io_base + VIRTIO_REG_QUEUE_SELECT, 0);
+	vb->queue_size = read_io_port_word(vb->io_base + VIRTIO_REG_QUEUE_SIZE);
+	if (!vb->queue_size || vb->max_segments < 1)
+		goto fail;
+	ring_size = (sizeof * vb->desc * vb->queue_size + sizeof * vb->avail + sizeof vb->avail->ring[0] * (vb->queue_size + 1)
+			+ VIRTIO_QUEUE_ALIGN - 1) & ~ (VIRTIO_QUEUE_ALIGN - 1);
+	vb->nr_queue_frames = (ring_size + sizeof * vb->used + sizeof vb->used->ring[0] * vb->queue_size + sizeof(uint16_t)
+			+ FRAME_SIZE - 1) / FRAME_SIZE;
+	if (!(queue = frame_alloc(vb->nr_queue_frames)))
+		goto fail;
+	if (!(vb->slots = frame_alloc((sizeof * vb->slots * vb->queue_size + FRAME_SIZE - 1) / FRAME_SIZE)))
+	{
+		frame_free(queue, vb->nr_queue_frames);
+		goto fail;
+	}
+	vb->desc = (struct vring_desc *) queue;
+	vb->avail = (struct vring_avail *) (queue + sizeof * vb->desc * vb->queue_size);
+	vb->used = (struct vring_used *) (queue + ring_size);
+	for (i = 0; i < vb->queue_size; i ++)
+		vb->desc[i].next = i + 1;
+	vb->nr_free = vb->queue_size;
+	write_io_port_long(vb->io_base + VIRTIO_REG_QUEUE_ADDRESS, (uint32_t) queue / VIRTIO_QUEUE_ALIGN);
+
+	vb->irq_attached = f->irq_line < NR_LEGACY_IRQS && !irq_attach(f->irq_line, virtio_blk_irq_handler, vb);
+	vb->polled = !vb->irq_attached;
+	if (vb->polled)
+		vb->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS,
+			VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+
+	vb->blockdev = (struct block_device)
+	{
+		.name		= device_names[nr_devices],
+		.sector_size	= VIRTIO_BLK_SECTOR_SIZE,
+		.nr_sectors	= vb->capacity,
+		.read		= virtio_blk_read,
+		.write		= virtio_blk_write,
+		.flush		= virtio_blk_flush,
+		.submit		= virtio_blk_submit,
+		.driver_data	= vb,
+	};
+	nr_devices ++;
+	blockdev_register(& vb->blockdev);
+	print_str(vb->blockdev.name);
+	print_str(vb->polled ? ": virtio block device, polled\n" : ": virtio block device\n");
+	return true;
+fail:
+	write_io_port_byte(vb->io_base + VIRTIO_REG_DEVICE_STATUS, VIRTIO_STATUS_FAILED);
+	return false;
+}
+
+static const struct pci_match virtio_blk_match[] =
+{
+	{ VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_DEVICE_ID, PCI_ANY_ID, PCI_ANY_ID, PCI_ANY_ID, },
+	{ 0, },
+};
+
+static const struct pci_driver virtio_blk_driver = { .name = "virtio-blk", .match = virtio_blk_match, .probe = virtio_blk_probe, };
+
+void init_virtio_blk(void)
+{
+	pci_register_driver(& virtio_blk_driver);
+}
+
+/*
+ * forth words
+ */
+
+static void do_virtio_blk_polled(void)
+{
+/* ( flag device-number -- ) selects polled, or interrupt driven completion; polling
+ * avoids the interrupt latency, at the cost of busy waiting */
+struct block_device * dev = blockdev_get(sf_pop());
+struct virtio_blk * vb;
+cell flag = sf_pop();
+
+	if (!dev || dev->read != virtio_blk_read)
+		return;
+	vb = dev->driver_data;
+	/* interrupt mode is only available if an interrupt handler has been attached */
+	vb->polled = flag || !vb->irq_attached;
+	vb->avail->flags = vb->polled ? VRING_AVAIL_F_NO_INTERRUPT : 0;
+}
+
+static struct word dict_base_dummy_word[1] = { MKWORD(0, 0, 0, "", 0), };
+static const struct word custom_dict[] = {
+	MKWORD(dict_base_dummy_word,	0,	"virtio-blk-polled",	do_virtio_blk_polled),
+
+}, * custom_dict_start = custom_dict + __COUNTER__;
+
+static void sf_dict_init(void) __attribute__((constructor));
+static void sf_dict_init(void)
+{
+	sf_merge_custom_dictionary(dict_base_dummy_word, custom_dict_start);
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2018 stoyan shopov
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+#ifndef __VIRTIO_BLK_H__
+#define __VIRTIO_BLK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+enum
+{
+	MAX_VIRTIO_BLK_DEVICES		=	4,
+	VIRTIO_BLK_SECTOR_SIZE		=	512,
+	/* maximum number of sectors transferred by a single request */
+	VIRTIO_BLK_MAX_SECTORS		=	256,
+	/* maximum number of data segments of a single request - a segment per page */
+	VIRTIO_BLK_MAX_SEGMENTS		=	VIRTIO_BLK_MAX_SECTORS * VIRTIO_BLK_SECTOR_SIZE / 4096 + 1,
+	VIRTIO_BLK_TIMEOUT_MS		=	5000,
+};
+
+/* split virtqueue structures, as laid out in memory by the legacy virtio interface */
+struct vring_desc
+{
+	uint64_t	address;
+	uint32_t	length;
+	uint16_t	flags;
+	uint16_t	next;
+};
+
+struct vring_avail
+{
+	uint16_t	flags;
+	uint16_t	idx;
+	uint16_t	ring[];
+};
+
+struct vring_used_elem
+{
+	uint32_t	id;
+	uint32_t	length;
+};
+
+struct vring_used
+{
+	uint16_t	flags;
+	uint16_t	idx;
+	struct vring_used_elem	ring[];
+};
+
+/* the header, and status byte of a request; one per descriptor, indexed
+ * by the number of the first descriptor of the request's chain */
+struct virtio_blk_request_slot
+{
+	uint32_t	type;
+	uint32_t	reserved;
+	uint64_t	sector;
+	uint8_t		status;
+	/* the request this is a part of, null for internal requests */
+	struct blockdev_request	* request;
+};
+
+struct virtio_blk
+{
+	uint16_t	io_base;
+	bool		irq_attached;
+	/* true if completions are polled, instead of waiting for the device interrupt */
+	bool		polled;
+	bool		flush_supported;
+	bool		read_only;
+	/* the features negotiated, these are negotiated again when the device is reset */
+	uint32_t	features;
+	uint64_t	capacity;
+	/* maximum number of data segments per request */
+	int		max_segments;
+
+	/* the virtqueue, allocated from extended memory */
+	uint16_t	queue_size;
+	int		nr_queue_frames;
+	struct vring_desc	* desc;
+	struct vring_avail	* avail;
+	volatile struct vring_used	* used;
+	/* head of the list of free descriptors, linked by their 'next' fields */
+	uint16_t	free_head;
+	uint16_t	nr_free;
+	/* the avail ring index of the next request to queue; this is published
+	 * to the device in 'avail->idx' when a batch of requests is submitted */
+	uint16_t	avail_idx;
+	uint16_t	last_used_idx;
+	/* number of requests submitted, and not yet completed */
+	int		nr_outstanding;
+	struct virtio_blk_request_slot	* slots;
+	struct block_device	blockdev;
+};
+
+/* locates the virtio block devices, and registers them as block devices */
+void init_virtio_blk(void);
+
+#endif /* __VIRTIO_BLK_H__ */